@@ -0,0 +1,117 @@
+// ChannelBench.cpp : Producer/consumer throughput of channels.
+//
+// Build together with the interpreter sources and POLYSCRIPT_NO_MAIN defined.
+// Usage: ChannelBench [messages]
+//
+// The C++ runs pass objects straight through a Channel, against a queue under one
+// mutex as the baseline. The script run has a future send through a channel to a
+// generator on the main thread.
+
+#include "../PolyScript/PolyScript.h"
+#include "../PolyScript/Interpreter.h"
+#include "../PolyScript/Channels.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+// The obvious queue: everything under one lock.
+class LockedQueue
+{
+public:
+	explicit LockedQueue(size_t capacity) : capacity(capacity) {}
+
+	void send(PolyScript::Object *value)
+	{
+		std::unique_lock<std::mutex> guard(lock);
+		not_full.wait(guard, [&]() { return items.size() < capacity; });
+		items.push_back(value);
+		not_empty.notify_one();
+	}
+
+	PolyScript::Object *recv()
+	{
+		std::unique_lock<std::mutex> guard(lock);
+		not_empty.wait(guard, [&]() { return !items.empty(); });
+		PolyScript::Object *value = items.front();
+		items.pop_front();
+		not_full.notify_one();
+		return value;
+	}
+
+private:
+	size_t capacity;
+	std::mutex lock;
+	std::condition_variable not_full;
+	std::condition_variable not_empty;
+	std::deque<PolyScript::Object *> items;
+};
+
+// Runs producers and consumers, each moving an equal share of the messages.
+// Returns messages per second.
+template <typename Send, typename Recv>
+static double throughput(int pairs, int messages, Send send, Recv recv)
+{
+	int share = messages / pairs;
+	std::vector<std::thread> threads;
+
+	auto start = std::chrono::steady_clock::now();
+	for (int i = 0; i < pairs; i++) {
+		threads.emplace_back([&]() { for (int n = 0; n < share; n++) send(); });
+		threads.emplace_back([&]() { for (int n = 0; n < share; n++) recv(); });
+	}
+	for (std::thread &thread : threads)
+		thread.join();
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	return share * pairs / seconds;
+}
+
+int main(int argc, char **argv)
+{
+	int messages = argc > 1 ? atoi(argv[1]) : 2000000;
+	const size_t capacity = 1024;
+
+	PolyScript::Interpreter interpreter;
+	PolyScript::Object *message = PolyScript::Object::MakeInt(1);
+
+	printf("%d messages, capacity %d\n", messages, (int)capacity);
+	printf("producers/consumers   channel msg/s   locked queue msg/s\n");
+	for (int pairs = 1; pairs <= 4; pairs *= 2) {
+		PolyScript::Channel channel(capacity);
+		double channel_rate = throughput(pairs, messages,
+			[&]() { channel.send(message); },
+			[&]() { PolyScript::Object *value; channel.recv(&value); });
+
+		LockedQueue queue(capacity);
+		double queue_rate = throughput(pairs, messages,
+			[&]() { queue.send(message); },
+			[&]() { queue.recv(); });
+
+		printf("%9d/%-9d %15.0f %20.0f\n", pairs, pairs, channel_rate, queue_rate);
+	}
+
+	// The same hand-off made by scripts, with a fraction of the messages.
+	int script_messages = messages / 20;
+	char script[256];
+	snprintf(script, sizeof(script), "(define ch (make-channel %d))", (int)capacity);
+	interpreter.eval(script);
+	snprintf(script, sizeof(script), "(reduce plus 0 (range %d))", script_messages);
+	std::string expected = interpreter.eval(script).to_string();
+
+	auto start = std::chrono::steady_clock::now();
+	snprintf(script, sizeof(script),
+		"(future (lambda () (reduce (lambda (a x) (send ch x)) 0 (range %d)) (close-channel ch)))", script_messages);
+	interpreter.eval(script);
+	PolyScript::Value sum = interpreter.eval("(reduce plus 0 (generator (lambda () (recv ch))))");
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	if (!sum.ok() || sum.to_string() != expected) {
+		fprintf(stderr, "script run failed: %s\n", sum.ok() ? sum.to_string().c_str() : sum.error.c_str());
+		return 1;
+	}
+	printf("script future -> generator: %.0f msg/s (%d messages)\n", script_messages / seconds, script_messages);
+	return 0;
+}
@@ -0,0 +1,76 @@
+// CoroutineBench.cpp : Context-switch latency and memory per parked coroutine.
+//
+// Build together with the interpreter sources and POLYSCRIPT_NO_MAIN defined.
+// Usage: CoroutineBench [switches] [parked]
+
+#include "../PolyScript/PolyScript.h"
+#include "../PolyScript/Interpreter.h"
+#include "../PolyScript/Coroutines.h"
+
+#include <chrono>
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
+// Peak resident set size in kilobytes, or -1 where it isn't available.
+static long peak_rss_kb()
+{
+#ifndef _WIN32
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_maxrss;
+#else
+	return -1;
+#endif
+}
+
+// A coroutine body that does nothing but yield, to time the switches alone.
+static PolyScript::Object *yield_forever(PolyScript::Object *, PolyScript::Object *)
+{
+	for (;;)
+		PolyScript::Coroutine::yield(PolyScript::Nil);
+}
+
+template <typename F>
+static double nanoseconds_each(int count, F body)
+{
+	auto start = std::chrono::steady_clock::now();
+	for (int i = 0; i < count; i++)
+		body();
+	return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / count;
+}
+
+int main(int argc, char **argv)
+{
+	int switches = argc > 1 ? atoi(argv[1]) : 1000000;
+	int parked = argc > 2 ? atoi(argv[2]) : 10000;
+
+	PolyScript::Interpreter interpreter;
+	PolyScript::Object *env = PolyScript::env;
+
+	PolyScript::Coroutine raw(env, PolyScript::Object::MakePrimitive(yield_forever, PolyScript::Stats::register_primitive("yield-forever")));
+	double raw_ns = nanoseconds_each(switches, [&]() { raw.resume(PolyScript::Nil); });
+	printf("resume + yield, C++ body:      %8.1f ns\n", raw_ns);
+
+	PolyScript::Value fn = interpreter.eval("(lambda () (reduce (lambda (a x) (yield x)) 0 (range)))");
+	PolyScript::Coroutine script(env, fn.object);
+	double script_ns = nanoseconds_each(switches, [&]() { script.resume(PolyScript::Nil); });
+	printf("resume + yield, script body:   %8.1f ns\n", script_ns);
+
+	// Park coroutines in their first yield, as waiting tasks would be.
+	PolyScript::Value task = interpreter.eval("(lambda () (yield) 'done)");
+	long before = peak_rss_kb();
+	std::vector<PolyScript::Coroutine *> tasks;
+	for (int i = 0; i < parked; i++) {
+		tasks.push_back(new PolyScript::Coroutine(env, task.object));
+		tasks.back()->resume(PolyScript::Nil);
+	}
+	long after = peak_rss_kb();
+	if (before >= 0)
+		printf("memory per parked coroutine:   %8.1f KB (%d parked)\n", (after - before) / (double)parked, parked);
+
+	for (PolyScript::Coroutine *coroutine : tasks)
+		coroutine->resume(PolyScript::Nil);
+	return 0;
+}
@@ -0,0 +1,45 @@
+// EmbedBench.cpp : Measures the per-call overhead of the embedding API.
+//
+// Build together with the interpreter sources and POLYSCRIPT_NO_MAIN defined.
+// Usage: EmbedBench [iterations]
+
+#include "../PolyScript/PolyScript.h"
+#include "../PolyScript/Interpreter.h"
+
+#include <chrono>
+
+template <typename F>
+static void measure(const char *name, int iterations, int calls_per_iteration, F body)
+{
+	auto start = std::chrono::steady_clock::now();
+	for (int i = 0; i < iterations; i++)
+		body();
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	printf("%-28s %8.0f ns/call\n", name, seconds * 1e9 / ((double)iterations * calls_per_iteration));
+}
+
+int main(int argc, char **argv)
+{
+	int iterations = argc > 1 ? atoi(argv[1]) : 200000;
+
+	PolyScript::Interpreter interpreter;
+	interpreter.eval_all("(defun inc (x) (plus x 1))");
+
+	PolyScript::Value check = interpreter.eval("(inc 41)");
+	if (!check.ok() || check.to_string() != "42")
+	{
+		fprintf(stderr, "unexpected result: %s\n", check.to_string().c_str());
+		return 1;
+	}
+
+	measure("eval \"42\"", iterations, 1, [&]() { interpreter.eval("42"); });
+	measure("eval \"(plus 1 2)\"", iterations, 1, [&]() { interpreter.eval("(plus 1 2)"); });
+	measure("eval \"(inc 41)\"", iterations, 1, [&]() { interpreter.eval("(inc 41)"); });
+	measure("eval error", iterations, 1, [&]() { interpreter.eval("undefined-variable"); });
+
+	std::vector<std::string_view> batch(100, "(inc 41)");
+	measure("eval_batch \"(inc 41)\"", iterations / 100, 100, [&]() { interpreter.eval_batch(batch); });
+
+	return 0;
+}
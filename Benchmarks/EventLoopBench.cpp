@@ -0,0 +1,100 @@
+// EventLoopBench.cpp : Event loop throughput with thousands of timers, and with a
+// pipe written by another thread.
+//
+// Build together with the interpreter sources and POLYSCRIPT_NO_MAIN defined.
+// Usage: EventLoopBench [timers]
+
+#include "../PolyScript/PolyScript.h"
+#include "../PolyScript/Interpreter.h"
+
+#include <chrono>
+#include <thread>
+
+#ifdef __linux__
+#include <unistd.h>
+#endif
+
+static double seconds_since(std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static void check(const PolyScript::Value &value)
+{
+	if (!value.ok()) {
+		fprintf(stderr, "%s\n", value.error.c_str());
+		exit(1);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	int timers = argc > 1 ? atoi(argv[1]) : 10000;
+	char script[512];
+
+	PolyScript::Interpreter interpreter;
+	check(interpreter.eval_all(
+		"(define fired 0)"
+		"(defun fire () (setq fired (plus fired 1)))"
+		"(defun ticker (count)"
+		"  (define id (set-interval (lambda () (fire) (setq count (minus count 1)) (if (zerop count) (clear-timer id) ())) 1)))"));
+
+	// One-shot timers spread over 0 to 49 ms.
+	auto start = std::chrono::steady_clock::now();
+	snprintf(script, sizeof(script),
+		"(reduce (lambda (a round) (reduce (lambda (b delay) (set-timeout fire delay)) 0 (range 50))) 0 (range %d))", timers / 50);
+	check(interpreter.eval(script));
+	double scheduling = seconds_since(start);
+	PolyScript::Value callbacks = interpreter.run_until_idle();
+	check(callbacks);
+	double total = seconds_since(start);
+	printf("%s timeouts: scheduled in %.1f ms, all fired after %.1f ms (%.0f scheduled/s)\n",
+		callbacks.to_string().c_str(), scheduling * 1e3, total * 1e3, timers / scheduling);
+
+	// Intervals of 1 ms, each clearing itself after 20 ticks.
+	int intervals = timers / 10;
+	check(interpreter.eval("(setq fired 0)"));
+	start = std::chrono::steady_clock::now();
+	snprintf(script, sizeof(script), "(reduce (lambda (a i) (ticker 20)) 0 (range %d))", intervals);
+	check(interpreter.eval(script));
+	callbacks = interpreter.run_until_idle();
+	check(callbacks);
+	total = seconds_since(start);
+	printf("%d intervals x 20 ticks: %s callbacks in %.1f ms (%.0f callbacks/s)\n",
+		intervals, callbacks.to_string().c_str(), total * 1e3, atoi(callbacks.to_string().c_str()) / total);
+
+#ifdef __linux__
+	// A writer thread sends small messages down a pipe; the script counts the bytes.
+	int fds[2];
+	if (pipe(fds) != 0)
+		return 1;
+	int messages = timers * 10;
+	std::thread writer([&]() {
+		char message[64];
+		memset(message, 'x', sizeof(message));
+		for (int i = 0; i < messages; i++)
+			if (write(fds[1], message, sizeof(message)) != sizeof(message))
+				break;
+		close(fds[1]);
+	});
+
+	check(interpreter.eval("(define received 0)"));
+	snprintf(script, sizeof(script),
+		"(watch-fd %d (lambda (fd) (define chunk (read-fd fd))"
+		"  (if chunk (setq received (plus received (string-length chunk))) (unwatch-fd fd))))", fds[0]);
+	start = std::chrono::steady_clock::now();
+	check(interpreter.eval(script));
+	callbacks = interpreter.run_until_idle();
+	check(callbacks);
+	total = seconds_since(start);
+	writer.join();
+	close(fds[0]);
+
+	PolyScript::Value received = interpreter.eval("received");
+	printf("pipe: %s bytes in %s callbacks, %.1f ms (%.0f MB/s)\n", received.to_string().c_str(),
+		callbacks.to_string().c_str(), total * 1e3, messages * 64.0 / total / 1e6);
+	if (received.to_string() != std::to_string(messages * 64))
+		return 1;
+#endif
+	return 0;
+}
@@ -0,0 +1,84 @@
+// HashBench.cpp : Compares lookups in a hash table with lookups in an alist of the same data.
+//
+// Build together with the interpreter sources and POLYSCRIPT_NO_MAIN defined.
+// Usage: HashBench [keys]
+
+#include "../PolyScript/PolyScript.h"
+#include "../PolyScript/Interpreter.h"
+#include "../PolyScript/HashTable.h"
+
+#include <chrono>
+
+using namespace PolyScript;
+
+// Looks a key up the way a script has to with an alist: by walking it.
+static Object *alist_get(Object *alist, Object *key)
+{
+	for (Object *p = alist; p != Nil; p = p->cdr)
+		if (HashTable::equal(p->car->car, key))
+			return p->car->cdr;
+	return NULL;
+}
+
+template <typename F>
+static void measure(const char *name, int lookups, F body)
+{
+	auto start = std::chrono::steady_clock::now();
+	for (int i = 0; i < lookups; i++)
+		body(i);
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	printf("%-28s %12.1f ns/lookup\n", name, seconds * 1e9 / lookups);
+}
+
+int main(int argc, char **argv)
+{
+	int keys = argc > 1 ? atoi(argv[1]) : 100000;
+
+	Interpreter interpreter;
+
+	std::vector<Object *> numbers, strings;
+	Object *number_alist = Nil, *string_alist = Nil;
+	Object *eq_table = HashTable::make(HT_EQ);
+	Object *equal_table = HashTable::make(HT_EQUAL);
+
+	for (int i = 0; i < keys; i++) {
+		char name[32];
+		snprintf(name, sizeof(name), "key-%d", i);
+		numbers.push_back(Object::MakeInt(i));
+		strings.push_back(Object::MakeString(name));
+
+		number_alist = Object::acons(numbers[i], numbers[i], number_alist);
+		string_alist = Object::acons(strings[i], numbers[i], string_alist);
+		HashTable::put(eq_table, numbers[i], numbers[i]);
+		HashTable::put(equal_table, strings[i], numbers[i]);
+	}
+
+	// Every key must be found, with its own value, in every structure.
+	for (int i = 0; i < keys; i++) {
+		Object *key = Object::MakeString(strings[i]->str_value);
+		if (HashTable::get(eq_table, Object::MakeInt(i)) != numbers[i] || HashTable::get(equal_table, key) != numbers[i]
+			|| (i % 997 == 0 && alist_get(string_alist, key) != numbers[i])) {
+			fprintf(stderr, "lookup of key %d failed\n", i);
+			return 1;
+		}
+	}
+
+	// An alist lookup costs O(n), so it gets far fewer lookups.
+	int alist_lookups = keys > 2000 ? 2000 : keys;
+	measure("alist, integer keys", alist_lookups, [&](int i) { alist_get(number_alist, numbers[(int)((i * 7919LL) % keys)]); });
+	measure("alist, string keys", alist_lookups, [&](int i) { alist_get(string_alist, strings[(int)((i * 7919LL) % keys)]); });
+	measure("hash table eq, integer keys", keys, [&](int i) { HashTable::get(eq_table, numbers[(int)((i * 7919LL) % keys)]); });
+	measure("hash table equal, string keys", keys, [&](int i) { HashTable::get(equal_table, strings[(int)((i * 7919LL) % keys)]); });
+
+	// Remove every other key, then check that the rest are still reachable.
+	for (int i = 0; i < keys; i += 2)
+		HashTable::remove(equal_table, strings[i]);
+	for (int i = 0; i < keys; i++)
+		if ((HashTable::get(equal_table, strings[i]) != NULL) != (i % 2 == 1)) {
+			fprintf(stderr, "key %d is in the wrong state after removal\n", i);
+			return 1;
+		}
+
+	return 0;
+}
@@ -0,0 +1,87 @@
+// LimitsBench.cpp : What evaluation limits cost, and how soon they stop a runaway.
+//
+// Build together with the interpreter sources and POLYSCRIPT_NO_MAIN defined.
+// Usage: LimitsBench [n] [runs]
+
+#include "../PolyScript/PolyScript.h"
+#include "../PolyScript/Interpreter.h"
+#include "../PolyScript/Limits.h"
+
+#include <algorithm>
+#include <chrono>
+
+static double seconds_since(std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// The fastest of several runs of source under settings.
+static double best_of(PolyScript::Interpreter &interpreter, const std::string &source, const PolyScript::Limits::Settings &settings, int runs)
+{
+	double best = 1e30;
+	for (int i = 0; i < runs; i++) {
+		PolyScript::ScratchScope scratch;
+		auto start = std::chrono::steady_clock::now();
+		PolyScript::Limits::Scope scope(settings);
+		PolyScript::Value value = interpreter.eval(source);
+		best = std::min(best, seconds_since(start));
+		if (!value.ok()) {
+			fprintf(stderr, "unexpected error: %s\n", value.error.c_str());
+			exit(1);
+		}
+	}
+	return best;
+}
+
+int main(int argc, char **argv)
+{
+	int n = argc > 1 ? atoi(argv[1]) : 22;
+	int runs = argc > 2 ? atoi(argv[2]) : 5;
+
+	PolyScript::Interpreter interpreter;
+	interpreter.eval_all(
+		"(defun fib (n) (if (< n 2) n (plus (fib (minus n 1)) (fib (minus n 2)))))"
+		"(defun spin (n) (spin (plus n 1)))");
+	std::string source = "(fib " + std::to_string(n) + ")";
+
+	struct { const char *name; PolyScript::Limits::Settings settings; } cases[] = {
+		{ "no limits", { 0, 0, 0, 0 } },
+		{ "fuel", { 1ull << 40, 0, 0, 0 } },
+		{ "heap", { 0, 1ull << 40, 0, 0 } },
+		{ "depth", { 0, 0, 100000, 0 } },
+		{ "deadline", { 0, 0, 0, 3600000 } },
+		{ "all four", { 1ull << 40, 1ull << 40, 100000, 3600000 } },
+	};
+	double base = 0;
+	for (auto &c : cases) {
+		double seconds = best_of(interpreter, source, c.settings, runs);
+		if (base == 0)
+			base = seconds;
+		printf("%-28s %8.2f ms  %+5.1f%%\n", c.name, seconds * 1e3, (seconds / base - 1) * 100);
+	}
+
+	// How long a runaway runs past its limit before the error reaches the host.
+	PolyScript::Limits::Settings deadline = { 0, 0, 0, 10 };
+	PolyScript::Limits::Settings depth = { 0, 0, 5000, 0 };
+	PolyScript::Limits::Settings heap = { 0, 16 << 20, 0, 0 };
+	auto start = std::chrono::steady_clock::now();
+	{
+		PolyScript::Limits::Scope scope(depth);
+		PolyScript::Value value = interpreter.eval("(spin 0)");
+		printf("%-28s %8.2f ms  %s\n", "runaway recursion, depth", seconds_since(start) * 1e3, value.limit == PolyScript::LIMIT_DEPTH ? "stopped" : "NOT STOPPED");
+	}
+	start = std::chrono::steady_clock::now();
+	{
+		PolyScript::Limits::Scope scope(deadline);
+		PolyScript::Value value = interpreter.eval("(reduce (lambda (a x) x) 0 (range))");
+		printf("%-28s %8.2f ms  %s\n", "runaway loop, 10 ms deadline", seconds_since(start) * 1e3, value.limit == PolyScript::LIMIT_DEADLINE ? "stopped" : "NOT STOPPED");
+	}
+	start = std::chrono::steady_clock::now();
+	{
+		PolyScript::Limits::Scope scope(heap);
+		PolyScript::Value value = interpreter.eval("(reduce (lambda (a x) (cons x a)) () (range))");
+		printf("%-28s %8.2f ms  %s\n", "runaway allocation, 16 MB", seconds_since(start) * 1e3, value.limit == PolyScript::LIMIT_HEAP ? "stopped" : "NOT STOPPED");
+	}
+
+	return 0;
+}
@@ -0,0 +1,95 @@
+// LinesBench.cpp : Streams a generated log file through count-if and file-lines.
+//
+// Build together with the interpreter sources and POLYSCRIPT_NO_MAIN defined.
+// Usage: LinesBench [megabytes] [path]
+
+#include "../PolyScript/PolyScript.h"
+#include "../PolyScript/Interpreter.h"
+#include "../PolyScript/Streams.h"
+#include "../PolyScript/StringKernels.h"
+
+#include <chrono>
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
+// Peak resident set size in megabytes, or -1 where it isn't available.
+static double peak_rss_mb()
+{
+#ifndef _WIN32
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_maxrss / 1024.0;
+#else
+	return -1;
+#endif
+}
+
+// Writes a log with one ERROR line in every hundred. Returns the number of ERROR lines.
+static int generate(const char *path, long long bytes)
+{
+	FILE *file = fopen(path, "wb");
+	if (!file)
+		return -1;
+
+	long long written = 0;
+	int errors = 0;
+	for (int i = 0; written < bytes; i++) {
+		bool error = i % 100 == 99;
+		errors += error;
+		written += fprintf(file, "2024-05-01 12:%02d:%02d [%s] request %d served in %d ms\n",
+			(i / 60) % 60, i % 60, error ? "ERROR" : "INFO", i, i % 997);
+	}
+	fclose(file);
+	return errors;
+}
+
+template <typename F>
+static double measure(const char *name, double megabytes, F body)
+{
+	auto start = std::chrono::steady_clock::now();
+	body();
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	printf("%-32s %8.2f s %10.1f MB/s   peak RSS %.1f MB\n", name, seconds, megabytes / seconds, peak_rss_mb());
+	return seconds;
+}
+
+int main(int argc, char **argv)
+{
+	double megabytes = argc > 1 ? atof(argv[1]) : 1024;
+	const char *path = argc > 2 ? argv[2] : "lines-bench.log";
+
+	int expected = generate(path, (long long)(megabytes * 1024 * 1024));
+	if (expected < 0) {
+		fprintf(stderr, "cannot write %s\n", path);
+		return 1;
+	}
+	printf("generated %.0f MB, peak RSS %.1f MB\n", megabytes, peak_rss_mb());
+
+	// The same count done directly in C++, as the floor for the interpreter.
+	int direct = 0;
+	measure("LineReader + find", megabytes, [&]() {
+		PolyScript::LineReader *reader = PolyScript::LineReader::open(path);
+		const char *line;
+		size_t length;
+		while (reader->next_line(&line, &length))
+			direct += PolyScript::StringKernels::find(line, length, "ERROR", 5) != NULL;
+		delete reader;
+	});
+
+	PolyScript::Interpreter interpreter;
+	char script[512];
+	snprintf(script, sizeof(script), "(count-if (lambda (line) (string-search \"ERROR\" line)) (file-lines \"%s\"))", path);
+
+	PolyScript::Value result;
+	measure("count-if over file-lines", megabytes, [&]() { result = interpreter.eval(script); });
+
+	remove(path);
+	if (!result.ok() || direct != expected || result.to_string() != std::to_string(expected)) {
+		fprintf(stderr, "expected %d, got %d and %s\n", expected, direct, result.to_string().c_str());
+		return 1;
+	}
+	return 0;
+}
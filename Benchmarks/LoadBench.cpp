@@ -0,0 +1,74 @@
+// LoadBench.cpp : Measures how load time for many independent data files scales with threads.
+//
+// Build together with the interpreter sources and POLYSCRIPT_NO_MAIN defined.
+// Usage: LoadBench [files] [max-threads]
+
+#include "../PolyScript/PolyScript.h"
+#include "../PolyScript/Loader.h"
+
+#include <chrono>
+#include <filesystem>
+#include <thread>
+
+// Writes a data file made of a few defines of large quoted lists.
+static void write_data_file(const std::string &path, int index)
+{
+	FILE *f = fopen(path.c_str(), "wb");
+	for (int d = 0; d < 10; d++)
+	{
+		fprintf(f, "(define table-%d-%d (quote (", index, d);
+		for (int i = 0; i < 2000; i++)
+			fprintf(f, "(entry-%d %d %d.5 \"label %d\") ", i % 50, i, i, i);
+		fprintf(f, ")))\n");
+	}
+	fclose(f);
+}
+
+int main(int argc, char **argv)
+{
+	int file_count = argc > 1 ? atoi(argv[1]) : 64;
+	unsigned max_threads = argc > 2 ? atoi(argv[2]) : std::thread::hardware_concurrency();
+	if (max_threads == 0)
+		max_threads = 1;
+
+	PolyScript::Initialize();
+
+	std::filesystem::path dir = std::filesystem::temp_directory_path() / "polyscript-loadbench";
+	std::filesystem::create_directories(dir);
+
+	std::vector<std::string> paths;
+	for (int i = 0; i < file_count; i++)
+	{
+		paths.push_back((dir / ("data" + std::to_string(i) + ".ps")).string());
+		write_data_file(paths.back(), i);
+	}
+
+	// Load once untimed so every timed run finds the same symbols already interned.
+	PolyScript::Loader::load_files(PolyScript::Object::MakeEnv(PolyScript::Nil, PolyScript::env), paths);
+
+	double single_thread = 0;
+	for (unsigned threads = 1; threads <= max_threads; threads *= 2)
+	{
+		// Each run defines into a fresh frame so runs don't slow each other down.
+		PolyScript::Object *frame = PolyScript::Object::MakeEnv(PolyScript::Nil, PolyScript::env);
+
+		auto start = std::chrono::steady_clock::now();
+		try
+		{
+			PolyScript::Loader::load_files(frame, paths, threads);
+		}
+		catch (PolyScript::Error &e)
+		{
+			fprintf(stderr, "load failed: %s\n", e.message.c_str());
+			return 1;
+		}
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+		if (threads == 1)
+			single_thread = seconds;
+		printf("load: %d files, %2u threads: %.3f s (speedup %.2fx)\n", file_count, threads, seconds, single_thread / seconds);
+	}
+
+	std::filesystem::remove_all(dir);
+	return 0;
+}
@@ -0,0 +1,117 @@
+// MapBench.cpp : Compares functional updates of an alist with those of a persistent map.
+//
+// Build together with the interpreter sources and POLYSCRIPT_NO_MAIN defined.
+// Usage: MapBench [keys]
+
+#include "../PolyScript/PolyScript.h"
+#include "../PolyScript/Interpreter.h"
+#include "../PolyScript/HashTable.h"
+#include "../PolyScript/Map.h"
+
+#include <chrono>
+#include <unordered_map>
+
+using namespace PolyScript;
+
+// Returns a copy of alist with key set to value, the way a script updates one
+// without disturbing whoever else holds the old version.
+static Object *alist_update(Object *alist, Object *key, Object *value)
+{
+	Object *copy = Nil;
+	for (Object *p = alist; p != Nil; p = p->cdr)
+		if (!HashTable::equal(p->car->car, key))
+			copy = Object::cons(p->car, copy);
+	return Object::acons(key, value, copy);
+}
+
+template <typename F>
+static void measure(const char *name, int operations, F body)
+{
+	auto start = std::chrono::steady_clock::now();
+	body();
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	printf("%-32s %12.1f ns/operation\n", name, seconds * 1e9 / operations);
+}
+
+int main(int argc, char **argv)
+{
+	int keys = argc > 1 ? atoi(argv[1]) : 100000;
+
+	Interpreter interpreter;
+
+	std::vector<Object *> strings;
+	for (int i = 0; i < keys; i++) {
+		char name[32];
+		snprintf(name, sizeof(name), "setting-%d", i);
+		strings.push_back(Object::MakeString(name));
+	}
+
+	// Copying an alist on every update is quadratic, so it only gets a few thousand keys.
+	int alist_keys = keys > 5000 ? 5000 : keys;
+	measure("alist copy-on-update", alist_keys, [&]() {
+		Object *alist = Nil;
+		for (int i = 0; i < alist_keys; i++)
+			alist = alist_update(alist, strings[i], strings[i]);
+	});
+
+	Object *map = NULL;
+	measure("persistent map assoc", keys, [&]() {
+		map = Map::make(HT_EQUAL);
+		for (int i = 0; i < keys; i++)
+			map = Map::assoc(map, strings[i], strings[i]);
+	});
+
+	Object *bulk = NULL;
+	measure("transient map assoc!", keys, [&]() {
+		bulk = Map::transient(Map::make(HT_EQUAL));
+		for (int i = 0; i < keys; i++)
+			Map::assoc(bulk, strings[i], strings[i]);
+		Map::persistent(bulk);
+	});
+
+	measure("persistent map lookup", keys, [&]() {
+		for (int i = 0; i < keys; i++)
+			Map::lookup(map, strings[(int)((i * 7919LL) % keys)]);
+	});
+
+	if (map->map_count != (uint32_t)keys || !Map::equal(map, bulk)) {
+		fprintf(stderr, "bulk-built map differs\n");
+		return 1;
+	}
+
+	// Random updates, checked against a reference. Each step keeps the previous
+	// version and checks that it was not disturbed.
+	std::unordered_map<int, int> reference;
+	Object *current = Map::make(HT_EQUAL);
+	unsigned seed = 12345;
+	for (int step = 0; step < keys; step++) {
+		seed = seed * 1103515245 + 12345;
+		int k = (seed >> 8) % (keys / 4 + 1);
+		Object *previous = current;
+		uint32_t previous_count = previous->map_count;
+
+		if (seed & 1) {
+			current = Map::assoc(current, Object::MakeInt(k), Object::MakeInt(step));
+			reference[k] = step;
+		}
+		else {
+			current = Map::dissoc(current, Object::MakeInt(k));
+			reference.erase(k);
+		}
+
+		if (previous->map_count != previous_count || current->map_count != reference.size()) {
+			fprintf(stderr, "count is wrong after step %d\n", step);
+			return 1;
+		}
+	}
+	for (auto &kv : reference) {
+		Object *value = Map::lookup(current, Object::MakeInt(kv.first));
+		if (!value || value->int_value != kv.second) {
+			fprintf(stderr, "key %d has the wrong value\n", kv.first);
+			return 1;
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,70 @@
+// ParallelBench.cpp : Speedup of pmap and preduce from 1 to 64 threads.
+//
+// Build together with the interpreter sources and POLYSCRIPT_NO_MAIN defined.
+// Usage: ParallelBench [records] [max-threads]
+//
+// Each record is scored by a function that makes a few hundred calls, like a small
+// model; the cheap run maps (plus x 1) to show what the scheduling itself costs.
+
+#include "../PolyScript/PolyScript.h"
+#include "../PolyScript/Interpreter.h"
+
+#include <chrono>
+
+static double seconds(PolyScript::Interpreter &interpreter, const char *script, std::string &result)
+{
+	auto start = std::chrono::steady_clock::now();
+	PolyScript::Value value = interpreter.eval(script);
+	double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	if (!value.ok()) {
+		fprintf(stderr, "%s\n", value.error.c_str());
+		exit(1);
+	}
+	result = value.to_string();
+	return elapsed;
+}
+
+int main(int argc, char **argv)
+{
+	int records = argc > 1 ? atoi(argv[1]) : 20000;
+	int max_threads = argc > 2 ? atoi(argv[2]) : 64;
+	char script[256];
+
+	PolyScript::Interpreter interpreter;
+	snprintf(script, sizeof(script), "(define records (to-list (range %d)))", records);
+	interpreter.eval(script);
+	interpreter.eval_all(
+		"(defun fib (n) (if (< n 2) n (plus (fib (minus n 1)) (fib (minus n 2)))))"
+		"(defun score (x) (plus x (fib 10)))");
+
+	const char *heavy = "(preduce plus 0 (pmap score records))";
+	const char *cheap = "(preduce plus 0 (pmap (lambda (x) (plus x 1)) records))";
+
+	std::string expected, expected_cheap, result;
+	interpreter.eval("(parallel-threads 1)");
+	double heavy_base = seconds(interpreter, heavy, expected);
+	double cheap_base = seconds(interpreter, cheap, expected_cheap);
+
+	printf("%d records\n", records);
+	printf("threads   score: s  speedup   plus 1: s  speedup\n");
+	for (int threads = 1; threads <= max_threads; threads *= 2) {
+		snprintf(script, sizeof(script), "(parallel-threads %d)", threads);
+		interpreter.eval(script);
+
+		double heavy_time = seconds(interpreter, heavy, result);
+		if (result != expected) {
+			fprintf(stderr, "%d threads gave %s, not %s\n", threads, result.c_str(), expected.c_str());
+			return 1;
+		}
+		double cheap_time = seconds(interpreter, cheap, result);
+		if (result != expected_cheap) {
+			fprintf(stderr, "%d threads gave %s, not %s\n", threads, result.c_str(), expected_cheap.c_str());
+			return 1;
+		}
+
+		printf("%7d %10.3f %8.2fx %11.3f %8.2fx\n", threads,
+			heavy_time, heavy_base / heavy_time, cheap_time, cheap_base / cheap_time);
+	}
+	return 0;
+}
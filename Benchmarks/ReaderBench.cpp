@@ -0,0 +1,70 @@
+// ReaderBench.cpp : Measures how fast the reader turns source text into objects.
+//
+// Build together with the interpreter sources and POLYSCRIPT_NO_MAIN defined.
+// Usage: ReaderBench [forms] [iterations]
+
+#include "../PolyScript/PolyScript.h"
+#include "../PolyScript/Parser.h"
+
+#include <chrono>
+
+// Builds a source text that looks like a typical data file: nested lists with
+// a mix of repeated symbols, strings, integers and floats.
+static std::string make_source(int forms)
+{
+	static const char *symbols[] = { "define", "config", "item-name", "weight", "price", "tags", "enabled", "count" };
+	std::string text;
+	char number[64];
+
+	for (int i = 0; i < forms; i++)
+	{
+		text += "(define ";
+		text += symbols[i % 8];
+		text += " (quote (";
+		for (int j = 0; j < 8; j++)
+		{
+			text += symbols[(i + j) % 8];
+			snprintf(number, sizeof(number), " %d %d.%d \"a string value %d\" ", i * j, j, i % 100, i);
+			text += number;
+		}
+		text += "(nested (list ";
+		text += symbols[(i + 3) % 8];
+		text += ")))))\n";
+	}
+	return text;
+}
+
+int main(int argc, char **argv)
+{
+	int forms = argc > 1 ? atoi(argv[1]) : 10000;
+	int iterations = argc > 2 ? atoi(argv[2]) : 20;
+
+	PolyScript::Initialize();
+	std::string source = make_source(forms);
+
+	long long total_forms = 0;
+	auto start = std::chrono::steady_clock::now();
+
+	try
+	{
+		for (int i = 0; i < iterations; i++)
+		{
+			PolyScript::Parser::set_input(source.data(), source.data() + source.size());
+			while (PolyScript::Parser::read() != NULL)
+				total_forms++;
+		}
+	}
+	catch (PolyScript::Error &e)
+	{
+		fprintf(stderr, "reader error: %s\n", e.message.c_str());
+		return 1;
+	}
+
+	auto end = std::chrono::steady_clock::now();
+	double seconds = std::chrono::duration<double>(end - start).count();
+	double bytes = (double)source.size() * iterations;
+
+	printf("reader: %lld forms, %.1f MB in %.3f s\n", total_forms, bytes / 1e6, seconds);
+	printf("reader: %.1f MB/s, %.0f ns/form\n", bytes / 1e6 / seconds, seconds * 1e9 / total_forms);
+	return 0;
+}
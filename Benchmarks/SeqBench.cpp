@@ -0,0 +1,64 @@
+// SeqBench.cpp : Compares a fused lazy pipeline against the same pipeline over lists.
+//
+// Build together with the interpreter sources and POLYSCRIPT_NO_MAIN defined.
+// Usage: SeqBench [elements]
+//
+// The lazy pipeline runs first: peak RSS only ever grows, so the eager one would
+// hide it otherwise.
+
+#include "../PolyScript/PolyScript.h"
+#include "../PolyScript/Interpreter.h"
+
+#include <chrono>
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
+// Peak resident set size in megabytes, or -1 where it isn't available.
+static double peak_rss_mb()
+{
+#ifndef _WIN32
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_maxrss / 1024.0;
+#else
+	return -1;
+#endif
+}
+
+static PolyScript::Value measure(PolyScript::Interpreter &interpreter, const char *name, const char *script)
+{
+	auto start = std::chrono::steady_clock::now();
+	PolyScript::Value result = interpreter.eval(script);
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	printf("%-10s %8.2f s   peak RSS %.1f MB\n", name, seconds, peak_rss_mb());
+	return result;
+}
+
+int main(int argc, char **argv)
+{
+	int elements = argc > 1 ? atoi(argv[1]) : 1000000;
+	char lazy[256];
+	char eager[256];
+
+	snprintf(lazy, sizeof(lazy),
+		"(reduce plus 0 (lazy-filter (lambda (x) (> x %d)) (lazy-map (lambda (x) (multiply x 2)) (range %d))))",
+		elements, elements);
+	snprintf(eager, sizeof(eager),
+		"(reduce plus 0 (filter (lambda (x) (> x %d)) (mapcar (lambda (x) (multiply x 2)) (to-list (range %d)))))",
+		elements, elements);
+
+	PolyScript::Interpreter interpreter;
+	printf("%d elements, peak RSS %.1f MB at start\n", elements, peak_rss_mb());
+
+	PolyScript::Value fused = measure(interpreter, "lazy", lazy);
+	PolyScript::Value lists = measure(interpreter, "eager", eager);
+
+	if (!fused.ok() || !lists.ok() || fused.to_string() != lists.to_string()) {
+		fprintf(stderr, "results differ: %s and %s\n", fused.to_string().c_str(), lists.to_string().c_str());
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,130 @@
+// ServerBench.cpp : Load generator for the evaluation server. Runs closed-loop
+// clients at rising concurrency and reports requests per second and latency.
+//
+// Build together with the interpreter sources and POLYSCRIPT_NO_MAIN defined.
+// Usage: ServerBench [expression] [seconds per level] [socket]
+// Without a socket, it starts a server of its own, with a worker per core and fib
+// defined in the library.
+
+#include "../PolyScript/PolyScript.h"
+#include "../PolyScript/Server.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+typedef std::chrono::steady_clock Clock;
+
+#ifndef _WIN32
+static int connect_to(const char *path)
+{
+	struct sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strncpy(address.sun_path, path, sizeof(address.sun_path) - 1);
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0 || connect(fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+		perror(path);
+		exit(1);
+	}
+	return fd;
+}
+
+// One client: sends the request and waits for the reply, over and over, until the
+// time is up. Returns each request's latency in microseconds.
+static void run_client(const char *path, const std::string &request, Clock::time_point end,
+	std::vector<double> &latencies, std::atomic<int> &errors)
+{
+	int fd = connect_to(path);
+	std::string reply;
+	while (Clock::now() < end) {
+		auto start = Clock::now();
+		if (!PolyScript::Server::write_frame(fd, request) || !PolyScript::Server::read_frame(fd, reply)) {
+			errors++;
+			break;
+		}
+		latencies.push_back(std::chrono::duration<double, std::micro>(Clock::now() - start).count());
+		if (reply.empty() || reply[0] != PolyScript::Server::REPLY_VALUE)
+			errors++;
+	}
+	close(fd);
+}
+
+static double percentile(const std::vector<double> &sorted, double p)
+{
+	return sorted[std::min(sorted.size() - 1, (size_t)(p * sorted.size()))];
+}
+#endif
+
+int main(int argc, char **argv)
+{
+#ifdef _WIN32
+	fprintf(stderr, "ServerBench needs Unix domain sockets\n");
+	return 1;
+#else
+	std::string request = argc > 1 ? argv[1] : "(fib 15)";
+	double seconds = argc > 2 ? atof(argv[2]) : 2.0;
+
+	std::unique_ptr<PolyScript::Server> server;
+	std::string path;
+	if (argc > 3) {
+		path = argv[3];
+	} else {
+		path = "/tmp/polyscript-bench-" + std::to_string(getpid()) + ".sock";
+		std::string library = path + ".lisp";
+		FILE *file = fopen(library.c_str(), "w");
+		fputs("(defun fib (n) (if (< n 2) n (plus (fib (minus n 1)) (fib (minus n 2)))))\n", file);
+		fclose(file);
+
+		PolyScript::Server::Options options;
+		options.socket_path = path;
+		options.workers = 0;
+		options.library.push_back(library);
+		options.limits = { 0, 0, 0, 0 };
+		server.reset(new PolyScript::Server(options));
+		try
+		{
+			server->start();
+		}
+		catch (PolyScript::Error &e)
+		{
+			fprintf(stderr, "%s\n", e.message.c_str());
+			return 1;
+		}
+		unlink(library.c_str());
+	}
+
+	printf("%s, %u cores\n", request.c_str(), std::thread::hardware_concurrency());
+	printf("clients  requests/s     p50 us     p99 us   errors\n");
+	for (int clients = 1; clients <= 64; clients *= 2) {
+		std::vector<std::vector<double>> latencies(clients);
+		std::vector<std::thread> threads;
+		std::atomic<int> errors(0);
+		auto start = Clock::now();
+		auto end = start + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(seconds));
+		for (int i = 0; i < clients; i++)
+			threads.emplace_back(run_client, path.c_str(), std::cref(request), end, std::ref(latencies[i]), std::ref(errors));
+		for (auto &thread : threads)
+			thread.join();
+		double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+
+		std::vector<double> all;
+		for (auto &l : latencies)
+			all.insert(all.end(), l.begin(), l.end());
+		if (all.empty())
+			continue;
+		std::sort(all.begin(), all.end());
+		printf("%7d %11.0f %10.0f %10.0f %8d\n", clients, all.size() / elapsed, percentile(all, 0.5), percentile(all, 0.99), errors.load());
+	}
+
+	if (server)
+		server->stop();
+	return 0;
+#endif
+}
@@ -0,0 +1,96 @@
+// StringBench.cpp : Measures building a large report and searching through it.
+//
+// Build together with the interpreter sources and POLYSCRIPT_NO_MAIN defined.
+// Usage: StringBench [lines]
+
+#include "../PolyScript/PolyScript.h"
+#include "../PolyScript/Interpreter.h"
+#include "../PolyScript/StringKernels.h"
+
+#include <chrono>
+
+template <typename F>
+static void measure(const char *name, F body)
+{
+	auto start = std::chrono::steady_clock::now();
+	body();
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	printf("%-36s %10.2f ms\n", name, seconds * 1e3);
+}
+
+// The search a script would have to write without string-search.
+static const char *naive_find(const char *text, size_t n, const char *needle, size_t m)
+{
+	for (size_t i = 0; i + m <= n; i++) {
+		size_t j = 0;
+		while (j < m && text[i + j] == needle[j])
+			j++;
+		if (j == m)
+			return text + i;
+	}
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	int lines = argc > 1 ? atoi(argv[1]) : 20000;
+	char script[256];
+
+	PolyScript::Interpreter interpreter;
+	printf("kernels: %s\n", PolyScript::StringKernels::instruction_set());
+
+	interpreter.eval_all(
+		"(defun build-concat (n report)"
+		"  (if (zerop n) report"
+		"      (build-concat (minus n 1) (concat report (format \"row ~d: value ~,2f~%\" n (multiply n 1.5))))))"
+		"(defun fill-builder (n b)"
+		"  (if (zerop n) b"
+		"      (fill-builder (minus n 1) (string-builder-append b (format \"row ~d: value ~,2f~%\" n (multiply n 1.5))))))");
+
+	// Quadratic: every step copies the whole report so far.
+	int concat_lines = lines > 5000 ? 5000 : lines;
+	snprintf(script, sizeof(script), "(string-length (build-concat %d \"\"))", concat_lines);
+	measure("concat, 5000 lines", [&]() { interpreter.eval(script); });
+
+	snprintf(script, sizeof(script), "(define report (string-builder-string (fill-builder %d (make-string-builder))))", lines);
+	PolyScript::Value report;
+	measure("string builder, all lines", [&]() { report = interpreter.eval(script); });
+	if (!report.ok()) {
+		fprintf(stderr, "%s\n", report.error.c_str());
+		return 1;
+	}
+
+	// Search for something that only appears at the very end.
+	PolyScript::Object *text = report.object;
+	const char *needle = "row 1: value";
+	size_t needle_length = strlen(needle);
+	const char *expected = naive_find(text->str_value, text->str_length, needle, needle_length);
+	const char *found = NULL;
+
+	// Every result is stored through a volatile so that no search can be optimized away.
+	static const char *volatile result;
+	measure("naive search x100", [&]() {
+		for (int i = 0; i < 100; i++)
+			result = naive_find(text->str_value, text->str_length, needle, needle_length);
+	});
+	measure("string-search kernel x100", [&]() {
+		for (int i = 0; i < 100; i++)
+			result = PolyScript::StringKernels::find(text->str_value, text->str_length, needle, needle_length);
+		found = result;
+	});
+	if (!expected || found != expected) {
+		fprintf(stderr, "search results differ\n");
+		return 1;
+	}
+
+	PolyScript::Value split;
+	measure("string-split into lines", [&]() { split = interpreter.eval("(string-split report \"\\n\")"); });
+	if (!split.ok()) {
+		fprintf(stderr, "%s\n", split.error.c_str());
+		return 1;
+	}
+
+	printf("report is %d bytes\n", (int)text->str_length);
+	return 0;
+}
@@ -0,0 +1,278 @@
+// SuiteBench.cpp : The standard benchmark suite, built as polyscript-bench.
+//
+// Runs a fixed set of Gabriel-style programs and writes one JSON document to stdout
+// with the time, allocations and peak RSS of each, so that runs can be compared
+// across changes. Every benchmark checks its result against a C++ reference.
+// Usage: polyscript-bench [--quick] [--repeat n] [name ...]
+
+#include "../PolyScript/PolyScript.h"
+#include "../PolyScript/Interpreter.h"
+#include "../PolyScript/StringKernels.h"
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+struct Benchmark
+{
+	const char *name;
+
+	// Definitions evaluated once, before timing.
+	std::string (*setup)(int size);
+
+	// The form that is timed.
+	std::string (*script)(int size);
+
+	// What the form must evaluate to.
+	long long (*expected)(int size);
+
+	int size;
+	int quick_size;
+};
+
+static std::string format(const char *control, int size)
+{
+	char buffer[1024];
+	snprintf(buffer, sizeof(buffer), control, size);
+	return buffer;
+}
+
+static long long fib(int n)
+{
+	return n < 2 ? n : fib(n - 1) + fib(n - 2);
+}
+
+static long long tak(int x, int y, int z)
+{
+	return y < x ? tak(tak(x - 1, y, z), tak(y - 1, z, x), tak(z - 1, x, y)) : z;
+}
+
+// The printed length of (tree n): LEAF, or (subtree n subtree).
+static long long tree_length(int n)
+{
+	return n == 0 ? 4 : 2 * tree_length(n - 1) + std::to_string(n).size() + 4;
+}
+
+// Source text with size top-level forms and a few hundred distinct symbols, like a
+// large program being loaded.
+static std::string generated_source(int size)
+{
+	std::string source = "(count-if (lambda (form) form) (quote (";
+	char form[256];
+	for (int i = 0; i < size; i++) {
+		int s = i % 400;
+		snprintf(form, sizeof(form), "(defun handler-%d (event-%d state) (dispatch-%d event-%d (lookup state 'key-%d) \"text\" %d))\n",
+			s, s, s % 40, s, s % 97, i);
+		source += form;
+	}
+	return source + ")))";
+}
+
+static const Benchmark benchmarks[] = {
+	{ "fib",
+		[](int) -> std::string { return "(defun fib (n) (if (< n 2) n (plus (fib (minus n 1)) (fib (minus n 2)))))"; },
+		[](int n) { return format("(fib %d)", n); },
+		[](int n) { return fib(n); },
+		25, 15 },
+	{ "tak",
+		[](int) -> std::string { return "(defun tak (x y z) (if (< y x) (tak (tak (minus x 1) y z) (tak (minus y 1) z x) (tak (minus z 1) x y)) z))"; },
+		[](int x) { return format("(tak %d 12 6)", x); },
+		[](int x) { return tak(x, 12, 6); },
+		18, 14 },
+	{ "ackermann",
+		[](int) -> std::string { return "(defun ack (m n) (if (zerop m) (plus n 1) (if (zerop n) (ack (minus m 1) 1) (ack (minus m 1) (ack m (minus n 1))))))"; },
+		[](int n) { return format("(ack 3 %d)", n); },
+		[](int n) { return (1LL << (n + 3)) - 3; },
+		6, 3 },
+	{ "list-reverse",
+		[](int) -> std::string {
+			return "(defun build (n acc) (if (zerop n) acc (build (minus n 1) (cons n acc))))"
+				"(defun rev (l acc) (if l (rev (cdr l) (cons (car l) acc)) acc))";
+		},
+		[](int n) { return format("(reduce (lambda (sum k) (plus sum (car (rev (build 1000 ()) ())))) 0 (range %d))", n); },
+		[](int n) { return 1000LL * n; },
+		200, 10 },
+	{ "read-symbols",
+		[](int) -> std::string { return ""; },
+		generated_source,
+		[](int n) { return (long long)n; },
+		5000, 200 },
+	{ "closures",
+		[](int) -> std::string {
+			return "(defun make-adder (n) (lambda (x) (plus x n)))"
+				"(defun compose (f g) (lambda (x) (f (g x))))";
+		},
+		[](int n) { return format("(reduce (lambda (acc k) ((compose (make-adder k) (make-adder 1)) acc)) 0 (range %d))", n); },
+		[](int n) { return (long long)n * (n + 1) / 2; },
+		50000, 1000 },
+	{ "deep-recursion",
+		[](int) -> std::string { return "(defun depth (n) (if (zerop n) 0 (plus 1 (depth (minus n 1)))))"; },
+		[](int n) { return format("(reduce (lambda (sum k) (plus sum (depth %d))) 0 (range 20))", n); },
+		[](int n) { return 20LL * n; },
+		10000, 1000 },
+	{ "special-variables",
+		[](int) -> std::string {
+			return "(defvar *step* 1)"
+				"(defun sum-steps (n) (if (zerop n) (reduce (lambda (sum k) (plus sum *step*)) 0 (range 100000)) (sum-steps (minus n 1))))";
+		},
+		[](int n) { return format("(dynamic-let ((*step* 2)) (sum-steps %d))", n); },
+		[](int) { return 200000LL; },
+		2000, 100 },
+	{ "let-bindings",
+		[](int) -> std::string {
+			return "(defun step-sum (k) (let* ((a k) (b (plus a 1))) (let ((c b) (d a)) (minus (plus c d) a))))";
+		},
+		[](int n) { return format("(reduce (lambda (sum k) (plus sum (step-sum k))) 0 (range %d))", n); },
+		[](int n) { return (long long)n * (n + 1) / 2; },
+		50000, 1000 },
+	{ "print-tree",
+		[](int n) {
+			return "(defun tree (n) (if (zerop n) 'leaf (list (tree (minus n 1)) n (tree (minus n 1)))))"
+				+ format("(define big-tree (tree %d))", n);
+		},
+		[](int) -> std::string { return "(string-length (prin1-to-string big-tree))"; },
+		tree_length,
+		16, 8 },
+};
+
+// Peak resident set size of this process in kilobytes, or -1 where it isn't available.
+static long peak_rss_kb()
+{
+#ifndef _WIN32
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_maxrss;
+#else
+	return -1;
+#endif
+}
+
+// Runs one benchmark and prints its JSON object. Returns false if a result was wrong.
+static bool run(const Benchmark &benchmark, bool quick, int repeat)
+{
+	int size = quick ? benchmark.quick_size : benchmark.size;
+	long long expected = benchmark.expected(size);
+	std::string script = benchmark.script(size);
+
+	PolyScript::Interpreter interpreter;
+	std::string definitions = benchmark.setup(size);
+	bool ok = true;
+	std::string error;
+	if (!definitions.empty()) {
+		PolyScript::Value setup = interpreter.eval_all(definitions);
+		ok = setup.ok();
+		error = setup.error;
+	}
+
+	// One untimed run to warm up, then the timed ones. Each run's allocations go to
+	// the scratch arena and are given back after it, so that repetitions don't add
+	// to the peak RSS.
+	std::vector<double> seconds;
+	uint64_t allocations = 0;
+	uint64_t bytes = 0;
+	for (int i = 0; ok && i <= repeat; i++) {
+		PolyScript::ScratchScope scope;
+		uint64_t count_before = PolyScript::allocation_count;
+		uint64_t bytes_before = PolyScript::allocation_bytes;
+		auto start = std::chrono::steady_clock::now();
+		PolyScript::Value result = interpreter.eval(script);
+		double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+		if (!result.ok() || !result.object->IsAtomSubtype(PolyScript::AT_INT) || result.object->int_value != expected) {
+			ok = false;
+			error = "expected " + std::to_string(expected) + ", got " + result.to_string();
+		}
+		if (i > 0) {
+			seconds.push_back(elapsed);
+			allocations += PolyScript::allocation_count - count_before;
+			bytes += PolyScript::allocation_bytes - bytes_before;
+		}
+	}
+
+	printf("    {\"name\": \"%s\", \"size\": %d, \"ok\": %s", benchmark.name, size, ok ? "true" : "false");
+	if (ok) {
+		std::sort(seconds.begin(), seconds.end());
+		printf(", \"runs\": %d, \"median_seconds\": %.6f, \"min_seconds\": %.6f, \"allocations\": %llu, \"allocated_bytes\": %llu, \"peak_rss_kb\": %ld}",
+			repeat, seconds[seconds.size() / 2], seconds[0],
+			(unsigned long long)(allocations / repeat), (unsigned long long)(bytes / repeat), peak_rss_kb());
+	}
+	else {
+		fprintf(stderr, "%s: %s\n", benchmark.name, error.c_str());
+		printf("}");
+	}
+	fflush(stdout);
+	return ok;
+}
+
+// Runs a benchmark in a child process where there is fork, so its peak RSS is its
+// own and a crash only loses that one result.
+static bool run_isolated(const Benchmark &benchmark, bool quick, int repeat)
+{
+#ifndef _WIN32
+	fflush(stdout);
+	pid_t child = fork();
+	if (child == 0)
+		_exit(run(benchmark, quick, repeat) ? 0 : 1);
+
+	int status = 0;
+	if (child < 0 || waitpid(child, &status, 0) < 0) {
+		printf("    {\"name\": \"%s\", \"ok\": false}", benchmark.name);
+		return false;
+	}
+	if (WIFSIGNALED(status)) {
+		fprintf(stderr, "%s: killed by signal %d\n", benchmark.name, WTERMSIG(status));
+		printf("    {\"name\": \"%s\", \"ok\": false}", benchmark.name);
+		return false;
+	}
+	return WEXITSTATUS(status) == 0;
+#else
+	return run(benchmark, quick, repeat);
+#endif
+}
+
+int main(int argc, char **argv)
+{
+	bool quick = false;
+	int repeat = 5;
+	std::vector<std::string> names;
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		if (arg == "--quick")
+			quick = true;
+		else if (arg == "--repeat" && i + 1 < argc)
+			repeat = std::max(1, atoi(argv[++i]));
+		else
+			names.push_back(arg);
+	}
+
+	for (const std::string &name : names) {
+		if (std::none_of(std::begin(benchmarks), std::end(benchmarks), [&](const Benchmark &b) { return name == b.name; })) {
+			fprintf(stderr, "unknown benchmark %s\n", name.c_str());
+			return 2;
+		}
+	}
+
+	printf("{\n  \"suite\": \"polyscript-bench\",\n  \"quick\": %s,\n  \"kernels\": \"%s\",\n  \"benchmarks\": [\n",
+		quick ? "true" : "false", PolyScript::StringKernels::instruction_set());
+
+	bool ok = true;
+	bool first = true;
+	for (const Benchmark &benchmark : benchmarks) {
+		if (!names.empty() && std::find(names.begin(), names.end(), benchmark.name) == names.end())
+			continue;
+		if (!first)
+			printf(",\n");
+		first = false;
+		ok &= run_isolated(benchmark, quick, repeat);
+	}
+
+	printf("\n  ]\n}\n");
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,62 @@
+// VectorBench.cpp : Compares summing a list of boxed floats with the typed vector kernels.
+//
+// Build together with the interpreter sources and POLYSCRIPT_NO_MAIN defined.
+// Usage: VectorBench [elements] [repeats]
+
+#include "../PolyScript/PolyScript.h"
+#include "../PolyScript/Interpreter.h"
+#include "../PolyScript/VectorKernels.h"
+
+#include <chrono>
+
+template <typename F>
+static double measure(const char *name, int repeats, size_t elements, F body)
+{
+	double result = 0;
+	auto start = std::chrono::steady_clock::now();
+	for (int i = 0; i < repeats; i++)
+		result = body();
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	printf("%-24s %8.3f ns/element\n", name, seconds * 1e9 / ((double)repeats * elements));
+	return result;
+}
+
+int main(int argc, char **argv)
+{
+	size_t elements = argc > 1 ? atoi(argv[1]) : 1000000;
+	int repeats = argc > 2 ? atoi(argv[2]) : 20;
+
+	using namespace PolyScript;
+	Interpreter interpreter;
+	printf("kernels: %s\n", VectorKernels::instruction_set());
+
+	// The same values as a cons list of boxed floats and as a float vector.
+	Object *list = Nil;
+	Object *vector = Object::MakeVector(VT_FLOAT64, elements);
+	for (size_t i = elements; i-- > 0; )
+	{
+		list = Object::cons(Object::MakeFloat(i * 0.5), list);
+		vector->float64_elements()[i] = i * 0.5;
+	}
+
+	double list_sum = measure("cons list walk", repeats, elements, [&]() {
+		double sum = 0;
+		for (Object *p = list; p != Nil; p = p->cdr)
+			sum += p->car->float_value;
+		return sum;
+	});
+	double vector_sum = measure("vsum kernel", repeats, elements, [&]() {
+		return VectorKernels::sum(vector->float64_elements(), elements);
+	});
+	measure("vdot kernel", repeats, elements, [&]() {
+		return VectorKernels::dot(vector->float64_elements(), vector->float64_elements(), elements);
+	});
+
+	if (list_sum != vector_sum)
+	{
+		fprintf(stderr, "sums differ: %f %f\n", list_sum, vector_sum);
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,265 @@
+#include "stdafx.h"
+#include "Allocations.h"
+#include "Primitives.h"
+#include "Printer.h"
+#include "Profiler.h"
+
+#include <algorithm>
+#include <map>
+#include <unordered_map>
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
+// Each thread counts into a table of its own, created the first time it allocates
+// while tracking and never freed, so a report can still read it after the thread
+// has gone. A site is keyed by the body of the function, rather than the closure,
+// so that every closure made from one lambda counts as the same site.
+
+namespace PolyScript
+{
+	namespace Allocations
+	{
+		using Primitives::evaluate_arguments;
+
+		std::atomic<bool> tracking(false);
+		thread_local Object *current_form = NULL;
+
+		static const char *const kind_names[AK_COUNT] = {
+			"cons", "int", "float", "symbol", "string", "env", "closure", "vector", "table", "data", "other"
+		};
+
+		struct Counts
+		{
+			uint64_t objects;
+			uint64_t bytes;
+		};
+
+		struct Site
+		{
+			// The function's name, or NULL for a lambda or the top level.
+			Object *name;
+			Counts counts;
+		};
+
+		struct SiteKey
+		{
+			Object *code;
+			Object *form;
+
+			bool operator==(const SiteKey &other) const { return code == other.code && form == other.form; }
+		};
+
+		struct SiteHash
+		{
+			size_t operator()(const SiteKey &key) const
+			{
+				return std::hash<Object *>()(key.code) * 31 + std::hash<Object *>()(key.form);
+			}
+		};
+
+		struct Table
+		{
+			std::mutex lock;
+			Counts kinds[AK_COUNT];
+			std::unordered_map<SiteKey, Site, SiteHash> sites;
+		};
+
+		static std::mutex tables_lock;
+		static std::vector<Table *> tables;
+		static thread_local Table *local_table = NULL;
+
+		static Table *thread_table()
+		{
+			if (!local_table) {
+				local_table = new Table();
+				std::lock_guard<std::mutex> guard(tables_lock);
+				tables.push_back(local_table);
+			}
+			return local_table;
+		}
+
+		void record(AllocationKind kind, size_t size)
+		{
+			Table *table = thread_table();
+			std::lock_guard<std::mutex> guard(table->lock);
+			table->kinds[kind].objects++;
+			table->kinds[kind].bytes += size;
+
+			Object *fn = Profiler::current_function();
+			SiteKey key = { fn ? fn->body : NULL, current_form };
+			auto found = table->sites.find(key);
+			if (found == table->sites.end()) {
+				found = table->sites.emplace(key, Site{ fn ? fn->fn_name : NULL, { 0, 0 } }).first;
+				// The report prints the form later, so a scratch scope must not rewind it.
+				note_pointer_store();
+			}
+			found->second.counts.objects++;
+			found->second.counts.bytes += size;
+		}
+
+		void start()
+		{
+#ifndef POLYSCRIPT_TRACK_ALLOCATIONS
+			error("allocations-start: this build does not track allocations; define POLYSCRIPT_TRACK_ALLOCATIONS");
+#endif
+			if (!tracking) {
+				Profiler::stack_users++;
+				tracking = true;
+			}
+			std::lock_guard<std::mutex> guard(tables_lock);
+			for (Table *table : tables) {
+				std::lock_guard<std::mutex> table_guard(table->lock);
+				memset(table->kinds, 0, sizeof(table->kinds));
+				table->sites.clear();
+			}
+		}
+
+		void stop()
+		{
+			if (tracking) {
+				tracking = false;
+				Profiler::stack_users--;
+			}
+		}
+
+		static std::string format_bytes(uint64_t bytes)
+		{
+			char text[32];
+			if (bytes >= 10 * 1024 * 1024)
+				snprintf(text, sizeof(text), "%.1f MB", bytes / (1024.0 * 1024.0));
+			else if (bytes >= 10 * 1024)
+				snprintf(text, sizeof(text), "%.1f KB", bytes / 1024.0);
+			else
+				snprintf(text, sizeof(text), "%llu B", (unsigned long long)bytes);
+			return text;
+		}
+
+		std::string report(int site_count)
+		{
+			// Copy everything out first: printing may itself allocate, and so record.
+			Counts kinds[AK_COUNT] = {};
+			std::unordered_map<SiteKey, Site, SiteHash> sites;
+			{
+				std::lock_guard<std::mutex> guard(tables_lock);
+				for (Table *table : tables) {
+					std::lock_guard<std::mutex> table_guard(table->lock);
+					for (int k = 0; k < AK_COUNT; k++) {
+						kinds[k].objects += table->kinds[k].objects;
+						kinds[k].bytes += table->kinds[k].bytes;
+					}
+					for (auto &entry : table->sites) {
+						Site &site = sites.emplace(entry.first, Site{ entry.second.name, { 0, 0 } }).first->second;
+						site.counts.objects += entry.second.counts.objects;
+						site.counts.bytes += entry.second.counts.bytes;
+					}
+				}
+			}
+
+			char line[256];
+			std::string out = "    objects        bytes  kind\n";
+			for (int k = 0; k < AK_COUNT; k++) {
+				if (kinds[k].objects == 0)
+					continue;
+				snprintf(line, sizeof(line), "%11llu %12s  %s\n", (unsigned long long)kinds[k].objects,
+					format_bytes(kinds[k].bytes).c_str(), kind_names[k]);
+				out += line;
+			}
+
+			std::vector<std::pair<SiteKey, Site>> ranked(sites.begin(), sites.end());
+			std::sort(ranked.begin(), ranked.end(), [](const std::pair<SiteKey, Site> &a, const std::pair<SiteKey, Site> &b) {
+				return a.second.counts.bytes > b.second.counts.bytes;
+			});
+			if (ranked.size() > (size_t)site_count)
+				ranked.resize(site_count);
+
+			out += "\n    objects        bytes  function / form\n";
+			for (auto &entry : ranked) {
+				std::string form = entry.first.form ? Printer::to_string(entry.first.form, true) : "(toplevel)";
+				if (form.size() > 60)
+					form = form.substr(0, 57) + "...";
+				const char *name = entry.second.name ? entry.second.name->name : entry.first.code ? "(lambda)" : "(toplevel)";
+				snprintf(line, sizeof(line), "%11llu %12s  %s  %s\n", (unsigned long long)entry.second.counts.objects,
+					format_bytes(entry.second.counts.bytes).c_str(), name, form.c_str());
+				out += line;
+			}
+			return out;
+		}
+
+		std::string room()
+		{
+			int symbols = 0;
+			{
+				std::lock_guard<std::mutex> guard(obarray_lock);
+				for (Object *p = obarray.load(std::memory_order_relaxed); p != Nil; p = p->cdr)
+					symbols++;
+			}
+
+			char text[512];
+			snprintf(text, sizeof(text),
+				"Arena chunks:        %s\n"
+				"This thread:         %llu allocations, %s\n"
+				"Symbols:             %d\n",
+				format_bytes(Arena::total_reserved()).c_str(),
+				(unsigned long long)allocation_count, format_bytes(allocation_bytes).c_str(),
+				symbols);
+			std::string out = text;
+#ifndef _WIN32
+			struct rusage usage;
+			getrusage(RUSAGE_SELF, &usage);
+			snprintf(text, sizeof(text), "Peak RSS:            %s\n", format_bytes((uint64_t)usage.ru_maxrss * 1024).c_str());
+			out += text;
+#endif
+			out += tracking ? "Allocation tracking is on.\n" : "Allocation tracking is off.\n";
+			return out;
+		}
+
+		// (allocations-start) starts counting allocations by kind and site.
+		DECLARE_PRIMITIVE_FN(AllocationsStart)
+		{
+			evaluate_arguments(env, list, 0, 0, "allocations-start");
+			start();
+			return True;
+		}
+
+		// (allocations-stop)
+		DECLARE_PRIMITIVE_FN(AllocationsStop)
+		{
+			evaluate_arguments(env, list, 0, 0, "allocations-stop");
+			stop();
+			return Nil;
+		}
+
+		// (allocation-report [sites]) returns what was counted, with the top 20 sites
+		// unless told otherwise.
+		DECLARE_PRIMITIVE_FN(AllocationReport)
+		{
+			Object *args = evaluate_arguments(env, list, 0, 1, "allocation-report");
+			int site_count = 20;
+			if (args != Nil) {
+				if (!args->car->IsAtomSubtype(AT_INT) || args->car->int_value < 0)
+					error("allocation-report: the number of sites is not a non-negative integer");
+				site_count = args->car->int_value;
+			}
+			std::string text = report(site_count);
+			return Object::MakeString(text.data(), text.size());
+		}
+
+		// (room) prints what the heap holds.
+		DECLARE_PRIMITIVE_FN(Room)
+		{
+			evaluate_arguments(env, list, 0, 0, "room");
+			Printer::write(room());
+			return Nil;
+		}
+
+		void create_primitives(Object *env)
+		{
+			Primitives::add_primitive(env, "allocations-start", AllocationsStart);
+			Primitives::add_primitive(env, "allocations-stop", AllocationsStop);
+			Primitives::add_primitive(env, "allocation-report", AllocationReport);
+			Primitives::add_primitive(env, "room", Room);
+		}
+	};
+};
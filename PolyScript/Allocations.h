@@ -0,0 +1,68 @@
+#pragma once
+
+#include "PolyScript.h"
+
+#include <string>
+
+namespace PolyScript
+{
+	// The allocation tracker. While it is on, every allocation is counted by kind
+	// and by the PolyScript function and form that made it. Even the test for
+	// whether it is on costs a few percent, so it is only compiled in when
+	// POLYSCRIPT_TRACK_ALLOCATIONS is defined; (room) works either way.
+	namespace Allocations
+	{
+		// The innermost function application being evaluated on this thread, while
+		// tracking.
+		extern thread_local Object *current_form;
+
+#ifdef POLYSCRIPT_TRACK_ALLOCATIONS
+		// Makes a form the current one while it is evaluated.
+		class FormScope
+		{
+		public:
+			explicit FormScope(Object *form) : saved(NULL), set(tracking.load(std::memory_order_relaxed))
+			{
+				if (set) {
+					saved = current_form;
+					current_form = form;
+				}
+			}
+
+			~FormScope()
+			{
+				if (set)
+					current_form = saved;
+			}
+
+			FormScope(const FormScope &) = delete;
+			FormScope &operator=(const FormScope &) = delete;
+
+		private:
+			Object *saved;
+			bool set;
+		};
+#else
+		class FormScope
+		{
+		public:
+			explicit FormScope(Object *) {}
+		};
+#endif
+
+		// Starts tracking, discarding what earlier tracking counted. Raises an error
+		// if the tracker isn't compiled in.
+		void start();
+		void stop();
+
+		// Objects and bytes by kind, then the sites that allocated the most bytes.
+		std::string report(int sites = 20);
+
+		// What the heap holds: memory taken for arenas, what this thread has
+		// allocated, the symbol table and the peak RSS.
+		std::string room();
+
+		// Add allocations-start, allocations-stop, allocation-report and room to the environment.
+		void create_primitives(Object *env);
+	};
+};
@@ -0,0 +1,103 @@
+#include "stdafx.h"
+#include "Arena.h"
+#include "Stats.h"
+
+#include <atomic>
+#include <exception>
+
+namespace PolyScript
+{
+	thread_local Arena *current_arena = NULL;
+	thread_local uint64_t pointer_stores = 0;
+	thread_local uint64_t allocation_count = 0;
+	thread_local uint64_t allocation_bytes = 0;
+
+	static thread_local Arena scratch_arena;
+
+	// How many ScratchScopes are open on this thread, and the arena that was current
+	// when the outermost one began.
+	static thread_local int open_scopes = 0;
+	static thread_local Arena *outside_arena = NULL;
+	static std::atomic<uint64_t> reserved(0);
+
+	// A chunk's header. The usable space follows it.
+	struct Chunk {
+		Chunk *next_chunk;
+		size_t size;
+	};
+
+	static const size_t HEADER_SIZE = (sizeof(Chunk) + alignof(std::max_align_t) - 1) & ~(alignof(std::max_align_t) - 1);
+
+	void Arena::refill(size_t size)
+	{
+		// Reuse the chunk after this one if a rewind left one behind and it's big enough.
+		Chunk *chunk = current ? current->next_chunk : first;
+		if (!chunk || chunk->size < size) {
+			// Oversized requests get a chunk of their own.
+			size_t bytes = size > CHUNK_SIZE ? size : CHUNK_SIZE;
+			Chunk *fresh = (Chunk *)malloc(HEADER_SIZE + bytes);
+			reserved.fetch_add(HEADER_SIZE + bytes, std::memory_order_relaxed);
+			fresh->size = bytes;
+			fresh->next_chunk = chunk;
+			if (current)
+				current->next_chunk = fresh;
+			else
+				first = fresh;
+			chunk = fresh;
+		}
+
+		current = chunk;
+		next = (char *)chunk + HEADER_SIZE;
+		limit = next + chunk->size;
+	}
+
+	void Arena::rewind(const Mark &mark)
+	{
+		current = mark.chunk;
+		next = mark.next;
+		limit = current ? (char *)current + HEADER_SIZE + current->size : NULL;
+	}
+
+	bool Arena::contains(const void *p) const
+	{
+		for (Chunk *chunk = first; chunk; chunk = chunk->next_chunk) {
+			const char *start = (const char *)chunk + HEADER_SIZE;
+			if ((const char *)p >= start && (const char *)p < start + chunk->size)
+				return true;
+		}
+		return false;
+	}
+
+	Arena *lasting_arena()
+	{
+		return open_scopes ? outside_arena : current_arena;
+	}
+
+	bool in_scratch(const void *p)
+	{
+		return scratch_arena.contains(p);
+	}
+
+	uint64_t Arena::total_reserved()
+	{
+		return reserved.load(std::memory_order_relaxed);
+	}
+
+	ScratchScope::ScratchScope()
+		: saved_arena(current_arena), mark(scratch_arena.mark()), stores(pointer_stores), exceptions(std::uncaught_exceptions()), kept(false)
+	{
+		if (open_scopes++ == 0)
+			outside_arena = saved_arena;
+		current_arena = &scratch_arena;
+	}
+
+	ScratchScope::~ScratchScope()
+	{
+		current_arena = saved_arena;
+		open_scopes--;
+		if (!kept && pointer_stores == stores && std::uncaught_exceptions() == exceptions) {
+			scratch_arena.rewind(mark);
+			STAT_ADD(scratch_rewinds, 1);
+		}
+	}
+};
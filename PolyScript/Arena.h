@@ -0,0 +1,132 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+
+namespace PolyScript
+{
+	// A bump allocator for objects created on one thread.
+	// Objects are never freed, so neither are the arena's chunks: an arena can go
+	// out of scope while the objects it handed out are still referenced. The one
+	// exception is rewinding, which only ScratchScope does.
+	class Arena
+	{
+	public:
+		static const size_t CHUNK_SIZE = 1024 * 1024;
+
+		// A position in the arena that it can later be rewound to.
+		struct Mark {
+			struct Chunk *chunk;
+			char *next;
+		};
+
+		Arena() : first(NULL), current(NULL), next(NULL), limit(NULL) {}
+
+		void *allocate(size_t size)
+		{
+			size = (size + alignof(std::max_align_t) - 1) & ~(alignof(std::max_align_t) - 1);
+			if ((size_t)(limit - next) < size)
+				refill(size);
+			void *p = next;
+			next += size;
+			return p;
+		}
+
+		Mark mark() const { return { current, next }; }
+
+		// Gives back everything allocated since mark was taken. The chunks are kept
+		// and reused by later allocations.
+		void rewind(const Mark &mark);
+
+		// Whether p is in one of the arena's chunks, whether or not it has been
+		// handed out.
+		bool contains(const void *p) const;
+
+		// Bytes every arena has taken from malloc for its chunks so far.
+		static uint64_t total_reserved();
+
+	private:
+		void refill(size_t size);
+
+		struct Chunk *first;
+		struct Chunk *current;
+		char *next;
+		char *limit;
+	};
+
+	// The arena used by Object::alloc on this thread, or NULL to use malloc.
+	extern thread_local Arena *current_arena;
+
+	// Counts stores of object pointers into objects that already existed: setq,
+	// puthash, aset and the like. Anything stored that way may outlive the code
+	// that made it, so a ScratchScope that sees the count change keeps its memory.
+	extern thread_local uint64_t pointer_stores;
+
+	inline void note_pointer_store() { pointer_stores++; }
+
+	// Whether p is in this thread's scratch arena. Memory there is reused once a
+	// ScratchScope rewinds, so anything that caches by object address must not
+	// cache such an object.
+	bool in_scratch(const void *p);
+
+	// Counts every allocation made through Object::allocate on this thread, and the
+	// bytes asked for, so a benchmark can report what a piece of code allocates.
+	extern thread_local uint64_t allocation_count;
+	extern thread_local uint64_t allocation_bytes;
+
+	// Object::allocate raises a LimitExceeded once allocation_bytes passes this.
+	// Set by Limits::Scope; no limit otherwise.
+	inline thread_local uint64_t allocation_limit = UINT64_MAX;
+
+	// The arena that was current outside every ScratchScope open on this thread.
+	// A value that has to outlive all of them is copied there.
+	Arena *lasting_arena();
+
+	// Makes an arena the current one for as long as it exists.
+	class UsingArena
+	{
+	public:
+		explicit UsingArena(Arena *arena) : saved(current_arena) { current_arena = arena; }
+		~UsingArena() { current_arena = saved; }
+
+		UsingArena(const UsingArena &) = delete;
+		UsingArena &operator=(const UsingArena &) = delete;
+
+	private:
+		Arena *saved;
+	};
+
+	// Runs a piece of code, such as the body of a loop over a stream, with its own
+	// allocations going to a per-thread scratch arena. When the scope ends the
+	// scratch arena is rewound, so a loop over millions of elements runs in constant
+	// memory. setq and define copy numbers and strings out of the arena rather than
+	// store a pointer into it; nothing is given back if the code stored any other
+	// pointer to a scratch object somewhere that outlives the scope, or if the scope
+	// is left by an exception. The caller must not keep anything allocated inside
+	// the scope except through those routes.
+	class ScratchScope
+	{
+	public:
+		ScratchScope();
+		~ScratchScope();
+
+		ScratchScope(const ScratchScope &) = delete;
+		ScratchScope &operator=(const ScratchScope &) = delete;
+
+		// Where allocations went before the scope began. Anything allocated there
+		// survives the rewind.
+		Arena *outer_arena() const { return saved_arena; }
+
+		// Leaves what was allocated in the scope in place, for a result that has to
+		// outlive it. An enclosing scope can still rewind it.
+		void keep() { kept = true; }
+
+	private:
+		Arena *saved_arena;
+		Arena::Mark mark;
+		uint64_t stores;
+		int exceptions;
+		bool kept;
+	};
+};
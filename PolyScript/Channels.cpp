@@ -0,0 +1,258 @@
+#include "stdafx.h"
+#include "Channels.h"
+#include "Coroutines.h"
+#include "Limits.h"
+#include "Primitives.h"
+
+#include <thread>
+
+// The channel is Dmitry Vyukov's bounded MPMC queue: each cell carries a sequence
+// number that says whose turn it is, so a sender or receiver claims a position with
+// one compare-and-swap and never waits on another thread that is part way through.
+// A thread that finds the channel full or empty yields for a while before it sleeps
+// on a condition variable; the thread on the other side takes the lock only when the
+// count of sleepers says someone needs waking.
+
+namespace PolyScript
+{
+	// Tries before a waiting thread goes to sleep.
+	static const int SPIN_LIMIT = 64;
+
+	Channel::Channel(size_t capacity)
+		: send_position(0), recv_position(0), is_closed(false), waiting_senders(0), waiting_receivers(0)
+	{
+		size_t size = 1;
+		while (size < capacity)
+			size *= 2;
+
+		cells = new Cell[size];
+		for (size_t i = 0; i < size; i++)
+			cells[i].sequence.store(i, std::memory_order_relaxed);
+		mask = size - 1;
+	}
+
+	Channel::~Channel()
+	{
+		delete[] cells;
+	}
+
+	bool Channel::try_send(Object *value)
+	{
+		if (is_closed)
+			return false;
+
+		size_t position = send_position.load(std::memory_order_relaxed);
+		for (;;) {
+			Cell &cell = cells[position & mask];
+			size_t sequence = cell.sequence.load(std::memory_order_acquire);
+			intptr_t turn = (intptr_t)sequence - (intptr_t)position;
+			if (turn == 0) {
+				if (send_position.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+					cell.value = value;
+					cell.sequence.store(position + 1, std::memory_order_release);
+					wake(waiting_receivers, not_empty);
+					return true;
+				}
+			}
+			else if (turn < 0)
+				return false;
+			else
+				position = send_position.load(std::memory_order_relaxed);
+		}
+	}
+
+	bool Channel::try_recv(Object **value)
+	{
+		size_t position = recv_position.load(std::memory_order_relaxed);
+		for (;;) {
+			Cell &cell = cells[position & mask];
+			size_t sequence = cell.sequence.load(std::memory_order_acquire);
+			intptr_t turn = (intptr_t)sequence - (intptr_t)(position + 1);
+			if (turn == 0) {
+				if (recv_position.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+					*value = cell.value;
+					cell.sequence.store(position + mask + 1, std::memory_order_release);
+					wake(waiting_senders, not_full);
+					return true;
+				}
+			}
+			else if (turn < 0)
+				return false;
+			else
+				position = recv_position.load(std::memory_order_relaxed);
+		}
+	}
+
+	void Channel::wake(std::atomic<int> &waiting, std::condition_variable &condition)
+	{
+		// Pairs with the fence in send and recv: either the sleeper sees the change
+		// when it tries once more under the lock, or this sees the sleeper.
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (waiting.load(std::memory_order_relaxed) == 0)
+			return;
+
+		std::lock_guard<std::mutex> guard(lock);
+		condition.notify_all();
+	}
+
+	bool Channel::send(Object *value)
+	{
+		for (int tries = 0; ; tries++) {
+			if (try_send(value))
+				return true;
+			if (is_closed)
+				return false;
+			if (tries < SPIN_LIMIT) {
+				std::this_thread::yield();
+				continue;
+			}
+
+			std::unique_lock<std::mutex> guard(lock);
+			waiting_senders++;
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			size_t position = send_position.load(std::memory_order_relaxed);
+			bool full = cells[position & mask].sequence.load(std::memory_order_acquire) < position;
+			if (full && !is_closed)
+				not_full.wait(guard);
+			waiting_senders--;
+		}
+	}
+
+	bool Channel::recv(Object **value)
+	{
+		for (int tries = 0; ; tries++) {
+			if (try_recv(value))
+				return true;
+			if (is_closed) {
+				// A send may have finished just before the close.
+				return try_recv(value);
+			}
+			if (tries < SPIN_LIMIT) {
+				std::this_thread::yield();
+				continue;
+			}
+
+			std::unique_lock<std::mutex> guard(lock);
+			waiting_receivers++;
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			size_t position = recv_position.load(std::memory_order_relaxed);
+			bool empty = cells[position & mask].sequence.load(std::memory_order_acquire) < position + 1;
+			if (empty && !is_closed)
+				not_empty.wait(guard);
+			waiting_receivers--;
+		}
+	}
+
+	void Channel::close()
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		is_closed = true;
+		not_full.notify_all();
+		not_empty.notify_all();
+	}
+
+	namespace Channels
+	{
+		using Primitives::evaluate_arguments;
+
+		static const int DEFAULT_CAPACITY = 64;
+
+		static Channel *channel_argument(Object *value, const char *name)
+		{
+			if (value->tag != T_CHANNEL)
+				error("%s: argument is not a channel", name);
+			return value->channel;
+		}
+
+		// (make-channel [capacity])
+		DECLARE_PRIMITIVE_FN(MakeChannel)
+		{
+			Object *args = evaluate_arguments(env, list, 0, 1, "make-channel");
+			int capacity = DEFAULT_CAPACITY;
+			if (args != Nil) {
+				if (!args->car->IsAtomSubtype(AT_INT) || args->car->int_value < 1)
+					error("make-channel: capacity is not a positive integer");
+				capacity = args->car->int_value;
+			}
+			return Object::MakeChannel(new Channel(capacity));
+		}
+
+		// Under a deadline a thread polls the channel rather than sleeping on it, so
+		// that it notices when the deadline passes.
+		static bool poll_until_deadline()
+		{
+			std::chrono::steady_clock::time_point deadline;
+			if (!Limits::deadline(deadline))
+				return false;
+			Limits::check_deadline();
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			return true;
+		}
+
+		// (send channel value) waits for room, and returns value. A task lets the
+		// other tasks on its thread run while it waits.
+		DECLARE_PRIMITIVE_FN(Send)
+		{
+			Object *args = evaluate_arguments(env, list, 2, 2, "send");
+			Channel *channel = channel_argument(args->car, "send");
+			Object *value = args->cdr->car;
+
+			// The value outlives any scratch scope it was made in.
+			note_pointer_store();
+			while (!channel->try_send(value)) {
+				if (channel->closed())
+					error("send: channel is closed");
+				if (!Coroutines::wait_in_task() && !poll_until_deadline()) {
+					if (!channel->send(value))
+						error("send: channel is closed");
+					break;
+				}
+			}
+			return value;
+		}
+
+		// (recv channel) waits for a value. Returns nil once the channel is closed
+		// and empty. A task lets the other tasks on its thread run while it waits.
+		DECLARE_PRIMITIVE_FN(Recv)
+		{
+			Object *args = evaluate_arguments(env, list, 1, 1, "recv");
+			Channel *channel = channel_argument(args->car, "recv");
+			Object *value;
+
+			while (!channel->try_recv(&value)) {
+				if (channel->closed())
+					return channel->try_recv(&value) ? value : Nil;
+				if (!Coroutines::wait_in_task() && !poll_until_deadline())
+					return channel->recv(&value) ? value : Nil;
+			}
+			return value;
+		}
+
+		// (try-recv channel) returns a value if one is waiting, or else nil.
+		DECLARE_PRIMITIVE_FN(TryRecv)
+		{
+			Object *args = evaluate_arguments(env, list, 1, 1, "try-recv");
+			Object *value;
+			if (!channel_argument(args->car, "try-recv")->try_recv(&value))
+				return Nil;
+			return value;
+		}
+
+		// (close-channel channel)
+		DECLARE_PRIMITIVE_FN(CloseChannel)
+		{
+			Object *args = evaluate_arguments(env, list, 1, 1, "close-channel");
+			channel_argument(args->car, "close-channel")->close();
+			return Nil;
+		}
+
+		void create_primitives(Object *env)
+		{
+			Primitives::add_primitive(env, "make-channel", MakeChannel);
+			Primitives::add_primitive(env, "send", Send);
+			Primitives::add_primitive(env, "recv", Recv);
+			Primitives::add_primitive(env, "try-recv", TryRecv);
+			Primitives::add_primitive(env, "close-channel", CloseChannel);
+		}
+	};
+};
@@ -0,0 +1,65 @@
+#pragma once
+
+#include "PolyScript.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+
+namespace PolyScript
+{
+	// A bounded queue of objects between any number of sending and receiving
+	// threads. Sending to a channel with room and receiving from one with values
+	// take no lock; only a thread that has to wait does.
+	class Channel
+	{
+	public:
+		// capacity is rounded up to a power of two.
+		explicit Channel(size_t capacity);
+		~Channel();
+
+		// Return false instead of waiting when the channel is full or empty.
+		bool try_send(Object *value);
+		bool try_recv(Object **value);
+
+		// Wait for room or for a value. send returns false if the channel is closed;
+		// recv returns false once it is closed and empty.
+		bool send(Object *value);
+		bool recv(Object **value);
+
+		// Values already sent can still be received.
+		void close();
+		bool closed() const { return is_closed; }
+
+	private:
+		// A cell is ready for the sender at position p when its sequence is p, and for
+		// the receiver when it is p + 1.
+		struct Cell {
+			std::atomic<size_t> sequence;
+			Object *value;
+		};
+
+		void wake(std::atomic<int> &waiting, std::condition_variable &condition);
+
+		Cell *cells;
+		size_t mask;
+
+		// The sender and receiver positions are kept on separate cache lines.
+		alignas(64) std::atomic<size_t> send_position;
+		alignas(64) std::atomic<size_t> recv_position;
+		alignas(64) std::atomic<bool> is_closed;
+
+		// Threads waiting, and what they wait on.
+		std::atomic<int> waiting_senders;
+		std::atomic<int> waiting_receivers;
+		std::mutex lock;
+		std::condition_variable not_full;
+		std::condition_variable not_empty;
+	};
+
+	namespace Channels
+	{
+		// Add make-channel, send, recv, try-recv and close-channel to the environment.
+		void create_primitives(Object *env);
+	};
+};
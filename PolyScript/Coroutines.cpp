@@ -0,0 +1,540 @@
+#include "stdafx.h"
+#include "Coroutines.h"
+#include "Evaluator.h"
+#include "Let.h"
+#include "Limits.h"
+#include "Primitives.h"
+#include "Profiler.h"
+#include "Specials.h"
+
+#include <atomic>
+#include <deque>
+#include <mutex>
+
+#if defined(__linux__) && defined(__x86_64__)
+#define SWITCH_X86_64
+#endif
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#ifndef SWITCH_X86_64
+#include <ucontext.h>
+#endif
+#endif
+
+// Coroutines are fibers on Windows. Elsewhere they switch stacks with ucontext, except
+// on x86-64 Linux, where swapcontext's signal mask system calls would cost more than
+// everything else in a switch put together, so only the registers a function call
+// must preserve are saved, by the few instructions below.
+//
+// A coroutine's stack is reserved up front and committed by the system as it is
+// touched. Outside Windows the lowest page is left inaccessible, so running off the
+// end faults instead of overwriting other memory.
+
+#ifdef SWITCH_X86_64
+// Saves the callee-saved registers and the SSE and x87 control words on the current
+// stack, stores the stack pointer in *save, and resumes the stack at load.
+extern "C" void polyscript_switch_stack(void **save, void *load);
+
+asm(
+	".text\n"
+	".globl polyscript_switch_stack\n"
+	".type polyscript_switch_stack, @function\n"
+	"polyscript_switch_stack:\n"
+	"	pushq %rbp\n"
+	"	pushq %rbx\n"
+	"	pushq %r12\n"
+	"	pushq %r13\n"
+	"	pushq %r14\n"
+	"	pushq %r15\n"
+	"	subq $8, %rsp\n"
+	"	stmxcsr (%rsp)\n"
+	"	fnstcw 4(%rsp)\n"
+	"	movq %rsp, (%rdi)\n"
+	"	movq %rsi, %rsp\n"
+	"	ldmxcsr (%rsp)\n"
+	"	fldcw 4(%rsp)\n"
+	"	addq $8, %rsp\n"
+	"	popq %r15\n"
+	"	popq %r14\n"
+	"	popq %r13\n"
+	"	popq %r12\n"
+	"	popq %rbx\n"
+	"	popq %rbp\n"
+	"	ret\n"
+	".size polyscript_switch_stack, .-polyscript_switch_stack\n");
+#endif
+
+namespace PolyScript
+{
+	struct Context {
+#ifdef _WIN32
+		void *fiber;
+		void *caller;
+#else
+#ifdef SWITCH_X86_64
+		void *registers;
+		void *caller;
+#else
+		ucontext_t registers;
+		ucontext_t caller;
+#endif
+		char *stack;
+		size_t mapped;
+#endif
+	};
+
+	static thread_local Coroutine *current = NULL;
+
+	// The bottom of every coroutine's stack.
+	void start_coroutine()
+	{
+		Coroutine *self = current;
+		try
+		{
+			self->transfer = Evaluator::funcall(self->env, self->fn, Nil);
+		}
+		catch (Throw &)
+		{
+			self->failed = true;
+			self->message = "throw to a catch outside a coroutine";
+		}
+		catch (LimitExceeded &e)
+		{
+			self->failed = true;
+			self->message = e.what();
+			self->limit = e.kind;
+		}
+		catch (std::exception &e)
+		{
+			self->failed = true;
+			self->message = e.what();
+		}
+		self->finish();
+	}
+
+#ifdef _WIN32
+	static VOID CALLBACK fiber_start(LPVOID)
+	{
+		start_coroutine();
+	}
+#endif
+
+	// Gives back a finished coroutine's stack. Called from outside the coroutine.
+	static void release_stack(Context *context)
+	{
+#ifdef _WIN32
+		if (context->fiber)
+			DeleteFiber(context->fiber);
+		context->fiber = NULL;
+#else
+		if (context->stack)
+			munmap(context->stack, context->mapped);
+		context->stack = NULL;
+#endif
+	}
+
+	Coroutine::Coroutine(Object *env, Object *fn, size_t stack_size)
+		: waiting(false), env(env), fn(fn), state(SUSPENDED), transfer(Nil), failed(false), limit(LIMIT_NONE), resumer(NULL), arena(NULL), started(false), context(new Context())
+	{
+#ifdef _WIN32
+		context->caller = NULL;
+		context->fiber = CreateFiberEx(0, stack_size, FIBER_FLAG_FLOAT_SWITCH, fiber_start, NULL);
+		if (!context->fiber) {
+			delete context;
+			error("Cannot create a coroutine");
+		}
+#else
+		size_t page = sysconf(_SC_PAGESIZE);
+		context->mapped = (stack_size + page - 1) / page * page + page;
+		void *stack = mmap(NULL, context->mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (stack == MAP_FAILED) {
+			delete context;
+			error("Cannot create a coroutine");
+		}
+		mprotect(stack, page, PROT_NONE);
+
+		context->stack = (char *)stack;
+#ifdef SWITCH_X86_64
+		// Lay the stack out as polyscript_switch_stack leaves it, so that its ret
+		// enters start_coroutine as though it had been called, with a null return
+		// address: from the top, that return address, the entry point, six zeroed
+		// registers and the default control words.
+		uint64_t *top = (uint64_t *)(context->stack + context->mapped);
+		top[-1] = 0;
+		top[-2] = (uint64_t)start_coroutine;
+		for (int i = 3; i <= 8; i++)
+			top[-i] = 0;
+		top[-9] = 0x037F00001F80ull;
+		context->registers = top - 9;
+#else
+		getcontext(&context->registers);
+		context->registers.uc_stack.ss_sp = context->stack + page;
+		context->registers.uc_stack.ss_size = context->mapped - page;
+		context->registers.uc_link = NULL;
+		makecontext(&context->registers, start_coroutine, 0);
+#endif
+#endif
+	}
+
+	Coroutine::~Coroutine()
+	{
+		release_stack(context);
+		delete context;
+	}
+
+	Object *Coroutine::resume(Object *value)
+	{
+		if (state == RUNNING)
+			error("resume: coroutine is already running");
+		if (state == DEAD)
+			error("resume: coroutine has finished");
+		if (owner == std::thread::id())
+			owner = std::this_thread::get_id();
+		else if (owner != std::this_thread::get_id())
+			error("resume: coroutine belongs to another thread");
+
+		// Scratch scopes still open on either stack must keep their memory, since the
+		// other stack's scopes come and go in between.
+		note_pointer_store();
+
+		// A new coroutine allocates where its first caller does.
+		Arena *caller_arena = current_arena;
+		if (!started)
+			arena = caller_arena;
+		started = true;
+		current_arena = arena;
+
+		transfer = value;
+		resumer = current;
+		current = this;
+		state = RUNNING;
+		int base = Profiler::depth();
+		Profiler::restore_frames(frames);
+		std::vector<Specials::Binding> *outer_bindings = Specials::enter(bindings);
+#ifdef _WIN32
+		if (!IsThreadAFiber())
+			ConvertThreadToFiber(NULL);
+		context->caller = GetCurrentFiber();
+		SwitchToFiber(context->fiber);
+#elif defined(SWITCH_X86_64)
+		polyscript_switch_stack(&context->caller, context->registers);
+#else
+		swapcontext(&context->caller, &context->registers);
+#endif
+		current = resumer;
+		arena = current_arena;
+		current_arena = caller_arena;
+		Profiler::save_frames(frames, base);
+		Specials::leave(bindings, outer_bindings);
+		note_pointer_store();
+
+		if (state == DEAD) {
+			release_stack(context);
+			if (failed && limit != LIMIT_NONE)
+				throw LimitExceeded(message, limit);
+			if (failed)
+				error("%s", message.c_str());
+		}
+		return transfer;
+	}
+
+	Object *Coroutine::yield(Object *value)
+	{
+		Coroutine *self = current;
+		if (!self)
+			error("yield: not inside a coroutine");
+
+		self->transfer = value;
+		self->state = SUSPENDED;
+#ifdef _WIN32
+		SwitchToFiber(self->context->caller);
+#elif defined(SWITCH_X86_64)
+		polyscript_switch_stack(&self->context->registers, self->context->caller);
+#else
+		swapcontext(&self->context->registers, &self->context->caller);
+#endif
+		return self->transfer;
+	}
+
+	Coroutine *Coroutine::running()
+	{
+		return current;
+	}
+
+	void Coroutine::finish()
+	{
+		state = DEAD;
+#ifdef _WIN32
+		SwitchToFiber(context->caller);
+#elif defined(SWITCH_X86_64)
+		void *unused;
+		polyscript_switch_stack(&unused, context->caller);
+#else
+		setcontext(&context->caller);
+#endif
+	}
+
+	namespace Coroutines
+	{
+		using Primitives::evaluate_arguments;
+
+		const char *status_name(Coroutine::Status status)
+		{
+			switch (status) {
+			case Coroutine::SUSPENDED:
+				return "suspended";
+			case Coroutine::RUNNING:
+				return "running";
+			default:
+				return "dead";
+			}
+		}
+
+		// Tasks spawned from outside a task, waiting for run_tasks.
+		static std::mutex pending_lock;
+		static std::vector<Coroutine *> pending;
+		static std::atomic<size_t> pending_count(0);
+
+		// While a thread runs tasks: its queue, and the task it is running.
+		static thread_local std::deque<Coroutine *> *thread_tasks = NULL;
+		static thread_local Coroutine *current_task = NULL;
+
+		struct Failures {
+			std::mutex lock;
+			int count;
+			std::string first;
+
+			// The limit the first failure ran into, if it was a LimitExceeded.
+			LimitKind limit;
+
+			void add(const char *message, LimitKind kind)
+			{
+				std::lock_guard<std::mutex> guard(lock);
+				if (count++ == 0) {
+					first = message;
+					limit = kind;
+				}
+			}
+		};
+
+		static Coroutine *function_argument(Object *env, Object *fn, const char *name)
+		{
+			if (fn->tag != T_FUNCTION && fn->tag != T_PRIMITIVE)
+				error("%s: argument is not a function", name);
+			// The coroutine keeps the closure past any scratch scope it was made in.
+			note_pointer_store();
+			return new Coroutine(Let::heap_env(env), fn);
+		}
+
+		Object *spawn_task(Object *env, Object *fn)
+		{
+			// Outside run-tasks the task is queued for whichever thread runs tasks next,
+			// which needn't be under this thread's limits.
+			if (Limits::active() && !thread_tasks)
+				error("spawn-task: cannot queue a task under with-limits except from another task");
+			Coroutine *task = function_argument(env, fn, "spawn-task");
+			if (thread_tasks) {
+				thread_tasks->push_back(task);
+			}
+			else {
+				std::lock_guard<std::mutex> guard(pending_lock);
+				pending.push_back(task);
+				pending_count++;
+			}
+			return Object::MakeCoroutine(task);
+		}
+
+		static void take_pending(std::deque<Coroutine *> &tasks)
+		{
+			if (pending_count == 0)
+				return;
+
+			std::lock_guard<std::mutex> guard(pending_lock);
+			tasks.insert(tasks.end(), pending.begin(), pending.end());
+			pending.clear();
+			pending_count = 0;
+		}
+
+		// Resumes each task in turn until they have all finished.
+		static void run_thread(std::deque<Coroutine *> &tasks, Failures &failures)
+		{
+			thread_tasks = &tasks;
+			for (;;) {
+				take_pending(tasks);
+				if (tasks.empty())
+					break;
+
+				bool progress = false;
+				for (size_t n = tasks.size(); n > 0; n--) {
+					Coroutine *task = tasks.front();
+					tasks.pop_front();
+
+					task->waiting = false;
+					current_task = task;
+					try
+					{
+						task->resume(Nil);
+					}
+					catch (LimitExceeded &e)
+					{
+						failures.add(e.what(), e.kind);
+					}
+					catch (std::exception &e)
+					{
+						failures.add(e.what(), LIMIT_NONE);
+					}
+					current_task = NULL;
+
+					if (task->status() != Coroutine::DEAD)
+						tasks.push_back(task);
+					if (!task->waiting)
+						progress = true;
+				}
+
+				// Every task is waiting on another thread; don't spin on the core. Nothing
+				// is evaluated meanwhile, so look at the deadline here.
+				if (!progress) {
+					try
+					{
+						Limits::check_deadline();
+					}
+					catch (LimitExceeded &)
+					{
+						thread_tasks = NULL;
+						throw;
+					}
+					std::this_thread::yield();
+				}
+			}
+			thread_tasks = NULL;
+		}
+
+		void run_tasks(unsigned threads)
+		{
+			if (thread_tasks)
+				error("run-tasks: already running tasks");
+			if (threads == 0)
+				threads = std::thread::hardware_concurrency();
+			if (threads == 0)
+				threads = 1;
+			// Limits apply to the thread that set them, so limited tasks stay on it.
+			if (Limits::active())
+				threads = 1;
+
+			std::vector<std::deque<Coroutine *> > queues(threads);
+			{
+				std::lock_guard<std::mutex> guard(pending_lock);
+				for (size_t i = 0; i < pending.size(); i++)
+					queues[i % threads].push_back(pending[i]);
+				pending.clear();
+				pending_count = 0;
+			}
+
+			Failures failures;
+			failures.count = 0;
+			failures.limit = LIMIT_NONE;
+
+			std::vector<std::thread> workers;
+			for (unsigned i = 1; i < threads; i++) {
+				workers.emplace_back([&queues, &failures, i]() {
+					// The arena outlives the thread's use of it: objects are never freed.
+					current_arena = new Arena();
+					run_thread(queues[i], failures);
+					current_arena = NULL;
+				});
+			}
+			run_thread(queues[0], failures);
+			for (std::thread &worker : workers)
+				worker.join();
+
+			if (failures.limit != LIMIT_NONE)
+				throw LimitExceeded(failures.first, failures.limit);
+			if (failures.count)
+				error("run-tasks: %d tasks failed, the first with: %s", failures.count, failures.first.c_str());
+		}
+
+		bool wait_in_task()
+		{
+			if (!current_task || Coroutine::running() != current_task)
+				return false;
+
+			current_task->waiting = true;
+			Coroutine::yield(Nil);
+			return true;
+		}
+
+		static Coroutine *coroutine_argument(Object *value, const char *name)
+		{
+			if (value->tag != T_COROUTINE)
+				error("%s: argument is not a coroutine", name);
+			return value->coroutine;
+		}
+
+		// (make-coroutine fn) returns a coroutine that runs (fn) when first resumed.
+		DECLARE_PRIMITIVE_FN(MakeCoroutine)
+		{
+			Object *args = evaluate_arguments(env, list, 1, 1, "make-coroutine");
+			return Object::MakeCoroutine(function_argument(env, args->car, "make-coroutine"));
+		}
+
+		// (resume coroutine [value]) runs the coroutine until it yields or returns.
+		DECLARE_PRIMITIVE_FN(Resume)
+		{
+			Object *args = evaluate_arguments(env, list, 1, 2, "resume");
+			Object *value = args->cdr != Nil ? args->cdr->car : Nil;
+			return coroutine_argument(args->car, "resume")->resume(value);
+		}
+
+		// (yield [value]) suspends the running coroutine; resume returns value.
+		DECLARE_PRIMITIVE_FN(Yield)
+		{
+			Object *args = evaluate_arguments(env, list, 0, 1, "yield");
+			return Coroutine::yield(args != Nil ? args->car : Nil);
+		}
+
+		// (coroutine-status coroutine) is suspended, running or dead.
+		DECLARE_PRIMITIVE_FN(CoroutineStatus)
+		{
+			Object *args = evaluate_arguments(env, list, 1, 1, "coroutine-status");
+			return Object::intern(status_name(coroutine_argument(args->car, "coroutine-status")->status()));
+		}
+
+		// (spawn-task fn) queues (fn) for run-tasks and returns its coroutine.
+		DECLARE_PRIMITIVE_FN(SpawnTask)
+		{
+			Object *args = evaluate_arguments(env, list, 1, 1, "spawn-task");
+			return spawn_task(env, args->car);
+		}
+
+		// (run-tasks [threads]) runs the queued tasks to the end. Tasks take turns on
+		// each thread by calling yield, or by waiting on a channel.
+		DECLARE_PRIMITIVE_FN(RunTasks)
+		{
+			Object *args = evaluate_arguments(env, list, 0, 1, "run-tasks");
+			unsigned threads = 0;
+			if (args != Nil) {
+				if (!args->car->IsAtomSubtype(AT_INT) || args->car->int_value < 0)
+					error("run-tasks: argument is not a thread count");
+				threads = args->car->int_value;
+			}
+			run_tasks(threads);
+			return Nil;
+		}
+
+		void create_primitives(Object *env)
+		{
+			Primitives::add_primitive(env, "make-coroutine", MakeCoroutine);
+			Primitives::add_primitive(env, "resume", Resume);
+			Primitives::add_primitive(env, "yield", Yield);
+			Primitives::add_primitive(env, "coroutine-status", CoroutineStatus);
+
+			// Tasks
+			Primitives::add_primitive(env, "spawn-task", SpawnTask);
+			Primitives::add_primitive(env, "run-tasks", RunTasks);
+		}
+	};
+};
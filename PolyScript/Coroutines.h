@@ -0,0 +1,100 @@
+#pragma once
+
+#include "PolyScript.h"
+#include "Specials.h"
+
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace PolyScript
+{
+	// A closure with no arguments, run on a stack of its own so that it can suspend
+	// itself part way through with yield and carry on when resumed. A coroutine
+	// stays on the thread that first resumes it.
+	class Coroutine
+	{
+	public:
+		enum Status { SUSPENDED, RUNNING, DEAD };
+
+		// Only the pages a coroutine touches are committed, so this is mostly address space.
+		static const size_t DEFAULT_STACK_SIZE = 256 * 1024;
+
+		Coroutine(Object *env, Object *fn, size_t stack_size = DEFAULT_STACK_SIZE);
+		~Coroutine();
+
+		// Runs the coroutine until it yields or returns, and returns the value it
+		// yielded or returned. value becomes the result of the yield it is suspended
+		// at. An error that ends the coroutine is raised again here.
+		Object *resume(Object *value);
+
+		// Suspends the coroutine running on this thread, and returns the value it is
+		// resumed with.
+		static Object *yield(Object *value);
+
+		// The coroutine running on this thread, or NULL.
+		static Coroutine *running();
+
+		Status status() const { return state; }
+
+		// Set by a task that yields only because it is waiting for something, so the
+		// scheduler can tell when none of its tasks are getting anywhere.
+		bool waiting;
+
+	private:
+		friend void start_coroutine();
+		void finish();
+
+		Object *env;
+		Object *fn;
+		Status state;
+
+		// The value being passed across a switch, one way or the other.
+		Object *transfer;
+		bool failed;
+		std::string message;
+
+		// The limit the coroutine ran into, if it failed with a LimitExceeded.
+		LimitKind limit;
+
+		// What was running on this thread before resume.
+		Coroutine *resumer;
+		std::thread::id owner;
+
+		// Where the coroutine's allocations go. current_arena belongs to a stack rather
+		// than a thread, since a scratch scope can be open on either side of a switch.
+		Arena *arena;
+		bool started;
+
+		// The coroutine's part of the profiler's shadow stack while it is suspended.
+		std::vector<Object *> frames;
+
+		// Its stack of special variable bindings.
+		std::vector<Specials::Binding> bindings;
+
+		// The platform's saved registers and stack. Defined in Coroutines.cpp.
+		struct Context *context;
+	};
+
+	namespace Coroutines
+	{
+		const char *status_name(Coroutine::Status status);
+
+		// Queues (fn) as a task for run_tasks. A task started by another task runs on
+		// the same thread as it.
+		Object *spawn_task(Object *env, Object *fn);
+
+		// Runs the queued tasks on the given number of threads, counting this one,
+		// until every task has finished. Each thread switches between its tasks
+		// whenever one yields. Raises an Error afterwards if any task failed.
+		void run_tasks(unsigned threads);
+
+		// Called by a task that cannot go on yet, such as one receiving from an empty
+		// channel: lets the other tasks on its thread run. Returns false outside a task,
+		// where the caller has to block instead.
+		bool wait_in_task();
+
+		// Add the coroutine and task primitives to the environment.
+		void create_primitives(Object *env);
+	};
+};
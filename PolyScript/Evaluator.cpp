@@ -1,5 +1,11 @@
 #include "stdafx.h"
 #include "Evaluator.h"
+#include "Allocations.h"
+#include "Let.h"
+#include "Limits.h"
+#include "Profiler.h"
+#include "Specials.h"
+#include "Tracer.h"
 
 namespace PolyScript
 {
@@ -17,8 +23,34 @@ namespace PolyScript
 			}
 		}
 
+		// Returns value, or a copy of it, that can be stored in an object made outside
+		// the scratch scopes open on this thread. Numbers and strings are copied out
+		// of the scratch arena; storing any other scratch object makes the scopes
+		// keep their memory.
+		Object *lasting_value(Object *value) {
+			if (!in_scratch(value))
+				return value;
+			if (!value->IsNumber() && !value->IsAtomSubtype(AT_STRING)) {
+				note_pointer_store();
+				return value;
+			}
+			UsingArena lasting(lasting_arena());
+			if (value->atom_subtype == AT_INT)
+				return Object::MakeInt(value->int_value);
+			if (value->atom_subtype == AT_FLOAT)
+				return Object::MakeFloat(value->float_value);
+			return Object::MakeString(value->str_value, value->str_length);
+		}
+
+		// The binding is made outside any scratch scope, since the frame may be older
+		// than the scope.
 		void add_variable(Object *env, Object *sym, Object *val) {
+			val = lasting_value(val);
+			UsingArena lasting(lasting_arena());
 			env->vars = Object::acons(sym, val, env->vars);
+			if (env->tag == T_STACK_ENV && env->heap)
+				env->heap->vars = env->vars;
+			Let::note_definition(val);
 		}
 
 		// Returns a newly created environment frame.
@@ -36,7 +68,7 @@ namespace PolyScript
 
 		// Evaluates the list elements from head and returns the last return value.
 		Object *progn(Object *env, Object *list) {
-			Object *r = NULL;
+			Object *r = Nil;
 			for (Object *lp = list; lp != Nil; lp = lp->cdr)
 				r = eval(env, lp->car);
 			return r;
@@ -61,9 +93,6 @@ namespace PolyScript
 
 				Object *tmp = eval(env, lp->car);
 
-				if (error_flag)
-					return NULL;
-
 				if (head == NULL) {
 					head = tail = Object::cons(tmp, Nil);
 				}
@@ -84,9 +113,6 @@ namespace PolyScript
 			for (Object *lp = list; lp != Nil; lp = lp->cdr) {
 				Object *tmp = eval(env, lp->car);
 
-				if (error_flag)
-					return NULL;
-
 				if (head == NULL) {
 					head = tail = Object::cons(tmp, Nil);
 				}
@@ -108,22 +134,64 @@ namespace PolyScript
 		Object *apply(Object *env, Object *fn, Object *args) {
 			if (!is_list(args))
 				error("argument must be a list");
-			if (fn->tag == T_PRIMITIVE)
+			if (fn->tag == T_PRIMITIVE) {
+				STAT_ADD(primitive_calls, 1);
+				STAT_ADD(primitive_counts[fn->primitive_id], 1);
+				if (Tracer::tracing.load(std::memory_order_relaxed))
+					return Tracer::call_primitive(env, fn, args);
 				return fn->fn(env, args);
+			}
 			if (fn->tag == T_FUNCTION) {
+				STAT_ADD(applications, 1);
 				Object *body = fn->body;
 				Object *params = fn->params;
 				Object *eargs = eval_list(env, args);
 				Object *newenv = push_env(fn->env, params, eargs);
+				Limits::DepthGuard depth;
+				Profiler::Frame frame(fn);
+				Tracer::Span span(fn);
 				return progn(newenv, body);
 			}
 			error("not supported");
-			return NULL;
+		}
+
+		// Calls fn with arguments that have already been evaluated.
+		Object *funcall(Object *env, Object *fn, Object *values) {
+			if (fn->tag == T_FUNCTION) {
+				STAT_ADD(applications, 1);
+				Object *newenv = push_env(fn->env, fn->params, values);
+				Limits::DepthGuard depth;
+				Profiler::Frame frame(fn);
+				Tracer::Span span(fn);
+				return progn(newenv, fn->body);
+			}
+			if (fn->tag != T_PRIMITIVE)
+				error("The head of a list must be a function");
+
+			// Primitives evaluate their own arguments, so each value is passed quoted.
+			static Object *quote = Object::intern("quote");
+			Object *head = Nil;
+			Object *tail = NULL;
+			for (Object *p = values; p != Nil; p = p->cdr) {
+				Object *cell = Object::cons(Object::cons(quote, Object::cons(p->car, Nil)), Nil);
+				if (tail)
+					tail->cdr = cell;
+				else
+					head = cell;
+				tail = cell;
+			}
+			STAT_ADD(primitive_calls, 1);
+			STAT_ADD(primitive_counts[fn->primitive_id], 1);
+			if (Tracer::tracing.load(std::memory_order_relaxed))
+				return Tracer::call_primitive(env, fn, head);
+			return fn->fn(env, head);
 		}
 
 		// Searches for a variable by symbol. Returns null if not found.
 		Object *find(Object *env, Object *sym) {
+			STAT_ADD(lookups, 1);
 			for (Object *p = env; p; p = p->up) {
+				STAT_ADD(frames_walked, 1);
 				for (Object *cell = p->vars; cell != Nil; cell = cell->cdr) {
 					Object *bind = cell->car;
 					if (sym == bind->car)
@@ -135,11 +203,12 @@ namespace PolyScript
 
 		// Expands the given macro application form.
 		Object *macroexpand(Object *env, Object *obj) {
-			if (obj->tag != T_CELL || obj->car->IsAtomSubtype(AT_SYMBOL))
+			if (obj->tag != T_CELL || !obj->car->IsAtomSubtype(AT_SYMBOL))
 				return obj;
 			Object *bind = find(env, obj->car);
 			if (!bind || bind->cdr->tag != T_MACRO)
 				return obj;
+			STAT_ADD(macro_expansions, 1);
 			Object *args = obj->cdr;
 			Object *body = bind->cdr->body;
 			Object *params = bind->cdr->params;
@@ -151,31 +220,33 @@ namespace PolyScript
 			if (list->tag != T_CELL || !is_list(list->car) || list->cdr->tag != T_CELL)
 				error("Malformed lambda");
 			for (Object *p = list->car; p != Nil; p = p->cdr) {
-				if (p->car->IsAtomSubtype(AT_SYMBOL))
+				if (!p->car->IsAtomSubtype(AT_SYMBOL))
 					error("Parameter must be a symbol");
+				if (p->car->special_index)
+					error("Parameter %s is a special variable; bind it with dynamic-let", p->car->name);
 				if (!is_list(p->cdr))
 					error("Parameter list is not a flat list");
 			}
 			Object *car = list->car;
 			Object *cdr = list->cdr;
-			return Object::MakeFunction(type, car, cdr, env);
+			return Object::MakeFunction(type, car, cdr, Let::heap_env(env));
 		}
 
 		Object *handle_defun(Object *env, Object *list, ObjectTag type) {
-			if (list->car->IsAtomSubtype(AT_SYMBOL) || list->cdr->tag != T_CELL)
+			if (list->tag != T_CELL || !list->car->IsAtomSubtype(AT_SYMBOL) || list->cdr->tag != T_CELL)
 				error("Malformed defun");
 			Object *sym = list->car;
 			Object *rest = list->cdr;
 			Object *fn = handle_function(env, rest, type);
+			fn->fn_name = sym;
 			add_variable(env, sym, fn);
 			return fn;
 		}
 
 		// Evaluates the S expression.
 		Object *eval(Object *env, Object *obj) {
-			if (error_flag)
-				return NULL;
-
+			STAT_ADD(evals, 1);
+			Limits::step();
 			switch (obj->tag) {
 
 			case T_ATOM:
@@ -186,39 +257,55 @@ namespace PolyScript
 					return obj; // Self-evaluating
 				case AT_SYMBOL:
 					// Variable
+					if (obj->special_index)
+						return Specials::value(obj);
 					Object *bind = find(env, obj);
-					if (!bind)
-					{
+					if (!bind) {
+						// An unbound keyword, such as :iterations, evaluates to itself.
+						if (obj->name[0] == ':')
+							return obj;
 						error("Undefined symbol: %s", obj->name);
-						return NULL;
 					}
-					
 					return bind->cdr;
 				}
 
 			case T_PRIMITIVE:
 			case T_FUNCTION:
 			case T_SPECIAL:
+			case T_ERROR:
+			case T_VECTOR:
+			case T_HASHTABLE:
+			case T_MAP:
+			case T_BUILDER:
+			case T_STREAM:
+			case T_SEQUENCE:
+			case T_FUTURE:
+			case T_CHANNEL:
+			case T_COROUTINE:
 				// Self-evaluating objects
 				return obj;
 			case T_CELL: {
-				// Function application form
-				Object *expanded = macroexpand(env, obj);
-				if (expanded != obj)
-					return eval(env, expanded);
-				Object *fn = eval(env, obj->car);
-				Object *args = obj->cdr;
-				if (fn->tag != PolyScript::T_PRIMITIVE && fn->tag != PolyScript::T_FUNCTION)
-				{
-					error("The head of a list must be a function");
-					return NULL;
+				// Function application form. Errors unwind straight through here; the
+				// handler only runs on the way out, to record where the error happened.
+				try {
+					Allocations::FormScope scope(obj);
+					Object *expanded = macroexpand(env, obj);
+					if (expanded != obj)
+						return eval(env, expanded);
+					Object *fn = eval(env, obj->car);
+					Object *args = obj->cdr;
+					if (fn->tag != PolyScript::T_PRIMITIVE && fn->tag != PolyScript::T_FUNCTION)
+						error("The head of a list must be a function");
+					return apply(env, fn, args);
+				}
+				catch (Error &e) {
+					e.add_frame(obj);
+					throw;
 				}
-				return apply(env, fn, args);
 			}
 			default:
 				error("Bug: eval: Unknown tag type: %d", obj->tag);
-				return NULL;
-			}  
+			}
 		}
 	}
 }
\ No newline at end of file
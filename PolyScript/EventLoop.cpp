@@ -0,0 +1,504 @@
+#include "stdafx.h"
+#include "EventLoop.h"
+#include "Let.h"
+#include "Limits.h"
+#include "Loader.h"
+#include "Primitives.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <unordered_map>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <errno.h>
+#include <unistd.h>
+#endif
+
+namespace PolyScript
+{
+	namespace EventLoop
+	{
+		using Primitives::evaluate_arguments;
+
+		typedef std::chrono::steady_clock Clock;
+
+		struct Timer {
+			Clock::time_point due;
+			// Zero for a timeout; the period of an interval.
+			Clock::duration period;
+			Object *env;
+			Object *fn;
+		};
+
+		// A timer's place in the queue. Entries for cleared timers are skipped when
+		// they come up.
+		struct Due {
+			Clock::time_point due;
+			int id;
+
+			bool operator>(const Due &other) const { return due > other.due || (due == other.due && id > other.id); }
+		};
+
+		struct Watch {
+			Object *env;
+			Object *fn;
+		};
+
+		// A background read that has finished, waiting for the loop to call back.
+		struct Completion {
+			Object *env;
+			Object *fn;
+			std::string contents;
+			bool ok;
+		};
+
+		class Loop
+		{
+		public:
+			Loop();
+
+			int add_timer(Object *env, Object *fn, int milliseconds, bool repeat);
+			void clear_timer(int id) { timers.erase(id); }
+
+			void watch(int fd, Object *env, Object *fn, bool write);
+			void unwatch(int fd);
+
+			void read_file(const std::string &path, Object *env, Object *fn);
+
+			// Called from a reader thread.
+			void complete(Completion &&completion);
+
+			// Runs what is due, after waiting up to the first timer if wait is set.
+			// Returns false when there is nothing left to wait for.
+			bool turn(bool wait, size_t &callbacks);
+
+		private:
+			void wait_for_events(int timeout, size_t &callbacks);
+			void run_completions(size_t &callbacks);
+			void run_timers(size_t &callbacks);
+
+			int next_id;
+			std::map<int, Timer> timers;
+			std::priority_queue<Due, std::vector<Due>, std::greater<Due> > queue;
+			std::unordered_map<int, Watch> watches;
+
+			// Reads not yet called back, and the finished ones.
+			size_t reads_in_flight;
+			std::mutex completions_lock;
+			std::condition_variable completions_ready;
+			std::vector<Completion> completions;
+
+#ifdef __linux__
+			int epoll;
+			// Readable when a reader thread has added a completion.
+			int wakeup;
+#endif
+		};
+
+		// Each thread that uses the event loop primitives gets its own loop. Reader
+		// threads may still hold a loop after the thread is gone, so loops are never freed.
+		static thread_local Loop *thread_loop = NULL;
+
+		static Loop &loop()
+		{
+			if (!thread_loop)
+				thread_loop = new Loop();
+			return *thread_loop;
+		}
+
+		Loop::Loop() : next_id(1), reads_in_flight(0)
+		{
+#ifdef __linux__
+			epoll = epoll_create1(EPOLL_CLOEXEC);
+			wakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+			if (epoll < 0 || wakeup < 0)
+				error("Cannot create the event loop");
+
+			struct epoll_event event = {};
+			event.events = EPOLLIN;
+			event.data.fd = wakeup;
+			epoll_ctl(epoll, EPOLL_CTL_ADD, wakeup, &event);
+#endif
+		}
+
+		int Loop::add_timer(Object *env, Object *fn, int milliseconds, bool repeat)
+		{
+			if (milliseconds < 0)
+				milliseconds = 0;
+
+			Timer timer;
+			timer.period = repeat ? std::chrono::milliseconds(milliseconds) : Clock::duration::zero();
+			timer.due = Clock::now() + std::chrono::milliseconds(milliseconds);
+			timer.env = Let::heap_env(env);
+			timer.fn = fn;
+
+			int id = next_id++;
+			timers[id] = timer;
+			queue.push({ timer.due, id });
+			return id;
+		}
+
+		void Loop::watch(int fd, Object *env, Object *fn, bool write)
+		{
+#ifdef __linux__
+			struct epoll_event event = {};
+			event.events = write ? EPOLLOUT : EPOLLIN;
+			event.data.fd = fd;
+			int op = watches.count(fd) ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+			if (epoll_ctl(epoll, op, fd, &event) < 0)
+				error("watch-fd: cannot watch descriptor %d: %s", fd, strerror(errno));
+			watches[fd] = { Let::heap_env(env), fn };
+#else
+			error("watch-fd: not supported on this system");
+#endif
+		}
+
+		void Loop::unwatch(int fd)
+		{
+#ifdef __linux__
+			if (watches.erase(fd))
+				epoll_ctl(epoll, EPOLL_CTL_DEL, fd, NULL);
+#endif
+		}
+
+		struct Read {
+			std::string path;
+			Loop *loop;
+			Completion completion;
+		};
+
+		// Threads that read files for read-file-async, started when first needed.
+		struct ReadQueue {
+			std::mutex lock;
+			std::condition_variable changed;
+			std::deque<Read> reads;
+			bool started = false;
+		};
+
+		static const int READER_THREADS = 4;
+
+		static ReadQueue &read_queue()
+		{
+			static ReadQueue *queue = new ReadQueue();
+			return *queue;
+		}
+
+		static void reader_thread()
+		{
+			ReadQueue &pending = read_queue();
+			for (;;) {
+				Read read;
+				{
+					std::unique_lock<std::mutex> guard(pending.lock);
+					pending.changed.wait(guard, [&]() { return !pending.reads.empty(); });
+					read = std::move(pending.reads.front());
+					pending.reads.pop_front();
+				}
+				read.completion.ok = Loader::read_file(read.path.c_str(), read.completion.contents);
+				read.loop->complete(std::move(read.completion));
+			}
+		}
+
+		void Loop::read_file(const std::string &path, Object *env, Object *fn)
+		{
+			Read read;
+			read.path = path;
+			read.loop = this;
+			read.completion.env = Let::heap_env(env);
+			read.completion.fn = fn;
+			read.completion.ok = false;
+			reads_in_flight++;
+
+			ReadQueue &pending = read_queue();
+			{
+				std::lock_guard<std::mutex> guard(pending.lock);
+				if (!pending.started) {
+					for (int i = 0; i < READER_THREADS; i++)
+						std::thread(reader_thread).detach();
+					pending.started = true;
+				}
+				pending.reads.push_back(std::move(read));
+			}
+			pending.changed.notify_one();
+		}
+
+		void Loop::complete(Completion &&completion)
+		{
+			{
+				std::lock_guard<std::mutex> guard(completions_lock);
+				completions.push_back(std::move(completion));
+			}
+#ifdef __linux__
+			uint64_t one = 1;
+			ssize_t written = write(wakeup, &one, sizeof(one));
+			(void)written;
+#else
+			completions_ready.notify_one();
+#endif
+		}
+
+		void Loop::run_completions(size_t &callbacks)
+		{
+			std::vector<Completion> finished;
+			{
+				std::lock_guard<std::mutex> guard(completions_lock);
+				finished.swap(completions);
+			}
+
+			for (size_t i = 0; i < finished.size(); i++) {
+				Completion &read = finished[i];
+				reads_in_flight--;
+				callbacks++;
+
+				Object *contents = read.ok ? Object::MakeString(read.contents.data(), read.contents.size()) : Nil;
+				try
+				{
+					Evaluator::funcall(read.env, read.fn, Object::cons(contents, Nil));
+				}
+				catch (...)
+				{
+					// Put back the ones not called yet, so the loop can go on later.
+					std::lock_guard<std::mutex> guard(completions_lock);
+					completions.insert(completions.begin(), std::make_move_iterator(finished.begin() + i + 1),
+						std::make_move_iterator(finished.end()));
+					throw;
+				}
+			}
+		}
+
+		void Loop::run_timers(size_t &callbacks)
+		{
+			Clock::time_point now = Clock::now();
+			while (!queue.empty() && queue.top().due <= now) {
+				Due next = queue.top();
+				queue.pop();
+
+				auto it = timers.find(next.id);
+				if (it == timers.end() || it->second.due != next.due)
+					continue;
+
+				Timer timer = it->second;
+				if (timer.period != Clock::duration::zero()) {
+					// Intervals keep to their schedule rather than drifting by the
+					// time each callback takes.
+					it->second.due += timer.period;
+					if (it->second.due <= now)
+						it->second.due = now + timer.period;
+					queue.push({ it->second.due, next.id });
+				}
+				else
+					timers.erase(it);
+
+				callbacks++;
+				Evaluator::funcall(timer.env, timer.fn, Nil);
+			}
+		}
+
+		void Loop::wait_for_events(int timeout, size_t &callbacks)
+		{
+#ifdef __linux__
+			struct epoll_event events[64];
+			int count = epoll_wait(epoll, events, 64, timeout);
+			for (int i = 0; i < count; i++) {
+				int fd = events[i].data.fd;
+				if (fd == wakeup) {
+					uint64_t value;
+					ssize_t read_bytes = read(wakeup, &value, sizeof(value));
+					(void)read_bytes;
+					continue;
+				}
+
+				// An earlier callback in this batch may have stopped watching it.
+				auto it = watches.find(fd);
+				if (it == watches.end())
+					continue;
+				Watch watch = it->second;
+				callbacks++;
+				Evaluator::funcall(watch.env, watch.fn, Object::cons(Object::MakeInt(fd), Nil));
+			}
+#else
+			std::unique_lock<std::mutex> guard(completions_lock);
+			if (timeout < 0)
+				completions_ready.wait(guard, [this]() { return !completions.empty(); });
+			else
+				completions_ready.wait_for(guard, std::chrono::milliseconds(timeout), [this]() { return !completions.empty(); });
+#endif
+		}
+
+		bool Loop::turn(bool wait, size_t &callbacks)
+		{
+			run_timers(callbacks);
+			run_completions(callbacks);
+
+			if (timers.empty() && watches.empty() && reads_in_flight == 0)
+				return false;
+
+			int timeout = 0;
+			if (wait) {
+				timeout = -1;
+				if (!timers.empty()) {
+					// Round up, so the wait doesn't end just before the timer is due.
+					auto until = queue.top().due - Clock::now();
+					long long ms = (std::chrono::duration_cast<std::chrono::microseconds>(until).count() + 999) / 1000;
+					timeout = ms < 0 ? 0 : (int)ms;
+				}
+
+				// Nothing is evaluated while the loop waits, so under a deadline the wait
+				// ends at it instead of holding the thread past it.
+				Clock::time_point deadline;
+				if (Limits::deadline(deadline)) {
+					Limits::check_deadline();
+					long long ms = (std::chrono::duration_cast<std::chrono::microseconds>(deadline - Clock::now()).count() + 999) / 1000;
+					if (timeout < 0 || ms < timeout)
+						timeout = ms < 0 ? 0 : (int)ms;
+				}
+			}
+			wait_for_events(timeout, callbacks);
+			Limits::check_deadline();
+			run_completions(callbacks);
+			return true;
+		}
+
+		size_t run_until_idle()
+		{
+			size_t callbacks = 0;
+			while (loop().turn(true, callbacks))
+				;
+			return callbacks;
+		}
+
+		size_t run_pending()
+		{
+			size_t callbacks = 0;
+			loop().turn(false, callbacks);
+			return callbacks;
+		}
+
+		static Object *function_argument(Object *value, const char *name)
+		{
+			if (value->tag != T_FUNCTION && value->tag != T_PRIMITIVE)
+				error("%s: argument is not a function", name);
+			// The loop keeps the closure past any scratch scope it was made in.
+			note_pointer_store();
+			return value;
+		}
+
+		static int integer_argument(Object *value, const char *name)
+		{
+			if (!value->IsAtomSubtype(AT_INT))
+				error("%s: argument is not an integer", name);
+			return value->int_value;
+		}
+
+		// (set-timeout fn milliseconds) calls (fn) once, after the delay. Returns a
+		// timer id for clear-timer.
+		DECLARE_PRIMITIVE_FN(SetTimeout)
+		{
+			Object *args = evaluate_arguments(env, list, 2, 2, "set-timeout");
+			Object *fn = function_argument(args->car, "set-timeout");
+			return Object::MakeInt(loop().add_timer(env, fn, integer_argument(args->cdr->car, "set-timeout"), false));
+		}
+
+		// (set-interval fn milliseconds) calls (fn) every period until cleared.
+		DECLARE_PRIMITIVE_FN(SetInterval)
+		{
+			Object *args = evaluate_arguments(env, list, 2, 2, "set-interval");
+			Object *fn = function_argument(args->car, "set-interval");
+			int period = integer_argument(args->cdr->car, "set-interval");
+			if (period < 1)
+				error("set-interval: period must be at least 1 millisecond");
+			return Object::MakeInt(loop().add_timer(env, fn, period, true));
+		}
+
+		// (clear-timer id)
+		DECLARE_PRIMITIVE_FN(ClearTimer)
+		{
+			Object *args = evaluate_arguments(env, list, 1, 1, "clear-timer");
+			loop().clear_timer(integer_argument(args->car, "clear-timer"));
+			return Nil;
+		}
+
+		// (watch-fd fd fn [write]) calls (fn fd) whenever fd can be read, or written if
+		// write is true. The watch is level-triggered: fn must read what is there, or
+		// unwatch-fd, or it is called again straight away.
+		DECLARE_PRIMITIVE_FN(WatchFd)
+		{
+			Object *args = evaluate_arguments(env, list, 2, 3, "watch-fd");
+			int fd = integer_argument(args->car, "watch-fd");
+			Object *fn = function_argument(args->cdr->car, "watch-fd");
+			bool write = args->cdr->cdr != Nil && args->cdr->cdr->car != Nil;
+			loop().watch(fd, env, fn, write);
+			return Nil;
+		}
+
+		// (unwatch-fd fd)
+		DECLARE_PRIMITIVE_FN(UnwatchFd)
+		{
+			Object *args = evaluate_arguments(env, list, 1, 1, "unwatch-fd");
+			loop().unwatch(integer_argument(args->car, "unwatch-fd"));
+			return Nil;
+		}
+
+		// (read-fd fd) returns what can be read from fd without waiting, as a string:
+		// empty if there is nothing yet, nil at the end of the input.
+		DECLARE_PRIMITIVE_FN(ReadFd)
+		{
+			Object *args = evaluate_arguments(env, list, 1, 1, "read-fd");
+			int fd = integer_argument(args->car, "read-fd");
+#ifdef __linux__
+			char buffer[65536];
+			ssize_t count = read(fd, buffer, sizeof(buffer));
+			if (count == 0)
+				return Nil;
+			if (count < 0) {
+				if (errno == EAGAIN || errno == EWOULDBLOCK)
+					return Object::MakeString("", 0);
+				error("read-fd: cannot read descriptor %d: %s", fd, strerror(errno));
+			}
+			return Object::MakeString(buffer, count);
+#else
+			error("read-fd: not supported on this system");
+#endif
+		}
+
+		// (read-file-async path fn) reads the file on a background thread, then calls
+		// (fn contents) from the loop, with nil if the file could not be read.
+		DECLARE_PRIMITIVE_FN(ReadFileAsync)
+		{
+			Object *args = evaluate_arguments(env, list, 2, 2, "read-file-async");
+			if (!args->car->IsAtomSubtype(AT_STRING))
+				error("read-file-async: path is not a string");
+			std::string path(args->car->str_value, args->car->str_length);
+			Object *fn = function_argument(args->cdr->car, "read-file-async");
+			loop().read_file(path, env, fn);
+			return Nil;
+		}
+
+		// (run-until-idle) runs the loop until it has nothing left to wait for, and
+		// returns the number of callbacks it ran.
+		DECLARE_PRIMITIVE_FN(RunUntilIdle)
+		{
+			evaluate_arguments(env, list, 0, 0, "run-until-idle");
+			return Object::MakeInt((int)run_until_idle());
+		}
+
+		void create_primitives(Object *env)
+		{
+			Primitives::add_primitive(env, "set-timeout", SetTimeout);
+			Primitives::add_primitive(env, "set-interval", SetInterval);
+			Primitives::add_primitive(env, "clear-timer", ClearTimer);
+			Primitives::add_primitive(env, "watch-fd", WatchFd);
+			Primitives::add_primitive(env, "unwatch-fd", UnwatchFd);
+			Primitives::add_primitive(env, "read-fd", ReadFd);
+			Primitives::add_primitive(env, "read-file-async", ReadFileAsync);
+			Primitives::add_primitive(env, "run-until-idle", RunUntilIdle);
+		}
+	};
+};
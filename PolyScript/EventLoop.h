@@ -0,0 +1,29 @@
+#pragma once
+
+#include "PolyScript.h"
+
+namespace PolyScript
+{
+	// An event loop for the thread that runs it: timers, file descriptors to watch
+	// and files being read in the background, each with a closure to call. Nothing
+	// happens until the host or a script runs the loop; the callbacks then run on
+	// that thread, one at a time.
+	//
+	// Descriptors are watched with epoll, so watch-fd is only available on Linux.
+	// Timers and background reads work everywhere.
+	namespace EventLoop
+	{
+		// Runs callbacks as they become due until there are no timers, watched
+		// descriptors or reads left to wait for. Returns the number of callbacks run.
+		// An error raised by a callback stops the loop and is raised here; the rest
+		// of the loop's work stays queued.
+		size_t run_until_idle();
+
+		// Runs the callbacks that are due now, without waiting. For hosts with an event
+		// loop of their own, which call this when it suits them.
+		size_t run_pending();
+
+		// Add the timer, descriptor and background read primitives to the environment.
+		void create_primitives(Object *env);
+	};
+};
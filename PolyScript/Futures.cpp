@@ -0,0 +1,183 @@
+#include "stdafx.h"
+#include "Futures.h"
+#include "Evaluator.h"
+#include "Let.h"
+#include "Limits.h"
+#include "Primitives.h"
+
+#include <deque>
+#include <thread>
+
+namespace PolyScript
+{
+	Future::Future(Object *env, Object *fn)
+		: state(PENDING), env(env), fn(fn), value(Nil), failed(false), limit(LIMIT_NONE)
+	{
+	}
+
+	void Future::run()
+	{
+		int expected = PENDING;
+		if (!state.compare_exchange_strong(expected, RUNNING))
+			return;
+
+		Object *result = Nil;
+		std::string error_message;
+		LimitKind error_limit = LIMIT_NONE;
+		bool error_raised = true;
+		try
+		{
+			result = Evaluator::funcall(env, fn, Nil);
+			error_raised = false;
+		}
+		catch (Throw &)
+		{
+			error_message = "throw to a catch outside a future";
+		}
+		catch (LimitExceeded &e)
+		{
+			error_message = e.what();
+			error_limit = e.kind;
+		}
+		catch (std::exception &e)
+		{
+			error_message = e.what();
+		}
+
+		// The value is handed to other threads, so a scratch scope around this call
+		// must not give it back.
+		note_pointer_store();
+
+		std::lock_guard<std::mutex> guard(lock);
+		value = result;
+		failed = error_raised;
+		message = error_message;
+		limit = error_limit;
+		state = DONE;
+		finished.notify_all();
+	}
+
+	Object *Future::wait()
+	{
+		// A future nobody has started yet is run here rather than waited for, so
+		// futures that touch other futures cannot run out of pool threads.
+		run();
+
+		// Under a deadline, give up waiting when it passes.
+		std::unique_lock<std::mutex> guard(lock);
+		std::chrono::steady_clock::time_point deadline;
+		if (Limits::deadline(deadline)) {
+			if (!finished.wait_until(guard, deadline, [this]() { return state == DONE; })) {
+				guard.unlock();
+				Limits::check_deadline();
+			}
+		}
+		else
+			finished.wait(guard, [this]() { return state == DONE; });
+		if (failed && limit != LIMIT_NONE)
+			throw LimitExceeded(message, limit);
+		if (failed)
+			error("%s", message.c_str());
+		return value;
+	}
+
+	namespace Futures
+	{
+		using Primitives::evaluate_arguments;
+
+		// Futures waiting for a pool thread. The threads start when the first future
+		// is made and run for the rest of the process, so the queue is never destroyed.
+		struct Queue {
+			std::mutex lock;
+			std::condition_variable changed;
+			std::deque<Future *> futures;
+			bool started = false;
+		};
+
+		static Queue &queue()
+		{
+			static Queue *queue = new Queue();
+			return *queue;
+		}
+
+		static void pool_thread()
+		{
+			// The arena outlives the thread's use of it: objects are never freed.
+			current_arena = new Arena();
+
+			Queue &pending = queue();
+			for (;;) {
+				Future *future;
+				{
+					std::unique_lock<std::mutex> guard(pending.lock);
+					pending.changed.wait(guard, [&]() { return !pending.futures.empty(); });
+					future = pending.futures.front();
+					pending.futures.pop_front();
+				}
+				future->run();
+			}
+		}
+
+		Object *spawn(Object *env, Object *fn)
+		{
+			if (fn->tag != T_FUNCTION && fn->tag != T_PRIMITIVE)
+				error("future: argument is not a function");
+			// The pool thread that runs it would be outside this thread's limits.
+			if (Limits::active())
+				error("future: cannot start a future under with-limits");
+			// The future keeps the closure past any scratch scope it was made in.
+			note_pointer_store();
+
+			Future *future = new Future(Let::heap_env(env), fn);
+			Queue &pending = queue();
+			{
+				std::lock_guard<std::mutex> guard(pending.lock);
+				if (!pending.started) {
+					// At least two, so that a future can wait on a channel fed by another.
+					unsigned threads = std::thread::hardware_concurrency();
+					if (threads < 2)
+						threads = 2;
+					for (unsigned i = 0; i < threads; i++)
+						std::thread(pool_thread).detach();
+					pending.started = true;
+				}
+				pending.futures.push_back(future);
+			}
+			pending.changed.notify_one();
+			return Object::MakeFuture(future);
+		}
+
+		// (future fn) starts (fn) on another thread and returns a future for its value.
+		DECLARE_PRIMITIVE_FN(MakeFuture)
+		{
+			Object *args = evaluate_arguments(env, list, 1, 1, "future");
+			return spawn(env, args->car);
+		}
+
+		// (touch value) waits for a future's value. Anything else is its own value,
+		// so code can touch whatever it was given.
+		DECLARE_PRIMITIVE_FN(Touch)
+		{
+			Object *args = evaluate_arguments(env, list, 1, 1, "touch");
+			if (args->car->tag != T_FUTURE)
+				return args->car;
+			return args->car->future->wait();
+		}
+
+		// (future-done-p future)
+		DECLARE_PRIMITIVE_FN(FutureDoneP)
+		{
+			Object *args = evaluate_arguments(env, list, 1, 1, "future-done-p");
+			if (args->car->tag != T_FUTURE)
+				error("future-done-p: argument is not a future");
+			return args->car->future->done() ? True : Nil;
+		}
+
+		void create_primitives(Object *env)
+		{
+			Primitives::add_primitive(env, "future", MakeFuture);
+			Primitives::add_primitive(env, "touch", Touch);
+			Primitives::add_primitive(env, "future-done-p", FutureDoneP);
+		}
+	};
+};
@@ -0,0 +1,52 @@
+#pragma once
+
+#include "PolyScript.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+
+namespace PolyScript
+{
+	// A closure with no arguments that runs once, on a pool thread or on whichever
+	// thread needs its value first.
+	class Future
+	{
+	public:
+		Future(Object *env, Object *fn);
+
+		// Runs the closure on this thread unless another thread has already started it.
+		void run();
+
+		// Waits for the closure to finish and returns its value. An error raised by the
+		// closure is raised again here.
+		Object *wait();
+
+		bool done() const { return state == DONE; }
+
+	private:
+		enum State { PENDING, RUNNING, DONE };
+
+		std::atomic<int> state;
+		Object *env;
+		Object *fn;
+
+		// Set once the state is DONE.
+		Object *value;
+		bool failed;
+		std::string message;
+		LimitKind limit;
+
+		std::mutex lock;
+		std::condition_variable finished;
+	};
+
+	namespace Futures
+	{
+		// Returns a future for (fn), queued to run on the future pool.
+		Object *spawn(Object *env, Object *fn);
+
+		// Add future, touch and future-done-p to the environment.
+		void create_primitives(Object *env);
+	};
+};
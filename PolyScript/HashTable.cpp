@@ -0,0 +1,347 @@
+#include "stdafx.h"
+#include "HashTable.h"
+#include "Primitives.h"
+#include "Map.h"
+
+#include <vector>
+
+namespace PolyScript
+{
+	namespace HashTable
+	{
+		using Primitives::evaluate_arguments;
+
+		static const uint32_t INITIAL_CAPACITY = 8;
+
+		// Marks a slot whose entry was removed. Lookups probe past it; inserts may reuse it.
+		static Object deleted_marker;
+		static Object *const Deleted = &deleted_marker;
+
+		// Spreads the bits of x over the whole word (the MurmurHash3 finalizer).
+		static uint64_t mix(uint64_t x)
+		{
+			x ^= x >> 33;
+			x *= 0xff51afd7ed558ccdULL;
+			x ^= x >> 33;
+			x *= 0xc4ceb9fe1a85ec53ULL;
+			x ^= x >> 33;
+			return x;
+		}
+
+		static uint64_t combine(uint64_t h, uint64_t x)
+		{
+			return mix(h * 31 + x);
+		}
+
+		static uint64_t hash_bytes(const void *data, size_t len)
+		{
+			// FNV-1a
+			const unsigned char *p = (const unsigned char *)data;
+			uint64_t h = 0xcbf29ce484222325ULL;
+			for (size_t i = 0; i < len; i++)
+				h = (h ^ p[i]) * 0x100000001b3ULL;
+			return h;
+		}
+
+		static bool is_number(Object *obj)
+		{
+			return obj->tag == T_ATOM && (obj->atom_subtype == AT_INT || obj->atom_subtype == AT_FLOAT);
+		}
+
+		// Numbers are boxed afresh each time they are made, so they compare by value.
+		// Floats compare bit for bit so that equal keys always hash alike.
+		static bool same_number(Object *a, Object *b)
+		{
+			if (a->atom_subtype != b->atom_subtype)
+				return false;
+			if (a->atom_subtype == AT_INT)
+				return a->int_value == b->int_value;
+			return memcmp(&a->float_value, &b->float_value, sizeof(double)) == 0;
+		}
+
+		static uint64_t hash_number(Object *obj)
+		{
+			if (obj->atom_subtype == AT_INT)
+				return mix((uint64_t)(int64_t)obj->int_value);
+			uint64_t bits;
+			memcpy(&bits, &obj->float_value, sizeof(bits));
+			return mix(bits ^ AT_FLOAT);
+		}
+
+		static uint64_t hash_eq(Object *key)
+		{
+			if (is_number(key))
+				return hash_number(key);
+			return mix((uint64_t)(uintptr_t)key);
+		}
+
+		static uint64_t hash_equal(Object *key)
+		{
+			uint64_t h = T_CELL;
+
+			// Walk down the spine of a list and recurse only into the elements.
+			while (key->tag == T_CELL) {
+				h = combine(h, hash_equal(key->car));
+				key = key->cdr;
+			}
+
+			if (key->IsAtomSubtype(AT_STRING))
+				return combine(h, hash_bytes(key->str_value, key->str_length));
+			if (key->tag == T_VECTOR) {
+				h = combine(h, key->vector_type);
+				if (key->vector_type == VT_GENERIC) {
+					for (size_t i = 0; i < key->length; i++)
+						h = combine(h, hash_equal(key->generic_elements()[i]));
+					return h;
+				}
+				size_t element_size = key->vector_type == VT_INT32 ? sizeof(int32_t) : sizeof(double);
+				return combine(h, hash_bytes(key->elements, key->length * element_size));
+			}
+			if (key->tag == T_MAP)
+				return combine(h, Map::hash(key));
+			return combine(h, hash_eq(key));
+		}
+
+		bool equal(Object *a, Object *b)
+		{
+			for (;;) {
+				if (a == b)
+					return true;
+				if (a->tag != b->tag)
+					return false;
+				if (a->tag != T_CELL)
+					break;
+				if (!equal(a->car, b->car))
+					return false;
+				a = a->cdr;
+				b = b->cdr;
+			}
+
+			switch (a->tag) {
+			case T_ATOM:
+				if (a->atom_subtype != b->atom_subtype)
+					return false;
+				if (a->atom_subtype == AT_STRING)
+					return a->str_length == b->str_length && memcmp(a->str_value, b->str_value, a->str_length) == 0;
+				return is_number(a) && same_number(a, b);
+			case T_VECTOR:
+				if (a->vector_type != b->vector_type || a->length != b->length)
+					return false;
+				if (a->vector_type == VT_GENERIC) {
+					for (size_t i = 0; i < a->length; i++)
+						if (!equal(a->generic_elements()[i], b->generic_elements()[i]))
+							return false;
+					return true;
+				}
+				return memcmp(a->elements, b->elements,
+					a->length * (a->vector_type == VT_INT32 ? sizeof(int32_t) : sizeof(double))) == 0;
+			case T_MAP:
+				return Map::equal(a, b);
+			default:
+				return false;
+			}
+		}
+
+		uint32_t hash(HashTest test, Object *key)
+		{
+			return (uint32_t)(test == HT_EQUAL ? hash_equal(key) : hash_eq(key));
+		}
+
+		bool keys_match(HashTest test, Object *a, Object *b)
+		{
+			if (a == b)
+				return true;
+			if (test == HT_EQUAL)
+				return equal(a, b);
+			return is_number(a) && is_number(b) && same_number(a, b);
+		}
+
+		// Returns the entry holding key, or NULL.
+		static HashEntry *find_entry(Object *table, Object *key, uint32_t hash)
+		{
+			uint32_t mask = table->hash_capacity - 1;
+			for (uint32_t i = hash & mask;; i = (i + 1) & mask) {
+				HashEntry *entry = &table->hash_entries[i];
+				if (entry->key == NULL)
+					return NULL;
+				if (entry->key != Deleted && entry->hash == hash && keys_match(table->hash_test, entry->key, key))
+					return entry;
+			}
+		}
+
+		// Moves the live entries into a fresh array sized so that it is at most half full.
+		// Deleted slots are dropped. Like every other object, the old array is never freed.
+		static void rehash(Object *table)
+		{
+			uint32_t capacity = INITIAL_CAPACITY;
+			while (capacity < (table->hash_count + 1) * 2)
+				capacity *= 2;
+
+			HashEntry *old_entries = table->hash_entries;
+			uint32_t old_capacity = table->hash_capacity;
+
+			table->hash_entries = (HashEntry *)Object::allocate(capacity * sizeof(HashEntry));
+			memset(table->hash_entries, 0, capacity * sizeof(HashEntry));
+			table->hash_capacity = capacity;
+			table->hash_used = table->hash_count;
+
+			uint32_t mask = capacity - 1;
+			for (uint32_t i = 0; i < old_capacity; i++) {
+				HashEntry *entry = &old_entries[i];
+				if (entry->key == NULL || entry->key == Deleted)
+					continue;
+				uint32_t j = entry->hash & mask;
+				while (table->hash_entries[j].key != NULL)
+					j = (j + 1) & mask;
+				table->hash_entries[j] = *entry;
+			}
+		}
+
+		Object *make(HashTest test)
+		{
+			return Object::MakeHashTable(test, INITIAL_CAPACITY);
+		}
+
+		Object *get(Object *table, Object *key)
+		{
+			HashEntry *entry = find_entry(table, key, HashTable::hash(table->hash_test, key));
+			return entry ? entry->value : NULL;
+		}
+
+		void put(Object *table, Object *key, Object *value)
+		{
+			note_pointer_store();
+			uint32_t hash = HashTable::hash(table->hash_test, key);
+			HashEntry *entry = find_entry(table, key, hash);
+			if (entry) {
+				entry->value = value;
+				return;
+			}
+
+			// Keep at least a quarter of the slots empty, counting deleted ones as used,
+			// so that probe sequences stay short and always end.
+			if ((table->hash_used + 1) * 4 > table->hash_capacity * 3)
+				rehash(table);
+
+			uint32_t mask = table->hash_capacity - 1;
+			uint32_t i = hash & mask;
+			while (table->hash_entries[i].key != NULL && table->hash_entries[i].key != Deleted)
+				i = (i + 1) & mask;
+
+			entry = &table->hash_entries[i];
+			if (entry->key == NULL)
+				table->hash_used++;
+			entry->key = key;
+			entry->value = value;
+			entry->hash = hash;
+			table->hash_count++;
+		}
+
+		bool remove(Object *table, Object *key)
+		{
+			HashEntry *entry = find_entry(table, key, HashTable::hash(table->hash_test, key));
+			if (!entry)
+				return false;
+			entry->key = Deleted;
+			entry->value = NULL;
+			table->hash_count--;
+			return true;
+		}
+
+		static Object *table_argument(Object *value, const char *name)
+		{
+			if (value->tag != T_HASHTABLE)
+				error("%s: argument is not a hash table", name);
+			return value;
+		}
+
+		HashTest test_argument(Object *value, const char *name)
+		{
+			if (value->IsAtomSubtype(AT_SYMBOL) && strcmp(value->name, "EQ") == 0)
+				return HT_EQ;
+			if (value->IsAtomSubtype(AT_SYMBOL) && strcmp(value->name, "EQUAL") == 0)
+				return HT_EQUAL;
+			error("%s: test must be eq or equal", name);
+		}
+
+		// (make-hash-table ['eq | 'equal])
+		DECLARE_PRIMITIVE_FN(MakeTable)
+		{
+			Object *args = evaluate_arguments(env, list, 0, 1, "make-hash-table");
+			return make(args == Nil ? HT_EQ : test_argument(args->car, "make-hash-table"));
+		}
+
+		// (gethash key table [default])
+		DECLARE_PRIMITIVE_FN(Gethash)
+		{
+			Object *args = evaluate_arguments(env, list, 2, 3, "gethash");
+			Object *table = table_argument(args->cdr->car, "gethash");
+			Object *value = get(table, args->car);
+			if (value)
+				return value;
+			return args->cdr->cdr != Nil ? args->cdr->cdr->car : Nil;
+		}
+
+		// (puthash key value table)
+		DECLARE_PRIMITIVE_FN(Puthash)
+		{
+			Object *args = evaluate_arguments(env, list, 3, 3, "puthash");
+			Object *value = args->cdr->car;
+			put(table_argument(args->cdr->cdr->car, "puthash"), args->car, value);
+			return value;
+		}
+
+		// (remhash key table)
+		DECLARE_PRIMITIVE_FN(Remhash)
+		{
+			Object *args = evaluate_arguments(env, list, 2, 2, "remhash");
+			return remove(table_argument(args->cdr->car, "remhash"), args->car) ? True : Nil;
+		}
+
+		// (maphash fn table) calls (fn key value) for every entry.
+		DECLARE_PRIMITIVE_FN(Maphash)
+		{
+			Object *args = evaluate_arguments(env, list, 2, 2, "maphash");
+			Object *fn = args->car;
+			Object *table = table_argument(args->cdr->car, "maphash");
+
+			// fn may add or remove entries, and a rehash moves every entry, so walk a
+			// copy: fn is called for the entries there were when maphash began.
+			std::vector<HashEntry> entries;
+			entries.reserve(table->hash_count);
+			for (uint32_t i = 0; i < table->hash_capacity; i++) {
+				HashEntry *entry = &table->hash_entries[i];
+				if (entry->key != NULL && entry->key != Deleted)
+					entries.push_back(*entry);
+			}
+			for (HashEntry &entry : entries)
+				Evaluator::funcall(env, fn, Object::cons(entry.key, Object::cons(entry.value, Nil)));
+			return Nil;
+		}
+
+		// (hash-table-count table)
+		DECLARE_PRIMITIVE_FN(HashTableCount)
+		{
+			Object *args = evaluate_arguments(env, list, 1, 1, "hash-table-count");
+			return Object::MakeInt((int)table_argument(args->car, "hash-table-count")->hash_count);
+		}
+
+		// (equal a b)
+		DECLARE_PRIMITIVE_FN(Equal)
+		{
+			Object *args = evaluate_arguments(env, list, 2, 2, "equal");
+			return equal(args->car, args->cdr->car) ? True : Nil;
+		}
+
+		void create_primitives(Object *env)
+		{
+			Primitives::add_primitive(env, "make-hash-table", MakeTable);
+			Primitives::add_primitive(env, "gethash", Gethash);
+			Primitives::add_primitive(env, "puthash", Puthash);
+			Primitives::add_primitive(env, "remhash", Remhash);
+			Primitives::add_primitive(env, "maphash", Maphash);
+			Primitives::add_primitive(env, "hash-table-count", HashTableCount);
+			Primitives::add_primitive(env, "equal", Equal);
+		}
+	};
+};
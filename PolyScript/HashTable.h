@@ -0,0 +1,38 @@
+#pragma once
+
+#include "PolyScript.h"
+
+namespace PolyScript
+{
+	// Hash tables with open addressing and linear probing. Entries live in one flat
+	// array, so a lookup usually touches a single cache line.
+	namespace HashTable
+	{
+		Object *make(HashTest test);
+
+		// Returns the value stored under key, or NULL if there is none.
+		Object *get(Object *table, Object *key);
+
+		void put(Object *table, Object *key, Object *value);
+
+		// Returns true if key was present.
+		bool remove(Object *table, Object *key);
+
+		// The hash of key under a table's test. Keys that match have the same hash.
+		uint32_t hash(HashTest test, Object *key);
+
+		// Whether two keys are the same under a table's test.
+		bool keys_match(HashTest test, Object *a, Object *b);
+
+		// Parses the symbol eq or equal naming a test; name is the caller, for the error.
+		HashTest test_argument(Object *value, const char *name);
+
+		// Structural equality: numbers by type and value, strings by contents,
+		// lists and vectors element by element, maps by their entries and
+		// everything else by identity.
+		bool equal(Object *a, Object *b);
+
+		// Add the hash table primitives to the environment.
+		void create_primitives(Object *env);
+	};
+};
@@ -0,0 +1,107 @@
+#include "stdafx.h"
+#include "Interpreter.h"
+#include "Evaluator.h"
+#include "EventLoop.h"
+#include "Parser.h"
+#include "Primitives.h"
+#include "Printer.h"
+
+namespace PolyScript
+{
+	std::string Value::to_string() const
+	{
+		if (!ok())
+			return error;
+		return Printer::to_string(object, true);
+	}
+
+	Interpreter::Interpreter()
+	{
+		// The special objects and the symbol table are shared by every context.
+		Initialize();
+
+		env = Object::MakeEnv(Nil, NULL);
+		Primitives::create_primitives(env);
+	}
+
+	// Returns what body evaluates to, or the error that stopped it. Errors are
+	// returned to the host rather than printed.
+	template <typename F>
+	static Value capture(F body)
+	{
+		Value value;
+		value.object = NULL;
+		value.error_form = NULL;
+		value.limit = LIMIT_NONE;
+
+		try
+		{
+			value.object = body(value);
+		}
+		catch (Error &e)
+		{
+			value.object = NULL;
+			value.error = e.message;
+			value.error_form = e.form;
+			value.backtrace = e.backtrace;
+			if (LimitExceeded *limit = dynamic_cast<LimitExceeded *>(&e))
+				value.limit = limit->kind;
+		}
+		catch (Throw &t)
+		{
+			value.object = NULL;
+			value.error = Printer::describe_throw(t);
+			value.error.pop_back();
+		}
+
+		return value;
+	}
+
+	Value Interpreter::evaluate(std::string_view source, bool all_forms)
+	{
+		return capture([&](Value &value) -> Object * {
+			Parser::InputScope input(source.data(), source.data() + source.size());
+
+			Object *result = NULL;
+			bool read_any = false;
+			for (;;) {
+				Object *expr = Parser::read();
+				if (!expr)
+					break;
+				read_any = true;
+
+				result = Evaluator::eval(env, expr);
+				if (!all_forms)
+					break;
+			}
+
+			if (!read_any)
+				value.error = "No form to evaluate";
+			return result;
+		});
+	}
+
+	Value Interpreter::run_until_idle()
+	{
+		return capture([](Value &) { return Object::MakeInt((int)EventLoop::run_until_idle()); });
+	}
+
+	Value Interpreter::eval(std::string_view source)
+	{
+		return evaluate(source, false);
+	}
+
+	Value Interpreter::eval_all(std::string_view source)
+	{
+		return evaluate(source, true);
+	}
+
+	std::vector<Value> Interpreter::eval_batch(const std::vector<std::string_view> &inputs)
+	{
+		std::vector<Value> results;
+		results.reserve(inputs.size());
+		for (std::string_view input : inputs)
+			results.push_back(evaluate(input, true));
+		return results;
+	}
+};
@@ -0,0 +1,62 @@
+#pragma once
+
+#include "PolyScript.h"
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace PolyScript
+{
+	// The outcome of evaluating source text: a value, or the error that stopped evaluation.
+	struct Value
+	{
+		// NULL if evaluation failed.
+		Object *object;
+
+		// Empty unless evaluation failed.
+		std::string error;
+
+		// Where the error happened: the innermost form being evaluated, and the
+		// forms being evaluated around it, innermost first.
+		Object *error_form;
+		std::vector<Object *> backtrace;
+
+		// The limit that stopped evaluation, if it was a Limits::Scope's.
+		LimitKind limit;
+
+		bool ok() const { return object != NULL; }
+
+		// The printed representation of the value, or the error message.
+		std::string to_string() const;
+	};
+
+	// An embeddable interpreter context. Each one has its own top-level environment
+	// with the primitives defined in it; symbols and the reader are shared.
+	class Interpreter
+	{
+	public:
+		Interpreter();
+
+		// Reads and evaluates the first form in source.
+		Value eval(std::string_view source);
+
+		// Evaluates every form in source in order and returns the last value.
+		Value eval_all(std::string_view source);
+
+		// Evaluates each input as a script against this context, in order.
+		std::vector<Value> eval_batch(const std::vector<std::string_view> &inputs);
+
+		// Runs this thread's event loop until no timers, watched descriptors or
+		// background reads are left. The value is the number of callbacks run, or the
+		// error a callback raised.
+		Value run_until_idle();
+
+		Object *environment() const { return env; }
+
+	private:
+		Value evaluate(std::string_view source, bool all_forms);
+
+		Object *env;
+	};
+};
@@ -0,0 +1,334 @@
+#include "stdafx.h"
+#include "Let.h"
+#include "Evaluator.h"
+#include "Primitives.h"
+#include "Specials.h"
+
+#include <mutex>
+#include <optional>
+#include <unordered_map>
+#include <vector>
+
+#ifdef _WIN32
+#include <malloc.h>
+#else
+#include <alloca.h>
+#endif
+
+namespace PolyScript
+{
+	namespace Let
+	{
+		// A let with more bindings than this gets a heap frame, to bound what one
+		// level of eval takes from the C stack.
+		static const int MAX_STACK_BINDINGS = 32;
+
+		// A frame of n bindings on the stack is an env and 2n conses: for each binding,
+		// the pair and the cell that links it into the alist. A stack env has heap as
+		// well as vars and up.
+		static const size_t PAIR_BYTES = (offsetof(Object, int_value) + sizeof(Object *) * 2 + alignof(Object) - 1) & ~(alignof(Object) - 1);
+		static const size_t ENV_BYTES = (offsetof(Object, int_value) + sizeof(Object *) * 3 + alignof(Object) - 1) & ~(alignof(Object) - 1);
+
+		// Primitives that keep the environment they are called in, to evaluate
+		// something in it later.
+		static const char *const capturing_names[] = {
+			"lambda", "defun", "defmacro", "flet", "labels",
+			"future", "make-coroutine", "spawn-task",
+			"set-timeout", "set-interval", "watch-fd", "read-file-async",
+			"lazy-map", "lazy-filter", "generator",
+			"load", "load-parallel",
+		};
+		static std::vector<Primitive *> capturing;
+		static std::once_flag capturing_found;
+
+		static bool captures(Object *value)
+		{
+			if (value->tag == T_MACRO)
+				return true;
+			if (value->tag != T_PRIMITIVE)
+				return false;
+			for (Primitive *fn : capturing)
+				if (value->fn == fn)
+					return true;
+			return false;
+		}
+
+		struct Analysis
+		{
+			bool escapes;
+
+			// False if the answer depends on a function in a local variable, which
+			// may be a different one the next time the form is evaluated.
+			bool cacheable;
+		};
+
+		// Looks up every symbol in form. A symbol bound to a macro or a capturing
+		// primitive could capture the frame, whether it is called or passed on.
+		static void scan(Object *env, Object *form, Analysis &analysis)
+		{
+			for (; !analysis.escapes; form = form->cdr) {
+				if (form->tag == T_ATOM) {
+					if (form->atom_subtype != AT_SYMBOL || form->special_index)
+						return;
+					for (Object *p = env; p; p = p->up) {
+						for (Object *cell = p->vars; cell != Nil; cell = cell->cdr) {
+							Object *bind = cell->car;
+							if (bind->car != form)
+								continue;
+							Object *value = bind->cdr;
+							if (captures(value))
+								analysis.escapes = true;
+							if (p->up && (value->tag == T_PRIMITIVE || value->tag == T_FUNCTION || value->tag == T_MACRO))
+								analysis.cacheable = false;
+							return;
+						}
+					}
+					return;
+				}
+				if (form->tag != T_CELL)
+					return;
+				scan(env, form->car, analysis);
+			}
+		}
+
+		// What has been found about forms on this thread, by address. It is dropped
+		// when a macro or primitive is defined. A form in the scratch arena isn't
+		// kept, since a rewind may put another form at its address.
+		struct Cache
+		{
+			uint64_t definitions;
+			std::unordered_map<Object *, bool> escapes;
+		};
+
+		static const size_t MAX_CACHED_FORMS = 4096;
+		static thread_local Cache cache;
+
+		bool escapes(Object *env, Object *form)
+		{
+			uint64_t current = definitions.load(std::memory_order_relaxed);
+			if (cache.definitions != current || cache.escapes.size() >= MAX_CACHED_FORMS) {
+				cache.escapes.clear();
+				cache.definitions = current;
+			}
+			auto found = cache.escapes.find(form);
+			if (found != cache.escapes.end())
+				return found->second;
+
+			Analysis analysis = { false, true };
+			scan(env, form, analysis);
+			if (analysis.cacheable && !in_scratch(form))
+				cache.escapes.emplace(form, analysis.escapes);
+			return analysis.escapes;
+		}
+
+		static Object *copy_vars(Object *vars)
+		{
+			Object *head = Nil;
+			Object **tail = &head;
+			for (Object *p = vars; p != Nil; p = p->cdr) {
+				*tail = Object::cons(Object::cons(p->car->car, p->car->cdr), Nil);
+				tail = &(*tail)->cdr;
+			}
+			return head;
+		}
+
+		Object *heap_env(Object *env)
+		{
+			if (!env)
+				return NULL;
+			if (env->tag == T_ENV) {
+				// A heap frame can be inside a stack one, as a macro's is.
+				Object *up = heap_env(env->up);
+				if (up != env->up)
+					env->up = up;
+				return env;
+			}
+			if (!env->heap) {
+				Object *copy = Object::MakeEnv(copy_vars(env->vars), heap_env(env->up));
+				// The stack frame may be older than the scratch scopes open now.
+				if (in_scratch(copy))
+					note_pointer_store();
+				env->vars = copy->vars;
+				env->up = copy->up;
+				env->heap = copy;
+			}
+			return env->heap;
+		}
+
+		// A frame being built, in memory from the caller's stack or, if there is none,
+		// on the heap.
+		class Frame
+		{
+		public:
+			Frame(Object *up, void *memory) : next((char *)memory)
+			{
+				if (next) {
+					env = place(T_STACK_ENV, ENV_BYTES);
+					env->vars = Nil;
+					env->up = up;
+					env->heap = NULL;
+				}
+				else
+					env = Object::MakeEnv(Nil, up);
+			}
+
+			// Once the frame has been moved to the heap, what is added to it goes there
+			// too.
+			Object *cons(Object *car, Object *cdr)
+			{
+				if (!next || env->heap)
+					return Object::cons(car, cdr);
+				Object *cell = place(T_CELL, PAIR_BYTES);
+				cell->car = car;
+				cell->cdr = cdr;
+				return cell;
+			}
+
+			void bind(Object *sym, Object *value)
+			{
+				env->vars = cons(cons(sym, value), env->vars);
+				if (next && env->heap)
+					env->heap->vars = env->vars;
+			}
+
+			Object *env;
+
+		private:
+			Object *place(ObjectTag tag, size_t bytes)
+			{
+				Object *obj = (Object *)next;
+				next += bytes;
+				obj->tag = tag;
+				return obj;
+			}
+
+			char *next;
+		};
+
+		static size_t frame_bytes(int bindings)
+		{
+			return ENV_BYTES + 2 * bindings * PAIR_BYTES;
+		}
+
+		// A binding is sym, (sym) or (sym init).
+		static Object *binding_symbol(Object *binding, Object *&init, const char *name)
+		{
+			init = NULL;
+			if (binding->IsAtomSubtype(AT_SYMBOL))
+				return binding;
+			int length = binding->tag == T_CELL ? Evaluator::list_length(binding) : 0;
+			if (length < 1 || length > 2 || !binding->car->IsAtomSubtype(AT_SYMBOL))
+				error("Malformed %s binding", name);
+			if (length == 2)
+				init = binding->cdr->car;
+			return binding->car;
+		}
+
+		// let evaluates every init form before binding any variable; let* binds each
+		// one before evaluating the next. A special variable is bound dynamically, as
+		// dynamic-let would, for as long as the body runs.
+		static Object *bind_variables(Object *env, Object *list, bool sequential, const char *name)
+		{
+			if (list->tag != T_CELL || !Evaluator::is_list(list->car))
+				error("Malformed %s", name);
+			int count = Evaluator::list_length(list->car);
+
+			void *memory = NULL;
+			if (count <= MAX_STACK_BINDINGS && !escapes(env, list))
+				memory = alloca(frame_bytes(count));
+			Frame frame(env, memory);
+
+			std::optional<Specials::Scope> scope;
+			Object *specials = Nil;
+			for (Object *p = list->car; p != Nil; p = p->cdr) {
+				Object *init;
+				Object *sym = binding_symbol(p->car, init, name);
+				Object *value = init ? Evaluator::eval(sequential ? frame.env : env, init) : Nil;
+				if (!sym->special_index)
+					frame.bind(sym, value);
+				else if (!sequential)
+					specials = frame.cons(frame.cons(sym, value), specials);
+				else {
+					if (!scope)
+						scope.emplace();
+					Specials::bind(sym, value);
+				}
+			}
+			if (specials != Nil) {
+				scope.emplace();
+				for (Object *p = specials; p != Nil; p = p->cdr)
+					Specials::bind(p->car->car, p->car->cdr);
+			}
+			return Evaluator::progn(frame.env, list->cdr);
+		}
+
+		// flet's functions are closed over the environment outside it; labels' are
+		// closed over the new frame, so they can call each other, and so it is always
+		// on the heap.
+		static Object *bind_functions(Object *env, Object *list, bool recursive, const char *name)
+		{
+			if (list->tag != T_CELL || !Evaluator::is_list(list->car))
+				error("Malformed %s", name);
+			int count = Evaluator::list_length(list->car);
+
+			void *memory = NULL;
+			if (!recursive && count <= MAX_STACK_BINDINGS && !escapes(env, list))
+				memory = alloca(frame_bytes(count));
+			Frame frame(env, memory);
+
+			for (Object *p = list->car; p != Nil; p = p->cdr) {
+				Object *definition = p->car;
+				if (definition->tag != T_CELL || !definition->car->IsAtomSubtype(AT_SYMBOL))
+					error("Malformed %s definition", name);
+				Object *sym = definition->car;
+				if (sym->special_index)
+					error("%s: %s is a special variable", name, sym->name);
+				Object *fn = Evaluator::handle_function(recursive ? frame.env : env, definition->cdr, T_FUNCTION);
+				fn->fn_name = sym;
+				frame.bind(sym, fn);
+			}
+			return Evaluator::progn(frame.env, list->cdr);
+		}
+
+		// (let ((<symbol> expr) ...) expr ...)
+		DECLARE_PRIMITIVE_FN(LetForm)
+		{
+			return bind_variables(env, list, false, "let");
+		}
+
+		// (let* ((<symbol> expr) ...) expr ...)
+		DECLARE_PRIMITIVE_FN(LetStar)
+		{
+			return bind_variables(env, list, true, "let*");
+		}
+
+		// (flet ((<symbol> (<symbol> ...) expr ...) ...) expr ...)
+		DECLARE_PRIMITIVE_FN(Flet)
+		{
+			return bind_functions(env, list, false, "flet");
+		}
+
+		// (labels ((<symbol> (<symbol> ...) expr ...) ...) expr ...)
+		DECLARE_PRIMITIVE_FN(Labels)
+		{
+			return bind_functions(env, list, true, "labels");
+		}
+
+		void create_primitives(Object *env)
+		{
+			Primitives::add_primitive(env, "let", LetForm);
+			Primitives::add_primitive(env, "let*", LetStar);
+			Primitives::add_primitive(env, "flet", Flet);
+			Primitives::add_primitive(env, "labels", Labels);
+
+			// Every environment gets the same primitives, so the first one will do.
+			std::call_once(capturing_found, [env] {
+				for (const char *name : capturing_names) {
+					Object *bind = Evaluator::find(env, Object::intern(name));
+					if (bind && bind->cdr->tag == T_PRIMITIVE)
+						capturing.push_back(bind->cdr->fn);
+				}
+			});
+		}
+	};
+};
@@ -0,0 +1,41 @@
+#pragma once
+
+#include "PolyScript.h"
+
+#include <atomic>
+
+namespace PolyScript
+{
+	// let, let*, flet and labels. A frame that nothing in the form looks likely to
+	// capture, through a lambda, a macro or a primitive that keeps its environment
+	// such as future, is built on the C stack instead of the heap, so binding a
+	// local in code that makes no closures allocates nothing. The guess can be
+	// wrong, since what a form calls may change while it runs, so whatever keeps an
+	// environment keeps heap_env of it, which moves stack frames to the heap.
+	namespace Let
+	{
+		// Bumped whenever a macro or primitive is stored in a variable, since that can
+		// change whether a form captures its frame.
+		inline std::atomic<uint64_t> definitions(0);
+
+		inline void note_definition(Object *value)
+		{
+			if (value->tag == T_MACRO || value->tag == T_PRIMITIVE)
+				definitions.fetch_add(1, std::memory_order_relaxed);
+		}
+
+		// Whether evaluating form in env looks likely to keep a reference to a frame
+		// pushed on env after evaluation has finished.
+		bool escapes(Object *env, Object *form);
+
+		// Returns env, or if it has frames on the C stack, a copy with those frames on
+		// the heap. Each stack frame is left sharing its copy's bindings, so that
+		// setq and define on either side are seen by both. The frames are changed in
+		// place, so this is called on the thread whose stack they are on, before env
+		// is handed to any other thread.
+		Object *heap_env(Object *env);
+
+		// Add let, let*, flet and labels to the environment.
+		void create_primitives(Object *env);
+	};
+};
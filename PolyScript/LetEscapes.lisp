@@ -0,0 +1,30 @@
+; Closures made by let bodies that don't look like they make closures. let puts
+; such a frame on the C stack, so each closure here has to be moved to the heap
+; when it is made. Run with polyscript < LetEscapes.lisp; every line prints 42.
+
+(defun clobber () (let ((a 1) (b 2) (c 3) (d 4)) (list a b c d)))
+
+; lambda reached through a special variable.
+(defvar *make-fn* lambda)
+(define special-head (let ((x 41)) (*make-fn* (y) (plus x y))))
+(clobber)
+(println (special-head 1))
+
+; lambda reached through an operator computed at run time.
+(defun get-lambda () lambda)
+(define computed-head (let ((x 41)) ((get-lambda) (y) (plus x y))))
+(clobber)
+(println (computed-head 1))
+
+; The same form, first run with a number in f and then with lambda.
+(defun g (f) (let ((x 41)) (if (numberp f) x (f (y) (plus x y)))))
+(g 1)
+(define rebound-local (g lambda))
+(clobber)
+(println (rebound-local 1))
+
+; The frame and its copy share their bindings.
+(define counter (let ((n 0)) (define bump (*make-fn* () (setq n (plus n 1)))) (setq n 40) (bump) (list bump (*make-fn* () n))))
+(clobber)
+((car counter))
+(println ((car (cdr counter))))
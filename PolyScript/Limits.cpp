@@ -0,0 +1,135 @@
+#include "stdafx.h"
+#include "Limits.h"
+#include "Evaluator.h"
+#include "Primitives.h"
+
+#include <algorithm>
+
+// Fuel is handed out to countdown in batches, so that step is one decrement and
+// compare; checkpoint runs when a batch is used up. Without a deadline a batch is
+// all the fuel there is, so a thread without limits never gets to checkpoint. With
+// one, batches are CHECK_INTERVAL forms, which is how often the clock is read. A
+// limit that has been exceeded stays exceeded until its scope ends, so a script
+// that catches the error some other way fails again at its next step.
+
+namespace PolyScript
+{
+	namespace Limits
+	{
+		typedef std::chrono::steady_clock Clock;
+
+		// Fuel for a thread without limits, far more than can ever be used.
+		static const int64_t UNLIMITED = INT64_MAX / 2;
+
+		static thread_local State state = { UNLIMITED, false, Clock::time_point() };
+
+		void checkpoint()
+		{
+			// The form being stepped has used up the batch, and hasn't been charged.
+			countdown = 0;
+			if (state.fuel_left == 0)
+				throw LimitExceeded("Evaluation ran out of fuel", LIMIT_FUEL);
+			check_deadline();
+
+			int64_t batch = state.has_deadline ? std::min(state.fuel_left, CHECK_INTERVAL) : state.fuel_left;
+			state.fuel_left -= batch;
+			countdown = batch - 1;
+		}
+
+		bool deadline(Clock::time_point &when)
+		{
+			when = state.deadline;
+			return state.has_deadline;
+		}
+
+		void check_deadline()
+		{
+			if (state.has_deadline && Clock::now() >= state.deadline)
+				throw LimitExceeded("Evaluation passed its deadline", LIMIT_DEADLINE);
+		}
+
+		void heap_exceeded()
+		{
+			throw LimitExceeded("Evaluation allocated more than its heap quota", LIMIT_HEAP);
+		}
+
+		void depth_exceeded()
+		{
+			depth--;
+			throw LimitExceeded("Calls nested deeper than the depth limit", LIMIT_DEPTH);
+		}
+
+		Scope::Scope(const Settings &settings)
+			: saved(state), saved_fuel(state.fuel_left + countdown), saved_max_depth(max_depth), saved_allocation_limit(allocation_limit)
+		{
+			fuel = saved_fuel;
+			if (settings.fuel && (int64_t)settings.fuel < fuel)
+				fuel = (int64_t)settings.fuel;
+			state.fuel_left = fuel;
+			countdown = 0;
+
+			if (settings.deadline_ms) {
+				Clock::time_point deadline = Clock::now() + std::chrono::milliseconds(settings.deadline_ms);
+				if (!state.has_deadline || deadline < state.deadline)
+					state.deadline = deadline;
+				state.has_deadline = true;
+			}
+			if (settings.depth && depth + settings.depth < max_depth)
+				max_depth = depth + settings.depth;
+			if (settings.heap_bytes && settings.heap_bytes < allocation_limit - allocation_bytes)
+				allocation_limit = allocation_bytes + settings.heap_bytes;
+			scopes++;
+		}
+
+		Scope::~Scope()
+		{
+			int64_t used = fuel - (state.fuel_left + std::max<int64_t>(countdown, 0));
+			state = saved;
+			state.fuel_left = saved_fuel - used;
+			countdown = 0;
+			max_depth = saved_max_depth;
+			allocation_limit = saved_allocation_limit;
+			scopes--;
+		}
+
+		static uint64_t setting(Object *value, const char *keyword)
+		{
+			if (!value->IsAtomSubtype(AT_INT) || value->int_value < 0)
+				error("with-limits: %s must be a non-negative integer", keyword);
+			return (uint64_t)value->int_value;
+		}
+
+		// (with-limits (:fuel n :heap bytes :depth n :deadline ms) body ...) evaluates
+		// body under the limits given. Any that are left out or zero don't apply.
+		DECLARE_PRIMITIVE_FN(WithLimits)
+		{
+			if (list == Nil || !Evaluator::is_list(list->car))
+				error("Malformed with-limits");
+
+			Settings settings = { 0, 0, 0, 0 };
+			for (Object *p = list->car; p != Nil; p = p->cdr->cdr) {
+				if (p->cdr == Nil)
+					error("with-limits: a keyword has no value");
+				Object *value = Evaluator::eval(env, p->cdr->car);
+				if (p->car == Object::intern(":fuel"))
+					settings.fuel = setting(value, ":fuel");
+				else if (p->car == Object::intern(":heap"))
+					settings.heap_bytes = setting(value, ":heap");
+				else if (p->car == Object::intern(":depth"))
+					settings.depth = (int)setting(value, ":depth");
+				else if (p->car == Object::intern(":deadline"))
+					settings.deadline_ms = (int)setting(value, ":deadline");
+				else
+					error("with-limits: unknown keyword; expected :fuel, :heap, :depth or :deadline");
+			}
+
+			Scope scope(settings);
+			return Evaluator::progn(env, list->cdr);
+		}
+
+		void create_primitives(Object *env)
+		{
+			Primitives::add_primitive(env, "with-limits", WithLimits);
+		}
+	};
+};
@@ -0,0 +1,122 @@
+#pragma once
+
+#include "PolyScript.h"
+
+#include <chrono>
+
+namespace PolyScript
+{
+	// Limits on an evaluation, so that a runaway script fails with a LimitExceeded
+	// instead of holding its thread: the forms it may evaluate (its fuel), the bytes
+	// it may allocate, how deep its calls may nest and when it must be done by. They
+	// belong to the thread that sets them, so while they are in force, futures and
+	// tasks are refused and the parallel primitives run on that thread.
+	namespace Limits
+	{
+		// Zero means no limit.
+		struct Settings
+		{
+			// Forms evaluated, counting every variable and constant.
+			uint64_t fuel;
+
+			// Bytes allocated.
+			uint64_t heap_bytes;
+
+			// PolyScript function calls nested inside one another.
+			int depth;
+
+			// Milliseconds of wall time.
+			int deadline_ms;
+		};
+
+		// The clock is read once every this many forms while there is a deadline.
+		static const int64_t CHECK_INTERVAL = 1024;
+
+		// The limits in force on this thread.
+		struct State
+		{
+			// Fuel not yet handed to countdown.
+			int64_t fuel_left;
+
+			bool has_deadline;
+			std::chrono::steady_clock::time_point deadline;
+		};
+
+		// Forms that can be evaluated before checkpoint has to look at the limits.
+		// These are defined here, rather than declared extern, so that the compiler
+		// can see they need no dynamic initialization and step stays a decrement.
+		inline thread_local int64_t countdown = 0;
+
+		inline thread_local int depth = 0;
+		inline thread_local int max_depth = INT32_MAX;
+
+		// Charges the fuel, reads the clock and sets the next countdown. Raises a
+		// LimitExceeded if the fuel has run out or the deadline has passed.
+		void checkpoint();
+
+		// Called for every form evaluated.
+		inline void step()
+		{
+			if (--countdown < 0)
+				checkpoint();
+		}
+
+		[[noreturn]] void depth_exceeded();
+
+		// Counts a PolyScript function call for as long as it runs.
+		class DepthGuard
+		{
+		public:
+			DepthGuard()
+			{
+				if (++depth > max_depth)
+					depth_exceeded();
+			}
+
+			~DepthGuard() { depth--; }
+
+			DepthGuard(const DepthGuard &) = delete;
+			DepthGuard &operator=(const DepthGuard &) = delete;
+		};
+
+		// Scopes open on this thread. Limits don't follow work to other threads, so
+		// while one is open, work that would run elsewhere is kept on this thread or
+		// refused.
+		inline thread_local int scopes = 0;
+
+		inline bool active()
+		{
+			return scopes > 0;
+		}
+
+		// The deadline in force on this thread, if there is one.
+		bool deadline(std::chrono::steady_clock::time_point &when);
+
+		// Raises a LimitExceeded if the deadline has passed. For code that waits, and
+		// so evaluates no forms that would notice.
+		void check_deadline();
+
+		// Puts limits in force on this thread for as long as it exists. Scopes nest,
+		// and an inner scope can only tighten the limits of the one around it; the
+		// fuel it uses is charged to the outer one too.
+		class Scope
+		{
+		public:
+			explicit Scope(const Settings &settings);
+			~Scope();
+
+			Scope(const Scope &) = delete;
+			Scope &operator=(const Scope &) = delete;
+
+		private:
+			State saved;
+			int64_t saved_fuel;
+			int64_t fuel;
+			int saved_max_depth;
+			uint64_t saved_allocation_limit;
+		};
+
+		// Add with-limits to the environment.
+		void create_primitives(Object *env);
+	};
+};
@@ -0,0 +1,210 @@
+#include "stdafx.h"
+#include "Loader.h"
+#include "Evaluator.h"
+#include "Map.h"
+#include "Parser.h"
+
+#include <atomic>
+#include <thread>
+#include <unordered_map>
+
+namespace PolyScript
+{
+	namespace Loader
+	{
+		// The result of reading one file on a worker thread.
+		struct ParsedFile {
+			std::vector<Object *> forms;
+
+			// Symbols that were not in obarray yet when the file was read.
+			Object *symbols;
+
+			bool ok;
+		};
+
+		bool read_file(const char *path, std::string &contents)
+		{
+			FILE *f = fopen(path, "rb");
+			if (!f)
+				return false;
+
+			fseek(f, 0, SEEK_END);
+			long size = ftell(f);
+			fseek(f, 0, SEEK_SET);
+
+			contents.resize(size > 0 ? size : 0);
+			size_t read = fread(&contents[0], 1, contents.size(), f);
+			fclose(f);
+
+			contents.resize(read);
+			return true;
+		}
+
+		void load_file(Object *env, const char *path)
+		{
+			std::string contents;
+			if (!read_file(path, contents))
+				error("Cannot open file: %s", path);
+
+			Parser::InputScope input(contents.data(), contents.data() + contents.size());
+
+			Object *form;
+			while ((form = Parser::read()) != NULL)
+				Evaluator::eval(env, form);
+		}
+
+		// Runs on a worker thread, which has already installed its arena.
+		// Errors are reported here, since they cannot unwind into the calling thread.
+		static void parse_file(const std::string &path, ParsedFile &file)
+		{
+			private_obarray = &file.symbols;
+
+			try
+			{
+				std::string contents;
+				if (!read_file(path.c_str(), contents))
+					error("Cannot open file: %s", path.c_str());
+
+				Parser::set_input(contents.data(), contents.data() + contents.size());
+
+				Object *form;
+				while ((form = Parser::read()) != NULL)
+					file.forms.push_back(form);
+
+				file.ok = true;
+			}
+			catch (Error &e)
+			{
+				fprintf(stderr, "%s: %s\n", path.c_str(), e.message.c_str());
+			}
+
+			private_obarray = NULL;
+		}
+
+		// Moves a file's private symbols into obarray. Where another file or the
+		// interpreter already has a symbol of the same name, the file's forms are
+		// rewritten to refer to that one instead.
+		static void intern_symbols(ParsedFile &file)
+		{
+			std::unordered_map<Object *, Object *> renamed;
+
+			{
+				std::lock_guard<std::mutex> guard(obarray_lock);
+				Object *table = obarray.load(std::memory_order_relaxed);
+				for (Object *p = file.symbols; p != Nil; p = p->cdr) {
+					Object *sym = p->car;
+					Object *shared = Object::find_symbol(table, sym->name, strlen(sym->name));
+					if (shared)
+						renamed[sym] = shared;
+					else
+						table = Object::cons(sym, table);
+				}
+				obarray.store(table, std::memory_order_release);
+			}
+
+			if (renamed.empty())
+				return;
+
+			// Walk the forms with an explicit stack; data files can nest deeply.
+			std::vector<Object **> pending;
+			for (Object *&form : file.forms)
+				pending.push_back(&form);
+
+			// A map is hashed by its keys, so renaming a key in place would leave it in
+			// the wrong slot. Its entries are walked as a vector instead, and the map is
+			// built again from that once they are renamed.
+			std::vector<std::pair<Object **, Object *>> maps;
+
+			while (!pending.empty()) {
+				Object **slot = pending.back();
+				pending.pop_back();
+
+				Object *obj = *slot;
+				if (obj->tag == T_CELL) {
+					pending.push_back(&obj->car);
+					pending.push_back(&obj->cdr);
+				}
+				else if (obj->tag == T_VECTOR && obj->vector_type == VT_GENERIC) {
+					for (size_t i = 0; i < obj->length; i++)
+						pending.push_back(&obj->generic_elements()[i]);
+				}
+				else if (obj->tag == T_MAP) {
+					Object *entries = Map::flatten(obj);
+					maps.push_back(std::make_pair(slot, entries));
+					for (size_t i = 0; i < entries->length; i++)
+						pending.push_back(&entries->generic_elements()[i]);
+				}
+				else if (obj->tag == T_ATOM && obj->atom_subtype == AT_SYMBOL) {
+					auto it = renamed.find(obj);
+					if (it != renamed.end())
+						*slot = it->second;
+				}
+			}
+
+			// Inner maps were found after the maps that hold them, so rebuild those first.
+			for (auto it = maps.rbegin(); it != maps.rend(); ++it) {
+				Object *entries = it->second;
+				Object *map = Map::transient(Map::make((*it->first)->map_test));
+				for (size_t i = 0; i < entries->length; i += 2)
+					Map::assoc(map, entries->generic_elements()[i], entries->generic_elements()[i + 1]);
+				*it->first = Map::persistent(map);
+			}
+		}
+
+		void load_files(Object *env, const std::vector<std::string> &paths, unsigned threads)
+		{
+			std::vector<ParsedFile> files(paths.size());
+			for (ParsedFile &file : files) {
+				file.symbols = Nil;
+				file.ok = false;
+			}
+
+			if (threads == 0)
+				threads = std::thread::hardware_concurrency();
+			if (threads > paths.size())
+				threads = (unsigned)paths.size();
+			if (threads == 0)
+				threads = 1;
+
+			// Parse phase: the workers put new symbols in their files' own tables,
+			// so they only ever search obarray, which needs no lock.
+			std::atomic<size_t> next_file(0);
+			std::vector<std::thread> workers;
+
+			for (unsigned i = 0; i < threads; i++) {
+				workers.emplace_back([&]() {
+					Arena arena;
+					current_arena = &arena;
+
+					for (;;) {
+						size_t n = next_file++;
+						if (n >= paths.size())
+							break;
+						parse_file(paths[n], files[n]);
+					}
+
+					current_arena = NULL;
+				});
+			}
+
+			for (std::thread &worker : workers)
+				worker.join();
+
+			int failed = 0;
+			for (ParsedFile &file : files)
+				if (!file.ok)
+					failed++;
+
+			if (failed)
+				error("load-parallel: %d of %d files could not be read", failed, (int)files.size());
+
+			// Everything from here on runs on the calling thread, in the order the files were given.
+			for (ParsedFile &file : files)
+				intern_symbols(file);
+
+			for (ParsedFile &file : files)
+				for (Object *form : file.forms)
+					Evaluator::eval(env, form);
+		}
+	};
+};
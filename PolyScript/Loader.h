@@ -0,0 +1,26 @@
+#pragma once
+
+#include "PolyScript.h"
+
+#include <string>
+#include <vector>
+
+namespace PolyScript
+{
+	namespace Loader
+	{
+		// Reads a whole file into memory. Returns false if it cannot be read.
+		bool read_file(const char *path, std::string &contents);
+
+		// Reads and evaluates every top-level form of a file in env.
+		void load_file(Object *env, const char *path);
+
+		// Loads many independent files. The files are read and parsed concurrently,
+		// each on its own thread with its own arena and private symbol table; the
+		// symbols are then interned into obarray and the top-level forms evaluated
+		// in env on the calling thread, in the order the paths are given.
+		// Nothing is evaluated if any file cannot be read or parsed.
+		// threads == 0 uses one thread per core.
+		void load_files(Object *env, const std::vector<std::string> &paths, unsigned threads = 0);
+	};
+};
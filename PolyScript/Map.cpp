@@ -0,0 +1,518 @@
+#include "stdafx.h"
+#include "Map.h"
+#include "HashTable.h"
+#include "Primitives.h"
+
+#include <atomic>
+
+namespace PolyScript
+{
+	// One slot of a trie node: either a key and its value, or a child node.
+	struct MapEntry {
+		// NULL if this slot holds a child node.
+		Object *key;
+		union {
+			Object *value;
+			MapNode *child;
+		};
+		uint32_t hash;
+	};
+
+	// A trie node. Each level of the trie uses the next five bits of the key's hash.
+	// Keys whose hashes are identical end up together in a collision node.
+	struct MapNode {
+		// The transient allowed to change this node in place, or 0 if none is.
+		uint64_t owner;
+		// Which of the 32 possible slots are present, in order. 0 for a collision node.
+		uint32_t bitmap;
+		uint32_t count;
+		MapEntry entries[1];
+	};
+
+	namespace Map
+	{
+		using Primitives::evaluate_arguments;
+
+		static const int BITS = 5;
+
+		// Identifies transients. 0 is never used, so nodes of persistent maps are never changed.
+		static std::atomic<uint64_t> next_owner(1);
+
+		static uint32_t popcount(uint32_t x)
+		{
+			x = x - ((x >> 1) & 0x55555555);
+			x = (x & 0x33333333) + ((x >> 2) & 0x33333333);
+			return (((x + (x >> 4)) & 0x0f0f0f0f) * 0x01010101) >> 24;
+		}
+
+		static MapNode *new_node(uint64_t owner, uint32_t bitmap, uint32_t count)
+		{
+			MapNode *node = (MapNode *)Object::allocate(offsetof(MapNode, entries) + count * sizeof(MapEntry));
+			node->owner = owner;
+			node->bitmap = bitmap;
+			node->count = count;
+			return node;
+		}
+
+		// Returns node itself if owner may change it in place, or else an owned copy.
+		static MapNode *editable(MapNode *node, uint64_t owner)
+		{
+			if (owner && node->owner == owner)
+				return node;
+			MapNode *copy = new_node(owner, node->bitmap, node->count);
+			memcpy(copy->entries, node->entries, node->count * sizeof(MapEntry));
+			return copy;
+		}
+
+		// Returns a copy of node with entry inserted at index i.
+		static MapNode *insert_entry(MapNode *node, uint64_t owner, uint32_t bitmap, uint32_t i, const MapEntry &entry)
+		{
+			MapNode *copy = new_node(owner, bitmap, node->count + 1);
+			memcpy(copy->entries, node->entries, i * sizeof(MapEntry));
+			copy->entries[i] = entry;
+			memcpy(copy->entries + i + 1, node->entries + i, (node->count - i) * sizeof(MapEntry));
+			return copy;
+		}
+
+		// Returns a copy of node without the entry at index i, or NULL if that was the last one.
+		static MapNode *remove_entry(MapNode *node, uint64_t owner, uint32_t bitmap, uint32_t i)
+		{
+			if (node->count == 1)
+				return NULL;
+			MapNode *copy = new_node(owner, bitmap, node->count - 1);
+			memcpy(copy->entries, node->entries, i * sizeof(MapEntry));
+			memcpy(copy->entries + i, node->entries + i + 1, (node->count - i - 1) * sizeof(MapEntry));
+			return copy;
+		}
+
+		static uint32_t slot_bit(uint32_t hash, int shift)
+		{
+			return 1u << ((hash >> shift) & 31);
+		}
+
+		// Builds the subtrie holding two entries whose hashes agree below shift.
+		static MapNode *make_pair(int shift, const MapEntry &a, const MapEntry &b, uint64_t owner)
+		{
+			if (shift >= 32) {
+				MapNode *node = new_node(owner, 0, 2);
+				node->entries[0] = a;
+				node->entries[1] = b;
+				return node;
+			}
+
+			uint32_t bit_a = slot_bit(a.hash, shift);
+			uint32_t bit_b = slot_bit(b.hash, shift);
+			if (bit_a == bit_b) {
+				MapNode *node = new_node(owner, bit_a, 1);
+				node->entries[0].key = NULL;
+				node->entries[0].child = make_pair(shift + BITS, a, b, owner);
+				return node;
+			}
+
+			MapNode *node = new_node(owner, bit_a | bit_b, 2);
+			node->entries[bit_a < bit_b ? 0 : 1] = a;
+			node->entries[bit_a < bit_b ? 1 : 0] = b;
+			return node;
+		}
+
+		static MapNode *node_assoc(MapNode *node, int shift, const MapEntry &entry, HashTest test, uint64_t owner, bool &added)
+		{
+			if (!node) {
+				added = true;
+				node = new_node(owner, slot_bit(entry.hash, shift), 1);
+				node->entries[0] = entry;
+				return node;
+			}
+
+			if (node->bitmap == 0) {
+				// A collision node. Only keys with this exact hash can reach it.
+				for (uint32_t i = 0; i < node->count; i++) {
+					if (HashTable::keys_match(test, node->entries[i].key, entry.key)) {
+						if (node->entries[i].value == entry.value)
+							return node;
+						node = editable(node, owner);
+						node->entries[i].value = entry.value;
+						return node;
+					}
+				}
+				added = true;
+				return insert_entry(node, owner, 0, node->count, entry);
+			}
+
+			uint32_t bit = slot_bit(entry.hash, shift);
+			uint32_t i = popcount(node->bitmap & (bit - 1));
+			if (!(node->bitmap & bit)) {
+				added = true;
+				return insert_entry(node, owner, node->bitmap | bit, i, entry);
+			}
+
+			MapEntry &slot = node->entries[i];
+			if (!slot.key) {
+				MapNode *child = node_assoc(slot.child, shift + BITS, entry, test, owner, added);
+				if (child == slot.child)
+					return node;
+				node = editable(node, owner);
+				node->entries[i].child = child;
+				return node;
+			}
+
+			if (slot.hash == entry.hash && HashTable::keys_match(test, slot.key, entry.key)) {
+				if (slot.value == entry.value)
+					return node;
+				node = editable(node, owner);
+				node->entries[i].value = entry.value;
+				return node;
+			}
+
+			// Two different keys want this slot: push both down a level.
+			added = true;
+			MapNode *child = make_pair(shift + BITS, slot, entry, owner);
+			node = editable(node, owner);
+			node->entries[i].key = NULL;
+			node->entries[i].child = child;
+			return node;
+		}
+
+		static MapNode *node_dissoc(MapNode *node, int shift, Object *key, uint32_t hash, HashTest test, uint64_t owner, bool &removed)
+		{
+			if (node->bitmap == 0) {
+				for (uint32_t i = 0; i < node->count; i++) {
+					if (HashTable::keys_match(test, node->entries[i].key, key)) {
+						removed = true;
+						return remove_entry(node, owner, 0, i);
+					}
+				}
+				return node;
+			}
+
+			uint32_t bit = slot_bit(hash, shift);
+			if (!(node->bitmap & bit))
+				return node;
+
+			uint32_t i = popcount(node->bitmap & (bit - 1));
+			MapEntry &slot = node->entries[i];
+			if (!slot.key) {
+				MapNode *child = node_dissoc(slot.child, shift + BITS, key, hash, test, owner, removed);
+				if (child == slot.child)
+					return node;
+				if (!child)
+					return remove_entry(node, owner, node->bitmap & ~bit, i);
+
+				node = editable(node, owner);
+				if (child->count == 1 && child->entries[0].key)
+					// A lone key needs no node of its own; keep it here instead.
+					node->entries[i] = child->entries[0];
+				else
+					node->entries[i].child = child;
+				return node;
+			}
+
+			if (slot.hash != hash || !HashTable::keys_match(test, slot.key, key))
+				return node;
+			removed = true;
+			return remove_entry(node, owner, node->bitmap & ~bit, i);
+		}
+
+		static bool node_for_each(MapNode *node, EntryFn *fn, void *data)
+		{
+			for (uint32_t i = 0; i < node->count; i++) {
+				MapEntry &entry = node->entries[i];
+				if (entry.key ? !fn(entry.key, entry.value, data) : !node_for_each(entry.child, fn, data))
+					return false;
+			}
+			return true;
+		}
+
+		Object *make(HashTest test)
+		{
+			return Object::MakeMap(test, NULL, 0, 0);
+		}
+
+		Object *lookup(Object *map, Object *key)
+		{
+			uint32_t hash = HashTable::hash(map->map_test, key);
+			MapNode *node = map->map_root;
+
+			for (int shift = 0; node; shift += BITS) {
+				if (node->bitmap == 0) {
+					for (uint32_t i = 0; i < node->count; i++)
+						if (HashTable::keys_match(map->map_test, node->entries[i].key, key))
+							return node->entries[i].value;
+					return NULL;
+				}
+
+				uint32_t bit = slot_bit(hash, shift);
+				if (!(node->bitmap & bit))
+					return NULL;
+
+				MapEntry &slot = node->entries[popcount(node->bitmap & (bit - 1))];
+				if (!slot.key)
+					node = slot.child;
+				else if (slot.hash == hash && HashTable::keys_match(map->map_test, slot.key, key))
+					return slot.value;
+				else
+					return NULL;
+			}
+			return NULL;
+		}
+
+		Object *assoc(Object *map, Object *key, Object *value)
+		{
+			MapEntry entry;
+			entry.key = key;
+			entry.value = value;
+			entry.hash = HashTable::hash(map->map_test, key);
+
+			bool added = false;
+			MapNode *root = node_assoc(map->map_root, 0, entry, map->map_test, map->map_owner, added);
+			if (map->map_owner) {
+				map->map_root = root;
+				map->map_count += added;
+				note_pointer_store();
+				return map;
+			}
+			if (root == map->map_root)
+				return map;
+			return Object::MakeMap(map->map_test, root, map->map_count + added, 0);
+		}
+
+		Object *dissoc(Object *map, Object *key)
+		{
+			if (!map->map_root)
+				return map;
+
+			bool removed = false;
+			uint32_t hash = HashTable::hash(map->map_test, key);
+			MapNode *root = node_dissoc(map->map_root, 0, key, hash, map->map_test, map->map_owner, removed);
+			if (map->map_owner) {
+				map->map_root = root;
+				map->map_count -= removed;
+				note_pointer_store();
+				return map;
+			}
+			if (!removed)
+				return map;
+			return Object::MakeMap(map->map_test, root, map->map_count - 1, 0);
+		}
+
+		Object *transient(Object *map)
+		{
+			return Object::MakeMap(map->map_test, map->map_root, map->map_count, next_owner++);
+		}
+
+		Object *persistent(Object *map)
+		{
+			map->map_owner = 0;
+			return map;
+		}
+
+		void for_each(Object *map, EntryFn *fn, void *data)
+		{
+			if (map->map_root)
+				node_for_each(map->map_root, fn, data);
+		}
+
+		Object *from_list(Object *list)
+		{
+			Object *map = transient(make(HT_EQUAL));
+			for (Object *p = list; p != Nil; p = p->cdr->cdr) {
+				if (p->cdr == Nil)
+					error("A map needs a value for every key");
+				assoc(map, p->car, p->cdr->car);
+			}
+			return persistent(map);
+		}
+
+		static bool add_to_vector(Object *key, Object *value, void *data)
+		{
+			Object ***next = (Object ***)data;
+			*(*next)++ = key;
+			*(*next)++ = value;
+			return true;
+		}
+
+		Object *flatten(Object *map)
+		{
+			Object *vector = Object::MakeVector(VT_GENERIC, map->map_count * 2);
+			Object **next = vector->generic_elements();
+			for_each(map, add_to_vector, &next);
+			return vector;
+		}
+
+		struct EqualCheck {
+			Object *other;
+			bool same;
+		};
+
+		static bool entry_in_other(Object *key, Object *value, void *data)
+		{
+			EqualCheck *check = (EqualCheck *)data;
+			Object *found = lookup(check->other, key);
+			check->same = found && HashTable::equal(found, value);
+			return check->same;
+		}
+
+		bool equal(Object *a, Object *b)
+		{
+			if (a->map_test != b->map_test || a->map_count != b->map_count)
+				return false;
+
+			// Every entry of a must be in b. With equal counts that makes them the same.
+			EqualCheck check = { b, true };
+			for_each(a, entry_in_other, &check);
+			return check.same;
+		}
+
+		static bool add_hash(Object *key, Object *value, void *data)
+		{
+			// Summing the entry hashes makes the result independent of their order.
+			uint32_t *sum = (uint32_t *)data;
+			*sum += HashTable::hash(HT_EQUAL, key) * 31 ^ HashTable::hash(HT_EQUAL, value);
+			return true;
+		}
+
+		uint32_t hash(Object *map)
+		{
+			uint32_t sum = map->map_count;
+			for_each(map, add_hash, &sum);
+			return sum;
+		}
+
+		// Accepts a persistent map, or a transient one when transient is true.
+		static Object *map_argument(Object *value, const char *name, bool transient = false)
+		{
+			if (value->tag != T_MAP)
+				error("%s: argument is not a map", name);
+			if (transient && !value->map_owner)
+				error("%s: map is not transient", name);
+			if (!transient && value->map_owner)
+				error("%s: map is transient; use the ! form", name);
+			return value;
+		}
+
+		// (make-map ['eq | 'equal])
+		DECLARE_PRIMITIVE_FN(MakeEmptyMap)
+		{
+			Object *args = evaluate_arguments(env, list, 0, 1, "make-map");
+			return make(args == Nil ? HT_EQUAL : HashTable::test_argument(args->car, "make-map"));
+		}
+
+		// (hash-map key value ...) builds an equal map.
+		DECLARE_PRIMITIVE_FN(HashMap)
+		{
+			return from_list(Evaluator::eval_list(env, list));
+		}
+
+		// (lookup map key [default]) works on transient maps too.
+		DECLARE_PRIMITIVE_FN(Lookup)
+		{
+			Object *args = evaluate_arguments(env, list, 2, 3, "lookup");
+			if (args->car->tag != T_MAP)
+				error("lookup: argument is not a map");
+			Object *value = lookup(args->car, args->cdr->car);
+			if (value)
+				return value;
+			return args->cdr->cdr != Nil ? args->cdr->cdr->car : Nil;
+		}
+
+		// (assoc map key value)
+		DECLARE_PRIMITIVE_FN(Assoc)
+		{
+			Object *args = evaluate_arguments(env, list, 3, 3, "assoc");
+			return assoc(map_argument(args->car, "assoc"), args->cdr->car, args->cdr->cdr->car);
+		}
+
+		// (dissoc map key)
+		DECLARE_PRIMITIVE_FN(Dissoc)
+		{
+			Object *args = evaluate_arguments(env, list, 2, 2, "dissoc");
+			return dissoc(map_argument(args->car, "dissoc"), args->cdr->car);
+		}
+
+		// (transient map)
+		DECLARE_PRIMITIVE_FN(Transient)
+		{
+			Object *args = evaluate_arguments(env, list, 1, 1, "transient");
+			return transient(map_argument(args->car, "transient"));
+		}
+
+		// (assoc! transient key value)
+		DECLARE_PRIMITIVE_FN(AssocInPlace)
+		{
+			Object *args = evaluate_arguments(env, list, 3, 3, "assoc!");
+			return assoc(map_argument(args->car, "assoc!", true), args->cdr->car, args->cdr->cdr->car);
+		}
+
+		// (dissoc! transient key)
+		DECLARE_PRIMITIVE_FN(DissocInPlace)
+		{
+			Object *args = evaluate_arguments(env, list, 2, 2, "dissoc!");
+			return dissoc(map_argument(args->car, "dissoc!", true), args->cdr->car);
+		}
+
+		// (persistent! transient)
+		DECLARE_PRIMITIVE_FN(Persistent)
+		{
+			Object *args = evaluate_arguments(env, list, 1, 1, "persistent!");
+			return persistent(map_argument(args->car, "persistent!", true));
+		}
+
+		// (map-count map)
+		DECLARE_PRIMITIVE_FN(MapCount)
+		{
+			Object *args = evaluate_arguments(env, list, 1, 1, "map-count");
+			if (args->car->tag != T_MAP)
+				error("map-count: argument is not a map");
+			return Object::MakeInt((int)args->car->map_count);
+		}
+
+		static bool add_to_alist(Object *key, Object *value, void *data)
+		{
+			Object **alist = (Object **)data;
+			*alist = Object::acons(key, value, *alist);
+			return true;
+		}
+
+		// (map->list map) returns the entries as an alist.
+		DECLARE_PRIMITIVE_FN(MapToList)
+		{
+			Object *args = evaluate_arguments(env, list, 1, 1, "map->list");
+			Object *alist = Nil;
+			for_each(map_argument(args->car, "map->list"), add_to_alist, &alist);
+			return alist;
+		}
+
+		// (map-for-each fn map) calls (fn key value) for every entry.
+		DECLARE_PRIMITIVE_FN(MapForEach)
+		{
+			Object *args = evaluate_arguments(env, list, 2, 2, "map-for-each");
+			Object *map = map_argument(args->cdr->car, "map-for-each");
+
+			// Walk a flat copy, so that fn can't disturb the iteration.
+			Object *entries = flatten(map);
+			for (size_t i = 0; i < entries->length; i += 2) {
+				Object *kv = Object::cons(entries->generic_elements()[i], Object::cons(entries->generic_elements()[i + 1], Nil));
+				Evaluator::funcall(env, args->car, kv);
+			}
+			return Nil;
+		}
+
+		void create_primitives(Object *env)
+		{
+			Primitives::add_primitive(env, "make-map", MakeEmptyMap);
+			Primitives::add_primitive(env, "hash-map", HashMap);
+			Primitives::add_primitive(env, "lookup", Lookup);
+			Primitives::add_primitive(env, "assoc", Assoc);
+			Primitives::add_primitive(env, "dissoc", Dissoc);
+			Primitives::add_primitive(env, "map-count", MapCount);
+			Primitives::add_primitive(env, "map->list", MapToList);
+			Primitives::add_primitive(env, "map-for-each", MapForEach);
+
+			// Transient maps, for building a map in bulk
+			Primitives::add_primitive(env, "transient", Transient);
+			Primitives::add_primitive(env, "assoc!", AssocInPlace);
+			Primitives::add_primitive(env, "dissoc!", DissocInPlace);
+			Primitives::add_primitive(env, "persistent!", Persistent);
+		}
+	};
+};
@@ -0,0 +1,53 @@
+#pragma once
+
+#include "PolyScript.h"
+
+namespace PolyScript
+{
+	// Persistent maps, stored as hash array mapped tries. Updating a map returns a
+	// new map that shares all but the changed path with the old one, so an update
+	// costs O(log32 n) rather than a copy of the whole map.
+	//
+	// A transient map is a private, editable copy for building a map in bulk. It
+	// changes the nodes it has created in place, and becomes an ordinary persistent
+	// map again with persistent().
+	namespace Map
+	{
+		Object *make(HashTest test);
+
+		// Returns the value stored under key, or NULL if there is none.
+		Object *lookup(Object *map, Object *key);
+
+		// Returns a map with key set to value. A transient map is changed in place
+		// and returned.
+		Object *assoc(Object *map, Object *key, Object *value);
+
+		// Returns a map without key. A transient map is changed in place and returned.
+		Object *dissoc(Object *map, Object *key);
+
+		// Returns a transient copy of a persistent map. This costs O(1).
+		Object *transient(Object *map);
+
+		// Freezes a transient map and returns it.
+		Object *persistent(Object *map);
+
+		// Calls fn for every entry until it returns false.
+		typedef bool EntryFn(Object *key, Object *value, void *data);
+		void for_each(Object *map, EntryFn *fn, void *data);
+
+		// Builds an equal map from a list of alternating keys and values.
+		Object *from_list(Object *list);
+
+		// Returns a generic vector of alternating keys and values.
+		Object *flatten(Object *map);
+
+		// Maps are equal when they have the same keys mapped to equal values.
+		bool equal(Object *a, Object *b);
+
+		// A hash of a map's contents that doesn't depend on their order.
+		uint32_t hash(Object *map);
+
+		// Add the map primitives to the environment.
+		void create_primitives(Object *env);
+	};
+};
@@ -0,0 +1,457 @@
+#include "stdafx.h"
+#include "Parallel.h"
+#include "Let.h"
+#include "Limits.h"
+#include "Sequence.h"
+#include "Primitives.h"
+
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+// Scheduling is work stealing with lazy binary splitting. A job starts as one range
+// in the calling thread's queue. A thread working through a range splits off the
+// upper half into its own queue whenever that queue is empty, which is when an idle
+// thread could be waiting to steal it; otherwise it just carries on. Cheap bodies
+// are therefore split only about log2(threads) deep, and expensive ones as finely
+// as the idle threads need.
+
+namespace PolyScript
+{
+	namespace Parallel
+	{
+		using Primitives::evaluate_arguments;
+
+		struct Range {
+			size_t begin;
+			size_t end;
+		};
+
+		// A thread's queue of ranges. The owner pushes and pops at the back, and
+		// thieves take from the front, where the biggest pieces are.
+		struct WorkQueue {
+			std::mutex lock;
+			std::deque<Range> ranges;
+			std::atomic<size_t> size;
+
+			WorkQueue() : size(0) {}
+
+			void push(const Range &range)
+			{
+				std::lock_guard<std::mutex> guard(lock);
+				ranges.push_back(range);
+				size = ranges.size();
+			}
+
+			bool pop(Range &range, bool steal)
+			{
+				if (size == 0)
+					return false;
+
+				std::lock_guard<std::mutex> guard(lock);
+				if (ranges.empty())
+					return false;
+				if (steal) {
+					range = ranges.front();
+					ranges.pop_front();
+				}
+				else {
+					range = ranges.back();
+					ranges.pop_back();
+				}
+				size = ranges.size();
+				return true;
+			}
+		};
+
+		struct Job {
+			RangeBody *body;
+			void *data;
+
+			// Indexes not yet done. The job is finished when this reaches zero.
+			std::atomic<size_t> remaining;
+
+			// Set by the first body to fail. The rest of the indexes are skipped.
+			std::atomic<bool> failed;
+			std::mutex error_lock;
+			std::string message;
+
+			// The limit the failure ran into, if it was a LimitExceeded.
+			LimitKind limit;
+
+			Job(size_t n, RangeBody *body, void *data) : body(body), data(data), remaining(n), failed(false), limit(LIMIT_NONE) {}
+
+			void fail(const char *text, LimitKind kind = LIMIT_NONE)
+			{
+				std::lock_guard<std::mutex> guard(error_lock);
+				if (!failed) {
+					message = text;
+					limit = kind;
+					failed = true;
+				}
+			}
+		};
+
+		// True on a pool thread, and on the calling thread while it works on a job.
+		static thread_local bool inside_job = false;
+
+		class Pool
+		{
+		public:
+			explicit Pool(unsigned threads);
+			~Pool();
+
+			unsigned size() const { return count; }
+
+			// Runs a job with the calling thread as worker 0.
+			void run(Job &job);
+
+		private:
+			void worker(unsigned index);
+			void work(Job &job, unsigned index);
+			void execute(Job &job, unsigned index, Range range);
+
+			unsigned count;
+			std::unique_ptr<WorkQueue[]> queues;
+			std::vector<std::thread> workers;
+
+			// Guards job, generation and stopping.
+			std::mutex lock;
+			std::condition_variable wake;
+			Job *job;
+			uint64_t generation;
+			bool stopping;
+
+			// Pool threads currently looking at a job.
+			std::atomic<unsigned> busy;
+		};
+
+		Pool::Pool(unsigned threads)
+			: count(threads), queues(new WorkQueue[threads]), job(NULL), generation(0), stopping(false), busy(0)
+		{
+			for (unsigned i = 1; i < threads; i++)
+				workers.emplace_back(&Pool::worker, this, i);
+		}
+
+		Pool::~Pool()
+		{
+			{
+				std::lock_guard<std::mutex> guard(lock);
+				stopping = true;
+			}
+			wake.notify_all();
+			for (std::thread &thread : workers)
+				thread.join();
+		}
+
+		void Pool::worker(unsigned index)
+		{
+			// The arena outlives the thread's use of it: objects are never freed.
+			Arena *arena = new Arena();
+			current_arena = arena;
+			inside_job = true;
+
+			uint64_t seen = 0;
+			for (;;) {
+				Job *current;
+				{
+					std::unique_lock<std::mutex> guard(lock);
+					wake.wait(guard, [&]() { return stopping || generation != seen; });
+					if (stopping)
+						break;
+					seen = generation;
+					current = job;
+					if (!current)
+						continue;
+					busy++;
+				}
+				work(*current, index);
+				busy--;
+			}
+
+			current_arena = NULL;
+		}
+
+		void Pool::work(Job &job, unsigned index)
+		{
+			Range range;
+			while (job.remaining > 0) {
+				bool found = queues[index].pop(range, false);
+				for (unsigned i = 1; !found && i < count; i++)
+					found = queues[(index + i) % count].pop(range, true);
+
+				if (found)
+					execute(job, index, range);
+				else
+					std::this_thread::yield();
+			}
+		}
+
+		void Pool::execute(Job &job, unsigned index, Range range)
+		{
+			WorkQueue &own = queues[index];
+			size_t done = 0;
+
+			while (range.begin < range.end) {
+				if (range.end - range.begin > 1 && own.size == 0) {
+					size_t middle = range.begin + (range.end - range.begin) / 2;
+					own.push({ middle, range.end });
+					range.end = middle;
+				}
+
+				size_t i = range.begin++;
+				done++;
+				if (job.failed)
+					continue;
+
+				try
+				{
+					job.body(i, i + 1, index, job.data);
+				}
+				catch (Throw &)
+				{
+					job.fail("throw to a catch outside a parallel function");
+				}
+				catch (LimitExceeded &e)
+				{
+					job.fail(e.what(), e.kind);
+				}
+				catch (std::exception &e)
+				{
+					job.fail(e.what());
+				}
+			}
+
+			job.remaining -= done;
+		}
+
+		void Pool::run(Job &job)
+		{
+			{
+				std::lock_guard<std::mutex> guard(lock);
+				queues[0].push({ 0, job.remaining });
+				this->job = &job;
+				generation++;
+			}
+			wake.notify_all();
+
+			inside_job = true;
+			work(job, 0);
+			inside_job = false;
+
+			// No pool thread can start on the job after this, and the ones already
+			// on it are only waiting to notice that it is finished.
+			{
+				std::lock_guard<std::mutex> guard(lock);
+				this->job = NULL;
+			}
+			while (busy > 0)
+				std::this_thread::yield();
+		}
+
+		static std::mutex pool_lock;
+		static Pool *pool = NULL;
+		static unsigned wanted_threads = 0;
+
+		static unsigned default_threads()
+		{
+			unsigned cores = std::thread::hardware_concurrency();
+			return cores ? cores : 1;
+		}
+
+		unsigned threads()
+		{
+			return wanted_threads ? wanted_threads : default_threads();
+		}
+
+		void set_threads(unsigned threads)
+		{
+			if (inside_job)
+				error("parallel-threads: cannot be changed by a parallel function");
+
+			std::lock_guard<std::mutex> guard(pool_lock);
+			delete pool;
+			pool = NULL;
+			wanted_threads = threads;
+		}
+
+		void run(size_t n, RangeBody *body, void *data)
+		{
+			if (n == 0)
+				return;
+			// Limits apply to the thread that set them, so limited work stays on it.
+			if (inside_job || threads() == 1 || Limits::active()) {
+				body(0, n, 0, data);
+				return;
+			}
+
+			// Jobs from different host threads take turns on the pool.
+			std::lock_guard<std::mutex> guard(pool_lock);
+			if (!pool)
+				pool = new Pool(threads());
+
+			Job job(n, body, data);
+			pool->run(job);
+			if (job.failed && job.limit != LIMIT_NONE)
+				throw LimitExceeded(job.message, job.limit);
+			if (job.failed)
+				error("%s", job.message.c_str());
+		}
+
+		// The elements of a list, vector or lazy sequence, read on the calling thread.
+		static std::vector<Object *> elements(Object *seq, const char *name)
+		{
+			std::vector<Object *> items;
+			Sequence::Iterator iterator(seq, name);
+			while (Object *element = iterator.next())
+				items.push_back(element);
+			return items;
+		}
+
+		struct MapJob {
+			Object *env;
+			Object *fn;
+			std::vector<Object *> items;
+			std::vector<Object *> results;
+		};
+
+		static void map_range(size_t begin, size_t end, unsigned, void *data)
+		{
+			MapJob *job = (MapJob *)data;
+			for (size_t i = begin; i < end; i++) {
+				ScratchScope scope;
+				job->results[i] = Sequence::keep(scope, Evaluator::funcall(job->env, job->fn, Object::cons(job->items[i], Nil)));
+			}
+		}
+
+		static void for_each_range(size_t begin, size_t end, unsigned, void *data)
+		{
+			MapJob *job = (MapJob *)data;
+			for (size_t i = begin; i < end; i++) {
+				ScratchScope scope;
+				Evaluator::funcall(job->env, job->fn, Object::cons(job->items[i], Nil));
+			}
+		}
+
+		// The fold of the consecutive elements from begin to end.
+		struct Partial {
+			size_t begin;
+			size_t end;
+			Object *value;
+		};
+
+		struct ReduceJob {
+			Object *env;
+			Object *fn;
+			Object *initial;
+			std::vector<Object *> items;
+
+			// Each worker's partial folds.
+			std::vector<std::vector<Partial> > partials;
+		};
+
+		static void reduce_range(size_t begin, size_t end, unsigned worker, void *data)
+		{
+			ReduceJob *job = (ReduceJob *)data;
+
+			// A worker carries on its last partial when given the indexes that follow it.
+			std::vector<Partial> &mine = job->partials[worker];
+			if (mine.empty() || mine.back().end != begin)
+				mine.push_back({ begin, begin, job->initial });
+
+			Partial &partial = mine.back();
+			for (size_t i = begin; i < end; i++) {
+				ScratchScope scope;
+				Object *value = Evaluator::funcall(job->env, job->fn, Object::cons(partial.value, Object::cons(job->items[i], Nil)));
+				partial.value = Sequence::keep(scope, value);
+			}
+			partial.end = end;
+		}
+
+		// (pmap fn sequence) is mapcar with the calls spread over the pool.
+		DECLARE_PRIMITIVE_FN(Pmap)
+		{
+			Object *args = evaluate_arguments(env, list, 2, 2, "pmap");
+
+			MapJob job;
+			job.env = Let::heap_env(env);
+			job.fn = args->car;
+			job.items = elements(args->cdr->car, "pmap");
+			job.results.resize(job.items.size());
+			run(job.items.size(), map_range, &job);
+
+			Object *result = Nil;
+			for (size_t i = job.results.size(); i > 0; i--)
+				result = Object::cons(job.results[i - 1], result);
+			return result;
+		}
+
+		// (pfor-each fn sequence) calls fn on every element for its effect, and
+		// returns nil. Only output is a safe effect; see Parallel.h.
+		DECLARE_PRIMITIVE_FN(PforEach)
+		{
+			Object *args = evaluate_arguments(env, list, 2, 2, "pfor-each");
+
+			MapJob job;
+			job.env = Let::heap_env(env);
+			job.fn = args->car;
+			job.items = elements(args->cdr->car, "pfor-each");
+			run(job.items.size(), for_each_range, &job);
+			return Nil;
+		}
+
+		// (preduce fn initial sequence) folds like reduce, but pieces of the sequence
+		// are folded on different threads and the results then folded in order. fn
+		// must be associative and initial an identity for it, as 0 is for plus.
+		DECLARE_PRIMITIVE_FN(Preduce)
+		{
+			Object *args = evaluate_arguments(env, list, 3, 3, "preduce");
+
+			ReduceJob job;
+			job.env = Let::heap_env(env);
+			job.fn = args->car;
+			job.initial = args->cdr->car;
+			job.items = elements(args->cdr->cdr->car, "preduce");
+			job.partials.resize(threads());
+			run(job.items.size(), reduce_range, &job);
+
+			std::vector<Partial> partials;
+			for (std::vector<Partial> &mine : job.partials)
+				partials.insert(partials.end(), mine.begin(), mine.end());
+			if (partials.empty())
+				return job.initial;
+
+			std::sort(partials.begin(), partials.end(), [](const Partial &a, const Partial &b) { return a.begin < b.begin; });
+			Object *result = partials[0].value;
+			for (size_t i = 1; i < partials.size(); i++)
+				result = Evaluator::funcall(env, job.fn, Object::cons(result, Object::cons(partials[i].value, Nil)));
+			return result;
+		}
+
+		// (parallel-threads [n]) returns the number of threads the parallel primitives
+		// use, after setting it to n if given. 0 means one per core.
+		DECLARE_PRIMITIVE_FN(ParallelThreads)
+		{
+			Object *args = evaluate_arguments(env, list, 0, 1, "parallel-threads");
+			if (args != Nil) {
+				if (!args->car->IsAtomSubtype(AT_INT) || args->car->int_value < 0)
+					error("parallel-threads: argument is not a thread count");
+				set_threads(args->car->int_value);
+			}
+			return Object::MakeInt((int)threads());
+		}
+
+		void create_primitives(Object *env)
+		{
+			Primitives::add_primitive(env, "pmap", Pmap);
+			Primitives::add_primitive(env, "preduce", Preduce);
+			Primitives::add_primitive(env, "pfor-each", PforEach);
+			Primitives::add_primitive(env, "parallel-threads", ParallelThreads);
+		}
+	};
+};
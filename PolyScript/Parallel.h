@@ -0,0 +1,37 @@
+#pragma once
+
+#include "PolyScript.h"
+
+namespace PolyScript
+{
+	// A pool of threads for the parallel primitives. Each thread has its own arena,
+	// so workers allocate without contending; what they return is read by the
+	// calling thread once the work is finished, and like every other object is
+	// never freed.
+	//
+	// Functions run in parallel must not change shared state: no setq or define of
+	// a global, no puthash on a table another call can see. Reading globals,
+	// calling other functions and building new objects are all fine.
+	namespace Parallel
+	{
+		// Called for a run of consecutive indexes, on the thread numbered worker.
+		// The calling thread is worker 0.
+		typedef void RangeBody(size_t begin, size_t end, unsigned worker, void *data);
+
+		// The number of threads used, counting the calling one.
+		unsigned threads();
+
+		// Sets the number of threads; 0 means one per core.
+		void set_threads(unsigned threads);
+
+		// Calls body over the indexes 0 to n - 1 across the pool and returns when all
+		// of them are done. The range is split in half only when a thread runs out of
+		// work, so a cheap body runs in a few long pieces. Raises an Error on the
+		// calling thread if body raised one anywhere. Runs everything on the calling
+		// thread when called from inside body.
+		void run(size_t n, RangeBody *body, void *data);
+
+		// Add pmap, preduce, pfor-each and parallel-threads to the environment.
+		void create_primitives(Object *env);
+	};
+};
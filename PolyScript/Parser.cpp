@@ -1,37 +1,112 @@
 #include "stdafx.h"
 #include "Parser.h"
+#include "Vector.h"
+#include "Map.h"
+
+#include <charconv>
+#include <limits>
 
 namespace PolyScript
 {
 	namespace Parser
 	{
-		wchar_t output_buffer[512];
+		// The span currently being read. Tokens are scanned in place and never copied
+		// into intermediate buffers.
+		thread_local const char *input_cur = NULL;
+		thread_local const char *input_end = NULL;
 
-		int peek()
+		// When reading from the console, whole lines are collected here until the
+		// parentheses balance, and the reader then works on the buffer like any other span.
+		thread_local bool input_is_console = true;
+		std::string console_buffer;
+
+		void set_input(const char *begin, const char *end)
 		{
-			if (PolyScript::evaluating_a_script)
-			{
-				return PolyScript::string_under_evaluation[PolyScript::string_pointer];
-			}
-			else 
-			{
-				int c = getchar();
-				ungetc(c, stdin);
-				return c;
-			}
+			input_is_console = false;
+			input_cur = begin;
+			input_end = end;
+		}
+
+		void set_console_input()
+		{
+			input_is_console = true;
+			discard_input();
+		}
+
+		void discard_input()
+		{
+			input_cur = input_end;
+		}
+
+		Input save_input()
+		{
+			Input input = { input_cur, input_end, input_is_console };
+			return input;
+		}
+
+		void restore_input(const Input &input)
+		{
+			input_cur = input.cur;
+			input_end = input.end;
+			input_is_console = input.console;
+		}
 
+		int peek()
+		{
+			if (input_cur == input_end)
+				return EOF;
+			return (unsigned char)*input_cur;
 		}
 
 		int get_next_char()
 		{
-			if (PolyScript::evaluating_a_script)
-			{
-				return PolyScript::string_under_evaluation[PolyScript::string_pointer++];
-			}
-			else
-			{
-				return getchar();
+			if (input_cur == input_end)
+				return EOF;
+			return (unsigned char)*input_cur++;
+		}
+
+		// Reads lines from stdin until a complete expression has been entered.
+		// Returns false at end of file.
+		static bool fill_console_buffer()
+		{
+			console_buffer.clear();
+
+			int depth = 0;
+			bool in_string = false;
+			char line[1024];
+
+			for (;;) {
+				if (!fgets(line, sizeof(line), stdin))
+					break;
+
+				bool in_comment = false;
+				for (char *p = line; *p; p++) {
+					if (in_comment)
+						break;
+					if (in_string) {
+						if (*p == '"' || *p == '\n' || *p == '\r')
+							in_string = false;
+						continue;
+					}
+					if (*p == '"')
+						in_string = true;
+					else if (*p == ';')
+						in_comment = true;
+					else if (*p == '(')
+						depth++;
+					else if (*p == ')')
+						depth--;
+				}
+				console_buffer += line;
+
+				// Keep going until the line is complete and the parentheses balance.
+				if (console_buffer.back() == '\n' && depth <= 0)
+					break;
 			}
+
+			input_cur = console_buffer.data();
+			input_end = input_cur + console_buffer.size();
+			return !console_buffer.empty();
 		}
 
 		// Skips the input until newline is found. Newline is one of \r, \r\n or \n.
@@ -48,98 +123,164 @@ namespace PolyScript
 			}
 		}
 
-		int read_number(int val) {
-			while (isdigit(peek()))
-				val = val * 10 + (get_next_char() - '0');
-			return val;
-		}
-
+		// Reads a string. Note that the opening " has already been read.
 		Object * read_string()
 		{
-			// read until we find another "
-			char buf[STRING_MAX_LEN];
-			int len = 0;
+			const char *start = input_cur;
 
-			while (peek() != '"' && peek() != '\0' && peek() != '\r' && peek() != '\n')
-			{
-				if (len >= STRING_MAX_LEN)
-				{
-					error("String too long");
-					return NULL;
-				}
+			while (peek() != '"' && peek() != '\\' && peek() != '\0' && peek() != '\r' && peek() != '\n' && peek() != EOF)
+				get_next_char();
 
-				buf[len++] = get_next_char();
+			Object *str;
+			if (peek() != '\\') {
+				// No escapes, so the string can be copied straight from the input.
+				str = Object::MakeString(start, input_cur - start);
+			}
+			else {
+				std::string text(start, input_cur - start);
+				while (peek() != '"' && peek() != '\0' && peek() != '\r' && peek() != '\n' && peek() != EOF) {
+					int c = get_next_char();
+					if (c == '\\' && peek() != EOF) {
+						c = get_next_char();
+						if (c == 'n')
+							c = '\n';
+						else if (c == 't')
+							c = '\t';
+					}
+					text += (char)c;
+				}
+				str = Object::MakeString(text.data(), text.size());
 			}
-
-			buf[len++] = '\0';
 
 			// dispose of ending "
 			if (peek() == '"')
 				get_next_char();
 
-			return Object::MakeString(buf);
+			return str;
 		}
 
-		Object * read_numeric_string(char c)
+		// Reads a number. start points at its first character, which has already been consumed.
+		Object * read_numeric_string(const char *start)
 		{
-			// parse the string and figure out if it's a float or an int.
-			char buf[NUMBER_MAX_LEN + 1];
-			int len = 1;
-			buf[0] = c;
-
+			// find the extent of the token and figure out if it's a float or an int.
 			bool decimal_flag = false;
-			bool negative_flag = false;
 
 			while (isdigit(peek()) || peek() == '.' || peek() == '-')
 			{
-				if (len >= NUMBER_MAX_LEN)
-					error("Number too long");
+				if (peek() == '.')
+					decimal_flag = true;
+				get_next_char();
+			}
 
-				if (peek() == '.' && decimal_flag == true)
-					error("Invalid numeric value: two decimal points");
-				else if (peek() == '.')
+			// An exponent, as in 1e+20 or 2.5E-7, makes it a float.
+			if (peek() == 'e' || peek() == 'E') {
+				const char *p = input_cur + 1;
+				if (p != input_end && (*p == '+' || *p == '-'))
+					p++;
+				if (p != input_end && isdigit((unsigned char)*p)) {
 					decimal_flag = true;
+					input_cur = p;
+					while (isdigit(peek()))
+						get_next_char();
+				}
+			}
 
-				if (peek() == '-' && negative_flag == true)
-					error("Invalid numeric value: two negative signs");
-				else if (peek() == '-')
-					negative_flag = true;
+			const char *end = input_cur;
+			std::from_chars_result result;
 
-				buf[len++] = get_next_char();
+			if (decimal_flag)
+			{
+				double value = 0;
+				result = std::from_chars(start, end, value);
+				if (result.ec == std::errc() && result.ptr == end)
+					return Object::MakeFloat(value);
+			}
+			else
+			{
+				int value = 0;
+				result = std::from_chars(start, end, value);
+				if (result.ec == std::errc() && result.ptr == end)
+					return Object::MakeInt(value);
 			}
 
-			if (decimal_flag)
-				return Object::MakeFloat(atof(buf));
+			if (result.ec == std::errc::result_out_of_range)
+				error("Numeric value out of range: %.*s", (int)(end - start), start);
 			else
-				return Object::MakeInt(atoi(buf));
+				error("Invalid numeric value: %.*s", (int)(end - start), start);
 		}
 
-		Object *read_symbol(char c) {
-			char buf[SYMBOL_MAX_LEN + 1];
-			int len = 1;
-			buf[0] = c;
-			while (isalnum(peek()) || peek() == '-' || peek() == '=') {
-				if (SYMBOL_MAX_LEN <= len)
-					error("Symbol name too long");
-				buf[len++] = toupper(get_next_char());
-			}
-			buf[len] = '\0';
-			return Object::intern(buf);
+		// Characters that can appear in a symbol after its first one.
+		static bool is_symbol_char(int c) {
+			return c != EOF && c != '\0' && (isalnum(c) || strchr("-=+*/<>!?%$&^@_:", c));
+		}
+
+		// Reads +inf.0, -inf.0 or +nan.0, the printer's spelling of the floats that have
+		// no digits. sign has already been consumed. Returns NULL for anything else.
+		static Object *read_infinity_or_nan(int sign) {
+			static const size_t LENGTH = 5;
+			if ((size_t)(input_end - input_cur) < LENGTH)
+				return NULL;
+			if (input_end - input_cur > (ptrdiff_t)LENGTH && (is_symbol_char((unsigned char)input_cur[LENGTH]) || input_cur[LENGTH] == '.'))
+				return NULL;
+			double value;
+			if (memcmp(input_cur, "inf.0", LENGTH) == 0)
+				value = sign == '-' ? -std::numeric_limits<double>::infinity() : std::numeric_limits<double>::infinity();
+			else if (memcmp(input_cur, "nan.0", LENGTH) == 0)
+				value = std::numeric_limits<double>::quiet_NaN();
+			else
+				return NULL;
+			input_cur += LENGTH;
+			return Object::MakeFloat(value);
 		}
 
+		// Reads a symbol. start points at its first character, which has already been consumed.
+		Object *read_symbol(const char *start) {
+			while (is_symbol_char(peek()))
+				get_next_char();
+			return Object::intern(start, input_cur - start);
+		}
+
+		static Object *read_form(void);
+
 		// Reader macro ' (single quote).
 		// It reads an expression and returns (quote <expr>).
 		Object *read_quote(void) {
 			Object *sym = Object::intern("quote");
-			return Object::cons(sym, Object::cons(read(), Nil));
+			Object *quoted = read_form();
+			if (!quoted || quoted == Cparen || quoted == Dot)
+				error("Nothing to quote");
+			return Object::cons(sym, Object::cons(quoted, Nil));
 		}
 
-		// Reads a list. Note that '(' has already been read.
-		Object *read_list(void) {
-			if (error_flag)
+		// Reads a literal that starts with #: a vector #(...), #i(...) for ints or
+		// #f(...) for floats, or a map #m(key value ...). Returns NULL if the input
+		// after the # is none of these.
+		static Object *read_hash_literal(void) {
+			int prefix = peek();
+			if ((prefix == 'i' || prefix == 'f' || prefix == 'm') && input_end - input_cur >= 2 && input_cur[1] == '(')
+				get_next_char();
+			else
+				prefix = 0;
+
+			if (peek() != '(')
 				return NULL;
+			get_next_char();
+
+			switch (prefix) {
+			case 'm':
+				return Map::from_list(read_list());
+			case 'i':
+				return Vector::from_list(VT_INT32, read_list());
+			case 'f':
+				return Vector::from_list(VT_FLOAT64, read_list());
+			default:
+				return Vector::from_list(VT_GENERIC, read_list());
+			}
+		}
 
-			Object *obj = read();
+		// Reads a list. Note that '(' has already been read.
+		Object *read_list(void) {
+			Object *obj = read_form();
 			if (!obj)
 				error("Unclosed parenthesis");
 			if (obj == Dot)
@@ -150,14 +291,14 @@ namespace PolyScript
 			head = tail = Object::cons(obj, Nil);
 
 			for (;;) {
-				Object *obj = read();
+				Object *obj = read_form();
 				if (!obj)
 					error("Unclosed parenthesis");
 				if (obj == Cparen)
 					return head;
 				if (obj == Dot) {
-					tail->cdr = read();
-					if (read() != Cparen)
+					tail->cdr = read_form();
+					if (read_form() != Cparen)
 						error("Closed parenthesis expected after dot");
 					return head;
 				}
@@ -166,12 +307,9 @@ namespace PolyScript
 			}
 		}
 
-		// Reads a line from the console.
-		Object *read(void) {
+		// Reads one expression from the current input.
+		static Object *read_form(void) {
 			for (;;) {
-				if (error_flag)
-					return NULL;
-
 				int c = get_next_char();
 
 				if (c == ' ' || c == '\n' || c == '\r' || c == '\t')
@@ -192,150 +330,47 @@ namespace PolyScript
 					return read_string();
 				if (c == '\'')
 					return read_quote();
-				if (isdigit(c) || c == '-')
-					return read_numeric_string(c);
-				if (isalpha(c) || strchr("+><=!@#$%^&*", c))
-					return read_symbol(c);
+				if (c == '#') {
+					Object *literal = read_hash_literal();
+					if (literal)
+						return literal;
+				}
+				if (c == '+' || c == '-') {
+					Object *value = read_infinity_or_nan(c);
+					if (value)
+						return value;
+				}
+				if (isdigit(c) || (c == '-' && (isdigit(peek()) || peek() == '.')))
+					return read_numeric_string(input_cur - 1);
+				if (isalpha(c) || strchr("+-><=!@#$%^&*:", c))
+					return read_symbol(input_cur - 1);
 				error("Don't know how to handle %c", c);
 			}
 		}
 
-		// Prints the given object.
-		void print(Object *obj) {
-			if (error_flag)
-				return;
-
-			switch (obj->tag) {
-
-			case T_ATOM:
-				switch (obj->atom_subtype)
-				{
-				case AT_INT:
-					printf("%d", obj->int_value);
-					return;
-				case AT_FLOAT:
-					printf("%f", obj->float_value);
-					return;
-				case AT_SYMBOL:
-					printf("%s", obj->name);
-					return;
-				case AT_STRING:
-					printf("%s", obj->name);
-					return;
+		// Returns true if only whitespace and comments are left in the current span.
+		static bool input_exhausted(void) {
+			for (;;) {
+				int c = peek();
+				if (c == ' ' || c == '\n' || c == '\r' || c == '\t') {
+					get_next_char();
+					continue;
 				}
-
-			case T_CELL:
-				printf("(");
-				for (;;) {
-					print(obj->car);
-					if (obj->cdr == Nil)
-						break;
-					if (obj->cdr->tag != T_CELL) {
-						printf(" . ");
-						print(obj->cdr);
-						break;
-					}
-					printf(" ");
-					obj = obj->cdr;
+				if (c == ';') {
+					skip_line();
+					continue;
 				}
-				printf(")");
-				return;
-			case T_PRIMITIVE:
-				printf("<primitive>");
-				return;
-			case T_FUNCTION:
-				printf("<function>");
-				return;
-			case T_MACRO:
-				printf("<macro>");
-				return;
-			case T_SPECIAL:
-				if (obj == Nil)
-					printf("()");
-				else if (obj == True)
-					printf("t");
-				else
-					error("Bug: print: Unknown subtype: %d", obj->subtype);
-				return;
-			default:
-				error("Bug: print: Unknown tag type: %d", obj->tag);
+				return c == EOF || c == '\0';
 			}
 		}
-		void win_debug_print(Object * obj)
-		{
-			// Prints the given object.
-			memset(output_buffer, 0x00, 512);
-
-			switch (obj->tag) {
 
-			case T_ATOM:
-				switch (obj->atom_subtype)
-				{
-				case AT_INT:
-					swprintf(output_buffer, L"%d", obj->int_value);
-					OutputDebugStringW(LPCWSTR(output_buffer));
-					return;
-				case AT_FLOAT:
-					swprintf(output_buffer, L"%f", obj->float_value);
-					OutputDebugStringW(LPCWSTR(output_buffer));
-					return;
-				case AT_SYMBOL:
-					// Convert obj->name to a WCHAR
-					wchar_t tmp[512];
-					mbstowcs(tmp, obj->name, 512);
-					swprintf(output_buffer,  L"%s", tmp);
-					OutputDebugStringW(LPCWSTR(output_buffer));
-					return;
-				}
-
-			case T_CELL:
-				swprintf(output_buffer, L"(");
-				for (;;) {
-					print(obj->car);
-					if (obj->cdr == Nil)
-						break;
-					if (obj->cdr->tag != T_CELL) {
-						swprintf(output_buffer, L" . ");
-						OutputDebugStringW(LPCWSTR(output_buffer));
-						print(obj->cdr);
-						break;
-					}
-					swprintf(output_buffer, L" ");
-					OutputDebugStringW(LPCWSTR(output_buffer));
-					obj = obj->cdr;
-				}
-				swprintf(output_buffer, L")");
-				OutputDebugStringW(LPCWSTR(output_buffer));
-				return;
-			case T_PRIMITIVE:
-				swprintf(output_buffer,  L"<primitive>");
-				OutputDebugStringW(LPCWSTR(output_buffer));
-				return;
-			case T_FUNCTION:
-				swprintf(output_buffer, L"<function>");
-				OutputDebugStringW(LPCWSTR(output_buffer));
-				return;
-			case T_MACRO:
-				swprintf(output_buffer, L"<macro>");
-				OutputDebugStringW(LPCWSTR(output_buffer));
-				return;
-			case T_SPECIAL:
-				if (obj == Nil)
-				{
-					swprintf(output_buffer, L"()");
-					OutputDebugStringW(LPCWSTR(output_buffer));
-				}
-				else if (obj == True)
-				{
-					swprintf(output_buffer, L"t");
-					OutputDebugStringW(LPCWSTR(output_buffer));
-				}
-				else
-					error("Bug: print: Unknown subtype: %d", obj->subtype);
-				return;
-			default:
-				error("Bug: print: Unknown tag type: %d", obj->tag);
-			}
+		// Reads the next expression. Returns NULL at the end of the input.
+		Object *read(void) {
+			// A line of only blanks or a comment has no form in it, so read the next.
+			while (input_is_console && input_exhausted())
+				if (!fill_console_buffer())
+					return NULL;
+			return read_form();
 		}
 	}
 }
\ No newline at end of file
@@ -5,27 +5,47 @@
 #include <cstdlib>
 #include <string>
 
-#include <Windows.h>
-
 namespace PolyScript
 {
 	namespace Parser
 	{
-#define SYMBOL_MAX_LEN 200
-#define NUMBER_MAX_LEN 100
-#define STRING_MAX_LEN 2048
+		// The reader scans tokens in place over a span of characters.
+		// Input comes either from a caller's buffer or from lines read from stdin.
+		void set_input(const char *begin, const char *end);
+		void set_console_input();
+		void discard_input();
+
+		// The reader's position, so that a nested load can read another span and return.
+		struct Input {
+			const char *cur;
+			const char *end;
+			bool console;
+		};
+
+		Input save_input();
+		void restore_input(const Input &input);
+
+		// Reads from a span for as long as it is in scope, then puts the previous
+		// input back, including when an error unwinds past it.
+		class InputScope
+		{
+		public:
+			InputScope(const char *begin, const char *end) : saved(save_input()) { set_input(begin, end); }
+			~InputScope() { restore_input(saved); }
+
+		private:
+			Input saved;
+		};
 
 		int peek();
 		void skip_line();
 
 		Object * read_string();
-		Object * read_numeric_string(char c);
-		Object * read_symbol(char c);
+		Object * read_numeric_string(const char *start);
+		Object * read_symbol(const char *start);
 		Object * read_quote();
 		Object * read_list();
 		Object * read();
-		void print(Object *obj);
-		void win_debug_print(Object *obj);
 	};
 };
 
@@ -5,9 +5,19 @@
 #include "PolyScript.h"
 #include "Primitives.h"
 #include "Parser.h"
+#include "Printer.h"
 #include "Evaluator.h"
+#include "Server.h"
 
-PolyScript::Object * PolyScript::obarray;
+#include <mutex>
+
+#ifndef _WIN32
+#include <signal.h>
+#endif
+
+std::atomic<PolyScript::Object *> PolyScript::obarray;
+thread_local PolyScript::Object ** PolyScript::private_obarray = NULL;
+std::mutex PolyScript::obarray_lock;
 
 PolyScript::Object * PolyScript::Nil;
 PolyScript::Object * PolyScript::Dot;
@@ -16,24 +26,21 @@ PolyScript::Object * PolyScript::True;
 
 PolyScript::Object * PolyScript::env;
 
-bool PolyScript::error_flag;
-
-char PolyScript::string_under_evaluation[65536];
-int PolyScript::string_pointer = 0;
-bool PolyScript::evaluating_a_script = false;
-
 void PolyScript::error(const char *fmt, ...) {
-	va_list ap;
+	va_list ap, len_ap;
 	va_start(ap, fmt);
-	vfprintf(stderr, fmt, ap);
-	fprintf(stderr, "\n");
+	va_copy(len_ap, ap);
+	int len = vsnprintf(NULL, 0, fmt, len_ap);
+	va_end(len_ap);
+
+	std::string message(len > 0 ? len : 0, '\0');
+	vsnprintf(&message[0], message.size() + 1, fmt, ap);
 	va_end(ap);
-	//exit(1);
 
-	error_flag = true;
+	throw Error(message);
 }
 
-void PolyScript::Initialize()
+static void InitializeOnce()
 {
 	PolyScript::Nil = PolyScript::Object::MakeSpecial(PolyScript::T_NIL);
 	PolyScript::Dot = PolyScript::Object::MakeSpecial(PolyScript::T_DOT);
@@ -42,44 +49,143 @@ void PolyScript::Initialize()
 
 	PolyScript::obarray = PolyScript::Nil;
 
-	env = PolyScript::Object::MakeEnv(PolyScript::Nil, NULL);
+	PolyScript::env = PolyScript::Object::MakeEnv(PolyScript::Nil, NULL);
+
+	PolyScript::Primitives::create_primitives(PolyScript::env);
+}
 
-	PolyScript::Primitives::create_primitives(env);
+// Safe to call more than once; only the first call does anything.
+void PolyScript::Initialize()
+{
+	static std::once_flag initialized;
+	std::call_once(initialized, InitializeOnce);
 }
 
+// Evaluates one form and sends the result to the debug output.
+// Hosts that need the value back should use PolyScript::Interpreter.
 void PolyScript::EvaluateString(const char *line)
 {
-	PolyScript::evaluating_a_script = true;
-	strcpy(PolyScript::string_under_evaluation, line);
+	// The reader works directly on the caller's string.
+	PolyScript::Parser::InputScope input(line, line + strlen(line));
+
+	try
+	{
+		PolyScript::Object *expr = PolyScript::Parser::read();
+		if (expr)
+			PolyScript::Printer::println(PolyScript::Evaluator::eval(PolyScript::env, expr), PolyScript::Printer::debug_sink);
+	}
+	catch (PolyScript::Error &e)
+	{
+		std::string text = PolyScript::Printer::describe_error(e);
+		PolyScript::Printer::debug_sink(text.data(), text.size());
+	}
+	catch (PolyScript::Throw &t)
+	{
+		std::string text = PolyScript::Printer::describe_throw(t);
+		PolyScript::Printer::debug_sink(text.data(), text.size());
+	}
+}
+
+// Benchmarks and embedding hosts link the interpreter without the REPL.
+#ifndef POLYSCRIPT_NO_MAIN
+
+// polyscript --serve socket [--workers n] [--load file]... [--fuel n] [--heap bytes] [--deadline ms]
+// serves evaluation requests on a Unix domain socket until it gets SIGINT or SIGTERM.
+static int serve(int argc, char **argv)
+{
+	PolyScript::Server::Options options;
+	options.socket_path = argv[2];
+	options.workers = 0;
+	options.limits = { 0, 0, 0, 0 };
+	for (int i = 3; i < argc; i++) {
+		if (i + 1 == argc) {
+			fprintf(stderr, "%s needs a value\n", argv[i]);
+			return 2;
+		}
+		if (strcmp(argv[i], "--workers") == 0)
+			options.workers = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--load") == 0)
+			options.library.push_back(argv[++i]);
+		else if (strcmp(argv[i], "--fuel") == 0)
+			options.limits.fuel = strtoull(argv[++i], NULL, 10);
+		else if (strcmp(argv[i], "--heap") == 0)
+			options.limits.heap_bytes = strtoull(argv[++i], NULL, 10);
+		else if (strcmp(argv[i], "--deadline") == 0)
+			options.limits.deadline_ms = atoi(argv[++i]);
+		else {
+			fprintf(stderr, "unknown option %s\n", argv[i]);
+			return 2;
+		}
+	}
 
-	PolyScript::Object *expr = PolyScript::Parser::read();
-	PolyScript::Parser::win_debug_print(PolyScript::Evaluator::eval(PolyScript::env, expr));
-	OutputDebugStringW(L"\n");
+#ifndef _WIN32
+	// Blocked before the server's threads start, so that they inherit the mask and
+	// the signals come to sigwait here.
+	sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &signals, NULL);
+#endif
+
+	PolyScript::Server server(options);
+	try
+	{
+		server.start();
+	}
+	catch (PolyScript::Error &e)
+	{
+		fprintf(stderr, "%s\n", e.message.c_str());
+		return 1;
+	}
 
-	PolyScript::evaluating_a_script = false;
+#ifndef _WIN32
+	int signal;
+	sigwait(&signals, &signal);
+	server.stop();
+#else
+	server.wait();
+#endif
+	return 0;
 }
 
-int main()
+int main(int argc, char **argv)
 {
+	if (argc >= 3 && strcmp(argv[1], "--serve") == 0)
+		return serve(argc, argv);
+
 	PolyScript::Initialize();
 
 	//PolyScript::EvaluateString("(if (eq 4 4) (plus 2 2))");
 	//printf("\n");
 
+	PolyScript::Parser::set_console_input();
+
 	while (true)
 	{
-		PolyScript::error_flag = false;
-
 		printf("> ");
-		PolyScript::Object *expr = PolyScript::Parser::read();
-		if(!PolyScript::error_flag)
-			PolyScript::Parser::print(PolyScript::Evaluator::eval(PolyScript::env, expr));
-		printf("\n");
 
-		//PolyScript::Parser::win_debug_print(PolyScript::Evaluator::eval(PolyScript::env, expr));
-		//OutputDebugStringW(L"\n");
-		
+		try
+		{
+			PolyScript::Object *expr = PolyScript::Parser::read();
+			if (!expr)
+				break;
+			PolyScript::Printer::println(PolyScript::Evaluator::eval(PolyScript::env, expr));
+		}
+		catch (PolyScript::Error &e)
+		{
+			fputs(PolyScript::Printer::describe_error(e).c_str(), stderr);
+
+			// Don't try to read the rest of a line that caused an error.
+			PolyScript::Parser::discard_input();
+		}
+		catch (PolyScript::Throw &t)
+		{
+			fputs(PolyScript::Printer::describe_throw(t).c_str(), stderr);
+			PolyScript::Parser::discard_input();
+		}
 	}
 
     return 0;
-}
\ No newline at end of file
+}
+#endif
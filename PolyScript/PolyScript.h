@@ -1,20 +1,104 @@
 #pragma once
 
+#include <atomic>
 #include <cassert>
 #include <cctype>
+#include <cstddef>
+#include <cstdint>
 #include <cstdio>
+#include <cstring>
 #include <string>
 #include <cstdlib>
 #include <cstdarg>
+#include <exception>
+#include <mutex>
+#include <vector>
+
+#include "Arena.h"
+#include "Stats.h"
 
 namespace PolyScript
 {
-	void error(const char *fmt, ...);
-	extern bool error_flag;
+	// Raised by error(). It unwinds to the nearest handler: handler-case, the REPL,
+	// an Interpreter call or a loader thread. Nothing checks for errors on the way.
+	struct Error : std::exception
+	{
+		// Backtraces stop growing after this many frames.
+		static const size_t MAX_BACKTRACE = 64;
+
+		std::string message;
+
+		// The innermost form being evaluated when the error was raised, or NULL.
+		struct Object *form;
+
+		// The forms being evaluated, innermost first.
+		std::vector<struct Object *> backtrace;
+
+		explicit Error(const std::string &message) : message(message), form(NULL) {}
+
+		const char *what() const noexcept { return message.c_str(); }
+
+		// Called as the error unwinds through each form being evaluated.
+		void add_frame(struct Object *frame_form)
+		{
+			if (!form)
+				form = frame_form;
+			if (backtrace.size() < MAX_BACKTRACE)
+				backtrace.push_back(frame_form);
+		}
+	};
+
+	// Which limit a LimitExceeded ran into.
+	typedef enum {
+		LIMIT_NONE,
+		LIMIT_FUEL,
+		LIMIT_HEAP,
+		LIMIT_DEPTH,
+		LIMIT_DEADLINE
+	} LimitKind;
+
+	// Raised when an evaluation goes past one of the limits set by a Limits::Scope.
+	// handler-case lets it through, so a script can't carry on past its limits.
+	struct LimitExceeded : Error
+	{
+		LimitKind kind;
+
+		LimitExceeded(const std::string &message, LimitKind kind) : Error(message), kind(kind) {}
+	};
+
+	// Raised by (throw tag value) and caught by the (catch tag ...) with the same tag.
+	struct Throw
+	{
+		struct Object *tag;
+		struct Object *value;
+	};
+
+	// Formats a message and raises it as an Error. Does not return.
+	[[noreturn]] void error(const char *fmt, ...);
 
 	typedef struct Object *Primitive(struct Object *env, struct Object *args);
 
-	extern Object *obarray;
+	// Script code can run on several threads at once, through futures, channels and
+	// the parallel primitives. The rules are:
+	// - Every thread allocates from its own arena and no object is ever freed, so
+	//   an object handed to another thread stays valid.
+	// - Any number of threads may read an object. Changing one in place (setq,
+	//   define, puthash, aset, assoc!, string-builder-append) while another thread
+	//   can see it is a race. Hand values over through a channel or a future
+	//   instead: everything the sender did before the handover is visible to the
+	//   receiver after it.
+	// - obarray is the only shared state with a lock of its own. Symbols are
+	//   added under obarray_lock and published with a release store, so a search
+	//   can start from an acquire load without taking the lock.
+	// - A lazy sequence or an input stream is used by one thread at a time.
+	extern std::atomic<Object *> obarray;
+
+	// When set, symbols that are not already in obarray are interned here instead.
+	// This lets reader threads run without touching the shared symbol table.
+	extern thread_local Object **private_obarray;
+
+	// Held while a symbol is added to obarray, since parallel workers can intern too.
+	extern std::mutex obarray_lock;
 
 	extern Object *Nil;
 	extern Object *Dot;
@@ -26,10 +110,6 @@ namespace PolyScript
 	void Initialize();
 	void EvaluateString(const char *line);
 
-	extern char string_under_evaluation[65536];
-	extern int string_pointer;
-	extern bool evaluating_a_script;
-
 	typedef enum ObjectTag {
 		T_ATOM,
 		T_CELL,
@@ -37,7 +117,18 @@ namespace PolyScript
 		T_FUNCTION,
 		T_MACRO,
 		T_ENV,
-		T_SPECIAL
+		T_STACK_ENV,
+		T_SPECIAL,
+		T_ERROR,
+		T_VECTOR,
+		T_HASHTABLE,
+		T_MAP,
+		T_BUILDER,
+		T_STREAM,
+		T_SEQUENCE,
+		T_FUTURE,
+		T_CHANNEL,
+		T_COROUTINE
 	} ObjectTag;
 
 	typedef enum AtomSubtype {
@@ -47,6 +138,74 @@ namespace PolyScript
 		AT_STRING,
 	} AtomSubtype;
 
+	// Element types for T_VECTOR. Typed vectors hold their elements unboxed.
+	typedef enum VectorType {
+		VT_GENERIC = 1,
+		VT_INT32,
+		VT_FLOAT64,
+	} VectorType;
+
+	// Key comparisons for T_HASHTABLE.
+	typedef enum HashTest {
+		HT_EQ = 1,	// Same object, or numbers of the same type and value
+		HT_EQUAL,	// Same structure and contents
+	} HashTest;
+
+	// One slot of a hash table. An empty slot has a NULL key.
+	struct HashEntry {
+		struct Object *key;
+		struct Object *value;
+		uint32_t hash;
+	};
+
+	// A node of a persistent map's trie. Defined in Map.cpp.
+	struct MapNode;
+
+	// An open input file. Defined in Streams.h.
+	class LineReader;
+
+	// A closure running on another thread, and a queue between threads. Defined in
+	// Futures.h and Channels.h.
+	class Future;
+	class Channel;
+
+	// A closure with its own stack that can suspend itself. Defined in Coroutines.h.
+	class Coroutine;
+
+	// Produces the next element of a lazy sequence, or NULL when it has run out.
+	typedef struct Object *SequenceNext(struct Object *seq);
+
+	// What the allocation tracker counts an allocation as. AK_DATA is memory that
+	// belongs to an object but isn't one, such as a vector's elements.
+	typedef enum AllocationKind {
+		AK_CONS,
+		AK_INT,
+		AK_FLOAT,
+		AK_SYMBOL,
+		AK_STRING,
+		AK_ENV,
+		AK_CLOSURE,
+		AK_VECTOR,
+		AK_TABLE,
+		AK_DATA,
+		AK_OTHER,
+		AK_COUNT
+	} AllocationKind;
+
+	// The allocation tracker. Defined in Allocations.h, and only compiled in when
+	// POLYSCRIPT_TRACK_ALLOCATIONS is defined.
+	namespace Allocations
+	{
+		extern std::atomic<bool> tracking;
+		void record(AllocationKind kind, size_t size);
+	};
+
+	// Evaluation limits. Defined in Limits.h.
+	namespace Limits
+	{
+		[[noreturn]] void heap_exceeded();
+	};
+
 	// Subtypes for TSPECIAL
 	typedef enum {
 		T_NIL = 1,
@@ -80,35 +239,121 @@ namespace PolyScript
 				struct Object *cdr;
 			};
 
-			// T_SYMBOL
-			char *name;
+			// T_SYMBOL. A special variable, made by defvar or defparameter, keeps its
+			// global value in symbol_value and has a special_index above zero, its slot
+			// in each thread's dynamic bindings. See Specials.h.
+			struct {
+				char *name;
+				struct Object *symbol_value;
+				int special_index;
+			};
 
-			// T_STRING
-			char *str_value;
+			// T_STRING. The body is NUL-terminated but may also contain NULs;
+			// str_length is authoritative.
+			struct {
+				char *str_value;
+				size_t str_length;
+			};
 
-			// T_PRIMITIVE
-			Primitive *fn;
+			// T_PRIMITIVE. primitive_id is the primitive's index in the runtime stats.
+			struct {
+				Primitive *fn;
+				int primitive_id;
+			};
 
 			// T_SPECIAL
 			int subtype;
 
-			// T_FUNCTION or T_MACRO
+			// T_FUNCTION or T_MACRO. fn_name is the symbol it was defined as by defun
+			// or defmacro, or NULL for a lambda.
 			struct {
 				struct Object *params;
 				struct Object *body;
 				struct Object *env;
+				struct Object *fn_name;
 			};
 
-			// T_ENV
+			// T_ENV, or T_STACK_ENV for a frame let built on the C stack. Only a stack
+			// frame has heap: its copy on the heap, once something has kept it. See Let.h.
 			struct {
 				struct Object *vars;
 				struct Object *up;
+				struct Object *heap;
+			};
+
+			// T_ERROR
+			struct {
+				struct Object *message;
+				struct Object *form;
+				struct Object *backtrace;
+			};
+
+			// T_VECTOR
+			struct {
+				VectorType vector_type;
+				size_t length;
+				void *elements;
+			};
+
+			// T_HASHTABLE
+			struct {
+				HashTest hash_test;
+				// Live entries, and live entries plus deleted slots.
+				uint32_t hash_count;
+				uint32_t hash_used;
+				// Always a power of two.
+				uint32_t hash_capacity;
+				struct HashEntry *hash_entries;
 			};
+
+			// T_MAP
+			struct {
+				// NULL for an empty map.
+				struct MapNode *map_root;
+				uint32_t map_count;
+				HashTest map_test;
+				// Nonzero while the map is transient and may be changed in place.
+				uint64_t map_owner;
+			};
+
+			// T_BUILDER
+			struct {
+				char *builder_data;
+				size_t builder_length;
+				size_t builder_capacity;
+			};
+
+			// T_STREAM. NULL once the stream is closed.
+			LineReader *stream_reader;
+
+			// T_SEQUENCE. seq_next uses whichever of the other fields it needs.
+			struct {
+				SequenceNext *seq_next;
+				// What the elements come from: a stream, a list, a vector or
+				// another sequence.
+				struct Object *seq_source;
+				// A function applied to each element, and where to call it from.
+				struct Object *seq_fn;
+				struct Object *seq_env;
+				// Counters, such as a range's next value, end and step.
+				int64_t seq_index;
+				int64_t seq_limit;
+				int64_t seq_step;
+			};
+
+			// T_FUTURE
+			Future *future;
+
+			// T_CHANNEL
+			Channel *channel;
+
+			// T_COROUTINE
+			Coroutine *coroutine;
 		};
 
 		bool IsAtomSubtype(AtomSubtype subtype)
 		{
-			if (tag == T_ATOM && this->subtype == subtype)
+			if (tag == T_ATOM && atom_subtype == subtype)
 				return true;
 			else
 				return false;
@@ -116,25 +361,65 @@ namespace PolyScript
 
 		bool IsNumber()
 		{
-			return tag == T_ATOM && (subtype == AT_INT || subtype == AT_FLOAT);
+			return tag == T_ATOM && (atom_subtype == AT_INT || atom_subtype == AT_FLOAT);
+		}
+
+		// Allocate memory for an object or its contents, from this thread's arena if it has one.
+		static void *allocate(size_t size, AllocationKind kind = AK_DATA)
+		{
+			allocation_count++;
+			allocation_bytes += size;
+			if (allocation_bytes > allocation_limit)
+				Limits::heap_exceeded();
+			STAT_ADD(allocations, 1);
+			STAT_ADD(bytes_allocated, size);
+#ifdef POLYSCRIPT_TRACK_ALLOCATIONS
+			if (Allocations::tracking.load(std::memory_order_relaxed))
+				Allocations::record(kind, size);
+#else
+			(void)kind;
+#endif
+			if (current_arena)
+				return current_arena->allocate(size);
+			return malloc(size);
 		}
 
 		// Allocate a new Object.
-		static Object *alloc(ObjectTag type, size_t size)
+		static Object *alloc(ObjectTag type, size_t size, AllocationKind kind)
 		{
 			size += offsetof(Object, int_value);
 
 			// Allocate an object.
-			Object *obj = (Object *)malloc(size);
+			Object *obj = (Object *)allocate(size, kind);
 			obj->tag = type;
 
 			return obj;
 		}
 
+		static Object *alloc(ObjectTag type, size_t size)
+		{
+			switch (type) {
+			case T_CELL:
+				return alloc(type, size, AK_CONS);
+			case T_ENV:
+				return alloc(type, size, AK_ENV);
+			case T_FUNCTION:
+			case T_MACRO:
+				return alloc(type, size, AK_CLOSURE);
+			case T_VECTOR:
+				return alloc(type, size, AK_VECTOR);
+			case T_HASHTABLE:
+			case T_MAP:
+				return alloc(type, size, AK_TABLE);
+			default:
+				return alloc(type, size, AK_OTHER);
+			}
+		}
+
 		// Constructors.
 		static Object *MakeInt(int value)
 		{
-			Object *r = alloc(T_ATOM, sizeof(int));
+			Object *r = alloc(T_ATOM, sizeof(int), AK_INT);
 			r->atom_subtype = AT_INT;
 			r->int_value = value;
 			return r;
@@ -142,46 +427,71 @@ namespace PolyScript
 
 		static Object *MakeFloat(double value)
 		{
-			Object *r = alloc(T_ATOM, sizeof(double));
+			Object *r = alloc(T_ATOM, sizeof(double), AK_FLOAT);
 			r->atom_subtype = AT_FLOAT;
 			r->float_value = value;
 			return r;
 		}
 
-		static Object *MakeString(const char *str)
+		// A string of len bytes for the caller to fill in. The body is stored inline,
+		// right after the length, so a string is a single allocation of any size.
+		static Object *AllocateString(size_t len)
 		{
-			Object *r = alloc(T_ATOM, sizeof(double));
+			Object *r = alloc(T_ATOM, sizeof(char *) + sizeof(size_t) + len + 1, AK_STRING);
 			r->atom_subtype = AT_STRING;
-			
-			char *dup = _strdup(str);
-			r->str_value = dup;
+			r->str_value = (char *)(&r->str_length + 1);
+			r->str_length = len;
+			r->str_value[len] = '\0';
+			return r;
+		}
 
+		static Object *MakeString(const char *str, size_t len)
+		{
+			// The body is copied exactly once, straight from the caller's buffer.
+			Object *r = AllocateString(len);
+			memcpy(r->str_value, str, len);
 			return r;
 		}
 
-		static Object *MakeSymbol(const char *name) {
-			Object *sym = alloc(T_ATOM, strlen(name) + 1);
+		static Object *MakeString(const char *str)
+		{
+			return MakeString(str, strlen(str));
+		}
+
+		// Symbol names are stored upper-cased in the same allocation as the symbol.
+		static Object *MakeSymbol(const char *name, size_t len) {
+			Object *sym = alloc(T_ATOM, sizeof(char *) + sizeof(Object *) + sizeof(int) + len + 1, AK_SYMBOL);
 			sym->atom_subtype = AT_SYMBOL;
+			sym->symbol_value = NULL;
+			sym->special_index = 0;
 
-			char *dup = _strdup(name);
-			dup = _strupr(dup);
+			char *dup = (char *)(&sym->special_index + 1);
+			for (size_t i = 0; i < len; i++)
+				dup[i] = toupper((unsigned char)name[i]);
+			dup[len] = '\0';
 			sym->name = dup;
 
 			return sym;
 		}
 
+		static Object *MakeSymbol(const char *name) {
+			return MakeSymbol(name, strlen(name));
+		}
+
 		static Object *MakeFunction(ObjectTag type, Object *params, Object *body, Object *env) {
 			assert(type == T_FUNCTION || type == T_MACRO);
-			Object *r = alloc(type, sizeof(Object *) * 3);
+			Object *r = alloc(type, sizeof(Object *) * 4);
 			r->params = params;
 			r->body = body;
 			r->env = env;
+			r->fn_name = NULL;
 			return r;
 		}
 
-		static Object *MakePrimitive(Primitive *fn) {
-			Object *r = alloc(T_PRIMITIVE, sizeof(Primitive *));
+		static Object *MakePrimitive(Primitive *fn, int id) {
+			Object *r = alloc(T_PRIMITIVE, sizeof(Primitive *) + sizeof(int));
 			r->fn = fn;
+			r->primitive_id = id;
 			return r;
 		}
 
@@ -192,8 +502,105 @@ namespace PolyScript
 			return r;
 		}
 
+		// An error as a first-class value, for handler-case.
+		static Object *MakeError(Object *message, Object *form, Object *backtrace) {
+			Object *r = alloc(T_ERROR, sizeof(Object *) * 3);
+			r->message = message;
+			r->form = form;
+			r->backtrace = backtrace;
+			return r;
+		}
+
+		// A vector of length elements. Generic vectors start out filled with Nil,
+		// typed vectors with zeros.
+		static Object *MakeVector(VectorType type, size_t length) {
+			Object *r = alloc(T_VECTOR, sizeof(Object *) * 3);
+			r->vector_type = type;
+			r->length = length;
+
+			size_t element_size = type == VT_INT32 ? sizeof(int32_t) : type == VT_FLOAT64 ? sizeof(double) : sizeof(Object *);
+			r->elements = allocate(length * element_size + 1);
+
+			if (type == VT_GENERIC)
+				for (size_t i = 0; i < length; i++)
+					((Object **)r->elements)[i] = Nil;
+			else
+				memset(r->elements, 0, length * element_size);
+			return r;
+		}
+
+		// An empty hash table with room for capacity slots, a power of two.
+		static Object *MakeHashTable(HashTest test, uint32_t capacity) {
+			Object *r = alloc(T_HASHTABLE, sizeof(uint32_t) * 4 + sizeof(HashEntry *));
+			r->hash_test = test;
+			r->hash_count = 0;
+			r->hash_used = 0;
+			r->hash_capacity = capacity;
+			r->hash_entries = (HashEntry *)allocate(capacity * sizeof(HashEntry));
+			memset(r->hash_entries, 0, capacity * sizeof(HashEntry));
+			return r;
+		}
+
+		static Object *MakeMap(HashTest test, MapNode *root, uint32_t count, uint64_t owner) {
+			Object *r = alloc(T_MAP, sizeof(MapNode *) + sizeof(uint32_t) * 2 + sizeof(uint64_t));
+			r->map_root = root;
+			r->map_count = count;
+			r->map_test = test;
+			r->map_owner = owner;
+			return r;
+		}
+
+		// An empty string builder with room for capacity bytes.
+		static Object *MakeBuilder(size_t capacity) {
+			Object *r = alloc(T_BUILDER, sizeof(char *) + sizeof(size_t) * 2);
+			r->builder_data = (char *)allocate(capacity);
+			r->builder_length = 0;
+			r->builder_capacity = capacity;
+			return r;
+		}
+
+		static Object *MakeStream(LineReader *reader) {
+			Object *r = alloc(T_STREAM, sizeof(LineReader *));
+			r->stream_reader = reader;
+			return r;
+		}
+
+		static Object *MakeFuture(Future *future) {
+			Object *r = alloc(T_FUTURE, sizeof(Future *));
+			r->future = future;
+			return r;
+		}
+
+		static Object *MakeChannel(Channel *channel) {
+			Object *r = alloc(T_CHANNEL, sizeof(Channel *));
+			r->channel = channel;
+			return r;
+		}
+
+		static Object *MakeCoroutine(Coroutine *coroutine) {
+			Object *r = alloc(T_COROUTINE, sizeof(Coroutine *));
+			r->coroutine = coroutine;
+			return r;
+		}
+
+		static Object *MakeSequence(SequenceNext *next, Object *source) {
+			Object *r = alloc(T_SEQUENCE, sizeof(SequenceNext *) + sizeof(Object *) * 3 + sizeof(int64_t) * 3);
+			r->seq_next = next;
+			r->seq_source = source;
+			r->seq_fn = Nil;
+			r->seq_env = Nil;
+			r->seq_index = 0;
+			r->seq_limit = 0;
+			r->seq_step = 0;
+			return r;
+		}
+
+		Object **generic_elements() { return (Object **)elements; }
+		int32_t *int32_elements() { return (int32_t *)elements; }
+		double *float64_elements() { return (double *)elements; }
+
 		static Object *MakeSpecial(SpecialSubtype subtype) {
-			Object *r = (Object *)malloc(sizeof(void *) * 2);
+			Object *r = (Object *)malloc(offsetof(Object, int_value) + sizeof(int));
 			r->tag = T_SPECIAL;
 			r->subtype = subtype;
 			return r;
@@ -214,19 +621,58 @@ namespace PolyScript
 			return cons(cons(x, y), a);
 		}
 
-		// May create a new symbol. If there's a symbol with the same name, it will not create a new symbol
-		// but return the existing one.
-		static Object *intern(const char *name) {
-			char *tmp = _strdup(name);
-			tmp = _strupr(tmp);
+		// Compares a (possibly lower-case) name of len characters against an interned symbol name.
+		static bool symbol_name_equals(const char *interned, const char *name, size_t len) {
+			for (size_t i = 0; i < len; i++)
+				if (interned[i] != toupper((unsigned char)name[i]))
+					return false;
+			return interned[len] == '\0';
+		}
 
-			for (Object *p = obarray; p != Nil; p = p->cdr)
-				if (strcmp(tmp, p->car->name) == 0)
+		// Returns the symbol with the given name from a symbol table, or NULL.
+		static Object *find_symbol(Object *table, const char *name, size_t len) {
+			for (Object *p = table; p != Nil; p = p->cdr)
+				if (symbol_name_equals(p->car->name, name, len))
 					return p->car;
-			Object *sym = Object::MakeSymbol(tmp);
-			obarray = Object::cons(sym, obarray);
+			return NULL;
+		}
+
+		// May create a new symbol. If there's a symbol with the same name, it will not create a new symbol
+		// but return the existing one. The name does not need to be NUL-terminated, so the reader can
+		// look up a token directly in its input buffer; nothing is copied unless the symbol is new.
+		static Object *intern(const char *name, size_t len) {
+			Object *sym = find_symbol(obarray.load(std::memory_order_acquire), name, len);
+			if (sym)
+				return sym;
+
+			if (private_obarray) {
+				sym = find_symbol(*private_obarray, name, len);
+				if (sym)
+					return sym;
+				sym = Object::MakeSymbol(name, len);
+				*private_obarray = Object::cons(sym, *private_obarray);
+				note_pointer_store();
+				STAT_ADD(symbols_interned, 1);
+				return sym;
+			}
+
+			// Another thread may have added it since the search above.
+			std::lock_guard<std::mutex> guard(obarray_lock);
+			Object *table = obarray.load(std::memory_order_relaxed);
+			sym = find_symbol(table, name, len);
+			if (sym)
+				return sym;
+
+			sym = Object::MakeSymbol(name, len);
+			obarray.store(Object::cons(sym, table), std::memory_order_release);
+			note_pointer_store();
+			STAT_ADD(symbols_interned, 1);
 			return sym;
 		}
 
+		static Object *intern(const char *name) {
+			return intern(name, strlen(name));
+		}
+
 	} Object;
 };
@@ -1,10 +1,27 @@
 #include "stdafx.h"
 #include "Primitives.h"
 #include "Evaluator.h"
-
-#include <Windows.h>
-
-#define DECLARE_PRIMITIVE_FN(NAME) static Object * NAME (Object *env, Object *list)
+#include "Loader.h"
+#include "Printer.h"
+#include "Vector.h"
+#include "HashTable.h"
+#include "Map.h"
+#include "Strings.h"
+#include "Streams.h"
+#include "Sequence.h"
+#include "Parallel.h"
+#include "Futures.h"
+#include "Channels.h"
+#include "Coroutines.h"
+#include "EventLoop.h"
+#include "Profiler.h"
+#include "Allocations.h"
+#include "Stats.h"
+#include "Tracer.h"
+#include "Timing.h"
+#include "Limits.h"
+#include "Specials.h"
+#include "Let.h"
 
 namespace PolyScript
 {
@@ -13,10 +30,19 @@ namespace PolyScript
 		// Add a primitive function to the environment.
 		void add_primitive(Object *env, const char *name, Primitive *fn) {
 			Object *sym = Object::intern(name);
-			Object *prim = Object::MakePrimitive(fn);
+			Object *prim = Object::MakePrimitive(fn, Stats::register_primitive(name));
 			Evaluator::add_variable(env, sym, prim);
 		}
 
+		// Checks that a primitive got between min and max arguments and returns their values.
+		Object *evaluate_arguments(Object *env, Object *list, int min, int max, const char *name)
+		{
+			int count = Evaluator::list_length(list);
+			if (count < min || count > max)
+				error("Malformed %s", name);
+			return Evaluator::eval_list(env, list);
+		}
+
 		// (+ <integer> ...)
 		DECLARE_PRIMITIVE_FN(Plus) {
 			
@@ -25,10 +51,7 @@ namespace PolyScript
 
 			for (Object *args = Evaluator::eval_list(env, list); args != Nil; args = args->cdr) {
 
-				if (error_flag)
-					return NULL;
-				
-				if(args->car->tag != T_ATOM)
+				if(!args->car->IsNumber())
 					error("+ takes only numbers");
 
 				if (args->car->atom_subtype == AT_INT)
@@ -55,10 +78,7 @@ namespace PolyScript
 
 			for (Object *args = Evaluator::eval_list(env, list); args != Nil; args = args->cdr) {
 
-				if (error_flag)
-					return NULL;
-
-				if (args->car->tag != T_ATOM)
+				if (!args->car->IsNumber())
 					error("- takes only numbers");
 
 				if (first_number)
@@ -92,38 +112,30 @@ namespace PolyScript
 				return Object::MakeInt((int)sum);
 		}
 
-		// (- <integer> ...)
-		Object *Multiply(Object *env, Object *list) {
+		// (* <integer> ...)
+		DECLARE_PRIMITIVE_FN(Multiply) {
 
 			bool promote_to_float = false;
-			double sum = 0;
+			double product = 1;
 
 			for (Object *args = Evaluator::eval_list(env, list); args != Nil; args = args->cdr) {
 
-				if (args->car->tag != T_ATOM)
-					error("- takes only numbers");
+				if (!args->car->IsNumber())
+					error("* takes only numbers");
 
-				else {
-					if (args->car->atom_subtype == AT_INT)
-						sum *= args->car->int_value;
-					else if (args->car->atom_subtype == AT_FLOAT)
-					{
-						sum *= args->car->float_value;
-						promote_to_float = true;
-					}
+				if (args->car->atom_subtype == AT_INT)
+					product *= args->car->int_value;
+				else
+				{
+					product *= args->car->float_value;
+					promote_to_float = true;
 				}
-
 			}
 
-			if (!error_flag)
-			{
-				if (promote_to_float)
-					return Object::MakeFloat(sum);
-				else if (!error_flag)
-					return Object::MakeInt((int)sum);
-			}
+			if (promote_to_float)
+				return Object::MakeFloat(product);
 			else
-				return NULL;
+				return Object::MakeInt((int)product);
 		}
 
 		// 'expr
@@ -142,6 +154,32 @@ namespace PolyScript
 			return Evaluator::eval_list(env, list);
 		}
 
+		// (cons expr expr)
+		DECLARE_PRIMITIVE_FN(Cons) {
+			Object *args = evaluate_arguments(env, list, 2, 2, "cons");
+			return Object::cons(args->car, args->cdr->car);
+		}
+
+		// Checks that a value is a cell or nil.
+		static Object *cell_argument(Object *value, const char *name)
+		{
+			if (value != Nil && value->tag != T_CELL)
+				error("%s: argument is not a list", name);
+			return value;
+		}
+
+		// (car list) is nil for nil.
+		DECLARE_PRIMITIVE_FN(Car) {
+			Object *cell = cell_argument(evaluate_arguments(env, list, 1, 1, "car")->car, "car");
+			return cell == Nil ? Nil : cell->car;
+		}
+
+		// (cdr list) is nil for nil.
+		DECLARE_PRIMITIVE_FN(Cdr) {
+			Object *cell = cell_argument(evaluate_arguments(env, list, 1, 1, "cdr")->car, "cdr");
+			return cell == Nil ? Nil : cell->cdr;
+		}
+
 		// (defun <symbol> (<symbol> ...) expr ...)
 		DECLARE_PRIMITIVE_FN(Defun) {
 			return Evaluator::handle_defun(env, list, T_FUNCTION);
@@ -160,6 +198,13 @@ namespace PolyScript
 				return NULL;
 			}
 				
+			if (list->car->special_index)
+			{
+				Object *value = Evaluator::eval(env, list->cdr->car);
+				Specials::set(list->car, value);
+				return value;
+			}
+
 			Object *bind = Evaluator::find(env, list->car);
 			if (!bind)
 			{
@@ -167,8 +212,9 @@ namespace PolyScript
 				return NULL;
 			}
 				
-			Object *value = Evaluator::eval(env, list->cdr->car);
+			Object *value = Evaluator::lasting_value(Evaluator::eval(env, list->cdr->car));
 			bind->cdr = value;
+			Let::note_definition(value);
 			return value;
 		}
 
@@ -182,7 +228,10 @@ namespace PolyScript
 			}
 			Object *sym = list->car;
 			Object *value = Evaluator::eval(env, list->cdr->car);
-			Evaluator::add_variable(env, sym, value);
+			if (sym->special_index)
+				Specials::set(sym, value);
+			else
+				Evaluator::add_variable(env, sym, value);
 			return value;
 		}
 
@@ -195,11 +244,65 @@ namespace PolyScript
 		// (println expr)
 		DECLARE_PRIMITIVE_FN(Println) 
 		{
-			Parser::print(Evaluator::eval(env, list->car));
-			printf("\n");
+			Printer::println(Evaluator::eval(env, list->car));
 			return Nil;
 		}
 
+		// (prin1-to-string expr)
+		DECLARE_PRIMITIVE_FN(Prin1ToString)
+		{
+			if (Evaluator::list_length(list) != 1)
+			{
+				error("Malformed prin1-to-string");
+				return NULL;
+			}
+
+			Object *value = Evaluator::eval(env, list->car);
+
+			std::string text = Printer::to_string(value, true);
+			return Object::MakeString(text.data(), text.size());
+		}
+
+		// (load "file")
+		DECLARE_PRIMITIVE_FN(Load)
+		{
+			Object *values = Evaluator::eval_list(env, list);
+
+			if (Evaluator::list_length(values) != 1 || values->car->tag != T_ATOM || values->car->atom_subtype != AT_STRING)
+			{
+				error("Malformed load");
+				return NULL;
+			}
+
+			Loader::load_file(env, values->car->str_value);
+			return True;
+		}
+
+		// (load-parallel "file" ...) or (load-parallel (list "file" ...))
+		DECLARE_PRIMITIVE_FN(LoadParallel)
+		{
+			Object *values = Evaluator::eval_list(env, list);
+
+			std::vector<std::string> paths;
+			for (Object *p = values; p != Nil; p = p->cdr)
+			{
+				// Accept lists of file names as well as file names.
+				Object *names = p->car->tag == T_CELL ? p->car : Object::cons(p->car, Nil);
+				for (Object *q = names; q != Nil; q = q->cdr)
+				{
+					if (q->car->tag != T_ATOM || q->car->atom_subtype != AT_STRING)
+					{
+						error("load-parallel takes only file names");
+						return NULL;
+					}
+					paths.push_back(q->car->str_value);
+				}
+			}
+
+			Loader::load_files(env, paths);
+			return True;
+		}
+
 		DECLARE_PRIMITIVE_FN(Eq)
 		{
 			if (Evaluator::list_length(list) != 2)
@@ -236,7 +339,7 @@ namespace PolyScript
 				}
 			}
 
-			return NULL;
+			return x == y ? True : Nil;
 		}
 
 		DECLARE_PRIMITIVE_FN(GreaterThan)
@@ -267,6 +370,8 @@ namespace PolyScript
 					return x->int_value > y->int_value ? True : Nil;
 				case AT_SYMBOL:
 					return x->name > y->name ? True : Nil;
+				default:
+					error("Only numerical and symbol comparison is currently supported by >");
 				}
 			}
 			else
@@ -306,6 +411,8 @@ namespace PolyScript
 					return x->int_value >= y->int_value ? True : Nil;
 				case AT_SYMBOL:
 					return x->name >= y->name ? True : Nil;
+				default:
+					error("Only numerical and symbol comparison is currently supported by >=");
 				}
 			}
 			else
@@ -345,6 +452,8 @@ namespace PolyScript
 					return x->int_value < y->int_value ? True : Nil;
 				case AT_SYMBOL:
 					return x->name < y->name ? True : Nil;
+				default:
+					error("Only numerical and symbol comparison is currently supported by <");
 				}
 			}
 			else
@@ -384,6 +493,8 @@ namespace PolyScript
 					return x->int_value <= y->int_value ? True : Nil;
 				case AT_SYMBOL:
 					return x->name <= y->name ? True : Nil;
+				default:
+					error("Only numerical and symbol comparison is currently supported by <=");
 				}
 			}
 			else
@@ -580,24 +691,156 @@ namespace PolyScript
 
 			if (elements != 2 && elements != 3)
 			{
-				error("Incorrect number of arguments: found %d instead of 1", Evaluator::list_length(list));
+				error("if takes 2 or 3 arguments, found %d", elements);
 				return NULL;
 			}
 
 			// Evaluate the first form.
-			Object *first_form = Evaluator::eval_list_element(env, list, 0);
+			Object *condition = Evaluator::eval(env, list->car);
 
-			if (first_form->car->subtype == T_TRUE)
+			if (condition != Nil)
+				return Evaluator::eval(env, list->cdr->car);
+			else if (elements == 3)
+				return Evaluator::eval(env, list->cdr->cdr->car);
+			else
+				return Nil;
+		}
+
+		// (catch tag expr ...)
+		// Evaluates the body. A (throw tag value) inside it with the same tag returns value from here.
+		DECLARE_PRIMITIVE_FN(Catch)
+		{
+			if (Evaluator::list_length(list) < 1)
+				error("Malformed catch");
+
+			Object *tag = Evaluator::eval(env, list->car);
+			try
 			{
-				return Evaluator::eval_list_element(env, list, 1);
+				return Evaluator::progn(env, list->cdr);
 			}
-			else if (first_form->car->subtype == T_NIL)
+			catch (Throw &t)
 			{
-				if (elements == 3)
-					return Evaluator::eval_list_element(env, list, 2);
-				else
-					return Nil;
+				if (t.tag != tag)
+					throw;
+				return t.value;
+			}
+		}
+
+		// (throw tag value)
+		DECLARE_PRIMITIVE_FN(ThrowTag)
+		{
+			if (Evaluator::list_length(list) != 2)
+				error("Malformed throw");
+
+			Object *values = Evaluator::eval_list(env, list);
+			Throw t = { values->car, values->cdr->car };
+			throw t;
+		}
+
+		// (unwind-protect protected-form cleanup-form ...)
+		// The cleanup forms run however the protected form is left.
+		DECLARE_PRIMITIVE_FN(UnwindProtect)
+		{
+			if (Evaluator::list_length(list) < 1)
+				error("Malformed unwind-protect");
+
+			// The cleanup runs after the catch block, since while a handler is active a
+			// coroutine that yields would leave its exception to another one.
+			Object *result = Nil;
+			std::exception_ptr failure;
+			try
+			{
+				result = Evaluator::eval(env, list->car);
+			}
+			catch (...)
+			{
+				failure = std::current_exception();
+			}
+
+			Evaluator::progn(env, list->cdr);
+			if (failure)
+				std::rethrow_exception(failure);
+			return result;
+		}
+
+		// (error message)
+		DECLARE_PRIMITIVE_FN(RaiseError)
+		{
+			if (Evaluator::list_length(list) != 1)
+				error("Malformed error");
+
+			Object *message = Evaluator::eval(env, list->car);
+			if (message->IsAtomSubtype(AT_STRING))
+				error("%s", message->str_value);
+			error("%s", Printer::to_string(message, true).c_str());
+		}
+
+		// (handler-case expr (error (var) handler ...))
+		// If expr raises an error, var is bound to the error object while the handler runs.
+		DECLARE_PRIMITIVE_FN(HandlerCase)
+		{
+			Object *clause = list->tag == T_CELL ? list->cdr : Nil;
+			if (Evaluator::list_length(list) != 2 || clause->car->tag != T_CELL
+				|| clause->car->car != Object::intern("error")
+				|| Evaluator::list_length(clause->car) < 2
+				|| Evaluator::list_length(clause->car->cdr->car) != 1)
+				error("Malformed handler-case");
+
+			Object *var = clause->car->cdr->car->car;
+			Object *handler = clause->car->cdr->cdr;
+
+			// As in unwind-protect, the handler runs after the catch block.
+			Object *condition;
+			try
+			{
+				return Evaluator::eval(env, list->car);
+			}
+			catch (LimitExceeded &)
+			{
+				throw;
 			}
+			catch (Error &e)
+			{
+				Object *backtrace = Nil;
+				for (size_t i = e.backtrace.size(); i > 0; i--)
+					backtrace = Object::cons(e.backtrace[i - 1], backtrace);
+
+				condition = Object::MakeError(Object::MakeString(e.message.data(), e.message.size()),
+					e.form ? e.form : Nil, backtrace);
+			}
+
+			Object *newenv = Evaluator::push_env(env, Object::cons(var, Nil), Object::cons(condition, Nil));
+			return Evaluator::progn(newenv, handler);
+		}
+
+		// Evaluates the single argument of an error accessor.
+		static Object *error_argument(Object *env, Object *list, const char *name)
+		{
+			if (Evaluator::list_length(list) != 1)
+				error("Malformed %s", name);
+
+			Object *condition = Evaluator::eval(env, list->car);
+			if (condition->tag != T_ERROR)
+				error("%s: argument is not an error", name);
+			return condition;
+		}
+
+		// (error-message error)
+		DECLARE_PRIMITIVE_FN(ErrorMessage)
+		{
+			return error_argument(env, list, "error-message")->message;
+		}
+
+		// (error-form error)
+		DECLARE_PRIMITIVE_FN(ErrorForm)
+		{
+			return error_argument(env, list, "error-form")->form;
+		}
+
+		// (error-backtrace error)
+		DECLARE_PRIMITIVE_FN(ErrorBacktrace)
+		{
+			return error_argument(env, list, "error-backtrace")->backtrace;
 		}
 
 		///////////
@@ -613,12 +856,18 @@ namespace PolyScript
 			// Lisp primitives
 			add_primitive(env, "quote", Quote);
 			add_primitive(env, "list", List);
+			add_primitive(env, "cons", Cons);
+			add_primitive(env, "car", Car);
+			add_primitive(env, "cdr", Cdr);
 			add_primitive(env, "defun", Defun);
 			add_primitive(env, "lambda", Lambda);
 			add_primitive(env, "setq", Setq);
 			add_primitive(env, "define", Define);
 			add_primitive(env, "defmacro", Defmacro);
 			add_primitive(env, "println", Println);
+			add_primitive(env, "prin1-to-string", Prin1ToString);
+			add_primitive(env, "load", Load);
+			add_primitive(env, "load-parallel", LoadParallel);
 
 			// Equality primitives
 			add_primitive(env, "eq", Eq);
@@ -636,7 +885,36 @@ namespace PolyScript
 			add_primitive(env, "minusp", MinusP);
 
 			add_primitive(env, "if", If);
-			
+
+			// Non-local exits and errors
+			add_primitive(env, "catch", Catch);
+			add_primitive(env, "throw", ThrowTag);
+			add_primitive(env, "unwind-protect", UnwindProtect);
+			add_primitive(env, "error", RaiseError);
+			add_primitive(env, "handler-case", HandlerCase);
+			add_primitive(env, "error-message", ErrorMessage);
+			add_primitive(env, "error-form", ErrorForm);
+			add_primitive(env, "error-backtrace", ErrorBacktrace);
+
+			Vector::create_primitives(env);
+			HashTable::create_primitives(env);
+			Map::create_primitives(env);
+			Strings::create_primitives(env);
+			Streams::create_primitives(env);
+			Sequence::create_primitives(env);
+			Parallel::create_primitives(env);
+			Futures::create_primitives(env);
+			Channels::create_primitives(env);
+			Coroutines::create_primitives(env);
+			EventLoop::create_primitives(env);
+			Profiler::create_primitives(env);
+			Allocations::create_primitives(env);
+			Stats::create_primitives(env);
+			Tracer::create_primitives(env);
+			Timing::create_primitives(env);
+			Limits::create_primitives(env);
+			Specials::create_primitives(env);
+			Let::create_primitives(env);
 		}
 	};
 };
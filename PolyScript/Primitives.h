@@ -4,6 +4,8 @@
 #include "Evaluator.h"
 #include "Parser.h"
 
+#define DECLARE_PRIMITIVE_FN(NAME) static Object * NAME (Object *env, Object *list)
+
 namespace PolyScript
 {
 	namespace Primitives
@@ -12,5 +14,8 @@ namespace PolyScript
 
 		// Add a primitive function to the environment.
 		void add_primitive(Object *env, const char *name, Primitive *fn);
+
+		// Checks that a primitive got between min and max arguments and returns their values.
+		Object *evaluate_arguments(Object *env, Object *list, int min, int max, const char *name);
 	};
 };
\ No newline at end of file
@@ -0,0 +1,352 @@
+#include "stdafx.h"
+#include "Printer.h"
+#include "Vector.h"
+#include "Map.h"
+#include "Futures.h"
+#include "Channels.h"
+#include "Coroutines.h"
+
+#include <charconv>
+#include <cmath>
+#include <vector>
+
+#ifdef _WIN32
+#include <Windows.h>
+#endif
+
+namespace PolyScript
+{
+	namespace Printer
+	{
+		static Sink *current_sink = stdout_sink;
+
+		void stdout_sink(const char *text, size_t length)
+		{
+			fwrite(text, 1, length, stdout);
+		}
+
+		void debug_sink(const char *text, size_t length)
+		{
+#ifdef _WIN32
+			std::string terminated(text, length);
+			OutputDebugStringA(terminated.c_str());
+#else
+			fwrite(text, 1, length, stderr);
+#endif
+		}
+
+		void set_sink(Sink *sink)
+		{
+			current_sink = sink;
+		}
+
+		void format_int(std::string &out, int value)
+		{
+			char buf[16];
+			std::to_chars_result result = std::to_chars(buf, buf + sizeof(buf), value);
+			out.append(buf, result.ptr);
+		}
+
+		void format_float(std::string &out, double value)
+		{
+			// Spelled as the reader reads them, since they have no digits.
+			if (std::isnan(value)) {
+				out += "+nan.0";
+				return;
+			}
+			if (std::isinf(value)) {
+				out += value < 0 ? "-inf.0" : "+inf.0";
+				return;
+			}
+
+			// The shortest text that reads back as the same double, which may have an
+			// exponent, as in 1e+20.
+			char buf[32];
+			std::to_chars_result result = std::to_chars(buf, buf + sizeof(buf), value);
+			out.append(buf, result.ptr);
+
+			// Keep a decimal point or exponent so the reader sees a float again.
+			for (char *p = buf; p != result.ptr; p++)
+				if (*p == '.' || *p == 'e')
+					return;
+			out += ".0";
+		}
+
+		// Prints a string in quotes, escaping what the reader would otherwise misread.
+		static void print_string(std::string &out, Object *obj)
+		{
+			out += '"';
+			for (size_t i = 0; i < obj->str_length; i++) {
+				char c = obj->str_value[i];
+				switch (c) {
+				case '"':
+				case '\\':
+					out += '\\';
+					out += c;
+					break;
+				case '\n':
+					out += "\\n";
+					break;
+				case '\t':
+					out += "\\t";
+					break;
+				default:
+					out += c;
+				}
+			}
+			out += '"';
+		}
+
+		// Prints anything that isn't a cons cell.
+		static void print_atom(std::string &out, Object *obj, bool readably)
+		{
+			switch (obj->tag) {
+
+			case T_ATOM:
+				switch (obj->atom_subtype)
+				{
+				case AT_INT:
+					format_int(out, obj->int_value);
+					return;
+				case AT_FLOAT:
+					format_float(out, obj->float_value);
+					return;
+				case AT_SYMBOL:
+					out += obj->name;
+					return;
+				case AT_STRING:
+					if (!readably) {
+						out.append(obj->str_value, obj->str_length);
+						return;
+					}
+					print_string(out, obj);
+					return;
+				}
+				break;
+
+			case T_PRIMITIVE:
+				out += "<primitive>";
+				return;
+			case T_FUNCTION:
+				out += "<function>";
+				return;
+			case T_MACRO:
+				out += "<macro>";
+				return;
+			case T_VECTOR:
+				// Generic vectors are containers and are handled by print_to.
+				out += Vector::syntax_prefix(obj->vector_type);
+				out += '(';
+				for (size_t i = 0; i < obj->length; i++) {
+					if (i)
+						out += ' ';
+					if (obj->vector_type == VT_INT32)
+						format_int(out, obj->int32_elements()[i]);
+					else
+						format_float(out, obj->float64_elements()[i]);
+				}
+				out += ')';
+				return;
+			case T_HASHTABLE:
+				out += obj->hash_test == HT_EQUAL ? "<hash-table equal " : "<hash-table eq ";
+				format_int(out, obj->hash_count);
+				out += ">";
+				return;
+			case T_BUILDER:
+				out += "<string-builder ";
+				format_int(out, (int)obj->builder_length);
+				out += ">";
+				return;
+			case T_STREAM:
+				out += obj->stream_reader ? "<input-stream>" : "<closed-stream>";
+				return;
+			case T_SEQUENCE:
+				out += "<lazy-sequence>";
+				return;
+			case T_FUTURE:
+				out += obj->future->done() ? "<future done>" : "<future>";
+				return;
+			case T_CHANNEL:
+				out += obj->channel->closed() ? "<closed-channel>" : "<channel>";
+				return;
+			case T_COROUTINE:
+				out += "<coroutine ";
+				out += Coroutines::status_name(obj->coroutine->status());
+				out += ">";
+				return;
+			case T_ERROR:
+				out += "<error: ";
+				out += obj->message->str_value;
+				out += ">";
+				return;
+			case T_SPECIAL:
+				if (obj == Nil)
+					out += "()";
+				else if (obj == True)
+					out += "t";
+				else
+					error("Bug: print: Unknown subtype: %d", obj->subtype);
+				return;
+			case T_ENV:
+			case T_STACK_ENV:
+				out += "<environment>";
+				return;
+			default:
+				// Conses and maps are containers and are handled by print_to.
+				break;
+			}
+
+			error("Bug: print: Unknown tag type: %d", obj->tag);
+		}
+
+		// A list, generic vector or map that print_to is partway through.
+		struct Container {
+			// For a list, the cell whose car was printed most recently, or Nil once
+			// the tail of a dotted list has been printed.
+			Object *obj;
+
+			// For a vector, the index of the next element to print. Maps are
+			// printed from a vector of their keys and values.
+			size_t next;
+		};
+
+		static bool is_container(Object *obj)
+		{
+			return obj->tag == T_CELL || obj->tag == T_MAP || (obj->tag == T_VECTOR && obj->vector_type == VT_GENERIC);
+		}
+
+		void print_to(std::string &out, Object *obj, bool readably)
+		{
+			// The containers currently being printed, innermost last. Keeping these
+			// on the heap rather than recursing lets deeply nested cars print
+			// without running out of C stack.
+			std::vector<Container> open;
+
+			for (;;) {
+				// Descend into containers until reaching something that prints on its own.
+				while (is_container(obj)) {
+					if (obj->tag == T_CELL) {
+						out += '(';
+						open.push_back({ obj, 0 });
+						obj = obj->car;
+						continue;
+					}
+
+					if (obj->tag == T_MAP) {
+						out += "#m";
+						obj = Map::flatten(obj);
+					}
+					else
+						out += '#';
+
+					out += '(';
+					if (obj->length == 0) {
+						out += ')';
+						break;
+					}
+					open.push_back({ obj, 1 });
+					obj = obj->generic_elements()[0];
+				}
+
+				if (!is_container(obj))
+					print_atom(out, obj, readably);
+
+				// Close every container that has just ended, then move on to the next element.
+				for (;;) {
+					if (open.empty())
+						return;
+
+					Container &c = open.back();
+					if (c.obj == Nil) {
+						out += ')';
+						open.pop_back();
+						continue;
+					}
+					if (c.obj->tag == T_VECTOR) {
+						if (c.next == c.obj->length) {
+							out += ')';
+							open.pop_back();
+							continue;
+						}
+						out += ' ';
+						obj = c.obj->generic_elements()[c.next++];
+						break;
+					}
+
+					Object *rest = c.obj->cdr;
+					if (rest == Nil) {
+						out += ')';
+						open.pop_back();
+						continue;
+					}
+					if (rest->tag != T_CELL) {
+						out += " . ";
+						c.obj = Nil;
+						obj = rest;
+						break;
+					}
+
+					out += ' ';
+					c.obj = rest;
+					obj = rest->car;
+					break;
+				}
+			}
+		}
+
+		std::string to_string(Object *obj, bool readably)
+		{
+			std::string out;
+			print_to(out, obj, readably);
+			return out;
+		}
+
+		void print(Object *obj)
+		{
+			std::string out;
+			print_to(out, obj);
+			current_sink(out.data(), out.size());
+		}
+
+		void write(const std::string &text)
+		{
+			current_sink(text.data(), text.size());
+		}
+
+		void println(Object *obj, Sink *sink)
+		{
+			std::string out;
+			print_to(out, obj);
+			out += '\n';
+			sink(out.data(), out.size());
+		}
+
+		void println(Object *obj)
+		{
+			println(obj, current_sink);
+		}
+
+		std::string describe_error(const Error &e)
+		{
+			std::string out = e.message;
+			out += '\n';
+
+			// Show the innermost forms; the rest are usually the same recursion again.
+			size_t shown = e.backtrace.size() < 8 ? e.backtrace.size() : 8;
+			for (size_t i = 0; i < shown; i++) {
+				out += "  in ";
+				print_to(out, e.backtrace[i], true);
+				out += '\n';
+			}
+			return out;
+		}
+
+		std::string describe_throw(const Throw &t)
+		{
+			std::string out = "No catch for tag ";
+			print_to(out, t.tag, true);
+			out += '\n';
+			return out;
+		}
+	};
+};
@@ -0,0 +1,41 @@
+#pragma once
+
+#include "PolyScript.h"
+
+#include <string>
+
+namespace PolyScript
+{
+	namespace Printer
+	{
+		// Somewhere printed text can go. Each printed result is handed over in one call.
+		typedef void Sink(const char *text, size_t length);
+
+		void stdout_sink(const char *text, size_t length);
+
+		// The debugger's output window on Windows, stderr elsewhere.
+		void debug_sink(const char *text, size_t length);
+
+		// Sets where print and println write to. Defaults to stdout_sink.
+		void set_sink(Sink *sink);
+
+		void format_int(std::string &out, int value);
+		void format_float(std::string &out, double value);
+
+		// Appends the printed representation of obj to out. When readably is set,
+		// strings are printed with their quotes so the text can be read back.
+		void print_to(std::string &out, Object *obj, bool readably = false);
+		std::string to_string(Object *obj, bool readably = false);
+
+		// An error message followed by the innermost forms of its backtrace, one per line.
+		std::string describe_error(const Error &e);
+		std::string describe_throw(const Throw &t);
+
+		// Writes text as it is to where print writes.
+		void write(const std::string &text);
+
+		void print(Object *obj);
+		void println(Object *obj);
+		void println(Object *obj, Sink *sink);
+	};
+};
@@ -0,0 +1,306 @@
+#include "stdafx.h"
+#include "Profiler.h"
+#include "Primitives.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <map>
+
+#ifdef _WIN32
+#include <chrono>
+#include <thread>
+#else
+#include <signal.h>
+#include <sys/time.h>
+#endif
+
+// Samples go into one preallocated buffer: a header word holding the number of
+// frames, then the frames, root first. Taking a sample only reserves space with an
+// atomic add and copies pointers, so it is safe inside a signal handler; names are
+// looked up when the report is made.
+
+namespace PolyScript
+{
+	namespace Profiler
+	{
+		using Primitives::evaluate_arguments;
+
+		thread_local ShadowStack shadow_stack;
+		std::atomic<int> stack_users(0);
+
+		// Set while the timer is sampling.
+		static std::atomic<bool> active(false);
+
+		// The most frames kept from one sample, counting from the innermost.
+		static const int SAMPLE_DEPTH = 128;
+		static const size_t BUFFER_WORDS = 1 << 20;
+
+		static std::vector<uintptr_t> buffer;
+		static std::atomic<size_t> cursor(0);
+		static std::atomic<int> samples(0);
+		static std::atomic<int> dropped(0);
+		static int interval = 0;
+
+		// A header is never zero, so a reserved word that was never written marks the end.
+		static uintptr_t header(int count, bool truncated) { return 1 + ((uintptr_t)count << 1) + truncated; }
+		static int header_count(uintptr_t word) { return (int)((word - 1) >> 1); }
+		static bool header_truncated(uintptr_t word) { return ((word - 1) & 1) != 0; }
+
+		static void take_sample(ShadowStack &stack)
+		{
+			int depth = stack.depth;
+			std::atomic_signal_fence(std::memory_order_acquire);
+			int recorded = depth < MAX_DEPTH ? depth : MAX_DEPTH;
+			int first = recorded > SAMPLE_DEPTH ? recorded - SAMPLE_DEPTH : 0;
+			int count = recorded - first;
+
+			size_t at = cursor.fetch_add(count + 1, std::memory_order_relaxed);
+			if (at + count + 1 > buffer.size()) {
+				dropped.fetch_add(1, std::memory_order_relaxed);
+				return;
+			}
+			for (int i = 0; i < count; i++)
+				buffer[at + 1 + i] = (uintptr_t)stack.frames[first + i];
+			buffer[at] = header(count, first > 0 || depth > MAX_DEPTH);
+			samples.fetch_add(1, std::memory_order_relaxed);
+		}
+
+#ifdef _WIN32
+		// Without a CPU timer signal, a thread wakes up every interval and samples the
+		// thread that started the profiler.
+		static ShadowStack *sampled_stack;
+		static std::thread sampler;
+
+		static void sample_loop()
+		{
+			while (active.load())
+			{
+				std::this_thread::sleep_for(std::chrono::microseconds(interval));
+				take_sample(*sampled_stack);
+			}
+		}
+#else
+		static void on_timer(int)
+		{
+			int saved_errno = errno;
+			if (active.load(std::memory_order_relaxed))
+				take_sample(shadow_stack);
+			errno = saved_errno;
+		}
+
+		static void set_timer(int microseconds)
+		{
+			struct itimerval timer;
+			timer.it_interval.tv_sec = microseconds / 1000000;
+			timer.it_interval.tv_usec = microseconds % 1000000;
+			timer.it_value = timer.it_interval;
+			setitimer(ITIMER_PROF, &timer, NULL);
+		}
+#endif
+
+		void start(int interval_us)
+		{
+			if (running())
+				stop();
+			if (interval_us < 1)
+				error("profile-start: the interval must be at least a microsecond");
+
+			buffer.assign(BUFFER_WORDS, 0);
+			cursor = 0;
+			samples = 0;
+			dropped = 0;
+			interval = interval_us;
+			stack_users++;
+			active = true;
+
+#ifdef _WIN32
+			sampled_stack = &shadow_stack;
+			sampler = std::thread(sample_loop);
+#else
+			struct sigaction action;
+			memset(&action, 0, sizeof(action));
+			action.sa_handler = on_timer;
+			action.sa_flags = SA_RESTART;
+			sigemptyset(&action.sa_mask);
+			sigaction(SIGPROF, &action, NULL);
+			set_timer(interval_us);
+#endif
+		}
+
+		int stop()
+		{
+			if (!running())
+				return samples;
+			active = false;
+#ifdef _WIN32
+			sampler.join();
+#else
+			set_timer(0);
+#endif
+			stack_users--;
+			return samples;
+		}
+
+		bool running()
+		{
+			return active.load();
+		}
+
+		static const char *frame_name(uintptr_t frame)
+		{
+			Object *fn = (Object *)frame;
+			if (!fn)
+				return "(unknown)";
+			return fn->fn_name ? fn->fn_name->name : "(lambda)";
+		}
+
+		// Calls body with the frames of each complete sample, root first.
+		template <typename F>
+		static void for_each_sample(F body)
+		{
+			size_t end = std::min(cursor.load(), buffer.size());
+			std::vector<const char *> names;
+			for (size_t at = 0; at < end && buffer[at] != 0; at += header_count(buffer[at]) + 1) {
+				names.clear();
+				if (header_truncated(buffer[at]))
+					names.push_back("...");
+				for (int i = 0; i < header_count(buffer[at]); i++)
+					names.push_back(frame_name(buffer[at + 1 + i]));
+				if (names.empty())
+					names.push_back("(toplevel)");
+				body(names);
+			}
+		}
+
+		std::string report(bool cumulative)
+		{
+			// depth is the shallowest the function was seen at, to order callers
+			// before callees that have the same count.
+			struct Counts { int self; int total; size_t depth; };
+			std::map<std::string, Counts> functions;
+			int total = 0;
+			for_each_sample([&](const std::vector<const char *> &names) {
+				total++;
+				functions[names.back()].self++;
+				// A recursive function is counted once per sample.
+				for (size_t i = 0; i < names.size(); i++) {
+					if (std::find_if(names.begin(), names.begin() + i, [&](const char *n) { return strcmp(n, names[i]) == 0; }) != names.begin() + i)
+						continue;
+					Counts &counts = functions[names[i]];
+					if (counts.total++ == 0 || i < counts.depth)
+						counts.depth = i;
+				}
+			});
+
+			std::vector<std::pair<std::string, Counts>> rows(functions.begin(), functions.end());
+			std::stable_sort(rows.begin(), rows.end(), [&](const std::pair<std::string, Counts> &a, const std::pair<std::string, Counts> &b) {
+				int x = cumulative ? a.second.total : a.second.self;
+				int y = cumulative ? b.second.total : b.second.self;
+				return x != y ? x > y : a.second.depth < b.second.depth;
+			});
+
+			char line[256];
+			snprintf(line, sizeof(line), "%d samples every %d us, %d dropped\n     self            total      function\n",
+				total, interval, dropped.load());
+			std::string out = line;
+			for (auto &row : rows) {
+				snprintf(line, sizeof(line), "%6.1f%% %8d  %6.1f%% %8d   %s\n",
+					100.0 * row.second.self / total, row.second.self,
+					100.0 * row.second.total / total, row.second.total, row.first.c_str());
+				out += line;
+			}
+			return out;
+		}
+
+		std::string folded()
+		{
+			std::map<std::string, int> stacks;
+			std::string stack;
+			for_each_sample([&](const std::vector<const char *> &names) {
+				stack.clear();
+				for (const char *name : names) {
+					if (!stack.empty())
+						stack += ';';
+					stack += name;
+				}
+				stacks[stack]++;
+			});
+
+			std::string out;
+			for (auto &entry : stacks)
+				out += entry.first + " " + std::to_string(entry.second) + "\n";
+			return out;
+		}
+
+		int depth()
+		{
+			return shadow_stack.depth;
+		}
+
+		void save_frames(std::vector<Object *> &frames, int base)
+		{
+			ShadowStack &stack = shadow_stack;
+			frames.clear();
+			for (int i = base; i < stack.depth; i++)
+				frames.push_back(i < MAX_DEPTH ? stack.frames[i] : NULL);
+			stack.depth = base;
+		}
+
+		void restore_frames(const std::vector<Object *> &frames)
+		{
+			ShadowStack &stack = shadow_stack;
+			for (Object *fn : frames) {
+				if (stack.depth < MAX_DEPTH)
+					stack.frames[stack.depth] = fn;
+				std::atomic_signal_fence(std::memory_order_release);
+				stack.depth++;
+			}
+		}
+
+		// (profile-start [microseconds]) starts sampling, by default every millisecond
+		// of CPU time.
+		DECLARE_PRIMITIVE_FN(ProfileStart)
+		{
+			Object *args = evaluate_arguments(env, list, 0, 1, "profile-start");
+			int interval_us = 1000;
+			if (args != Nil) {
+				if (!args->car->IsAtomSubtype(AT_INT))
+					error("profile-start: the interval is not an integer");
+				interval_us = args->car->int_value;
+			}
+			start(interval_us);
+			return True;
+		}
+
+		// (profile-stop) returns the number of samples taken.
+		DECLARE_PRIMITIVE_FN(ProfileStop)
+		{
+			evaluate_arguments(env, list, 0, 0, "profile-stop");
+			return Object::MakeInt(stop());
+		}
+
+		// (profile-report [kind]) returns the last run's samples as a string. kind is
+		// flat (the default), cumulative or folded.
+		DECLARE_PRIMITIVE_FN(ProfileReport)
+		{
+			Object *args = evaluate_arguments(env, list, 0, 1, "profile-report");
+			std::string text;
+			if (args == Nil || args->car == Object::intern("flat"))
+				text = report(false);
+			else if (args->car == Object::intern("cumulative"))
+				text = report(true);
+			else if (args->car == Object::intern("folded"))
+				text = folded();
+			else
+				error("profile-report: the kind must be flat, cumulative or folded");
+			return Object::MakeString(text.data(), text.size());
+		}
+
+		void create_primitives(Object *env)
+		{
+			Primitives::add_primitive(env, "profile-start", ProfileStart);
+			Primitives::add_primitive(env, "profile-stop", ProfileStop);
+			Primitives::add_primitive(env, "profile-report", ProfileReport);
+		}
+	};
+};
@@ -0,0 +1,95 @@
+#pragma once
+
+#include "PolyScript.h"
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+namespace PolyScript
+{
+	// A sampling profiler for scripts. While it runs, every call of a PolyScript
+	// function is pushed on a per-thread shadow stack, and a timer takes a copy of
+	// the stack of whichever thread it interrupts. Native profilers only see eval
+	// and apply; this sees the script's own functions.
+	namespace Profiler
+	{
+		// Frames deeper than this are counted but not recorded.
+		static const int MAX_DEPTH = 1024;
+
+		struct ShadowStack
+		{
+			Object *frames[MAX_DEPTH];
+			int depth;
+		};
+
+		extern thread_local ShadowStack shadow_stack;
+
+		// How many tools need the shadow stack: the profiler and the allocation tracker.
+		extern std::atomic<int> stack_users;
+
+		// Pushes a function on this thread's shadow stack for as long as it runs.
+		// Does nothing unless something is using the stack.
+		class Frame
+		{
+		public:
+			explicit Frame(Object *fn) : pushed(stack_users.load(std::memory_order_relaxed) > 0)
+			{
+				if (pushed) {
+					ShadowStack &stack = shadow_stack;
+					if (stack.depth < MAX_DEPTH)
+						stack.frames[stack.depth] = fn;
+					// The timer's handler runs on this thread, so it only has to see
+					// the frame stored before the depth that covers it.
+					std::atomic_signal_fence(std::memory_order_release);
+					stack.depth++;
+				}
+			}
+
+			~Frame()
+			{
+				if (pushed)
+					shadow_stack.depth--;
+			}
+
+			Frame(const Frame &) = delete;
+			Frame &operator=(const Frame &) = delete;
+
+		private:
+			bool pushed;
+		};
+
+		// The innermost function on this thread's shadow stack, or NULL.
+		inline Object *current_function()
+		{
+			const ShadowStack &stack = shadow_stack;
+			return stack.depth > 0 && stack.depth <= MAX_DEPTH ? stack.frames[stack.depth - 1] : NULL;
+		}
+
+		// Starts sampling every interval_us microseconds of CPU time, discarding the
+		// samples of any earlier run.
+		void start(int interval_us = 1000);
+
+		// Stops sampling. Returns the number of samples taken.
+		int stop();
+
+		bool running();
+
+		// A table of functions by samples in the function itself (flat) or in it and
+		// everything it called (cumulative).
+		std::string report(bool cumulative = false);
+
+		// One line per distinct stack, root first, in the folded format that
+		// flamegraph tools read: "F;G;H 12".
+		std::string folded();
+
+		// Called around a coroutine switch, so that a coroutine's frames leave the
+		// shadow stack with it and come back when it is resumed.
+		int depth();
+		void save_frames(std::vector<Object *> &frames, int base);
+		void restore_frames(const std::vector<Object *> &frames);
+
+		// Add profile-start, profile-stop and profile-report to the environment.
+		void create_primitives(Object *env);
+	};
+};
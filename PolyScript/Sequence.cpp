@@ -0,0 +1,329 @@
+#include "stdafx.h"
+#include "Sequence.h"
+#include "Let.h"
+#include "Vector.h"
+#include "Primitives.h"
+
+#include <climits>
+
+namespace PolyScript
+{
+	namespace Sequence
+	{
+		using Primitives::evaluate_arguments;
+
+		Iterator::Iterator(Object *seq, const char *name) : seq(seq), index(0)
+		{
+			if (seq != Nil && seq->tag != T_CELL && seq->tag != T_VECTOR && seq->tag != T_SEQUENCE)
+				error("%s: argument is not a sequence", name);
+		}
+
+		Object *Iterator::next()
+		{
+			if (seq == Nil)
+				return NULL;
+
+			switch (seq->tag) {
+			case T_CELL: {
+				Object *element = seq->car;
+				seq = seq->cdr;
+				if (seq != Nil && seq->tag != T_CELL)
+					error("Cannot iterate over a dotted list");
+				return element;
+			}
+			case T_VECTOR:
+				if (index == seq->length)
+					return NULL;
+				return Vector::element(seq, index++);
+			default:
+				return seq->seq_next(seq);
+			}
+		}
+
+		// (count-if pred sequence) counts the elements for which pred is true. Each
+		// element is tested in a scratch scope, so a lazy sequence of any length can
+		// be counted in constant memory.
+		DECLARE_PRIMITIVE_FN(CountIf)
+		{
+			Object *args = evaluate_arguments(env, list, 2, 2, "count-if");
+			Object *pred = args->car;
+			Iterator elements(args->cdr->car, "count-if");
+
+			int count = 0;
+			for (;;) {
+				ScratchScope scope;
+				Object *element = elements.next();
+				if (!element)
+					break;
+				if (Evaluator::funcall(env, pred, Object::cons(element, Nil)) != Nil)
+					count++;
+			}
+			return Object::MakeInt(count);
+		}
+
+		static Object *next_in_list(Object *seq)
+		{
+			Object *list = seq->seq_source;
+			if (list == Nil)
+				return NULL;
+			if (list->tag != T_CELL)
+				error("Cannot iterate over a dotted list");
+			seq->seq_source = list->cdr;
+			return list->car;
+		}
+
+		static Object *next_in_vector(Object *seq)
+		{
+			if ((size_t)seq->seq_index == seq->seq_source->length)
+				return NULL;
+			return Vector::element(seq->seq_source, seq->seq_index++);
+		}
+
+		Object *lazy(Object *seq, const char *name)
+		{
+			if (seq == Nil || seq->tag == T_CELL)
+				return Object::MakeSequence(next_in_list, seq);
+			if (seq->tag == T_VECTOR)
+				return Object::MakeSequence(next_in_vector, seq);
+			if (seq->tag != T_SEQUENCE)
+				error("%s: argument is not a sequence", name);
+			return seq;
+		}
+
+		static Object *next_in_range(Object *seq)
+		{
+			if (seq->seq_step > 0 ? seq->seq_index >= seq->seq_limit : seq->seq_index <= seq->seq_limit)
+				return NULL;
+			Object *value = Object::MakeInt((int)seq->seq_index);
+			seq->seq_index += seq->seq_step;
+			return value;
+		}
+
+		static Object *next_mapped(Object *seq)
+		{
+			Object *upstream = seq->seq_source;
+			Object *element = upstream->seq_next(upstream);
+			if (!element)
+				return NULL;
+			return Evaluator::funcall(seq->seq_env, seq->seq_fn, Object::cons(element, Nil));
+		}
+
+		// Each rejected element is dropped with its own scratch scope, so a filter that
+		// skips a long run doesn't grow memory while the consumer waits for one element.
+		static Object *next_filtered(Object *seq)
+		{
+			Object *upstream = seq->seq_source;
+			for (;;) {
+				ScratchScope scope;
+				Object *element = upstream->seq_next(upstream);
+				if (!element)
+					return NULL;
+				if (Evaluator::funcall(seq->seq_env, seq->seq_fn, Object::cons(element, Nil)) != Nil) {
+					scope.keep();
+					return element;
+				}
+			}
+		}
+
+		static Object *next_taken(Object *seq)
+		{
+			if (seq->seq_index == seq->seq_limit)
+				return NULL;
+			Object *upstream = seq->seq_source;
+			Object *element = upstream->seq_next(upstream);
+			if (element)
+				seq->seq_index++;
+			return element;
+		}
+
+		static Object *next_generated(Object *seq)
+		{
+			Object *value = Evaluator::funcall(seq->seq_env, seq->seq_fn, Nil);
+			return value == Nil ? NULL : value;
+		}
+
+		static int64_t integer_argument(Object *value, const char *name)
+		{
+			if (!value->IsAtomSubtype(AT_INT))
+				error("%s: argument is not an integer", name);
+			return value->int_value;
+		}
+
+		// A stage that calls fn on what comes out of source.
+		static Object *make_stage(SequenceNext *next, Object *env, Object *fn, Object *source, const char *name)
+		{
+			Object *seq = Object::MakeSequence(next, lazy(source, name));
+			seq->seq_fn = fn;
+			seq->seq_env = Let::heap_env(env);
+			return seq;
+		}
+
+		// (range), (range end), (range start end) or (range start end step). Without
+		// an end the range goes on as far as an int does.
+		DECLARE_PRIMITIVE_FN(Range)
+		{
+			Object *args = evaluate_arguments(env, list, 0, 3, "range");
+			int count = Evaluator::list_length(args);
+
+			Object *seq = Object::MakeSequence(next_in_range, Nil);
+			seq->seq_limit = INT_MAX;
+			seq->seq_step = 1;
+			if (count == 1)
+				seq->seq_limit = integer_argument(args->car, "range");
+			if (count >= 2) {
+				seq->seq_index = integer_argument(args->car, "range");
+				seq->seq_limit = integer_argument(args->cdr->car, "range");
+			}
+			if (count == 3)
+				seq->seq_step = integer_argument(args->cdr->cdr->car, "range");
+			if (seq->seq_step == 0)
+				error("range: step is zero");
+			return seq;
+		}
+
+		// (lazy-map fn sequence)
+		DECLARE_PRIMITIVE_FN(LazyMap)
+		{
+			Object *args = evaluate_arguments(env, list, 2, 2, "lazy-map");
+			return make_stage(next_mapped, env, args->car, args->cdr->car, "lazy-map");
+		}
+
+		// (lazy-filter pred sequence)
+		DECLARE_PRIMITIVE_FN(LazyFilter)
+		{
+			Object *args = evaluate_arguments(env, list, 2, 2, "lazy-filter");
+			return make_stage(next_filtered, env, args->car, args->cdr->car, "lazy-filter");
+		}
+
+		// (take n sequence) returns a lazy sequence of at most n elements.
+		DECLARE_PRIMITIVE_FN(Take)
+		{
+			Object *args = evaluate_arguments(env, list, 2, 2, "take");
+			int64_t n = integer_argument(args->car, "take");
+			if (n < 0)
+				error("take: count is negative");
+
+			Object *seq = Object::MakeSequence(next_taken, lazy(args->cdr->car, "take"));
+			seq->seq_limit = n;
+			return seq;
+		}
+
+		// (generator thunk) returns a lazy sequence of the values of calling thunk,
+		// ending when it returns nil.
+		DECLARE_PRIMITIVE_FN(Generator)
+		{
+			Object *args = evaluate_arguments(env, list, 1, 1, "generator");
+			Object *seq = Object::MakeSequence(next_generated, Nil);
+			seq->seq_fn = args->car;
+			seq->seq_env = Let::heap_env(env);
+			return seq;
+		}
+
+		Object *keep(const ScratchScope &scope, Object *value)
+		{
+			// Inside another scratch scope, the outer arena is the scratch arena too, and
+			// a copy made there would be rewound with the rest.
+			bool nested = scope.outer_arena() == current_arena;
+			if (!nested && (value->IsNumber() || value->IsAtomSubtype(AT_STRING))) {
+				Arena *scratch = current_arena;
+				current_arena = scope.outer_arena();
+				if (value->atom_subtype == AT_INT)
+					value = Object::MakeInt(value->int_value);
+				else if (value->atom_subtype == AT_FLOAT)
+					value = Object::MakeFloat(value->float_value);
+				else
+					value = Object::MakeString(value->str_value, value->str_length);
+				current_arena = scratch;
+				return value;
+			}
+			if (value->tag != T_SPECIAL && !value->IsAtomSubtype(AT_SYMBOL))
+				note_pointer_store();
+			return value;
+		}
+
+		// (reduce fn initial sequence) folds the elements into (fn (fn initial e1) e2) ...
+		DECLARE_PRIMITIVE_FN(Reduce)
+		{
+			Object *args = evaluate_arguments(env, list, 3, 3, "reduce");
+			Object *fn = args->car;
+			Object *result = args->cdr->car;
+			Iterator elements(args->cdr->cdr->car, "reduce");
+
+			for (;;) {
+				ScratchScope scope;
+				Object *element = elements.next();
+				if (!element)
+					break;
+				result = keep(scope, Evaluator::funcall(env, fn, Object::cons(result, Object::cons(element, Nil))));
+			}
+			return result;
+		}
+
+		// Appends value to the list being built in head and tail.
+		static void collect(Object *&head, Object *&tail, Object *value)
+		{
+			Object *cell = Object::cons(value, Nil);
+			if (tail)
+				tail->cdr = cell;
+			else
+				head = cell;
+			tail = cell;
+		}
+
+		// (to-list sequence) collects the elements into a list.
+		DECLARE_PRIMITIVE_FN(ToList)
+		{
+			Object *args = evaluate_arguments(env, list, 1, 1, "to-list");
+			Iterator elements(args->car, "to-list");
+
+			Object *head = Nil;
+			Object *tail = NULL;
+			while (Object *element = elements.next())
+				collect(head, tail, element);
+			return head;
+		}
+
+		// (mapcar fn sequence) is the eager lazy-map: it returns a new list.
+		DECLARE_PRIMITIVE_FN(Mapcar)
+		{
+			Object *args = evaluate_arguments(env, list, 2, 2, "mapcar");
+			Iterator elements(args->cdr->car, "mapcar");
+
+			Object *head = Nil;
+			Object *tail = NULL;
+			while (Object *element = elements.next())
+				collect(head, tail, Evaluator::funcall(env, args->car, Object::cons(element, Nil)));
+			return head;
+		}
+
+		// (filter pred sequence) is the eager lazy-filter: it returns a new list.
+		DECLARE_PRIMITIVE_FN(Filter)
+		{
+			Object *args = evaluate_arguments(env, list, 2, 2, "filter");
+			Iterator elements(args->cdr->car, "filter");
+
+			Object *head = Nil;
+			Object *tail = NULL;
+			while (Object *element = elements.next())
+				if (Evaluator::funcall(env, args->car, Object::cons(element, Nil)) != Nil)
+					collect(head, tail, element);
+			return head;
+		}
+
+		void create_primitives(Object *env)
+		{
+			Primitives::add_primitive(env, "count-if", CountIf);
+			Primitives::add_primitive(env, "reduce", Reduce);
+			Primitives::add_primitive(env, "to-list", ToList);
+			Primitives::add_primitive(env, "mapcar", Mapcar);
+			Primitives::add_primitive(env, "filter", Filter);
+
+			// Lazy sequences
+			Primitives::add_primitive(env, "range", Range);
+			Primitives::add_primitive(env, "lazy-map", LazyMap);
+			Primitives::add_primitive(env, "lazy-filter", LazyFilter);
+			Primitives::add_primitive(env, "take", Take);
+			Primitives::add_primitive(env, "generator", Generator);
+		}
+	};
+};
@@ -0,0 +1,41 @@
+#pragma once
+
+#include "PolyScript.h"
+
+namespace PolyScript
+{
+	// Lazy sequences produce their elements one at a time, as they are asked for.
+	// Stages such as lazy-map and lazy-filter pull from the stage before them, so
+	// a whole pipeline runs element by element and builds no intermediate lists.
+	// A lazy sequence can be walked only once.
+	namespace Sequence
+	{
+		// Walks the elements of a list, a vector or a lazy sequence. Elements of a
+		// lazy sequence are produced only as next() asks for them.
+		class Iterator
+		{
+		public:
+			// name is the caller, for the error raised if seq isn't a sequence.
+			Iterator(Object *seq, const char *name);
+
+			// Returns the next element, or NULL when there are no more.
+			Object *next();
+
+		private:
+			Object *seq;
+			size_t index;
+		};
+
+		// Returns seq if it is a lazy sequence, or else a lazy sequence over the
+		// elements of a list or vector.
+		Object *lazy(Object *seq, const char *name);
+
+		// Makes a value computed inside scope safe to keep after it ends. Numbers and
+		// strings are copied out, unless the scope is nested in another one; anything
+		// else makes the scope keep its memory.
+		Object *keep(const ScratchScope &scope, Object *value);
+
+		// Add the sequence primitives to the environment.
+		void create_primitives(Object *env);
+	};
+};
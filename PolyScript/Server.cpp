@@ -0,0 +1,298 @@
+#include "stdafx.h"
+#include "Server.h"
+#include "Loader.h"
+
+#include <algorithm>
+#include <cerrno>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+namespace PolyScript
+{
+	Server::Server(const Options &options)
+		: options(options), listen_fd(-1), stopping(false)
+	{
+		wake_fds[0] = wake_fds[1] = -1;
+	}
+
+	Server::~Server()
+	{
+		stop();
+	}
+
+#ifdef _WIN32
+	void Server::start()
+	{
+		error("server: Unix domain sockets aren't supported on this platform");
+	}
+
+	void Server::stop() {}
+	void Server::wait() {}
+	bool Server::read_frame(int, std::string &) { return false; }
+	bool Server::write_frame(int, const std::string &) { return false; }
+	void Server::poll_loop() {}
+	void Server::worker_loop(Interpreter *) {}
+	void Server::hand_back(int) {}
+#else
+	void Server::start()
+	{
+		std::vector<std::string> sources(options.library.size());
+		for (size_t i = 0; i < options.library.size(); i++)
+			if (!Loader::read_file(options.library[i].c_str(), sources[i]))
+				error("server: can't read %s", options.library[i].c_str());
+
+		unsigned count = options.workers ? options.workers : std::thread::hardware_concurrency();
+		if (count == 0)
+			count = 1;
+		for (unsigned i = 0; i < count; i++) {
+			interpreters.emplace_back(new Interpreter());
+			for (size_t j = 0; j < sources.size(); j++) {
+				Value value = interpreters.back()->eval_all(sources[j]);
+				if (!value.ok() && value.error != "No form to evaluate")
+					error("server: %s: %s", options.library[j].c_str(), value.error.c_str());
+			}
+		}
+
+		struct sockaddr_un address;
+		memset(&address, 0, sizeof(address));
+		address.sun_family = AF_UNIX;
+		if (options.socket_path.size() >= sizeof(address.sun_path))
+			error("server: the socket path is too long");
+		strcpy(address.sun_path, options.socket_path.c_str());
+
+		listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (listen_fd < 0)
+			error("server: socket: %s", strerror(errno));
+		unlink(options.socket_path.c_str());
+		if (bind(listen_fd, (struct sockaddr *)&address, sizeof(address)) < 0 || listen(listen_fd, 128) < 0) {
+			int saved = errno;
+			close(listen_fd);
+			listen_fd = -1;
+			error("server: can't listen on %s: %s", options.socket_path.c_str(), strerror(saved));
+		}
+		fcntl(listen_fd, F_SETFL, fcntl(listen_fd, F_GETFL) | O_NONBLOCK);
+		if (pipe(wake_fds) < 0)
+			error("server: pipe: %s", strerror(errno));
+
+		stopping = false;
+		for (auto &interpreter : interpreters)
+			workers.emplace_back(&Server::worker_loop, this, interpreter.get());
+		poller = std::thread(&Server::poll_loop, this);
+	}
+
+	void Server::stop()
+	{
+		if (listen_fd < 0)
+			return;
+		{
+			std::lock_guard<std::mutex> guard(queue_lock);
+			stopping = true;
+		}
+		queue_ready.notify_all();
+		char byte = 0;
+		if (write(wake_fds[1], &byte, 1) < 0) {}
+
+		for (auto &worker : workers)
+			worker.join();
+		workers.clear();
+		if (poller.joinable())
+			poller.join();
+
+		// Connections the workers had, or that were waiting for one.
+		for (int fd : ready)
+			close(fd);
+		ready.clear();
+		for (int fd : returned)
+			close(fd);
+		returned.clear();
+
+		close(listen_fd);
+		close(wake_fds[0]);
+		close(wake_fds[1]);
+		listen_fd = wake_fds[0] = wake_fds[1] = -1;
+		unlink(options.socket_path.c_str());
+	}
+
+	void Server::wait()
+	{
+		std::unique_lock<std::mutex> guard(queue_lock);
+		queue_ready.wait(guard, [this]() { return stopping; });
+	}
+
+	static bool read_fully(int fd, char *buffer, size_t size)
+	{
+		while (size > 0) {
+			ssize_t n = read(fd, buffer, size);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0)
+				return false;
+			buffer += n;
+			size -= n;
+		}
+		return true;
+	}
+
+	static bool write_fully(int fd, const char *buffer, size_t size)
+	{
+		while (size > 0) {
+			ssize_t n = send(fd, buffer, size, MSG_NOSIGNAL);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0)
+				return false;
+			buffer += n;
+			size -= n;
+		}
+		return true;
+	}
+
+	bool Server::read_frame(int fd, std::string &payload)
+	{
+		unsigned char header[4];
+		if (!read_fully(fd, (char *)header, 4))
+			return false;
+		uint32_t size = ((uint32_t)header[0] << 24) | ((uint32_t)header[1] << 16) | ((uint32_t)header[2] << 8) | header[3];
+		if (size > MAX_FRAME)
+			return false;
+		payload.resize(size);
+		return read_fully(fd, &payload[0], size);
+	}
+
+	bool Server::write_frame(int fd, const std::string &payload)
+	{
+		uint32_t size = (uint32_t)payload.size();
+		std::string frame;
+		frame.reserve(4 + payload.size());
+		frame += (char)(size >> 24);
+		frame += (char)(size >> 16);
+		frame += (char)(size >> 8);
+		frame += (char)size;
+		frame += payload;
+		return write_fully(fd, frame.data(), frame.size());
+	}
+
+	void Server::hand_back(int fd)
+	{
+		{
+			std::lock_guard<std::mutex> guard(returned_lock);
+			returned.push_back(fd);
+		}
+		char byte = 0;
+		if (write(wake_fds[1], &byte, 1) < 0) {}
+	}
+
+	void Server::poll_loop()
+	{
+		// Connections waiting for a request. A connection is left out while a worker
+		// has it.
+		std::vector<int> idle;
+		std::vector<struct pollfd> fds;
+		for (;;) {
+			fds.clear();
+			fds.push_back({ wake_fds[0], POLLIN, 0 });
+			fds.push_back({ listen_fd, POLLIN, 0 });
+			for (int fd : idle)
+				fds.push_back({ fd, POLLIN, 0 });
+			if (poll(fds.data(), fds.size(), -1) < 0) {
+				if (errno == EINTR)
+					continue;
+				break;
+			}
+
+			if (fds[0].revents) {
+				char bytes[64];
+				if (read(wake_fds[0], bytes, sizeof(bytes)) < 0) {}
+				std::lock_guard<std::mutex> guard(returned_lock);
+				idle.insert(idle.end(), returned.begin(), returned.end());
+				returned.clear();
+			}
+			{
+				std::lock_guard<std::mutex> guard(queue_lock);
+				if (stopping)
+					break;
+			}
+			if (fds[1].revents) {
+				int fd;
+				while ((fd = accept(listen_fd, NULL, NULL)) >= 0) {
+					// A worker blocks reading a request, so a client that stops halfway
+					// through one only holds it this long.
+					struct timeval timeout = { READ_TIMEOUT_SECONDS, 0 };
+					setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+					idle.push_back(fd);
+				}
+			}
+
+			std::vector<int> requests;
+			for (size_t i = 2; i < fds.size(); i++) {
+				if (fds[i].revents) {
+					requests.push_back(fds[i].fd);
+					idle.erase(std::find(idle.begin(), idle.end(), fds[i].fd));
+				}
+			}
+			if (!requests.empty()) {
+				{
+					std::lock_guard<std::mutex> guard(queue_lock);
+					ready.insert(ready.end(), requests.begin(), requests.end());
+				}
+				if (requests.size() == 1)
+					queue_ready.notify_one();
+				else
+					queue_ready.notify_all();
+			}
+		}
+
+		for (int fd : idle)
+			close(fd);
+	}
+
+	void Server::worker_loop(Interpreter *interpreter)
+	{
+		std::string request;
+		std::string reply;
+		for (;;) {
+			int fd;
+			{
+				std::unique_lock<std::mutex> guard(queue_lock);
+				queue_ready.wait(guard, [this]() { return stopping || !ready.empty(); });
+				if (stopping)
+					return;
+				fd = ready.front();
+				ready.pop_front();
+			}
+
+			// A closed connection polls as readable too, and ends here.
+			if (!read_frame(fd, request)) {
+				close(fd);
+				continue;
+			}
+
+			{
+				// Opened even with no limits set, to keep the request on this worker.
+				ScratchScope scratch;
+				Limits::Scope limits(options.limits);
+				Value value = interpreter->eval_all(request);
+				reply.assign(1, (char)(value.ok() ? REPLY_VALUE : REPLY_ERROR));
+				reply += value.to_string();
+			}
+
+			if (!write_frame(fd, reply)) {
+				close(fd);
+				continue;
+			}
+			hand_back(fd);
+		}
+	}
+#endif
+};
@@ -0,0 +1,103 @@
+#pragma once
+
+#include "PolyScript.h"
+#include "Interpreter.h"
+#include "Limits.h"
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace PolyScript
+{
+	// Serves evaluation requests on a Unix domain socket. Each request is a frame
+	// of source text; the reply is a frame holding a status byte, REPLY_VALUE or
+	// REPLY_ERROR, followed by the printed value or the error message. A frame is a
+	// four-byte big-endian length and then that many bytes.
+	//
+	// One thread waits on the socket and the idle connections. When a connection
+	// has a request, it is handed to a pool of workers; the worker reads the
+	// request, evaluates it, writes the reply and hands the connection back. Each
+	// worker has an Interpreter of its own, loaded with the same library, so a
+	// request sees the library's definitions but not what other requests defined
+	// on other workers. Each request runs under the limits in Options, even when
+	// none are set, so that it can't start futures or tasks that would outlive it
+	// or escape the limits, and in a scratch scope so that a busy server runs in
+	// constant memory.
+	//
+	// Not available on Windows.
+	class Server
+	{
+	public:
+		enum { REPLY_VALUE = 0, REPLY_ERROR = 1 };
+
+		// Requests longer than this close the connection.
+		static const uint32_t MAX_FRAME = 16 * 1024 * 1024;
+
+		// How long a worker waits for the rest of a request before it closes the
+		// connection.
+		static const int READ_TIMEOUT_SECONDS = 10;
+
+		struct Options
+		{
+			std::string socket_path;
+
+			// 0 starts one worker per core.
+			unsigned workers;
+
+			// Files every worker loads before serving, in order.
+			std::vector<std::string> library;
+
+			Limits::Settings limits;
+		};
+
+		explicit Server(const Options &options);
+		~Server();
+
+		// Loads the library into each worker's context, binds the socket and starts
+		// serving. Raises an error if the library fails to load or the socket can't
+		// be bound.
+		void start();
+
+		// Stops accepting requests, finishes the ones being evaluated and closes
+		// every connection.
+		void stop();
+
+		// Blocks until stop is called from another thread.
+		void wait();
+
+		// Reads or writes one frame on a blocking descriptor. Return false if the
+		// connection is closed or broken, or the frame is too long.
+		static bool read_frame(int fd, std::string &payload);
+		static bool write_frame(int fd, const std::string &payload);
+
+	private:
+		void poll_loop();
+		void worker_loop(Interpreter *interpreter);
+
+		// Gives a connection back to the polling thread.
+		void hand_back(int fd);
+
+		Options options;
+		int listen_fd;
+		int wake_fds[2];
+		bool stopping;
+
+		std::vector<std::unique_ptr<Interpreter>> interpreters;
+		std::vector<std::thread> workers;
+		std::thread poller;
+
+		// Connections with a request waiting, for the workers.
+		std::mutex queue_lock;
+		std::condition_variable queue_ready;
+		std::deque<int> ready;
+
+		// Connections the workers have finished with, for the polling thread.
+		std::mutex returned_lock;
+		std::vector<int> returned;
+	};
+};
@@ -0,0 +1,171 @@
+#include "stdafx.h"
+#include "Specials.h"
+#include "Evaluator.h"
+#include "Primitives.h"
+
+#include <algorithm>
+#include <atomic>
+
+namespace PolyScript
+{
+	namespace Specials
+	{
+		// Index 0 means "not special", so the first special variable gets 1.
+		static std::atomic<int> next_index(1);
+
+		// The thread's own binding stack, and the one in use: the thread's or that of
+		// the coroutine running on it.
+		static thread_local std::vector<Binding> thread_stack;
+		static thread_local std::vector<Binding> *current_stack = NULL;
+
+		static std::vector<Binding> &bindings()
+		{
+			return current_stack ? *current_stack : thread_stack;
+		}
+
+		void declare(Object *sym)
+		{
+			if (sym->special_index)
+				return;
+			std::lock_guard<std::mutex> guard(obarray_lock);
+			if (!sym->special_index)
+				sym->special_index = next_index++;
+		}
+
+		static Object *&thread_slot(int index)
+		{
+			if (index >= thread_capacity) {
+				int capacity = std::max(index + 1, thread_capacity * 2);
+				thread_values = (Object **)realloc(thread_values, capacity * sizeof(Object *));
+				std::fill(thread_values + thread_capacity, thread_values + capacity, (Object *)NULL);
+				thread_capacity = capacity;
+			}
+			return thread_values[index];
+		}
+
+		void set(Object *sym, Object *value)
+		{
+			value = Evaluator::lasting_value(value);
+			int index = sym->special_index;
+			if (index < thread_capacity && thread_values[index])
+				thread_values[index] = value;
+			else
+				sym->symbol_value = value;
+		}
+
+		// A binding is undone before the code that made it returns, so a value
+		// allocated in a scratch scope is never left in a slot after the scope ends,
+		// and binding isn't counted as a pointer store.
+		void bind(Object *sym, Object *value)
+		{
+			Object *&slot = thread_slot(sym->special_index);
+			bindings().push_back({ sym, slot, NULL });
+			slot = value;
+		}
+
+		size_t depth()
+		{
+			return bindings().size();
+		}
+
+		void unbind_to(size_t depth)
+		{
+			std::vector<Binding> &stack = bindings();
+			while (stack.size() > depth) {
+				Binding &binding = stack.back();
+				thread_values[binding.sym->special_index] = binding.old;
+				stack.pop_back();
+			}
+		}
+
+		std::vector<Binding> *enter(std::vector<Binding> &stack)
+		{
+			// Outermost first, so that each binding's old value is the one it hides.
+			for (Binding &binding : stack) {
+				Object *&slot = thread_slot(binding.sym->special_index);
+				binding.old = slot;
+				slot = binding.value;
+			}
+			std::vector<Binding> *previous = current_stack;
+			current_stack = &stack;
+			return previous;
+		}
+
+		void leave(std::vector<Binding> &stack, std::vector<Binding> *previous)
+		{
+			for (auto it = stack.rbegin(); it != stack.rend(); ++it) {
+				Object *&slot = thread_values[it->sym->special_index];
+				it->value = slot;
+				slot = it->old;
+			}
+			current_stack = previous;
+		}
+
+		static Object *special_symbol(Object *form, const char *name)
+		{
+			if (form->tag != T_CELL || !form->car->IsAtomSubtype(AT_SYMBOL))
+				error("Malformed %s", name);
+			return form->car;
+		}
+
+		// (defvar <symbol> [value]) declares symbol special, and gives it value if it
+		// has no global value yet.
+		DECLARE_PRIMITIVE_FN(Defvar)
+		{
+			int length = Evaluator::list_length(list);
+			if (length != 1 && length != 2)
+				error("Malformed defvar");
+			Object *sym = special_symbol(list, "defvar");
+			declare(sym);
+			if (length == 2 && !sym->symbol_value) {
+				sym->symbol_value = Evaluator::eval(env, list->cdr->car);
+				note_pointer_store();
+			}
+			return sym;
+		}
+
+		// (defparameter <symbol> value) declares symbol special and sets its global value.
+		DECLARE_PRIMITIVE_FN(Defparameter)
+		{
+			if (Evaluator::list_length(list) != 2)
+				error("Malformed defparameter");
+			Object *sym = special_symbol(list, "defparameter");
+			declare(sym);
+			sym->symbol_value = Evaluator::eval(env, list->cdr->car);
+			note_pointer_store();
+			return sym;
+		}
+
+		// (dynamic-let ((<symbol> value) ...) expr ...) evaluates the values, binds the
+		// special variables to them while the expressions run, and then puts back
+		// what they were before, however the expressions are left.
+		DECLARE_PRIMITIVE_FN(DynamicLet)
+		{
+			if (list->tag != T_CELL || !Evaluator::is_list(list->car))
+				error("Malformed dynamic-let");
+
+			std::vector<std::pair<Object *, Object *>> values;
+			for (Object *p = list->car; p != Nil; p = p->cdr) {
+				Object *binding = p->car;
+				if (Evaluator::list_length(binding) != 2)
+					error("Malformed dynamic-let binding");
+				Object *sym = special_symbol(binding, "dynamic-let");
+				if (!sym->special_index)
+					error("dynamic-let: %s is not a special variable; declare it with defvar", sym->name);
+				values.push_back(std::make_pair(sym, Evaluator::eval(env, binding->cdr->car)));
+			}
+
+			Scope scope;
+			for (auto &value : values)
+				bind(value.first, value.second);
+			return Evaluator::progn(env, list->cdr);
+		}
+
+		void create_primitives(Object *env)
+		{
+			Primitives::add_primitive(env, "defvar", Defvar);
+			Primitives::add_primitive(env, "defparameter", Defparameter);
+			Primitives::add_primitive(env, "dynamic-let", DynamicLet);
+		}
+	};
+};
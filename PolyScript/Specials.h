@@ -0,0 +1,88 @@
+#pragma once
+
+#include "PolyScript.h"
+
+#include <vector>
+
+namespace PolyScript
+{
+	// Special variables, declared with defvar or defparameter and rebound with
+	// dynamic-let. They use shallow binding: a symbol's global value is in its
+	// symbol_value, and each thread has an array of the values it has bound,
+	// indexed by special_index, so finding a value takes the same time however deep
+	// the call stack is. Rebinding pushes the old value on the thread's binding
+	// stack, and unbinding pops it.
+	//
+	// Bindings belong to the thread, and to the coroutine, that made them: a
+	// coroutine's bindings are taken off when it yields and put back when it is
+	// resumed. The global value is shared by every thread and context.
+	namespace Specials
+	{
+		// This thread's bound values, by special_index. NULL where the variable
+		// isn't bound on this thread.
+		inline thread_local Object **thread_values = NULL;
+		inline thread_local int thread_capacity = 0;
+
+		// Declares sym special. Does nothing if it already is.
+		void declare(Object *sym);
+
+		// The value of a special variable. Raises an error if it is unbound.
+		inline Object *value(Object *sym)
+		{
+			int index = sym->special_index;
+			Object *bound = index < thread_capacity ? thread_values[index] : NULL;
+			if (!bound)
+				bound = sym->symbol_value;
+			if (!bound)
+				error("Unbound variable %s", sym->name);
+			return bound;
+		}
+
+		// Changes the innermost binding of a special variable, or its global value if
+		// it isn't bound on this thread.
+		void set(Object *sym, Object *value);
+
+		// Binds a special variable on this thread, or coroutine, until unbind_to is
+		// called with a depth at or below the one before the binding.
+		void bind(Object *sym, Object *value);
+		size_t depth();
+		void unbind_to(size_t depth);
+
+		// Undoes every binding made since depth for as long as it exists, however it
+		// is left.
+		class Scope
+		{
+		public:
+			Scope() : base(depth()) {}
+			~Scope() { unbind_to(base); }
+
+			Scope(const Scope &) = delete;
+			Scope &operator=(const Scope &) = delete;
+
+		private:
+			size_t base;
+		};
+
+		struct Binding
+		{
+			Object *sym;
+
+			// The value before the binding, NULL if the thread had none.
+			Object *old;
+
+			// The bound value, kept here while the binding is taken off by leave.
+			Object *value;
+		};
+
+		// Each coroutine has a binding stack of its own, so that the depth a Scope
+		// saved still means the same thing after the coroutine has been suspended and
+		// resumed somewhere else. enter makes a coroutine's stack the current one and
+		// puts its bindings back; leave takes them off again and makes previous the
+		// current stack.
+		std::vector<Binding> *enter(std::vector<Binding> &bindings);
+		void leave(std::vector<Binding> &bindings, std::vector<Binding> *previous);
+
+		// Add defvar, defparameter and dynamic-let to the environment.
+		void create_primitives(Object *env);
+	};
+};
@@ -0,0 +1,131 @@
+#include "stdafx.h"
+#include "Stats.h"
+#include "PolyScript.h"
+#include "Primitives.h"
+
+#include <map>
+#include <mutex>
+
+namespace PolyScript
+{
+	namespace Stats
+	{
+		using Primitives::evaluate_arguments;
+
+		thread_local Counters *local_counters = NULL;
+
+		// Every thread's counters, and the names of the primitives by counter index.
+		static std::mutex registry_lock;
+		static std::vector<Counters *> all_counters;
+		static std::vector<std::string> primitive_names;
+
+		Counters *create_counters()
+		{
+			// Value-initialized, so every counter starts at zero.
+			Counters *counters = new Counters();
+			std::lock_guard<std::mutex> guard(registry_lock);
+			all_counters.push_back(counters);
+			local_counters = counters;
+			return counters;
+		}
+
+		int register_primitive(const char *name)
+		{
+			std::lock_guard<std::mutex> guard(registry_lock);
+			for (size_t i = 0; i < primitive_names.size(); i++)
+				if (primitive_names[i] == name)
+					return (int)i;
+			if (primitive_names.size() == MAX_PRIMITIVES - 1)
+				primitive_names.push_back("(other primitives)");
+			if (primitive_names.size() >= MAX_PRIMITIVES)
+				return MAX_PRIMITIVES - 1;
+			primitive_names.push_back(name);
+			return (int)primitive_names.size() - 1;
+		}
+
+		std::string primitive_name(int id)
+		{
+			std::lock_guard<std::mutex> guard(registry_lock);
+			return id >= 0 && (size_t)id < primitive_names.size() ? primitive_names[id] : "";
+		}
+
+		bool enabled()
+		{
+#ifdef POLYSCRIPT_RUNTIME_STATS
+			return true;
+#else
+			return false;
+#endif
+		}
+
+		Snapshot snapshot()
+		{
+			if (!enabled())
+				error("runtime-stats: this build does not count; define POLYSCRIPT_RUNTIME_STATS");
+
+			Snapshot totals = {};
+			std::vector<uint64_t> calls(MAX_PRIMITIVES);
+			std::lock_guard<std::mutex> guard(registry_lock);
+			for (Counters *c : all_counters) {
+				totals.evals += c->evals.load(std::memory_order_relaxed);
+				totals.applications += c->applications.load(std::memory_order_relaxed);
+				totals.primitive_calls += c->primitive_calls.load(std::memory_order_relaxed);
+				totals.macro_expansions += c->macro_expansions.load(std::memory_order_relaxed);
+				totals.lookups += c->lookups.load(std::memory_order_relaxed);
+				totals.frames_walked += c->frames_walked.load(std::memory_order_relaxed);
+				totals.symbols_interned += c->symbols_interned.load(std::memory_order_relaxed);
+				totals.allocations += c->allocations.load(std::memory_order_relaxed);
+				totals.bytes_allocated += c->bytes_allocated.load(std::memory_order_relaxed);
+				totals.scratch_rewinds += c->scratch_rewinds.load(std::memory_order_relaxed);
+				for (int i = 0; i < MAX_PRIMITIVES; i++)
+					calls[i] += c->primitive_counts[i].load(std::memory_order_relaxed);
+			}
+			for (size_t i = 0; i < primitive_names.size(); i++)
+				if (calls[i])
+					totals.primitives.push_back(std::make_pair(primitive_names[i], calls[i]));
+			return totals;
+		}
+
+		// Counters don't fit in an int, so large ones become floats.
+		static Object *make_count(uint64_t count)
+		{
+			if (count <= INT32_MAX)
+				return Object::MakeInt((int)count);
+			return Object::MakeFloat((double)count);
+		}
+
+		// (runtime-stats) returns the counters of every thread added together, as an
+		// alist. The primitives entry is an alist of calls by primitive name.
+		DECLARE_PRIMITIVE_FN(RuntimeStats)
+		{
+			evaluate_arguments(env, list, 0, 0, "runtime-stats");
+			Snapshot totals = snapshot();
+
+			Object *primitives = Nil;
+			for (auto it = totals.primitives.rbegin(); it != totals.primitives.rend(); ++it)
+				primitives = Object::acons(Object::intern(it->first.c_str()), make_count(it->second), primitives);
+
+			std::pair<const char *, uint64_t> counters[] = {
+				{ "evals", totals.evals },
+				{ "applications", totals.applications },
+				{ "primitive-calls", totals.primitive_calls },
+				{ "macro-expansions", totals.macro_expansions },
+				{ "lookups", totals.lookups },
+				{ "frames-walked", totals.frames_walked },
+				{ "symbols-interned", totals.symbols_interned },
+				{ "allocations", totals.allocations },
+				{ "bytes-allocated", totals.bytes_allocated },
+				{ "scratch-rewinds", totals.scratch_rewinds },
+			};
+			Object *result = Object::acons(Object::intern("primitives"), primitives, Nil);
+			for (int i = (int)(sizeof(counters) / sizeof(counters[0])) - 1; i >= 0; i--)
+				result = Object::acons(Object::intern(counters[i].first), make_count(counters[i].second), result);
+			return result;
+		}
+
+		void create_primitives(Object *env)
+		{
+			Primitives::add_primitive(env, "runtime-stats", RuntimeStats);
+		}
+	};
+};
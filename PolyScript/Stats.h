@@ -0,0 +1,97 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace PolyScript
+{
+	struct Object;
+
+	// Counters of what the interpreter does, to be exported to a metrics system.
+	// They are only compiled in when POLYSCRIPT_RUNTIME_STATS is defined; otherwise
+	// STAT_ADD expands to nothing.
+	namespace Stats
+	{
+		// Primitives registered after this many share the last counter.
+		static const int MAX_PRIMITIVES = 512;
+
+		// One thread's counters. Only that thread writes them, so an increment is a
+		// plain load and store; they are atomic so that a snapshot can read them.
+		struct Counters
+		{
+			std::atomic<uint64_t> evals;
+			std::atomic<uint64_t> applications;
+			std::atomic<uint64_t> primitive_calls;
+			std::atomic<uint64_t> macro_expansions;
+			std::atomic<uint64_t> lookups;
+			std::atomic<uint64_t> frames_walked;
+			std::atomic<uint64_t> symbols_interned;
+			std::atomic<uint64_t> allocations;
+			std::atomic<uint64_t> bytes_allocated;
+			std::atomic<uint64_t> scratch_rewinds;
+			std::atomic<uint64_t> primitive_counts[MAX_PRIMITIVES];
+		};
+
+		extern thread_local Counters *local_counters;
+
+		// Creates this thread's counters. They are never freed, so a snapshot still
+		// counts a thread that has finished.
+		Counters *create_counters();
+
+		inline Counters &local()
+		{
+			Counters *counters = local_counters;
+			return counters ? *counters : *create_counters();
+		}
+
+		inline void add(std::atomic<uint64_t> &counter, uint64_t n)
+		{
+			counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+		}
+
+		// The totals of every thread's counters at one moment.
+		struct Snapshot
+		{
+			uint64_t evals;
+			uint64_t applications;
+			uint64_t primitive_calls;
+			uint64_t macro_expansions;
+			uint64_t lookups;
+			uint64_t frames_walked;
+			uint64_t symbols_interned;
+			uint64_t allocations;
+			uint64_t bytes_allocated;
+
+			// There is no collector; rewinding a scratch arena is the only way memory
+			// is given back.
+			uint64_t scratch_rewinds;
+
+			// Calls of each primitive that has been called, by name.
+			std::vector<std::pair<std::string, uint64_t>> primitives;
+		};
+
+		bool enabled();
+
+		// Raises an error if the counters aren't compiled in.
+		Snapshot snapshot();
+
+		// Returns the counter index for a primitive's name, the same for every
+		// environment the primitive is added to.
+		int register_primitive(const char *name);
+
+		// The name registered for a counter index, or "" if there is none.
+		std::string primitive_name(int id);
+
+		// Add runtime-stats to the environment.
+		void create_primitives(Object *env);
+	};
+};
+
+#ifdef POLYSCRIPT_RUNTIME_STATS
+#define STAT_ADD(counter, n) PolyScript::Stats::add(PolyScript::Stats::local().counter, (n))
+#else
+#define STAT_ADD(counter, n) ((void)0)
+#endif
@@ -0,0 +1,189 @@
+#include "stdafx.h"
+#include "Streams.h"
+#include "StringKernels.h"
+#include "Primitives.h"
+
+#include <memory>
+
+namespace PolyScript
+{
+	LineReader::LineReader(FILE *file)
+		: file(file), buffer((char *)malloc(BUFFER_SIZE)), capacity(BUFFER_SIZE), start(0), end(0), at_eof(false)
+	{
+	}
+
+	LineReader *LineReader::open(const char *path)
+	{
+		FILE *file = fopen(path, "rb");
+		if (!file)
+			return NULL;
+		return new LineReader(file);
+	}
+
+	LineReader::~LineReader()
+	{
+		fclose(file);
+		free(buffer);
+	}
+
+	bool LineReader::next_line(const char **line, size_t *length)
+	{
+		for (;;) {
+			const char *text = buffer + start;
+			const char *newline = StringKernels::find_char(text, end - start, '\n');
+			if (newline || (at_eof && start < end)) {
+				size_t len = newline ? newline - text : end - start;
+				start += newline ? len + 1 : len;
+				if (len > 0 && text[len - 1] == '\r')
+					len--;
+				*line = text;
+				*length = len;
+				return true;
+			}
+			if (at_eof)
+				return false;
+
+			// Move the partial line to the front, make room for a line longer than the
+			// buffer if need be, and read some more.
+			memmove(buffer, buffer + start, end - start);
+			end -= start;
+			start = 0;
+			if (end == capacity) {
+				capacity *= 2;
+				buffer = (char *)realloc(buffer, capacity);
+			}
+
+			size_t got = fread(buffer + end, 1, capacity - end, file);
+			end += got;
+			if (got == 0)
+				at_eof = true;
+		}
+	}
+
+	namespace Streams
+	{
+		using Primitives::evaluate_arguments;
+
+		static LineReader *open_file(Object *path, const char *name)
+		{
+			if (!path->IsAtomSubtype(AT_STRING))
+				error("%s: file name is not a string", name);
+			LineReader *reader = LineReader::open(path->str_value);
+			if (!reader)
+				error("%s: cannot open %s", name, path->str_value);
+			return reader;
+		}
+
+		static Object *stream_argument(Object *value, const char *name)
+		{
+			if (value->tag != T_STREAM)
+				error("%s: argument is not a stream", name);
+			if (!value->stream_reader)
+				error("%s: stream is closed", name);
+			return value;
+		}
+
+		static void close(Object *stream)
+		{
+			delete stream->stream_reader;
+			stream->stream_reader = NULL;
+		}
+
+		static Object *next_file_line(Object *seq)
+		{
+			Object *stream = seq->seq_source;
+			if (!stream->stream_reader)
+				return NULL;
+
+			const char *line;
+			size_t length;
+			if (!stream->stream_reader->next_line(&line, &length)) {
+				close(stream);
+				return NULL;
+			}
+			return Object::MakeString(line, length);
+		}
+
+		Object *file_lines(const char *path)
+		{
+			LineReader *reader = LineReader::open(path);
+			if (!reader)
+				error("file-lines: cannot open %s", path);
+			return Object::MakeSequence(next_file_line, Object::MakeStream(reader));
+		}
+
+		// (open-input-file path)
+		DECLARE_PRIMITIVE_FN(OpenInputFile)
+		{
+			Object *args = evaluate_arguments(env, list, 1, 1, "open-input-file");
+			return Object::MakeStream(open_file(args->car, "open-input-file"));
+		}
+
+		// (read-line stream) returns the next line, or nil at the end of the file.
+		DECLARE_PRIMITIVE_FN(ReadLine)
+		{
+			Object *args = evaluate_arguments(env, list, 1, 1, "read-line");
+			Object *stream = stream_argument(args->car, "read-line");
+
+			const char *line;
+			size_t length;
+			if (!stream->stream_reader->next_line(&line, &length))
+				return Nil;
+			return Object::MakeString(line, length);
+		}
+
+		// (close-input-file stream). Closing a stream twice is harmless.
+		DECLARE_PRIMITIVE_FN(CloseInputFile)
+		{
+			Object *args = evaluate_arguments(env, list, 1, 1, "close-input-file");
+			if (args->car->tag != T_STREAM)
+				error("close-input-file: argument is not a stream");
+			close(args->car);
+			return True;
+		}
+
+		// (with-lines (var path) body ...) evaluates body with var bound to each line
+		// of the file in turn, then closes the file. Each line is processed in a
+		// scratch scope, so the whole file is read in constant memory unless body
+		// keeps something other than a number or string from a line.
+		DECLARE_PRIMITIVE_FN(WithLines)
+		{
+			if (list->tag != T_CELL || list->car->tag != T_CELL || !list->car->car->IsAtomSubtype(AT_SYMBOL)
+				|| list->car->cdr->tag != T_CELL)
+				error("Malformed with-lines");
+
+			Object *vars = Object::cons(list->car->car, Nil);
+			Object *body = list->cdr;
+			std::unique_ptr<LineReader> reader(open_file(Evaluator::eval(env, list->car->cdr->car), "with-lines"));
+
+			for (;;) {
+				ScratchScope scope;
+				const char *line;
+				size_t length;
+				if (!reader->next_line(&line, &length))
+					break;
+				Object *newenv = Evaluator::push_env(env, vars, Object::cons(Object::MakeString(line, length), Nil));
+				Evaluator::progn(newenv, body);
+			}
+			return Nil;
+		}
+
+		// (file-lines path) returns a lazy sequence of the lines of a file.
+		DECLARE_PRIMITIVE_FN(FileLines)
+		{
+			Object *args = evaluate_arguments(env, list, 1, 1, "file-lines");
+			if (!args->car->IsAtomSubtype(AT_STRING))
+				error("file-lines: file name is not a string");
+			return file_lines(args->car->str_value);
+		}
+
+		void create_primitives(Object *env)
+		{
+			Primitives::add_primitive(env, "open-input-file", OpenInputFile);
+			Primitives::add_primitive(env, "read-line", ReadLine);
+			Primitives::add_primitive(env, "close-input-file", CloseInputFile);
+			Primitives::add_primitive(env, "with-lines", WithLines);
+			Primitives::add_primitive(env, "file-lines", FileLines);
+		}
+	};
+};
@@ -0,0 +1,45 @@
+#pragma once
+
+#include "PolyScript.h"
+
+#include <cstdio>
+
+namespace PolyScript
+{
+	// Reads a file a line at a time through one large buffer, so that files of any
+	// size can be processed without loading them.
+	class LineReader
+	{
+	public:
+		static const size_t BUFFER_SIZE = 1024 * 1024;
+
+		// Returns NULL if the file can't be opened.
+		static LineReader *open(const char *path);
+		~LineReader();
+
+		// Points line at the next line, without its line ending. The text stays valid
+		// until the next call. Returns false at the end of the file.
+		bool next_line(const char **line, size_t *length);
+
+	private:
+		explicit LineReader(FILE *file);
+
+		FILE *file;
+		char *buffer;
+		size_t capacity;
+		// The unread text is buffer[start..end).
+		size_t start;
+		size_t end;
+		bool at_eof;
+	};
+
+	namespace Streams
+	{
+		// A lazy sequence of the lines of a file. The file is closed when the
+		// sequence runs out.
+		Object *file_lines(const char *path);
+
+		// Add the file primitives to the environment.
+		void create_primitives(Object *env);
+	};
+};
@@ -0,0 +1,109 @@
+#include "stdafx.h"
+#include "StringKernels.h"
+
+#include <cstdint>
+#include <cstring>
+
+#if defined(__AVX2__)
+#define KERNELS_AVX2
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define KERNELS_SSE2
+#include <emmintrin.h>
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+// Substring search compares whole registers of text against the needle's first and
+// last bytes at once, and only calls memcmp where both match. Text that doesn't fill
+// a register is searched with the scalar loop.
+
+namespace PolyScript
+{
+	namespace StringKernels
+	{
+#if defined(KERNELS_AVX2) || defined(KERNELS_SSE2)
+		static unsigned lowest_bit(uint32_t mask)
+		{
+#ifdef _MSC_VER
+			unsigned long i;
+			_BitScanForward(&i, mask);
+			return i;
+#else
+			return __builtin_ctz(mask);
+#endif
+		}
+#endif
+
+#if defined(KERNELS_AVX2)
+		typedef __m256i Block;
+		static const size_t BLOCK = 32;
+		static Block broadcast(char c) { return _mm256_set1_epi8(c); }
+		static uint32_t matches(const char *p, Block c) { return _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)p), c)); }
+#elif defined(KERNELS_SSE2)
+		typedef __m128i Block;
+		static const size_t BLOCK = 16;
+		static Block broadcast(char c) { return _mm_set1_epi8(c); }
+		static uint32_t matches(const char *p, Block c) { return _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)p), c)); }
+#endif
+
+		const char *instruction_set()
+		{
+#if defined(KERNELS_AVX2)
+			return "avx2";
+#elif defined(KERNELS_SSE2)
+			return "sse2";
+#else
+			return "scalar";
+#endif
+		}
+
+		const char *find_char(const char *text, size_t n, char c)
+		{
+			size_t i = 0;
+#if defined(KERNELS_AVX2) || defined(KERNELS_SSE2)
+			Block wanted = broadcast(c);
+			for (; i + BLOCK <= n; i += BLOCK) {
+				uint32_t mask = matches(text + i, wanted);
+				if (mask)
+					return text + i + lowest_bit(mask);
+			}
+#endif
+			for (; i < n; i++)
+				if (text[i] == c)
+					return text + i;
+			return NULL;
+		}
+
+		const char *find(const char *text, size_t n, const char *needle, size_t m)
+		{
+			if (m == 0)
+				return text;
+			if (m > n)
+				return NULL;
+			if (m == 1)
+				return find_char(text, n, needle[0]);
+
+			size_t i = 0;
+#if defined(KERNELS_AVX2) || defined(KERNELS_SSE2)
+			Block first = broadcast(needle[0]);
+			Block last = broadcast(needle[m - 1]);
+			for (; i + m - 1 + BLOCK <= n; i += BLOCK) {
+				uint32_t mask = matches(text + i, first) & matches(text + i + m - 1, last);
+				while (mask) {
+					size_t at = i + lowest_bit(mask);
+					if (memcmp(text + at + 1, needle + 1, m - 2) == 0)
+						return text + at;
+					mask &= mask - 1;
+				}
+			}
+#endif
+			for (; i + m <= n; i++)
+				if (text[i] == needle[0] && memcmp(text + i, needle, m) == 0)
+					return text + i;
+			return NULL;
+		}
+	};
+};
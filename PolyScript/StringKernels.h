@@ -0,0 +1,21 @@
+#pragma once
+
+#include <cstddef>
+
+namespace PolyScript
+{
+	// Byte searches over string bodies. Like VectorKernels, each has an AVX2 and an
+	// SSE2 version and a scalar fallback, chosen when the file is compiled.
+	namespace StringKernels
+	{
+		// "avx2", "sse2" or "scalar".
+		const char *instruction_set();
+
+		// Returns the first occurrence of c in text[0..n), or NULL.
+		const char *find_char(const char *text, size_t n, char c);
+
+		// Returns the first occurrence of needle[0..m) in text[0..n), or NULL.
+		// An empty needle is found at the start.
+		const char *find(const char *text, size_t n, const char *needle, size_t m);
+	};
+};
@@ -0,0 +1,304 @@
+#include "stdafx.h"
+#include "Strings.h"
+#include "StringKernels.h"
+#include "Printer.h"
+#include "Primitives.h"
+
+#include <climits>
+
+namespace PolyScript
+{
+	namespace Strings
+	{
+		using Primitives::evaluate_arguments;
+
+		static const size_t INITIAL_BUILDER_CAPACITY = 64;
+
+		void append(Object *builder, const char *text, size_t len)
+		{
+			size_t needed = builder->builder_length + len;
+			if (needed > builder->builder_capacity) {
+				size_t capacity = builder->builder_capacity * 2;
+				if (capacity < needed)
+					capacity = needed;
+
+				// Like every other object, the old buffer is never freed.
+				char *data = (char *)Object::allocate(capacity);
+				memcpy(data, builder->builder_data, builder->builder_length);
+				builder->builder_data = data;
+				builder->builder_capacity = capacity;
+				note_pointer_store();
+			}
+			memcpy(builder->builder_data + builder->builder_length, text, len);
+			builder->builder_length = needed;
+		}
+
+		static Object *string_argument(Object *value, const char *name)
+		{
+			if (!value->IsAtomSubtype(AT_STRING))
+				error("%s: argument is not a string", name);
+			return value;
+		}
+
+		static Object *builder_argument(Object *value, const char *name)
+		{
+			if (value->tag != T_BUILDER)
+				error("%s: argument is not a string builder", name);
+			return value;
+		}
+
+		// Checks an optional index argument against a string's length.
+		static size_t position_argument(Object *value, size_t length, const char *name)
+		{
+			if (!value->IsAtomSubtype(AT_INT))
+				error("%s: index is not an integer", name);
+			if (value->int_value < 0 || (size_t)value->int_value > length)
+				error("%s: index %d is out of range for a string of length %d", name, value->int_value, (int)length);
+			return value->int_value;
+		}
+
+		// (string-length string)
+		DECLARE_PRIMITIVE_FN(StringLength)
+		{
+			Object *args = evaluate_arguments(env, list, 1, 1, "string-length");
+			return Object::MakeInt((int)string_argument(args->car, "string-length")->str_length);
+		}
+
+		// (concat string ...) copies every argument once, into a string of the final size.
+		DECLARE_PRIMITIVE_FN(Concat)
+		{
+			Object *args = Evaluator::eval_list(env, list);
+
+			size_t length = 0;
+			for (Object *p = args; p != Nil; p = p->cdr)
+				length += string_argument(p->car, "concat")->str_length;
+
+			Object *result = Object::AllocateString(length);
+			char *out = result->str_value;
+			for (Object *p = args; p != Nil; p = p->cdr) {
+				memcpy(out, p->car->str_value, p->car->str_length);
+				out += p->car->str_length;
+			}
+			return result;
+		}
+
+		// (substring string start [end])
+		DECLARE_PRIMITIVE_FN(Substring)
+		{
+			Object *args = evaluate_arguments(env, list, 2, 3, "substring");
+			Object *str = string_argument(args->car, "substring");
+			size_t start = position_argument(args->cdr->car, str->str_length, "substring");
+			size_t end = str->str_length;
+			if (args->cdr->cdr != Nil)
+				end = position_argument(args->cdr->cdr->car, str->str_length, "substring");
+			if (end < start)
+				error("substring: end is before start");
+			return Object::MakeString(str->str_value + start, end - start);
+		}
+
+		// (string= a b)
+		DECLARE_PRIMITIVE_FN(StringEquals)
+		{
+			Object *args = evaluate_arguments(env, list, 2, 2, "string=");
+			Object *a = string_argument(args->car, "string=");
+			Object *b = string_argument(args->cdr->car, "string=");
+			return a->str_length == b->str_length && memcmp(a->str_value, b->str_value, a->str_length) == 0 ? True : Nil;
+		}
+
+		// (string-search needle string [start]) returns the index of the first match, or nil.
+		DECLARE_PRIMITIVE_FN(StringSearch)
+		{
+			Object *args = evaluate_arguments(env, list, 2, 3, "string-search");
+			Object *needle = string_argument(args->car, "string-search");
+			Object *str = string_argument(args->cdr->car, "string-search");
+			size_t start = 0;
+			if (args->cdr->cdr != Nil)
+				start = position_argument(args->cdr->cdr->car, str->str_length, "string-search");
+
+			const char *found = StringKernels::find(str->str_value + start, str->str_length - start,
+				needle->str_value, needle->str_length);
+			if (!found)
+				return Nil;
+			return Object::MakeInt((int)(found - str->str_value));
+		}
+
+		// (string-split string separator) returns the pieces between separators as a list.
+		DECLARE_PRIMITIVE_FN(StringSplit)
+		{
+			Object *args = evaluate_arguments(env, list, 2, 2, "string-split");
+			Object *str = string_argument(args->car, "string-split");
+			Object *separator = string_argument(args->cdr->car, "string-split");
+			if (separator->str_length == 0)
+				error("string-split: separator is empty");
+
+			Object *head = Nil;
+			Object *tail = NULL;
+			const char *p = str->str_value;
+			const char *end = str->str_value + str->str_length;
+			for (;;) {
+				const char *found = StringKernels::find(p, end - p, separator->str_value, separator->str_length);
+				Object *cell = Object::cons(Object::MakeString(p, (found ? found : end) - p), Nil);
+				if (tail)
+					tail->cdr = cell;
+				else
+					head = cell;
+				tail = cell;
+
+				if (!found)
+					return head;
+				p = found + separator->str_length;
+			}
+		}
+
+		// Appends a number formatted with a fixed number of decimals.
+		static void format_fixed(std::string &out, Object *value, int decimals)
+		{
+			// Enough for the largest double with the most decimals allowed.
+			char buffer[400];
+			if (decimals > 20)
+				decimals = 20;
+			double number = value->atom_subtype == AT_INT ? value->int_value : value->float_value;
+			int length = snprintf(buffer, sizeof(buffer), "%.*f", decimals, number);
+			out.append(buffer, length);
+		}
+
+		// (format control arg ...) returns a string. The control string understands
+		//   ~a  an argument as print shows it    ~s  an argument as it would be read
+		//   ~d  an integer                       ~f  a number, or ~,Nf with N decimals
+		//   ~%  a newline                        ~~  a tilde
+		DECLARE_PRIMITIVE_FN(Format)
+		{
+			if (list == Nil)
+				error("Malformed format");
+			Object *args = Evaluator::eval_list(env, list);
+			Object *control = string_argument(args->car, "format");
+			args = args->cdr;
+
+			std::string out;
+			const char *p = control->str_value;
+			const char *end = p + control->str_length;
+			while (p < end) {
+				const char *tilde = StringKernels::find_char(p, end - p, '~');
+				if (!tilde) {
+					out.append(p, end - p);
+					break;
+				}
+				out.append(p, tilde - p);
+				p = tilde + 1;
+
+				int decimals = -1;
+				if (p < end && *p == ',') {
+					decimals = 0;
+					for (p++; p < end && isdigit((unsigned char)*p); p++)
+						decimals = decimals * 10 + (*p - '0');
+				}
+				if (p == end)
+					error("format: control string ends in the middle of a directive");
+
+				char directive = tolower((unsigned char)*p++);
+				if (directive == '%') {
+					out += '\n';
+					continue;
+				}
+				if (directive == '~') {
+					out += '~';
+					continue;
+				}
+
+				if (args == Nil)
+					error("format: not enough arguments for ~%c", directive);
+				Object *arg = args->car;
+				args = args->cdr;
+
+				switch (directive) {
+				case 'a':
+					Printer::print_to(out, arg, false);
+					break;
+				case 's':
+					Printer::print_to(out, arg, true);
+					break;
+				case 'd':
+					if (!arg->IsAtomSubtype(AT_INT))
+						error("format: ~d needs an integer");
+					Printer::format_int(out, arg->int_value);
+					break;
+				case 'f':
+					if (!arg->IsNumber())
+						error("format: ~f needs a number");
+					if (decimals >= 0)
+						format_fixed(out, arg, decimals);
+					else if (arg->atom_subtype == AT_INT)
+						Printer::format_float(out, arg->int_value);
+					else
+						Printer::format_float(out, arg->float_value);
+					break;
+				default:
+					error("format: unknown directive ~%c", directive);
+				}
+			}
+
+			if (args != Nil)
+				error("format: too many arguments");
+			return Object::MakeString(out.data(), out.size());
+		}
+
+		// (make-string-builder)
+		DECLARE_PRIMITIVE_FN(MakeStringBuilder)
+		{
+			evaluate_arguments(env, list, 0, 0, "make-string-builder");
+			return Object::MakeBuilder(INITIAL_BUILDER_CAPACITY);
+		}
+
+		// (string-builder-append builder value ...) appends strings as they are and
+		// anything else as print shows it. Returns the builder.
+		DECLARE_PRIMITIVE_FN(StringBuilderAppend)
+		{
+			Object *args = evaluate_arguments(env, list, 1, INT_MAX, "string-builder-append");
+			Object *builder = builder_argument(args->car, "string-builder-append");
+
+			std::string printed;
+			for (Object *p = args->cdr; p != Nil; p = p->cdr) {
+				if (p->car->IsAtomSubtype(AT_STRING)) {
+					append(builder, p->car->str_value, p->car->str_length);
+					continue;
+				}
+				printed.clear();
+				Printer::print_to(printed, p->car, false);
+				append(builder, printed.data(), printed.size());
+			}
+			return builder;
+		}
+
+		// (string-builder-length builder)
+		DECLARE_PRIMITIVE_FN(StringBuilderLength)
+		{
+			Object *args = evaluate_arguments(env, list, 1, 1, "string-builder-length");
+			return Object::MakeInt((int)builder_argument(args->car, "string-builder-length")->builder_length);
+		}
+
+		// (string-builder-string builder) returns a copy of what has been appended so far.
+		DECLARE_PRIMITIVE_FN(StringBuilderString)
+		{
+			Object *args = evaluate_arguments(env, list, 1, 1, "string-builder-string");
+			Object *builder = builder_argument(args->car, "string-builder-string");
+			return Object::MakeString(builder->builder_data, builder->builder_length);
+		}
+
+		void create_primitives(Object *env)
+		{
+			Primitives::add_primitive(env, "string-length", StringLength);
+			Primitives::add_primitive(env, "concat", Concat);
+			Primitives::add_primitive(env, "substring", Substring);
+			Primitives::add_primitive(env, "string=", StringEquals);
+			Primitives::add_primitive(env, "string-search", StringSearch);
+			Primitives::add_primitive(env, "string-split", StringSplit);
+			Primitives::add_primitive(env, "format", Format);
+
+			// String builders
+			Primitives::add_primitive(env, "make-string-builder", MakeStringBuilder);
+			Primitives::add_primitive(env, "string-builder-append", StringBuilderAppend);
+			Primitives::add_primitive(env, "string-builder-length", StringBuilderLength);
+			Primitives::add_primitive(env, "string-builder-string", StringBuilderString);
+		}
+	};
+};
@@ -0,0 +1,16 @@
+#pragma once
+
+#include "PolyScript.h"
+
+namespace PolyScript
+{
+	namespace Strings
+	{
+		// Appends len bytes to a string builder, growing it geometrically so that
+		// a run of appends costs amortized O(1) per byte.
+		void append(Object *builder, const char *text, size_t len);
+
+		// Add the string and string builder primitives to the environment.
+		void create_primitives(Object *env);
+	};
+};
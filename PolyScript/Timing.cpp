@@ -0,0 +1,158 @@
+#include "stdafx.h"
+#include "Timing.h"
+#include "Evaluator.h"
+#include "Primitives.h"
+#include "Printer.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <time.h>
+#endif
+
+namespace PolyScript
+{
+	namespace Timing
+	{
+		double wall_seconds()
+		{
+			return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+		}
+
+		double thread_cpu_seconds()
+		{
+#ifdef _WIN32
+			FILETIME creation, exit, kernel, user;
+			GetThreadTimes(GetCurrentThread(), &creation, &exit, &kernel, &user);
+			ULARGE_INTEGER k, u;
+			k.LowPart = kernel.dwLowDateTime;
+			k.HighPart = kernel.dwHighDateTime;
+			u.LowPart = user.dwLowDateTime;
+			u.HighPart = user.dwHighDateTime;
+			// FILETIMEs count 100 ns ticks.
+			return (k.QuadPart + u.QuadPart) * 1e-7;
+#else
+			struct timespec now;
+			clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+			return now.tv_sec + now.tv_nsec * 1e-9;
+#endif
+		}
+
+		static double median_of(std::vector<double> &values)
+		{
+			std::sort(values.begin(), values.end());
+			size_t n = values.size();
+			return n % 2 ? values[n / 2] : (values[n / 2 - 1] + values[n / 2]) / 2;
+		}
+
+		Summary summarize(std::vector<double> samples)
+		{
+			Summary summary;
+			summary.median = median_of(samples);
+			summary.min = samples.front();
+			summary.max = samples.back();
+			for (double &sample : samples)
+				sample = fabs(sample - summary.median);
+			summary.mad = median_of(samples);
+			return summary;
+		}
+
+		// (time expr) evaluates expr once, prints how long it took and what it
+		// allocated, and returns its value. There is no collector, so there is no GC
+		// time to report.
+		DECLARE_PRIMITIVE_FN(Time)
+		{
+			if (Evaluator::list_length(list) != 1)
+				error("time takes 1 argument, found %d", Evaluator::list_length(list));
+
+			uint64_t objects = allocation_count;
+			uint64_t bytes = allocation_bytes;
+			double cpu = thread_cpu_seconds();
+			double wall = wall_seconds();
+			Object *result = Evaluator::eval(env, list->car);
+			wall = wall_seconds() - wall;
+			cpu = thread_cpu_seconds() - cpu;
+			objects = allocation_count - objects;
+			bytes = allocation_bytes - bytes;
+
+			char text[256];
+			snprintf(text, sizeof(text),
+				"; real time:  %.6f s\n"
+				"; CPU time:   %.6f s\n"
+				"; allocated:  %llu objects, %llu bytes\n",
+				wall, cpu, (unsigned long long)objects, (unsigned long long)bytes);
+			Printer::write(text);
+			return result;
+		}
+
+		static int keyword_count(Object *value, const char *keyword, int least)
+		{
+			if (!value->IsAtomSubtype(AT_INT) || value->int_value < least)
+				error("bench: %s must be an integer of at least %d", keyword, least);
+			return value->int_value;
+		}
+
+		// (bench expr [:iterations n] [:warmup n]) evaluates expr warmup times (1 by
+		// default) untimed, then n times (10 by default) timed one by one. Returns an
+		// alist of the median, median absolute deviation, fastest and slowest run in
+		// seconds, and the objects and bytes one run allocates.
+		DECLARE_PRIMITIVE_FN(Bench)
+		{
+			if (list == Nil)
+				error("bench: no expression to run");
+			Object *expr = list->car;
+			int iterations = 10;
+			int warmup = 1;
+			for (Object *p = list->cdr; p != Nil; p = p->cdr->cdr) {
+				if (p->cdr == Nil)
+					error("bench: a keyword has no value");
+				Object *value = Evaluator::eval(env, p->cdr->car);
+				if (p->car == Object::intern(":iterations"))
+					iterations = keyword_count(value, ":iterations", 1);
+				else if (p->car == Object::intern(":warmup"))
+					warmup = keyword_count(value, ":warmup", 0);
+				else
+					error("bench: unknown keyword; expected :iterations or :warmup");
+			}
+
+			// Each run's garbage is given back when it ends, so a long benchmark runs
+			// in constant memory and later runs don't pay for the earlier ones'.
+			for (int i = 0; i < warmup; i++) {
+				ScratchScope scratch;
+				Evaluator::eval(env, expr);
+			}
+
+			std::vector<double> times;
+			times.reserve(iterations);
+			uint64_t objects = allocation_count;
+			uint64_t bytes = allocation_bytes;
+			for (int i = 0; i < iterations; i++) {
+				ScratchScope scratch;
+				double start = wall_seconds();
+				Evaluator::eval(env, expr);
+				times.push_back(wall_seconds() - start);
+			}
+			objects = allocation_count - objects;
+			bytes = allocation_bytes - bytes;
+
+			Summary summary = summarize(times);
+			Object *result = Object::acons(Object::intern("bytes"), Object::MakeFloat((double)bytes / iterations), Nil);
+			result = Object::acons(Object::intern("allocations"), Object::MakeFloat((double)objects / iterations), result);
+			result = Object::acons(Object::intern("iterations"), Object::MakeInt(iterations), result);
+			result = Object::acons(Object::intern("max"), Object::MakeFloat(summary.max), result);
+			result = Object::acons(Object::intern("min"), Object::MakeFloat(summary.min), result);
+			result = Object::acons(Object::intern("mad"), Object::MakeFloat(summary.mad), result);
+			return Object::acons(Object::intern("median"), Object::MakeFloat(summary.median), result);
+		}
+
+		void create_primitives(Object *env)
+		{
+			Primitives::add_primitive(env, "time", Time);
+			Primitives::add_primitive(env, "bench", Bench);
+		}
+	};
+};
@@ -0,0 +1,38 @@
+#pragma once
+
+#include "PolyScript.h"
+
+#include <vector>
+
+namespace PolyScript
+{
+	// Measuring scripts from inside the language: time reports on one evaluation,
+	// bench on many.
+	namespace Timing
+	{
+		// Seconds on a monotonic clock, from an arbitrary start.
+		double wall_seconds();
+
+		// Seconds of CPU time this thread has used.
+		double thread_cpu_seconds();
+
+		// The middle of a set of timings and how far they spread around it.
+		struct Summary
+		{
+			double median;
+
+			// The median absolute deviation from the median. Unlike the standard
+			// deviation, one slow run doesn't swamp it.
+			double mad;
+
+			double min;
+			double max;
+		};
+
+		// samples must not be empty.
+		Summary summarize(std::vector<double> samples);
+
+		// Add time and bench to the environment.
+		void create_primitives(Object *env);
+	};
+};
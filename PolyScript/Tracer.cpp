@@ -0,0 +1,283 @@
+#include "stdafx.h"
+#include "Tracer.h"
+#include "Primitives.h"
+#include "Stats.h"
+
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <mutex>
+
+// Each thread writes its events into a ring of its own, created the first time it
+// traces and never freed. The thread is the only producer; whoever exports is the
+// only consumer, so neither side takes a lock. When the ring is full, events are
+// dropped and counted rather than waiting for an export. An event is written when
+// the call exits, as one complete event, so a dropped event never leaves an entry
+// without its exit.
+
+namespace PolyScript
+{
+	namespace Tracer
+	{
+		using Primitives::evaluate_arguments;
+
+		std::atomic<bool> tracing(false);
+
+		static const uint32_t RING_SIZE = 1 << 17;
+
+		struct Ring
+		{
+			int thread_id;
+			std::atomic<uint32_t> head;
+			std::atomic<uint32_t> tail;
+			std::atomic<uint64_t> dropped;
+			Event events[RING_SIZE];
+		};
+
+		static std::mutex rings_lock;
+		static std::vector<Ring *> rings;
+		static thread_local Ring *local_ring = NULL;
+		static thread_local int countdown = 0;
+
+		// Events taken out of the rings, with the thread that recorded them. Guarded
+		// by rings_lock, which also makes sure there is one consumer at a time.
+		static std::vector<std::pair<int, Event>> collected;
+
+		static int sample_every = 1;
+		static bool filtered = false;
+		static std::vector<Object *> function_names;
+		static std::vector<bool> primitive_allowed;
+		static std::chrono::steady_clock::time_point epoch;
+
+		static Ring *thread_ring()
+		{
+			if (!local_ring) {
+				Ring *ring = new Ring();
+				std::lock_guard<std::mutex> guard(rings_lock);
+				ring->thread_id = (int)rings.size() + 1;
+				rings.push_back(ring);
+				local_ring = ring;
+			}
+			return local_ring;
+		}
+
+		static uint64_t now_ns()
+		{
+			return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - epoch).count();
+		}
+
+		bool enter(Object *fn, uint64_t &start_ns)
+		{
+			if (filtered) {
+				if (fn->tag == T_PRIMITIVE) {
+					if (!primitive_allowed[fn->primitive_id])
+						return false;
+				} else if (std::find(function_names.begin(), function_names.end(), fn->fn_name) == function_names.end()) {
+					return false;
+				}
+			}
+			if (--countdown > 0)
+				return false;
+			countdown = sample_every;
+			// Make the ring now, so that making it isn't counted in the call's time.
+			thread_ring();
+			start_ns = now_ns();
+			return true;
+		}
+
+		void exit(Object *fn, uint64_t start_ns)
+		{
+			Event event;
+			event.start_ns = start_ns;
+			event.duration_ns = now_ns() - start_ns;
+			if (fn->tag == T_PRIMITIVE) {
+				event.name = NULL;
+				event.primitive_id = fn->primitive_id;
+			} else {
+				event.name = fn->fn_name;
+				event.primitive_id = -1;
+			}
+
+			Ring *ring = thread_ring();
+			uint32_t head = ring->head.load(std::memory_order_relaxed);
+			if (head - ring->tail.load(std::memory_order_acquire) == RING_SIZE) {
+				ring->dropped.store(ring->dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+				return;
+			}
+			ring->events[head & (RING_SIZE - 1)] = event;
+			ring->head.store(head + 1, std::memory_order_release);
+		}
+
+		Object *call_primitive(Object *env, Object *fn, Object *args)
+		{
+			Span span(fn);
+			return fn->fn(env, args);
+		}
+
+		// Moves every ring's events into collected. Called with rings_lock held.
+		static void drain()
+		{
+			for (Ring *ring : rings) {
+				uint32_t tail = ring->tail.load(std::memory_order_relaxed);
+				uint32_t head = ring->head.load(std::memory_order_acquire);
+				for (; tail != head; tail++)
+					collected.push_back(std::make_pair(ring->thread_id, ring->events[tail & (RING_SIZE - 1)]));
+				ring->tail.store(tail, std::memory_order_release);
+			}
+		}
+
+		void start(int every, const std::vector<Object *> &names)
+		{
+			if (every < 1)
+				error("trace-start: the sampling rate must be at least 1");
+			stop();
+			thread_ring();
+
+			std::lock_guard<std::mutex> guard(rings_lock);
+			drain();
+			collected.clear();
+			for (Ring *ring : rings)
+				ring->dropped = 0;
+
+			sample_every = every;
+			filtered = !names.empty();
+			function_names = names;
+			primitive_allowed.assign(Stats::MAX_PRIMITIVES, false);
+			for (int id = 0; id < Stats::MAX_PRIMITIVES; id++) {
+				std::string name = Stats::primitive_name(id);
+				if (!name.empty() && std::find(names.begin(), names.end(), Object::intern(name.c_str())) != names.end())
+					primitive_allowed[id] = true;
+			}
+			epoch = std::chrono::steady_clock::now();
+			tracing = true;
+		}
+
+		size_t stop()
+		{
+			tracing = false;
+			std::lock_guard<std::mutex> guard(rings_lock);
+			drain();
+			return collected.size();
+		}
+
+		bool running()
+		{
+			return tracing.load();
+		}
+
+		static void append_json_string(std::string &out, const char *text)
+		{
+			out += '"';
+			for (const char *p = text; *p; p++) {
+				char escaped[8];
+				if (*p == '"' || *p == '\\') {
+					out += '\\';
+					out += *p;
+				} else if ((unsigned char)*p < 0x20) {
+					snprintf(escaped, sizeof(escaped), "\\u%04x", *p);
+					out += escaped;
+				} else {
+					out += *p;
+				}
+			}
+			out += '"';
+		}
+
+		std::string chrome_json()
+		{
+			std::lock_guard<std::mutex> guard(rings_lock);
+			drain();
+			uint64_t dropped = 0;
+			for (Ring *ring : rings)
+				dropped += ring->dropped.load(std::memory_order_relaxed);
+
+			std::map<int, std::string> primitive_names;
+			std::string out = "{\"traceEvents\":[";
+			char line[128];
+			bool first = true;
+			for (auto &entry : collected) {
+				const Event &event = entry.second;
+				const char *name;
+				const char *category;
+				if (event.primitive_id >= 0) {
+					auto found = primitive_names.find(event.primitive_id);
+					if (found == primitive_names.end())
+						found = primitive_names.emplace(event.primitive_id, Stats::primitive_name(event.primitive_id)).first;
+					name = found->second.c_str();
+					category = "primitive";
+				} else {
+					name = event.name ? event.name->name : "(lambda)";
+					category = "function";
+				}
+				out += first ? "\n{\"name\":" : ",\n{\"name\":";
+				first = false;
+				append_json_string(out, name);
+				snprintf(line, sizeof(line), ",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%d}",
+					category, event.start_ns / 1000.0, event.duration_ns / 1000.0, entry.first);
+				out += line;
+			}
+			snprintf(line, sizeof(line), "\n],\"displayTimeUnit\":\"ns\",\"otherData\":{\"dropped\":%llu}}\n",
+				(unsigned long long)dropped);
+			out += line;
+			return out;
+		}
+
+		// (trace-start [sample-every [names]]) starts tracing every call, or one in
+		// every sample-every calls, of the functions and primitives named in the
+		// list names, or of all of them.
+		DECLARE_PRIMITIVE_FN(TraceStart)
+		{
+			Object *args = evaluate_arguments(env, list, 0, 2, "trace-start");
+			int every = 1;
+			std::vector<Object *> names;
+			if (args != Nil) {
+				if (!args->car->IsAtomSubtype(AT_INT))
+					error("trace-start: the sampling rate is not an integer");
+				every = args->car->int_value;
+				if (args->cdr != Nil) {
+					for (Object *p = args->cdr->car; p != Nil; p = p->cdr) {
+						if (p->tag != T_CELL || p->car->tag != T_ATOM || p->car->atom_subtype != AT_SYMBOL)
+							error("trace-start: the names are not a list of symbols");
+						names.push_back(p->car);
+					}
+				}
+			}
+			start(every, names);
+			return True;
+		}
+
+		// (trace-stop) returns the number of events recorded.
+		DECLARE_PRIMITIVE_FN(TraceStop)
+		{
+			evaluate_arguments(env, list, 0, 0, "trace-stop");
+			return Object::MakeInt((int)stop());
+		}
+
+		// (trace-export [path]) writes the events as Chrome trace-event JSON to path,
+		// or returns them as a string.
+		DECLARE_PRIMITIVE_FN(TraceExport)
+		{
+			Object *args = evaluate_arguments(env, list, 0, 1, "trace-export");
+			std::string json = chrome_json();
+			if (args == Nil)
+				return Object::MakeString(json.data(), json.size());
+			if (!args->car->IsAtomSubtype(AT_STRING))
+				error("trace-export: the path is not a string");
+			FILE *file = fopen(args->car->str_value, "wb");
+			if (!file)
+				error("trace-export: can't write %s", args->car->str_value);
+			size_t written = fwrite(json.data(), 1, json.size(), file);
+			fclose(file);
+			if (written != json.size())
+				error("trace-export: can't write %s", args->car->str_value);
+			return True;
+		}
+
+		void create_primitives(Object *env)
+		{
+			Primitives::add_primitive(env, "trace-start", TraceStart);
+			Primitives::add_primitive(env, "trace-stop", TraceStop);
+			Primitives::add_primitive(env, "trace-export", TraceExport);
+		}
+	};
+};
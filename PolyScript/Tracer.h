@@ -0,0 +1,81 @@
+#pragma once
+
+#include "PolyScript.h"
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace PolyScript
+{
+	// An execution tracer. While it is on, every call of a PolyScript function or a
+	// primitive is timed and recorded in a ring buffer belonging to the thread that
+	// made it. The events export as Chrome trace-event JSON, for chrome://tracing or
+	// Perfetto.
+	namespace Tracer
+	{
+		// Set while tracing.
+		extern std::atomic<bool> tracing;
+
+		// One call, from its entry to its exit.
+		struct Event
+		{
+			uint64_t start_ns;
+			uint64_t duration_ns;
+
+			// The function's name, or NULL for a lambda. Unused for a primitive.
+			Object *name;
+
+			// The primitive's counter index, or -1 for a function.
+			int primitive_id;
+		};
+
+		// Decides whether a call is traced, and notes the time it started.
+		bool enter(Object *fn, uint64_t &start_ns);
+
+		// Records a traced call that has returned or unwound.
+		void exit(Object *fn, uint64_t start_ns);
+
+		// Times a call for as long as it runs. Does nothing unless tracing.
+		class Span
+		{
+		public:
+			explicit Span(Object *fn) : fn(fn), traced(tracing.load(std::memory_order_relaxed) && enter(fn, start_ns)) {}
+
+			~Span()
+			{
+				if (traced)
+					exit(fn, start_ns);
+			}
+
+			Span(const Span &) = delete;
+			Span &operator=(const Span &) = delete;
+
+		private:
+			Object *fn;
+			uint64_t start_ns;
+			bool traced;
+		};
+
+		// Calls a primitive under a Span. Kept out of line, so that the untraced call
+		// in apply stays a tail call.
+		Object *call_primitive(Object *env, Object *fn, Object *args);
+
+		// Starts tracing one call in every sample_every, discarding the events of any
+		// earlier run. If names isn't empty, only functions and primitives with those
+		// names are traced.
+		void start(int sample_every = 1, const std::vector<Object *> &names = std::vector<Object *>());
+
+		// Stops tracing. Returns the number of events recorded.
+		size_t stop();
+
+		bool running();
+
+		// The events recorded so far, as Chrome trace-event JSON.
+		std::string chrome_json();
+
+		// Add trace-start, trace-stop and trace-export to the environment.
+		void create_primitives(Object *env);
+	};
+};
@@ -0,0 +1,293 @@
+#include "stdafx.h"
+#include "Vector.h"
+#include "VectorKernels.h"
+#include "Primitives.h"
+
+#include <climits>
+
+namespace PolyScript
+{
+	namespace Vector
+	{
+		using Primitives::evaluate_arguments;
+
+		const char *syntax_prefix(VectorType type)
+		{
+			switch (type)
+			{
+			case VT_INT32:
+				return "#i";
+			case VT_FLOAT64:
+				return "#f";
+			default:
+				return "#";
+			}
+		}
+
+		static double number_value(Object *value)
+		{
+			return value->atom_subtype == AT_INT ? value->int_value : value->float_value;
+		}
+
+		// Stores value at index i, checking that it fits the vector's element type.
+		static void store(Object *vector, size_t i, Object *value)
+		{
+			switch (vector->vector_type)
+			{
+			case VT_GENERIC:
+				vector->generic_elements()[i] = value;
+				note_pointer_store();
+				return;
+			case VT_INT32:
+				if (!value->IsAtomSubtype(AT_INT))
+					error("An int vector can only hold integers");
+				vector->int32_elements()[i] = value->int_value;
+				return;
+			case VT_FLOAT64:
+				if (!value->IsNumber())
+					error("A float vector can only hold numbers");
+				vector->float64_elements()[i] = number_value(value);
+				return;
+			}
+		}
+
+		Object *element(Object *vector, size_t i)
+		{
+			switch (vector->vector_type)
+			{
+			case VT_INT32:
+				return Object::MakeInt(vector->int32_elements()[i]);
+			case VT_FLOAT64:
+				return Object::MakeFloat(vector->float64_elements()[i]);
+			default:
+				return vector->generic_elements()[i];
+			}
+		}
+
+		Object *from_list(VectorType type, Object *list)
+		{
+			Object *vector = Object::MakeVector(type, Evaluator::list_length(list));
+			size_t i = 0;
+			for (Object *p = list; p != Nil; p = p->cdr)
+				store(vector, i++, p->car);
+			return vector;
+		}
+
+		// Integer results are computed in 64 bits; ones that don't fit an int become floats.
+		static Object *make_integer(int64_t value)
+		{
+			if (value < INT_MIN || value > INT_MAX)
+				return Object::MakeFloat((double)value);
+			return Object::MakeInt((int)value);
+		}
+
+		static Object *vector_argument(Object *value, const char *name)
+		{
+			if (value->tag != T_VECTOR)
+				error("%s: argument is not a vector", name);
+			return value;
+		}
+
+		// The bulk primitives work on unboxed data only.
+		static Object *typed_vector_argument(Object *value, const char *name)
+		{
+			if (value->tag != T_VECTOR || value->vector_type == VT_GENERIC)
+				error("%s: argument is not an int or float vector", name);
+			return value;
+		}
+
+		static size_t index_argument(Object *vector, Object *value, const char *name)
+		{
+			if (!value->IsAtomSubtype(AT_INT))
+				error("%s: index is not an integer", name);
+			if (value->int_value < 0 || (size_t)value->int_value >= vector->length)
+				error("%s: index %d is out of range for a vector of length %d", name, value->int_value, (int)vector->length);
+			return value->int_value;
+		}
+
+		// (vector expr ...)
+		DECLARE_PRIMITIVE_FN(MakeVectorOf)
+		{
+			return from_list(VT_GENERIC, Evaluator::eval_list(env, list));
+		}
+
+		static Object *make_vector(Object *env, Object *list, VectorType type, const char *name)
+		{
+			Object *args = evaluate_arguments(env, list, 1, 2, name);
+			if (!args->car->IsAtomSubtype(AT_INT) || args->car->int_value < 0)
+				error("%s: length is not a non-negative integer", name);
+
+			Object *vector = Object::MakeVector(type, args->car->int_value);
+			if (args->cdr != Nil)
+				for (size_t i = 0; i < vector->length; i++)
+					store(vector, i, args->cdr->car);
+			return vector;
+		}
+
+		// (make-vector length [initial-element])
+		DECLARE_PRIMITIVE_FN(MakeGenericVector)
+		{
+			return make_vector(env, list, VT_GENERIC, "make-vector");
+		}
+
+		// (make-int-vector length [initial-element])
+		DECLARE_PRIMITIVE_FN(MakeIntVector)
+		{
+			return make_vector(env, list, VT_INT32, "make-int-vector");
+		}
+
+		// (make-float-vector length [initial-element])
+		DECLARE_PRIMITIVE_FN(MakeFloatVector)
+		{
+			return make_vector(env, list, VT_FLOAT64, "make-float-vector");
+		}
+
+		// (vector-length vector)
+		DECLARE_PRIMITIVE_FN(VectorLength)
+		{
+			Object *args = evaluate_arguments(env, list, 1, 1, "vector-length");
+			return Object::MakeInt((int)vector_argument(args->car, "vector-length")->length);
+		}
+
+		// (aref vector index)
+		DECLARE_PRIMITIVE_FN(Aref)
+		{
+			Object *args = evaluate_arguments(env, list, 2, 2, "aref");
+			Object *vector = vector_argument(args->car, "aref");
+			return element(vector, index_argument(vector, args->cdr->car, "aref"));
+		}
+
+		// (aset vector index value)
+		DECLARE_PRIMITIVE_FN(Aset)
+		{
+			Object *args = evaluate_arguments(env, list, 3, 3, "aset");
+			Object *vector = vector_argument(args->car, "aset");
+			Object *value = args->cdr->cdr->car;
+			store(vector, index_argument(vector, args->cdr->car, "aset"), value);
+			return value;
+		}
+
+		// (vsum vector)
+		DECLARE_PRIMITIVE_FN(Vsum)
+		{
+			Object *args = evaluate_arguments(env, list, 1, 1, "vsum");
+			Object *v = typed_vector_argument(args->car, "vsum");
+
+			if (v->vector_type == VT_INT32)
+				return make_integer(VectorKernels::sum(v->int32_elements(), v->length));
+			return Object::MakeFloat(VectorKernels::sum(v->float64_elements(), v->length));
+		}
+
+		// Checks that two vectors can be combined element by element.
+		static void check_same_shape(Object *a, Object *b, const char *name)
+		{
+			if (a->vector_type != b->vector_type)
+				error("%s: vectors have different element types", name);
+			if (a->length != b->length)
+				error("%s: vectors have different lengths", name);
+		}
+
+		// (vdot a b)
+		DECLARE_PRIMITIVE_FN(Vdot)
+		{
+			Object *args = evaluate_arguments(env, list, 2, 2, "vdot");
+			Object *a = typed_vector_argument(args->car, "vdot");
+			Object *b = typed_vector_argument(args->cdr->car, "vdot");
+			check_same_shape(a, b, "vdot");
+
+			if (a->vector_type == VT_INT32)
+				return make_integer(VectorKernels::dot(a->int32_elements(), b->int32_elements(), a->length));
+			return Object::MakeFloat(VectorKernels::dot(a->float64_elements(), b->float64_elements(), a->length));
+		}
+
+		// (vmap+ a b) returns a new vector of the element-wise sums.
+		DECLARE_PRIMITIVE_FN(VmapPlus)
+		{
+			Object *args = evaluate_arguments(env, list, 2, 2, "vmap+");
+			Object *a = typed_vector_argument(args->car, "vmap+");
+			Object *b = typed_vector_argument(args->cdr->car, "vmap+");
+			check_same_shape(a, b, "vmap+");
+
+			Object *result = Object::MakeVector(a->vector_type, a->length);
+			if (a->vector_type == VT_INT32)
+				VectorKernels::add(a->int32_elements(), b->int32_elements(), result->int32_elements(), a->length);
+			else
+				VectorKernels::add(a->float64_elements(), b->float64_elements(), result->float64_elements(), a->length);
+			return result;
+		}
+
+		// (vscale vector k) returns a new vector with every element multiplied by k.
+		// An int vector scaled by a float becomes a float vector.
+		DECLARE_PRIMITIVE_FN(Vscale)
+		{
+			Object *args = evaluate_arguments(env, list, 2, 2, "vscale");
+			Object *v = typed_vector_argument(args->car, "vscale");
+			Object *k = args->cdr->car;
+			if (!k->IsNumber())
+				error("vscale: factor is not a number");
+
+			if (v->vector_type == VT_INT32 && k->atom_subtype == AT_INT)
+			{
+				Object *result = Object::MakeVector(VT_INT32, v->length);
+				VectorKernels::scale(v->int32_elements(), k->int_value, result->int32_elements(), v->length);
+				return result;
+			}
+
+			Object *result = Object::MakeVector(VT_FLOAT64, v->length);
+			if (v->vector_type == VT_INT32)
+			{
+				for (size_t i = 0; i < v->length; i++)
+					result->float64_elements()[i] = v->int32_elements()[i];
+				VectorKernels::scale(result->float64_elements(), number_value(k), result->float64_elements(), v->length);
+			}
+			else
+				VectorKernels::scale(v->float64_elements(), number_value(k), result->float64_elements(), v->length);
+			return result;
+		}
+
+		static Object *extremum(Object *env, Object *list, bool want_max, const char *name)
+		{
+			Object *args = evaluate_arguments(env, list, 1, 1, name);
+			Object *v = typed_vector_argument(args->car, name);
+			if (v->length == 0)
+				error("%s: vector is empty", name);
+
+			if (v->vector_type == VT_INT32)
+				return Object::MakeInt(want_max ? VectorKernels::max(v->int32_elements(), v->length)
+					: VectorKernels::min(v->int32_elements(), v->length));
+			return Object::MakeFloat(want_max ? VectorKernels::max(v->float64_elements(), v->length)
+				: VectorKernels::min(v->float64_elements(), v->length));
+		}
+
+		// (vmin vector)
+		DECLARE_PRIMITIVE_FN(Vmin)
+		{
+			return extremum(env, list, false, "vmin");
+		}
+
+		// (vmax vector)
+		DECLARE_PRIMITIVE_FN(Vmax)
+		{
+			return extremum(env, list, true, "vmax");
+		}
+
+		void create_primitives(Object *env)
+		{
+			Primitives::add_primitive(env, "vector", MakeVectorOf);
+			Primitives::add_primitive(env, "make-vector", MakeGenericVector);
+			Primitives::add_primitive(env, "make-int-vector", MakeIntVector);
+			Primitives::add_primitive(env, "make-float-vector", MakeFloatVector);
+			Primitives::add_primitive(env, "vector-length", VectorLength);
+			Primitives::add_primitive(env, "aref", Aref);
+			Primitives::add_primitive(env, "aset", Aset);
+
+			// Bulk numeric primitives
+			Primitives::add_primitive(env, "vsum", Vsum);
+			Primitives::add_primitive(env, "vdot", Vdot);
+			Primitives::add_primitive(env, "vmap+", VmapPlus);
+			Primitives::add_primitive(env, "vscale", Vscale);
+			Primitives::add_primitive(env, "vmin", Vmin);
+			Primitives::add_primitive(env, "vmax", Vmax);
+		}
+	};
+};
@@ -0,0 +1,22 @@
+#pragma once
+
+#include "PolyScript.h"
+
+namespace PolyScript
+{
+	namespace Vector
+	{
+		// Builds a vector from the elements of a list. Typed vectors accept only numbers
+		// that fit their element type.
+		Object *from_list(VectorType type, Object *list);
+
+		// Element i of a vector, boxed if the vector is typed. i must be in range.
+		Object *element(Object *vector, size_t i);
+
+		// The reader and printer prefix for a vector type: "#", "#i" or "#f".
+		const char *syntax_prefix(VectorType type);
+
+		// Add the vector primitives to the environment.
+		void create_primitives(Object *env);
+	};
+};
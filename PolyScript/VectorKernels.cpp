@@ -0,0 +1,347 @@
+#include "stdafx.h"
+#include "VectorKernels.h"
+
+#if defined(__AVX2__)
+#define KERNELS_AVX2
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define KERNELS_SSE2
+#include <emmintrin.h>
+#endif
+
+// Every kernel runs its vector loop over as many whole registers as fit and
+// finishes the remaining elements with the scalar loop.
+
+namespace PolyScript
+{
+	namespace VectorKernels
+	{
+#if defined(KERNELS_AVX2)
+		static double horizontal_sum(__m256d v)
+		{
+			double lanes[4];
+			_mm256_storeu_pd(lanes, v);
+			return (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+		}
+
+		static int64_t horizontal_sum(__m256i v)
+		{
+			int64_t lanes[4];
+			_mm256_storeu_si256((__m256i *)lanes, v);
+			return lanes[0] + lanes[1] + lanes[2] + lanes[3];
+		}
+#elif defined(KERNELS_SSE2)
+		static double horizontal_sum(__m128d v)
+		{
+			double lanes[2];
+			_mm_storeu_pd(lanes, v);
+			return lanes[0] + lanes[1];
+		}
+
+		static int64_t horizontal_sum(__m128i v)
+		{
+			int64_t lanes[2];
+			_mm_storeu_si128((__m128i *)lanes, v);
+			return lanes[0] + lanes[1];
+		}
+
+		// SSE2 has no 32-bit signed min/max; select with a comparison mask instead.
+		static __m128i min_epi32(__m128i a, __m128i b)
+		{
+			__m128i a_smaller = _mm_cmplt_epi32(a, b);
+			return _mm_or_si128(_mm_and_si128(a_smaller, a), _mm_andnot_si128(a_smaller, b));
+		}
+
+		static __m128i max_epi32(__m128i a, __m128i b)
+		{
+			__m128i a_larger = _mm_cmpgt_epi32(a, b);
+			return _mm_or_si128(_mm_and_si128(a_larger, a), _mm_andnot_si128(a_larger, b));
+		}
+#endif
+
+		const char *instruction_set()
+		{
+#if defined(KERNELS_AVX2)
+			return "avx2";
+#elif defined(KERNELS_SSE2)
+			return "sse2";
+#else
+			return "scalar";
+#endif
+		}
+
+		double sum(const double *a, size_t n)
+		{
+			size_t i = 0;
+			double total = 0;
+#if defined(KERNELS_AVX2)
+			__m256d acc0 = _mm256_setzero_pd(), acc1 = _mm256_setzero_pd();
+			for (; i + 8 <= n; i += 8) {
+				acc0 = _mm256_add_pd(acc0, _mm256_loadu_pd(a + i));
+				acc1 = _mm256_add_pd(acc1, _mm256_loadu_pd(a + i + 4));
+			}
+			total = horizontal_sum(_mm256_add_pd(acc0, acc1));
+#elif defined(KERNELS_SSE2)
+			__m128d acc0 = _mm_setzero_pd(), acc1 = _mm_setzero_pd();
+			for (; i + 4 <= n; i += 4) {
+				acc0 = _mm_add_pd(acc0, _mm_loadu_pd(a + i));
+				acc1 = _mm_add_pd(acc1, _mm_loadu_pd(a + i + 2));
+			}
+			total = horizontal_sum(_mm_add_pd(acc0, acc1));
+#endif
+			for (; i < n; i++)
+				total += a[i];
+			return total;
+		}
+
+		int64_t sum(const int32_t *a, size_t n)
+		{
+			size_t i = 0;
+			int64_t total = 0;
+#if defined(KERNELS_AVX2)
+			// Widen to 64 bits as we go so large arrays can't overflow.
+			__m256i acc = _mm256_setzero_si256();
+			for (; i + 8 <= n; i += 8) {
+				acc = _mm256_add_epi64(acc, _mm256_cvtepi32_epi64(_mm_loadu_si128((const __m128i *)(a + i))));
+				acc = _mm256_add_epi64(acc, _mm256_cvtepi32_epi64(_mm_loadu_si128((const __m128i *)(a + i + 4))));
+			}
+			total = horizontal_sum(acc);
+#elif defined(KERNELS_SSE2)
+			__m128i acc = _mm_setzero_si128();
+			for (; i + 4 <= n; i += 4) {
+				__m128i v = _mm_loadu_si128((const __m128i *)(a + i));
+				__m128i sign = _mm_srai_epi32(v, 31);
+				acc = _mm_add_epi64(acc, _mm_unpacklo_epi32(v, sign));
+				acc = _mm_add_epi64(acc, _mm_unpackhi_epi32(v, sign));
+			}
+			total = horizontal_sum(acc);
+#endif
+			for (; i < n; i++)
+				total += a[i];
+			return total;
+		}
+
+		double dot(const double *a, const double *b, size_t n)
+		{
+			size_t i = 0;
+			double total = 0;
+#if defined(KERNELS_AVX2)
+			__m256d acc0 = _mm256_setzero_pd(), acc1 = _mm256_setzero_pd();
+			for (; i + 8 <= n; i += 8) {
+				acc0 = _mm256_add_pd(acc0, _mm256_mul_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+				acc1 = _mm256_add_pd(acc1, _mm256_mul_pd(_mm256_loadu_pd(a + i + 4), _mm256_loadu_pd(b + i + 4)));
+			}
+			total = horizontal_sum(_mm256_add_pd(acc0, acc1));
+#elif defined(KERNELS_SSE2)
+			__m128d acc0 = _mm_setzero_pd(), acc1 = _mm_setzero_pd();
+			for (; i + 4 <= n; i += 4) {
+				acc0 = _mm_add_pd(acc0, _mm_mul_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+				acc1 = _mm_add_pd(acc1, _mm_mul_pd(_mm_loadu_pd(a + i + 2), _mm_loadu_pd(b + i + 2)));
+			}
+			total = horizontal_sum(_mm_add_pd(acc0, acc1));
+#endif
+			for (; i < n; i++)
+				total += a[i] * b[i];
+			return total;
+		}
+
+		int64_t dot(const int32_t *a, const int32_t *b, size_t n)
+		{
+			size_t i = 0;
+			int64_t total = 0;
+#if defined(KERNELS_AVX2)
+			// _mm256_mul_epi32 multiplies the low halves of 64-bit lanes into full 64-bit products.
+			__m256i acc = _mm256_setzero_si256();
+			for (; i + 4 <= n; i += 4) {
+				__m256i x = _mm256_cvtepi32_epi64(_mm_loadu_si128((const __m128i *)(a + i)));
+				__m256i y = _mm256_cvtepi32_epi64(_mm_loadu_si128((const __m128i *)(b + i)));
+				acc = _mm256_add_epi64(acc, _mm256_mul_epi32(x, y));
+			}
+			total = horizontal_sum(acc);
+#endif
+			// SSE2 has no signed 32x32->64 multiply, so it uses the scalar loop.
+			for (; i < n; i++)
+				total += (int64_t)a[i] * b[i];
+			return total;
+		}
+
+		void add(const double *a, const double *b, double *out, size_t n)
+		{
+			size_t i = 0;
+#if defined(KERNELS_AVX2)
+			for (; i + 4 <= n; i += 4)
+				_mm256_storeu_pd(out + i, _mm256_add_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+#elif defined(KERNELS_SSE2)
+			for (; i + 2 <= n; i += 2)
+				_mm_storeu_pd(out + i, _mm_add_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+#endif
+			for (; i < n; i++)
+				out[i] = a[i] + b[i];
+		}
+
+		void add(const int32_t *a, const int32_t *b, int32_t *out, size_t n)
+		{
+			size_t i = 0;
+#if defined(KERNELS_AVX2)
+			for (; i + 8 <= n; i += 8)
+				_mm256_storeu_si256((__m256i *)(out + i), _mm256_add_epi32(
+					_mm256_loadu_si256((const __m256i *)(a + i)), _mm256_loadu_si256((const __m256i *)(b + i))));
+#elif defined(KERNELS_SSE2)
+			for (; i + 4 <= n; i += 4)
+				_mm_storeu_si128((__m128i *)(out + i), _mm_add_epi32(
+					_mm_loadu_si128((const __m128i *)(a + i)), _mm_loadu_si128((const __m128i *)(b + i))));
+#endif
+			for (; i < n; i++)
+				out[i] = (int32_t)((uint32_t)a[i] + (uint32_t)b[i]);
+		}
+
+		void scale(const double *a, double k, double *out, size_t n)
+		{
+			size_t i = 0;
+#if defined(KERNELS_AVX2)
+			__m256d factor = _mm256_set1_pd(k);
+			for (; i + 4 <= n; i += 4)
+				_mm256_storeu_pd(out + i, _mm256_mul_pd(_mm256_loadu_pd(a + i), factor));
+#elif defined(KERNELS_SSE2)
+			__m128d factor = _mm_set1_pd(k);
+			for (; i + 2 <= n; i += 2)
+				_mm_storeu_pd(out + i, _mm_mul_pd(_mm_loadu_pd(a + i), factor));
+#endif
+			for (; i < n; i++)
+				out[i] = a[i] * k;
+		}
+
+		void scale(const int32_t *a, int32_t k, int32_t *out, size_t n)
+		{
+			size_t i = 0;
+#if defined(KERNELS_AVX2)
+			__m256i factor = _mm256_set1_epi32(k);
+			for (; i + 8 <= n; i += 8)
+				_mm256_storeu_si256((__m256i *)(out + i), _mm256_mullo_epi32(_mm256_loadu_si256((const __m256i *)(a + i)), factor));
+#endif
+			// SSE2 has no 32-bit multiply that keeps the low halves, so it uses the scalar loop.
+			for (; i < n; i++)
+				out[i] = (int32_t)((uint32_t)a[i] * (uint32_t)k);
+		}
+
+		double min(const double *a, size_t n)
+		{
+			size_t i = 0;
+			double result = a[0];
+#if defined(KERNELS_AVX2)
+			if (n >= 4) {
+				__m256d acc = _mm256_loadu_pd(a);
+				for (i = 4; i + 4 <= n; i += 4)
+					acc = _mm256_min_pd(acc, _mm256_loadu_pd(a + i));
+				double lanes[4];
+				_mm256_storeu_pd(lanes, acc);
+				for (int l = 0; l < 4; l++)
+					result = lanes[l] < result ? lanes[l] : result;
+			}
+#elif defined(KERNELS_SSE2)
+			if (n >= 2) {
+				__m128d acc = _mm_loadu_pd(a);
+				for (i = 2; i + 2 <= n; i += 2)
+					acc = _mm_min_pd(acc, _mm_loadu_pd(a + i));
+				double lanes[2];
+				_mm_storeu_pd(lanes, acc);
+				for (int l = 0; l < 2; l++)
+					result = lanes[l] < result ? lanes[l] : result;
+			}
+#endif
+			for (; i < n; i++)
+				result = a[i] < result ? a[i] : result;
+			return result;
+		}
+
+		double max(const double *a, size_t n)
+		{
+			size_t i = 0;
+			double result = a[0];
+#if defined(KERNELS_AVX2)
+			if (n >= 4) {
+				__m256d acc = _mm256_loadu_pd(a);
+				for (i = 4; i + 4 <= n; i += 4)
+					acc = _mm256_max_pd(acc, _mm256_loadu_pd(a + i));
+				double lanes[4];
+				_mm256_storeu_pd(lanes, acc);
+				for (int l = 0; l < 4; l++)
+					result = lanes[l] > result ? lanes[l] : result;
+			}
+#elif defined(KERNELS_SSE2)
+			if (n >= 2) {
+				__m128d acc = _mm_loadu_pd(a);
+				for (i = 2; i + 2 <= n; i += 2)
+					acc = _mm_max_pd(acc, _mm_loadu_pd(a + i));
+				double lanes[2];
+				_mm_storeu_pd(lanes, acc);
+				for (int l = 0; l < 2; l++)
+					result = lanes[l] > result ? lanes[l] : result;
+			}
+#endif
+			for (; i < n; i++)
+				result = a[i] > result ? a[i] : result;
+			return result;
+		}
+
+		int32_t min(const int32_t *a, size_t n)
+		{
+			size_t i = 0;
+			int32_t result = a[0];
+#if defined(KERNELS_AVX2)
+			if (n >= 8) {
+				__m256i acc = _mm256_loadu_si256((const __m256i *)a);
+				for (i = 8; i + 8 <= n; i += 8)
+					acc = _mm256_min_epi32(acc, _mm256_loadu_si256((const __m256i *)(a + i)));
+				int32_t lanes[8];
+				_mm256_storeu_si256((__m256i *)lanes, acc);
+				for (int l = 0; l < 8; l++)
+					result = lanes[l] < result ? lanes[l] : result;
+			}
+#elif defined(KERNELS_SSE2)
+			if (n >= 4) {
+				__m128i acc = _mm_loadu_si128((const __m128i *)a);
+				for (i = 4; i + 4 <= n; i += 4)
+					acc = min_epi32(acc, _mm_loadu_si128((const __m128i *)(a + i)));
+				int32_t lanes[4];
+				_mm_storeu_si128((__m128i *)lanes, acc);
+				for (int l = 0; l < 4; l++)
+					result = lanes[l] < result ? lanes[l] : result;
+			}
+#endif
+			for (; i < n; i++)
+				result = a[i] < result ? a[i] : result;
+			return result;
+		}
+
+		int32_t max(const int32_t *a, size_t n)
+		{
+			size_t i = 0;
+			int32_t result = a[0];
+#if defined(KERNELS_AVX2)
+			if (n >= 8) {
+				__m256i acc = _mm256_loadu_si256((const __m256i *)a);
+				for (i = 8; i + 8 <= n; i += 8)
+					acc = _mm256_max_epi32(acc, _mm256_loadu_si256((const __m256i *)(a + i)));
+				int32_t lanes[8];
+				_mm256_storeu_si256((__m256i *)lanes, acc);
+				for (int l = 0; l < 8; l++)
+					result = lanes[l] > result ? lanes[l] : result;
+			}
+#elif defined(KERNELS_SSE2)
+			if (n >= 4) {
+				__m128i acc = _mm_loadu_si128((const __m128i *)a);
+				for (i = 4; i + 4 <= n; i += 4)
+					acc = max_epi32(acc, _mm_loadu_si128((const __m128i *)(a + i)));
+				int32_t lanes[4];
+				_mm_storeu_si128((__m128i *)lanes, acc);
+				for (int l = 0; l < 4; l++)
+					result = lanes[l] > result ? lanes[l] : result;
+			}
+#endif
+			for (; i < n; i++)
+				result = a[i] > result ? a[i] : result;
+			return result;
+		}
+	};
+};
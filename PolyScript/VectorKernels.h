@@ -0,0 +1,35 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace PolyScript
+{
+	// Bulk numeric loops over unboxed arrays. Each has an AVX2 and an SSE2 version
+	// and a scalar fallback; which one is used is decided when the file is compiled.
+	namespace VectorKernels
+	{
+		// "avx2", "sse2" or "scalar".
+		const char *instruction_set();
+
+		double sum(const double *a, size_t n);
+		int64_t sum(const int32_t *a, size_t n);
+
+		double dot(const double *a, const double *b, size_t n);
+		int64_t dot(const int32_t *a, const int32_t *b, size_t n);
+
+		// out[i] = a[i] + b[i]
+		void add(const double *a, const double *b, double *out, size_t n);
+		void add(const int32_t *a, const int32_t *b, int32_t *out, size_t n);
+
+		// out[i] = a[i] * k
+		void scale(const double *a, double k, double *out, size_t n);
+		void scale(const int32_t *a, int32_t k, int32_t *out, size_t n);
+
+		// n must be at least 1.
+		double min(const double *a, size_t n);
+		double max(const double *a, size_t n);
+		int32_t min(const int32_t *a, size_t n);
+		int32_t max(const int32_t *a, size_t n);
+	};
+};